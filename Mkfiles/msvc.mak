@@ -61,7 +61,7 @@ X               = .exe
 
 #-- Begin File Lists --#
 # Edit in Makefile.in, not here!
-NASM    = asm\nasm.$(O)
+NASM    = asm\main.$(O)
 NDISASM = disasm\ndisasm.$(O)
 
 PROGOBJ = $(NASM) $(NDISASM)
@@ -74,13 +74,14 @@ LIBOBJ_NW = stdlib\snprintf.$(O) stdlib\vsnprintf.$(O) stdlib\strlcpy.$(O) \
 	nasmlib\alloc.$(O) nasmlib\asprintf.$(O) nasmlib\errfile.$(O) \
 	nasmlib\crc32.$(O) nasmlib\crc64.$(O) nasmlib\md5c.$(O) \
 	nasmlib\string.$(O) nasmlib\nctype.$(O) \
-	nasmlib\file.$(O) nasmlib\mmap.$(O) nasmlib\ilog2.$(O) \
+	nasmlib\file.$(O) nasmlib\mmap.$(O) nasmlib\filecache.$(O) \
+	nasmlib\ilog2.$(O) \
 	nasmlib\realpath.$(O) nasmlib\path.$(O) \
 	nasmlib\filename.$(O) nasmlib\rlimit.$(O) \
 	nasmlib\zerobuf.$(O) nasmlib\readnum.$(O) nasmlib\bsi.$(O) \
 	nasmlib\rbtree.$(O) nasmlib\hashtbl.$(O) \
 	nasmlib\raa.$(O) nasmlib\saa.$(O) \
-	nasmlib\strlist.$(O) \
+	nasmlib\strlist.$(O) nasmlib\atom.$(O) nasmlib\outvec.$(O) \
 	nasmlib\perfhash.$(O) nasmlib\badenum.$(O) \
 	\
 	common\common.$(O) \
@@ -100,7 +101,8 @@ LIBOBJ_NW = stdlib\snprintf.$(O) stdlib\vsnprintf.$(O) stdlib\strlcpy.$(O) \
 	asm\strfunc.$(O) asm\tokhash.$(O) \
 	asm\segalloc.$(O) \
 	asm\rdstrnum.$(O) \
-	asm\srcfile.$(O) \
+	asm\srcfile.$(O) asm\profile.$(O) asm\batch.$(O) \
+	asm\nasm.$(O) asm\rescache.$(O) asm\parallel.$(O) \
 	macros\macros.$(O) \
 	\
 	output\outform.$(O) output\outlib.$(O) output\legacy.$(O) \
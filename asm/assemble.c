@@ -185,6 +185,8 @@
 #include "disp8.h"
 #include "listing.h"
 #include "dbginfo.h"
+#include "labels.h"
+#include "profile.h"
 
 enum match_result {
     /*
@@ -213,6 +215,37 @@ enum match_result {
     MOK_GOOD		/* Matching unconditionally OK */
 };
 
+per_thread struct match_stats match_stats;
+
+/*
+ * Cache of find_match() results, keyed on everything matches() looks
+ * at in the instruction.  It is flushed whenever the CPU level changes.
+ */
+#define MATCH_CACHE_BITS 11
+#define MATCH_CACHE_SIZE (1 << MATCH_CACHE_BITS)
+
+struct match_key {
+    opflags_t       type[MAX_OPERANDS];
+    decoflags_t     deco[MAX_OPERANDS];
+    int             prefixes[MAXPREFIX];
+    enum opcode     opcode;
+    int             operands;
+    int             bits;
+    int             brerop;
+};
+
+struct match_cache_entry {
+    struct match_key key;
+    opflags_t       type[MAX_OPERANDS];     /* Sizes set by fuzzy matching */
+    decoflags_t     deco[MAX_OPERANDS];
+    const struct itemplate *temp;
+    enum match_result result;
+    bool valid;
+};
+
+static per_thread struct match_cache_entry *match_cache;
+static per_thread iflag_t match_cache_cpu;
+
 typedef struct {
     enum ea_type type;            /* what kind of EA is this? */
     int sib_present;              /* is a SIB byte necessary? */
@@ -236,6 +269,8 @@ static enum match_result find_match(const struct itemplate **tempp,
                                     insn *instruction,
                                     int32_t segment, int64_t offset, int bits);
 static enum match_result matches(const struct itemplate *, insn *, int bits);
+static void relax_record(int32_t, int64_t, int, const insn *, int64_t);
+static void relax_operands(const insn *);
 static opflags_t regflag(const operand *);
 static int32_t regval(const operand *);
 static int rexflags(int, opflags_t, int);
@@ -332,11 +367,59 @@ static void debug_macro_out(const struct out_data *data)
     }
 }
 
+struct out_record {
+    struct out_data data;
+    size_t bytes;               /* Offset of OUT_RAWDATA contents in the log */
+    uint64_t zeropad;
+    bool segbase;               /* tsegment still needs ofmt->segbase() */
+};
+
+/* Set while assemble_record() is recording the output */
+static per_thread struct out_log *out_log;
+static per_thread bool out_segbase;
+
+static void out_log_add(struct out_log *log, const struct out_data *data,
+                        uint64_t zeropad)
+{
+    struct out_record *r;
+
+    if (log->nrecs >= log->maxrecs) {
+        log->maxrecs = log->maxrecs ? log->maxrecs << 1 : 16;
+        log->recs = nasm_realloc(log->recs, log->maxrecs * sizeof *log->recs);
+    }
+
+    r = &log->recs[log->nrecs++];
+    r->data    = *data;
+    r->zeropad = zeropad;
+    r->bytes   = log->nbytes;
+    r->segbase = out_segbase;
+
+    if (data->type == OUT_RAWDATA && data->data) {
+        if (log->nbytes + data->size > log->maxbytes) {
+            log->maxbytes = log->nbytes + data->size;
+            log->maxbytes += log->maxbytes >> 1;
+            log->bytes = nasm_realloc(log->bytes, log->maxbytes);
+        }
+        memcpy(log->bytes + log->nbytes, data->data, data->size);
+        log->nbytes += data->size;
+    }
+}
+
+void out_log_free(struct out_log *log)
+{
+    nasm_free(log->recs);
+    nasm_free(log->bytes);
+    nasm_zero(*log);
+}
+
+static void out_emit(struct out_data *data, uint64_t zeropad);
+
 /*
  * This routine wrappers the real output format's output routine,
  * in order to pass a copy of the data off to the listing file
  * generator at the same time, flatten unnecessary relocations,
- * and verify backend compatibility.
+ * and verify backend compatibility.  While assemble_record() is
+ * running, the converted data is recorded instead.
  */
 /*
  * This warning is currently issued by backends, but in the future
@@ -350,10 +433,6 @@ static void debug_macro_out(const struct out_data *data)
  */
 static void out(struct out_data *data)
 {
-    static struct last_debug_info {
-        struct src_location where;
-        int32_t segment;
-    } dbg;
     union {
         uint8_t b[8];
         uint64_t q;
@@ -411,21 +490,6 @@ static void out(struct out_data *data)
         break;
     }
 
-    /*
-     * If the source location or output segment has changed,
-     * let the debug backend know. Some backends really don't
-     * like being given a NULL filename as can happen if we
-     * use -Lb and expand a macro, so filter out that case.
-     */
-    data->where = src_where();
-    if (data->where.filename &&
-        (!src_location_same(data->where, dbg.where) |
-         (data->segment != dbg.segment))) {
-        dbg.where   = data->where;
-        dbg.segment = data->segment;
-        dfmt->linenum(dbg.where.filename, dbg.where.lineno, data->segment);
-    }
-
     if (asize > amax) {
         if (data->type == OUT_RELADDR || (data->flags & OUT_SIGNED)) {
             nasm_nonfatal("%u-bit signed relocation unsupported by output format %s",
@@ -445,6 +509,44 @@ static void out(struct out_data *data)
         zeropad = data->size - amax;
         data->size = amax;
     }
+
+    if (unlikely(out_log)) {
+        out_log_add(out_log, data, zeropad);
+        data->offset  += data->size + zeropad;
+        data->insoffs += data->size + zeropad;
+        data->size    += zeropad;
+        return;
+    }
+
+    out_emit(data, zeropad);
+}
+
+/*
+ * Pass the converted data on to the listing and the backends.
+ */
+static void out_emit(struct out_data *data, uint64_t zeropad)
+{
+    static per_thread struct last_debug_info {
+        struct src_location where;
+        int32_t segment;
+    } dbg;
+    enum profile_step step;
+
+    /*
+     * If the source location or output segment has changed,
+     * let the debug backend know. Some backends really don't
+     * like being given a NULL filename as can happen if we
+     * use -Lb and expand a macro, so filter out that case.
+     */
+    data->where = src_where();
+    if (data->where.filename &&
+        (!src_location_same(data->where, dbg.where) |
+         (data->segment != dbg.segment))) {
+        dbg.where   = data->where;
+        dbg.segment = data->segment;
+        dfmt->linenum(dbg.where.filename, dbg.where.lineno, data->segment);
+    }
+
     lfmt->output(data);
 
     if (likely(data->segment != NO_SEG)) {
@@ -454,7 +556,9 @@ static void out(struct out_data *data)
         if (debug_current_macro)
             debug_macro_out(data);
 
+        step = profile_enter(STEP_OUTPUT);
         ofmt->output(data);
+        profile_leave(step);
     } else {
         /* Outputting to ABSOLUTE section - only reserve is permitted */
         if (data->type != OUT_RESERVE)
@@ -469,7 +573,9 @@ static void out(struct out_data *data)
         data->type     = OUT_ZERODATA;
         data->size     = zeropad;
         lfmt->output(data);
+        step = profile_enter(STEP_OUTPUT);
         ofmt->output(data);
+        profile_leave(step);
         data->offset  += zeropad;
         data->insoffs += zeropad;
         data->size    += zeropad;  /* Restore original size value */
@@ -509,9 +615,18 @@ static void out_segment(struct out_data *data, const struct operand *opx)
     data->flags     = OUT_UNSIGNED;
     data->size      = 2;
     data->toffset   = opx->offset;
-    data->tsegment  = ofmt->segbase(opx->segment | 1);
+    data->tsegment  = opx->segment | 1;
     data->twrt      = opx->wrt;
-    out(data);
+
+    /* When recording, the backend is asked on replay */
+    if (out_log) {
+        out_segbase = true;
+        out(data);
+        out_segbase = false;
+    } else {
+        data->tsegment = ofmt->segbase(data->tsegment);
+        out(data);
+    }
 }
 
 static void out_imm(struct out_data *data, const struct operand *opx,
@@ -562,6 +677,47 @@ static void out_reladdr(struct out_data *data, const struct operand *opx,
     out(data);
 }
 
+/*
+ * Jump relaxation. During optimization passes, every jump whose size
+ * jmp_match() decided by the distance to a single label is recorded.
+ * After a pass which moved labels, relax_jumps() solves the sizes of
+ * these jumps in memory, and moves the labels to where they will be
+ * with those sizes, so the next pass starts from a converged layout
+ * instead of approaching it one pass at a time.
+ *
+ * This finds the layout the passes would only if the jumps are the
+ * only sizes which depend on labels, so nothing is predicted after a
+ * pass in which any other size did: a TIMES or DUP count, as used by
+ * ALIGN, or an operand such as an immediate or displacement whose
+ * value is a label difference. The pass after a prediction still
+ * verifies it; if it did not hold, the caller puts the labels back
+ * with restore_labels() and stops predicting.
+ */
+struct relax_item {
+    int32_t segment;
+    int64_t offset;             /* Start of the jump in this pass */
+    const void *label;          /* Target is label + addend */
+    int64_t addend;
+    int64_t lofs;               /* Offset of the label in this pass */
+    int64_t delta;              /* Growth of the jumps before this one */
+    int size, short_size, long_size, new_size;
+};
+
+static per_thread struct relax_item *relax_items;
+static per_thread size_t relax_nitems, relax_maxitems;
+
+static per_thread bool relax_nojump;       /* Disable jmp_match() */
+static per_thread bool relax_blocked;      /* A size not modelled depends on labels */
+
+/* What the last call to jmp_match() decided */
+static per_thread struct {
+    bool valid;                 /* Decided by the distance to the target */
+    bool is_short;
+    int short_size;
+} jmp_cand;
+
+#define RELAX_MAX_ITERATIONS 1000
+
 static bool jmp_match(int32_t segment, int64_t offset, int bits,
                       insn * ins, const struct itemplate *temp)
 {
@@ -576,6 +732,8 @@ static bool jmp_match(int32_t segment, int64_t offset, int bits,
         return false;
     if (optimizing.level < 0 && c == 0371)
         return false;
+    if (relax_nojump)
+        return false;
 
     isize = calcsize(segment, offset, bits, ins, temp);
 
@@ -586,9 +744,14 @@ static bool jmp_match(int32_t segment, int64_t offset, int bits,
     if (ins->oprs[0].segment != segment)
         return false;
 
+    jmp_cand.short_size = isize;
+
     isize = ins->oprs[0].offset - offset - isize; /* isize is delta */
     is_byte = (isize >= -128 && isize <= 127); /* is it byte size? */
 
+    jmp_cand.valid = true;
+    jmp_cand.is_short = is_byte;
+
     if (is_byte && c == 0371 && ins->prefixes[PPS_REP] == P_BND) {
         /* jmp short (opcode eb) cannot be used with bnd prefix. */
         ins->prefixes[PPS_REP] = P_none;
@@ -702,9 +865,6 @@ static void out_eops(struct out_data *data, const extop *e)
     }
 }
 
-/* This is totally just a wild guess what is reasonable... */
-#define INCBIN_MAX_BUF (ZERO_BUF_SIZE * 16)
-
 int64_t assemble(int32_t segment, int64_t start, int bits, insn *instruction)
 {
     struct out_data data;
@@ -724,33 +884,23 @@ int64_t assemble(int32_t segment, int64_t start, int bits, insn *instruction)
         out_eops(&data, instruction->eops);
     } else if (instruction->opcode == I_INCBIN) {
         const char *fname = instruction->eops->val.string.data;
-        FILE *fp;
+        const struct cached_file *cf;
         size_t t = instruction->times; /* INCBIN handles TIMES by itself */
         off_t base = 0;
         off_t len;
-        const void *map = NULL;
-        char *buf = NULL;
-        size_t blk = 0;         /* Buffered I/O block size */
-        size_t m = 0;           /* Bytes last read */
 
         if (!t)
             goto done;
 
-        fp = nasm_open_read(fname, NF_BINARY|NF_FORMAP);
-        if (!fp) {
+        /* The file is read once, and kept for the following passes */
+        cf = nasm_cached_file(fname);
+        if (!cf) {
             nasm_nonfatal("`incbin': unable to open file `%s'",
                           fname);
             goto done;
         }
 
-        len = nasm_file_size(fp);
-
-        if (len == (off_t)-1) {
-            nasm_nonfatal("`incbin': unable to get length of file `%s'",
-                          fname);
-            goto close_done;
-        }
-
+        len = cf->len;
         if (instruction->eops->next) {
             base = instruction->eops->next->val.num.offset;
             if (base >= len) {
@@ -766,17 +916,7 @@ int64_t assemble(int32_t segment, int64_t start, int bits, insn *instruction)
         lfmt->set_offset(data.offset);
         lfmt->uplevel(LIST_INCBIN, len);
 
-        if (!len)
-            goto end_incbin;
-
-        /* Try to map file data */
-        map = nasm_map_file(fp, base, len);
-        if (!map) {
-            blk = len < (off_t)INCBIN_MAX_BUF ? (size_t)len : INCBIN_MAX_BUF;
-            buf = nasm_malloc(blk);
-        }
-
-        while (t--) {
+        while (len && t--) {
             /*
              * Consider these irrelevant for INCBIN, since it is fully
              * possible that these might be (way) bigger than an int
@@ -788,51 +928,14 @@ int64_t assemble(int32_t segment, int64_t start, int bits, insn *instruction)
             data.insoffs = 0;
             data.inslen = 0;
 
-            if (map) {
-                out_rawdata(&data, map, len);
-            } else if ((off_t)m == len) {
-                out_rawdata(&data, buf, len);
-            } else {
-                off_t l = len;
-
-                if (fseeko(fp, base, SEEK_SET) < 0 || ferror(fp)) {
-                    nasm_nonfatal("`incbin': unable to seek on file `%s'",
-                                  fname);
-                    goto end_incbin;
-                }
-                while (l > 0) {
-                    m = fread(buf, 1, l < (off_t)blk ? (size_t)l : blk, fp);
-                    if (!m || feof(fp)) {
-                        /*
-                         * This shouldn't happen unless the file
-                         * actually changes while we are reading
-                         * it.
-                         */
-                        nasm_nonfatal("`incbin': unexpected EOF while"
-                                      " reading file `%s'", fname);
-                        goto end_incbin;
-                    }
-                    out_rawdata(&data, buf, m);
-                    l -= m;
-                }
-            }
+            out_rawdata(&data, cf->data + base, len);
         }
-    end_incbin:
+
         lfmt->downlevel(LIST_INCBIN);
         if (instruction->times > 1) {
             lfmt->uplevel(LIST_TIMES, instruction->times);
             lfmt->downlevel(LIST_TIMES);
         }
-        if (ferror(fp)) {
-            nasm_nonfatal("`incbin': error while"
-                          " reading file `%s'", fname);
-        }
-    close_done:
-        if (buf)
-            nasm_free(buf);
-        if (map)
-            nasm_unmap_file(map, len);
-        fclose(fp);
     done:
         instruction->times = 1; /* Tell the upper layer not to iterate */
         ;
@@ -963,6 +1066,45 @@ int64_t assemble(int32_t segment, int64_t start, int bits, insn *instruction)
     return data.offset - start;
 }
 
+/*
+ * Encode an instruction like assemble(), but record the output in
+ * the log instead of passing it on.  This touches nothing but the
+ * log and the instruction, so it can run on another thread; segment
+ * bases, which belong to the backend, are looked up on replay.
+ */
+int64_t assemble_record(struct out_log *log, int32_t segment, int64_t start,
+                        int bits, insn *instruction)
+{
+    int64_t len;
+
+    log->nrecs = log->nbytes = 0;
+
+    out_log = log;
+    len = assemble(segment, start, bits, instruction);
+    out_log = NULL;
+
+    return len;
+}
+
+/*
+ * Emit the output recorded by assemble_record(), as assemble()
+ * would have at the current source location.
+ */
+void assemble_replay(const struct out_log *log)
+{
+    const struct out_record *r;
+    struct out_data data;
+    size_t i;
+
+    for (i = 0, r = log->recs; i < log->nrecs; i++, r++) {
+        data = r->data;
+        data.data = data.type == OUT_RAWDATA ? log->bytes + r->bytes : NULL;
+        if (r->segbase)
+            data.tsegment = ofmt->segbase(data.tsegment);
+        out_emit(&data, r->zeropad);
+    }
+}
+
 static int32_t eops_typeinfo(const extop *e)
 {
     int32_t typeinfo = 0;
@@ -1071,6 +1213,8 @@ static void define_equ(insn * instruction)
         define_label(instruction->label,
                      instruction->oprs[0].segment,
                      instruction->oprs[0].offset, false);
+        set_label_layout(instruction->label,
+                         instruction->oprs[0].opflags & OPFLAG_LAYOUT);
     } else if (instruction->operands == 2
                && (instruction->oprs[0].type & IMMEDIATE)
                && (instruction->oprs[0].type & COLON)
@@ -1142,14 +1286,16 @@ int64_t insn_size(int32_t segment, int64_t offset, int bits, insn *instruction)
     } else if (instruction->opcode == I_INCBIN) {
         const extop *e = instruction->eops;
         const char *fname = e->val.string.data;
+        const struct cached_file *cf;
         off_t len;
 
-        len = nasm_file_size_by_path(fname);
-        if (len == (off_t)-1) {
+        cf = nasm_cached_file(fname);
+        if (!cf) {
             nasm_nonfatal("`incbin': unable to get length of file `%s'",
                           fname);
             return 0;
         }
+        len = cf->len;
 
         e = e->next;
         if (e) {
@@ -1174,6 +1320,7 @@ int64_t insn_size(int32_t segment, int64_t offset, int bits, insn *instruction)
         /* Check to see if we need an address-size prefix */
         add_asp(instruction, bits);
 
+        jmp_cand.valid = false;
         m = find_match(&temp, instruction, segment, offset, bits);
         if (m != MOK_GOOD)
             return -1;              /* No match */
@@ -1182,10 +1329,254 @@ int64_t insn_size(int32_t segment, int64_t offset, int bits, insn *instruction)
         debug_set_type(instruction);
         isize = merge_resb(instruction, isize);
 
+        if (pass_type() == PASS_OPT) {
+            if (jmp_cand.valid)
+                relax_record(segment, offset, bits, instruction, isize);
+            else
+                relax_operands(instruction);
+        }
+
         return isize;
     }
 }
 
+/*
+ * Record a jump whose size was chosen by jmp_match()
+ */
+static void relax_record(int32_t segment, int64_t offset, int bits,
+                         const insn *instruction, int64_t isize)
+{
+    const operand *op = &instruction->oprs[0];
+    struct relax_item *ri;
+    int32_t lseg;
+    int64_t lofs;
+    int64_t short_size, long_size;
+
+    if (!(op->opflags & OPFLAG_LAYOUT))
+        return;                 /* A constant distance, e.g. jmp $+5 */
+
+    if (!op->label || !label_ref_value(op->label, &lseg, &lofs) ||
+        lseg != segment) {
+        relax_blocked = true;
+        return;
+    }
+
+    if (jmp_cand.is_short) {
+        const struct itemplate *temp;
+        insn tmp = *instruction;
+        enum match_result m;
+
+        /* What would it be if it was not short? */
+        relax_nojump = true;
+        m = find_match(&temp, &tmp, segment, offset, bits);
+        relax_nojump = false;
+        if (m != MOK_GOOD) {
+            relax_blocked = true;
+            return;
+        }
+
+        short_size = isize;
+        long_size  = calcsize(segment, offset, bits, &tmp, temp);
+    } else {
+        short_size = jmp_cand.short_size;
+        long_size  = isize;
+    }
+
+    if (short_size >= long_size)
+        return;
+
+    if (relax_nitems >= relax_maxitems) {
+        relax_maxitems = relax_maxitems ? relax_maxitems << 1 : 1024;
+        relax_items = nasm_realloc(relax_items,
+                                   relax_maxitems * sizeof *relax_items);
+    }
+
+    ri = &relax_items[relax_nitems++];
+    ri->segment    = segment;
+    ri->offset     = offset;
+    ri->label      = op->label;
+    ri->addend     = op->offset - lofs;
+    ri->size       = isize;
+    ri->short_size = short_size;
+    ri->long_size  = long_size;
+}
+
+/*
+ * An absolute operand value which depends on where labels are, such
+ * as a label difference, can decide the size of an instruction.
+ */
+static void relax_operands(const insn *instruction)
+{
+    int i;
+
+    for (i = 0; i < instruction->operands; i++) {
+        const operand *op = &instruction->oprs[i];
+
+        if ((op->opflags & OPFLAG_LAYOUT) && op->segment == NO_SEG)
+            relax_blocked = true;
+    }
+}
+
+/*
+ * Note that a size which relax_jumps() does not model depends on
+ * where labels are in this pass, e.g. that of a TIMES count.
+ */
+void relax_unmodelled(void)
+{
+    relax_blocked = true;
+}
+
+/*
+ * Forget the jumps recorded; called at the start of each pass
+ */
+void relax_reset(void)
+{
+    relax_nitems = 0;
+    relax_blocked = false;
+}
+
+void relax_cleanup(void)
+{
+    nasm_free(relax_items);
+    relax_items = NULL;
+    relax_nitems = relax_maxitems = 0;
+}
+
+static int relax_cmp(const void *a, const void *b)
+{
+    const struct relax_item *ra = a, *rb = b;
+
+    if (ra->segment != rb->segment)
+        return ra->segment < rb->segment ? -1 : 1;
+    if (ra->offset != rb->offset)
+        return ra->offset < rb->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * How much the jumps ending at or before offset in segment have grown.
+ * Returns 0 if no jumps were recorded in this segment.
+ */
+static int64_t relax_delta(int32_t segment, int64_t offset)
+{
+    size_t lo = 0, hi = relax_nitems;
+    const struct relax_item *ri;
+
+    /* Find the first jump which ends after segment:offset */
+    while (lo < hi) {
+        size_t mid = (lo + hi) >> 1;
+        ri = &relax_items[mid];
+        if (ri->segment < segment ||
+            (ri->segment == segment && ri->offset + ri->size <= offset))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0) {
+        ri = &relax_items[lo-1];
+        if (ri->segment == segment)
+            return ri->delta + ri->new_size - ri->size;
+    }
+    return 0;
+}
+
+static int64_t relax_adjust(int32_t segment, int64_t offset)
+{
+    return offset + relax_delta(segment, offset);
+}
+
+/*
+ * Solve the sizes of the jumps recorded during the pass just ended,
+ * and move the labels accordingly. Returns true if any label moved.
+ */
+bool relax_jumps(void)
+{
+    struct relax_item *ri, *end;
+    bool changed;
+    int iter;
+
+    if (!relax_nitems || relax_blocked ||
+        (optimizing.flag & OPTIM_DISABLE_RELAX))
+        return false;
+
+    qsort(relax_items, relax_nitems, sizeof *relax_items, relax_cmp);
+    end = relax_items + relax_nitems;
+
+    for (ri = relax_items; ri < end; ri++) {
+        int32_t lseg;
+        int64_t lofs;
+
+        if (ri > relax_items && !relax_cmp(ri-1, ri))
+            return false;       /* Overlapping code; don't even try */
+
+        if (!label_ref_value(ri->label, &lseg, &lofs) ||
+            lseg != ri->segment) {
+            /* Can't tell where this goes; assume it stays the same */
+            ri->short_size = ri->long_size = ri->size;
+            lofs = ri->offset - ri->addend;
+        }
+
+        ri->lofs     = lofs;
+        ri->new_size = ri->short_size;
+    }
+
+    /*
+     * Start with every jump short and only ever grow them, which
+     * converges on the smallest consistent set of sizes. Each round
+     * first places the jumps by the sizes of the previous round, so
+     * that a jump and its target are always placed by the same sizes;
+     * otherwise a distance can appear larger than it will ever be,
+     * and grow a jump which did not need to.
+     */
+    for (iter = 0; iter < RELAX_MAX_ITERATIONS; iter++) {
+        int64_t delta = 0;
+
+        for (ri = relax_items; ri < end; ri++) {
+            if (ri > relax_items && ri[-1].segment != ri->segment)
+                delta = 0;
+            ri->delta = delta;
+            delta += ri->new_size - ri->size;
+        }
+
+        changed = false;
+        for (ri = relax_items; ri < end; ri++) {
+            int64_t where, dist;
+
+            if (ri->new_size == ri->long_size)
+                continue;
+
+            /*
+             * The label moves, not the target: a jump which grows
+             * between label and label + addend does not move the
+             * target away from the label.
+             */
+            where = ri->offset + ri->delta + ri->short_size;
+            dist  = relax_adjust(ri->segment, ri->lofs) + ri->addend - where;
+            if (dist < -128 || dist > 127) {
+                ri->new_size = ri->long_size;
+                changed = true;
+            }
+        }
+
+        if (!changed)
+            break;
+    }
+
+    if (changed)
+        return false;           /* No convergence, leave it to the passes */
+
+    for (ri = relax_items; ri < end; ri++) {
+        if (ri->new_size != ri->size) {
+            save_labels();
+            adjust_labels(relax_adjust);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void bad_hle_warn(const insn * ins, uint8_t hleok)
 {
     enum prefixes rep_pfx = ins->prefixes[PPS_REP];
@@ -2401,17 +2792,186 @@ static int op_evexflags(const operand * o, int mask, uint8_t byte)
     return evexflags(val, o->decoflags, mask, byte);
 }
 
-static enum match_result find_match(const struct itemplate **tempp,
-                                    insn *instruction,
-                                    int32_t segment, int64_t offset, int bits)
+/*
+ * Load the prefilter signature of an instruction: the class bits of
+ * each operand type, as stored in struct itemplate_filter.
+ */
+static void filter_signature(uint32_t *sig, const insn *instruction)
+{
+    int i;
+
+    for (i = 0; i < instruction->operands; i++)
+        sig[i] = ITF_OPD(instruction->oprs[i].type);
+}
+
+/*
+ * Returns true if the template might match the instruction.  A template
+ * rejected here always fails in matches() with something other than
+ * MOK_GOOD or MOK_JUMP, so it only matters for picking an error code.
+ */
+static inline bool filter_passes(const struct itemplate_filter *f,
+                                 const uint32_t *sig, int operands,
+                                 unsigned int mode)
+{
+    int i;
+
+    if (f->operands != operands || !(f->modes & mode))
+        return false;
+
+    for (i = 0; i < operands; i++)
+        if (f->opd[i] & ~sig[i])
+            return false;
+
+    return true;
+}
+
+/*
+ * Scan the templates of an opcode, first only those that pass the
+ * prefilter.  If none of them matches, the rest is checked too, so
+ * the error and fuzzy size information is the same as for a full scan.
+ */
+static enum match_result scan_templates(const struct itemplate **tempp,
+                                        insn *instruction,
+                                        int32_t segment, int64_t offset,
+                                        int bits, opflags_t *xsizeflags,
+                                        bool *opsizemissing, bool *jump)
 {
     const struct itemplate *temp;
+    const struct itemplate_filter *f;
+    enum match_result m, merr = MERR_INVALOP;
+    const unsigned int mode = (bits == 64) ? ITF_MODE_64 : ITF_MODE_1632;
+    const int8_t broadcast = instruction->evex_brerop;
+    uint32_t sig[MAX_OPERANDS];
+    bool skipped = false;
+    int i, phase;
+
+    filter_signature(sig, instruction);
+
+    for (phase = 0; phase < 2; phase++) {
+        temp = nasm_instructions[instruction->opcode];
+        f = nasm_instruction_filters[instruction->opcode];
+
+        for (; temp->opcode != I_none; temp++, f++) {
+            match_stats.templates += !phase;
+            if (filter_passes(f, sig, instruction->operands, mode) == !!phase) {
+                skipped = true;
+                continue;
+            }
+
+            match_stats.matches++;
+            m = matches(temp, instruction, bits);
+            if (m == MOK_JUMP) {
+                *jump = true;
+                if (jmp_match(segment, offset, bits, instruction, temp))
+                    m = MOK_GOOD;
+                else
+                    m = MERR_INVALOP;
+            } else if (m == MERR_OPSIZEMISSING && xsizeflags &&
+                       !itemp_has(temp, IF_SX)) {
+                /*
+                 * Missing operand size and a candidate for fuzzy matching...
+                 */
+                for (i = 0; i < temp->operands; i++)
+                    if (i == broadcast)
+                        xsizeflags[i] |= temp->deco[i] & BRSIZE_MASK;
+                    else
+                        xsizeflags[i] |= temp->opd[i] & SIZE_MASK;
+                *opsizemissing = true;
+            }
+            if (m > merr)
+                merr = m;
+            if (merr == MOK_GOOD)
+                goto done;
+        }
+
+        if (!skipped)
+            break;
+    }
+
+done:
+    *tempp = temp;
+    return merr;
+}
+
+/*
+ * Hash the key a word at a time; it starts with opflags_t, so its size
+ * is a multiple of 8.
+ */
+static uint64_t match_key_hash(const struct match_key *key)
+{
+    const char *p = (const char *)key;
+    uint64_t h = 0, w;
+    size_t i;
+
+    for (i = 0; i < sizeof *key; i += sizeof w) {
+        memcpy(&w, p + i, sizeof w);
+        h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+    }
+    return h;
+}
+
+/*
+ * Find the cache slot for an instruction, filling in its key.
+ */
+static struct match_cache_entry *
+match_cache_slot(struct match_key *key, const insn *instruction, int bits)
+{
+    int i;
+
+    if (!match_cache) {
+        match_cache = nasm_zalloc(MATCH_CACHE_SIZE * sizeof *match_cache);
+        match_cache_cpu = cpu;
+    } else if (memcmp(&match_cache_cpu, &cpu, sizeof cpu)) {
+        memset(match_cache, 0, MATCH_CACHE_SIZE * sizeof *match_cache);
+        match_cache_cpu = cpu;
+    }
+
+    memset(key, 0, sizeof *key);  /* Padding is hashed and compared too */
+    for (i = 0; i < instruction->operands; i++) {
+        key->type[i] = instruction->oprs[i].type;
+        key->deco[i] = instruction->oprs[i].decoflags;
+    }
+    memcpy(key->prefixes, instruction->prefixes, sizeof key->prefixes);
+    key->opcode   = instruction->opcode;
+    key->operands = instruction->operands;
+    key->bits     = bits;
+    key->brerop   = instruction->evex_brerop;
+
+    return &match_cache[match_key_hash(key) >> (64 - MATCH_CACHE_BITS)];
+}
+
+void match_cache_free(void)
+{
+    nasm_free(match_cache);
+    match_cache = NULL;
+}
+
+static enum match_result lookup_match(const struct itemplate **tempp,
+                                      insn *instruction,
+                                      int32_t segment, int64_t offset,
+                                      int bits)
+{
     enum match_result m, merr;
     opflags_t xsizeflags[MAX_OPERANDS];
     bool opsizemissing = false;
+    bool jump = false;
     int8_t broadcast = instruction->evex_brerop;
+    struct match_key key;
+    struct match_cache_entry *mc;
     int i;
 
+    mc = match_cache_slot(&key, instruction, bits);
+    match_stats.lookups++;
+    if (mc->valid && !memcmp(&mc->key, &key, sizeof key)) {
+        match_stats.hits++;
+        for (i = 0; i < instruction->operands; i++) {
+            instruction->oprs[i].type |= mc->type[i];
+            instruction->oprs[i].decoflags |= mc->deco[i];
+        }
+        *tempp = mc->temp;
+        return mc->result;
+    }
+
     /* broadcasting uses a different data element size */
     for (i = 0; i < instruction->operands; i++) {
         if (i == broadcast)
@@ -2420,32 +2980,10 @@ static enum match_result find_match(const struct itemplate **tempp,
             xsizeflags[i] = instruction->oprs[i].type & SIZE_MASK;
     }
 
-    merr = MERR_INVALOP;
-
-    for (temp = nasm_instructions[instruction->opcode];
-         temp->opcode != I_none; temp++) {
-        m = matches(temp, instruction, bits);
-        if (m == MOK_JUMP) {
-            if (jmp_match(segment, offset, bits, instruction, temp))
-                m = MOK_GOOD;
-            else
-                m = MERR_INVALOP;
-        } else if (m == MERR_OPSIZEMISSING && !itemp_has(temp, IF_SX)) {
-            /*
-             * Missing operand size and a candidate for fuzzy matching...
-             */
-            for (i = 0; i < temp->operands; i++)
-                if (i == broadcast)
-                    xsizeflags[i] |= temp->deco[i] & BRSIZE_MASK;
-                else
-                    xsizeflags[i] |= temp->opd[i] & SIZE_MASK;
-            opsizemissing = true;
-        }
-        if (m > merr)
-            merr = m;
-        if (merr == MOK_GOOD)
-            goto done;
-    }
+    merr = scan_templates(tempp, instruction, segment, offset, bits,
+                          xsizeflags, &opsizemissing, &jump);
+    if (merr == MOK_GOOD)
+        goto done;
 
     /* No match, but see if we can get a fuzzy operand size match... */
     if (!opsizemissing)
@@ -2473,26 +3011,42 @@ static enum match_result find_match(const struct itemplate **tempp,
     }
 
     /* Try matching again... */
-    for (temp = nasm_instructions[instruction->opcode];
-         temp->opcode != I_none; temp++) {
-        m = matches(temp, instruction, bits);
-        if (m == MOK_JUMP) {
-            if (jmp_match(segment, offset, bits, instruction, temp))
-                m = MOK_GOOD;
-            else
-                m = MERR_INVALOP;
-        }
-        if (m > merr)
-            merr = m;
-        if (merr == MOK_GOOD)
-            goto done;
-    }
+    m = scan_templates(tempp, instruction, segment, offset, bits,
+                       NULL, NULL, &jump);
+    if (m > merr)
+        merr = m;
 
 done:
-    *tempp = temp;
+    /*
+     * The result of jmp_match() depends on the distance to the target,
+     * so it is not cached.  Operand sizes set by fuzzy matching are
+     * remembered and applied again on a hit.
+     */
+    if (!jump) {
+        mc->key = key;
+        for (i = 0; i < instruction->operands; i++) {
+            mc->type[i] = instruction->oprs[i].type & ~key.type[i];
+            mc->deco[i] = instruction->oprs[i].decoflags & ~key.deco[i];
+        }
+        mc->temp   = *tempp;
+        mc->result = merr;
+        mc->valid  = true;
+    }
     return merr;
 }
 
+static enum match_result find_match(const struct itemplate **tempp,
+                                    insn *instruction,
+                                    int32_t segment, int64_t offset, int bits)
+{
+    enum profile_step step = profile_enter(STEP_FIND_MATCH);
+    enum match_result m;
+
+    m = lookup_match(tempp, instruction, segment, offset, bits);
+    profile_leave(step);
+    return m;
+}
+
 static uint8_t get_broadcast_num(opflags_t opflags, opflags_t brsize)
 {
     unsigned int opsize = (opflags & SIZE_MASK) >> SIZE_SHIFT;
@@ -3305,7 +3859,7 @@ static int process_ea(operand *input, ea *output, int bits,
 err_set_msg:
     if (!errmsg) {
         /* Default error message */
-        static char invalid_address_msg[40];
+        static per_thread char invalid_address_msg[40];
         snprintf(invalid_address_msg, sizeof invalid_address_msg,
                  "invalid %d-bit effective address", bits);
         errmsg = invalid_address_msg;
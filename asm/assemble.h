@@ -41,15 +41,46 @@
 #include "nasm.h"
 #include "iflag.h"
 
-extern iflag_t cpu, cmd_cpu;
+extern per_thread iflag_t cpu, cmd_cpu;
 void set_cpu(const char *cpuspec);
 
-extern bool in_absolute;        /* Are we in an absolute segment? */
-extern struct location absolute;
+extern per_thread bool in_absolute;        /* Are we in an absolute segment? */
+extern per_thread struct location absolute;
 
 int64_t insn_size(int32_t segment, int64_t offset, int bits, insn *instruction);
 int64_t assemble(int32_t segment, int64_t offset, int bits, insn *instruction);
 
+/*
+ * The output of one instruction, recorded by assemble_record() and
+ * emitted later by assemble_replay(); see parallel.c.
+ */
+struct out_record;
+struct out_log {
+    struct out_record *recs;
+    size_t nrecs, maxrecs;
+    uint8_t *bytes;             /* Contents of OUT_RAWDATA records */
+    size_t nbytes, maxbytes;
+};
+int64_t assemble_record(struct out_log *log, int32_t segment, int64_t offset,
+                        int bits, insn *instruction);
+void assemble_replay(const struct out_log *log);
+void out_log_free(struct out_log *log);
+
+/* Template matching statistics, reported by -Ov */
+struct match_stats {
+    uint64_t templates;         /* Templates an unfiltered scan would check */
+    uint64_t matches;           /* Templates actually passed to matches() */
+    uint64_t lookups;           /* Lookups in the match cache */
+    uint64_t hits;              /* Lookups answered by the match cache */
+};
+extern per_thread struct match_stats match_stats;
+void match_cache_free(void);
+
+void relax_reset(void);
+void relax_unmodelled(void);
+bool relax_jumps(void);
+void relax_cleanup(void);
+
 bool process_directives(char *);
 void process_pragma(char *);
 
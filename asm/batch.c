@@ -0,0 +1,265 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+
+/*
+ * batch.c - batch mode, see --batch
+ *
+ * Each job runs in a child process forked from the initialized
+ * assembler, so it starts without paying for the startup of a new
+ * process, and no state can leak from one job to the next.
+ *
+ * This file does not include nasm.h, since <sys/wait.h> may define
+ * names which clash with the register class macros.
+ */
+
+#include "compiler.h"
+
+#include "nasmlib.h"
+#include "nctype.h"
+#include "error.h"
+#include "strlist.h"
+#include "batch.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
+/*
+ * Read the job list, "-" for stdin; blank lines and lines starting
+ * with # are ignored.  The whole list is read before any job is
+ * started.
+ */
+struct strlist *batch_read(const char *name)
+{
+    struct strlist *jobs = strlist_alloc(false);
+    size_t size = 256;
+    char *buf = nasm_malloc(size);
+    FILE *f;
+    int c;
+
+    if (!strcmp(name, "-")) {
+        f = stdin;
+    } else {
+        f = nasm_open_read(name, NF_TEXT);
+        if (!f)
+            nasm_fatalf(ERR_USAGE, "unable to open batch file `%s'", name);
+    }
+
+    do {
+        size_t len = 0;
+        char *p, *q;
+
+        while ((c = getc(f)) != EOF && c != '\n') {
+            if (len + 1 >= size) {
+                size <<= 1;
+                buf = nasm_realloc(buf, size);
+            }
+            buf[len++] = c;
+        }
+        buf[len] = '\0';
+
+        p = nasm_skip_spaces(buf);
+        q = p + strlen(p);
+        while (q > p && nasm_isspace(q[-1]))
+            *--q = '\0';
+
+        if (*p && *p != '#')
+            strlist_add(jobs, p);
+    } while (c != EOF);
+
+    if (f != stdin)
+        fclose(f);
+    nasm_free(buf);
+    return jobs;
+}
+
+/*
+ * Split a job line in place into an argument vector, with argv0 as
+ * its first entry.  Arguments are separated by whitespace; a part of
+ * an argument in double quotes may contain whitespace.
+ */
+char **batch_split(char *line, const char *argv0, int *argcp)
+{
+    char **argv = nasm_malloc((strlen(line) / 2 + 2) * sizeof *argv);
+    int argc = 0;
+    char *p = line, *q;
+
+    argv[argc++] = (char *)argv0;
+    for (;;) {
+        p = nasm_skip_spaces(p);
+        if (!*p)
+            break;
+
+        argv[argc++] = q = p;
+        while (*p && !nasm_isspace(*p)) {
+            if (*p == '"') {
+                p++;
+                while (*p && *p != '"')
+                    *q++ = *p++;
+                if (*p)
+                    p++;
+            } else {
+                *q++ = *p++;
+            }
+        }
+        if (*p)
+            p++;
+        *q = '\0';
+    }
+    argv[argc] = NULL;
+
+    *argcp = argc;
+    return argv;
+}
+
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID) && defined(HAVE_SYS_WAIT_H)
+
+struct batch_slot {
+    pid_t pid;                  /* 0 if the slot is free */
+    const char *job;            /* The job line */
+    FILE *errors;               /* Buffered diagnostics, if any */
+};
+
+/*
+ * Wait for any job to finish, pass on its diagnostics and free its
+ * slot.  Returns true if the job failed.
+ */
+static bool batch_wait(struct batch_slot *slots)
+{
+    struct batch_slot *slot;
+    int status;
+    pid_t pid;
+
+    do {
+        pid = waitpid(-1, &status, 0);
+    } while (pid < 0 && errno == EINTR);
+    if (pid < 0)
+        nasm_fatal("unable to wait for batch jobs: %s", strerror(errno));
+
+    for (slot = slots; slot->pid != pid; slot++)
+        ;
+    slot->pid = 0;
+
+    if (slot->errors) {
+        char buf[BUFSIZ];
+        size_t n;
+
+        rewind(slot->errors);
+        while ((n = fread(buf, 1, sizeof buf, slot->errors)))
+            fwrite(buf, 1, n, stderr);
+        fclose(slot->errors);
+        slot->errors = NULL;
+    }
+
+    if (WIFSIGNALED(status)) {
+        nasm_nonfatal("batch job `%s' terminated by signal %d",
+                      slot->job, WTERMSIG(status));
+        return true;
+    }
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/*
+ * Run every job in the list, up to njobs at the same time.  When
+ * more than one job can run, the diagnostics written to stderr by
+ * each one are held until it has finished, so they are not mixed
+ * with those of other jobs.  Returns true if any job failed.
+ */
+bool batch_run(const struct strlist *jobs, unsigned int njobs,
+               batch_job_func job)
+{
+    const struct strlist_entry *e;
+    struct batch_slot *slots, *slot;
+    unsigned int running = 0;
+    bool failed = false;
+
+    slots = nasm_zalloc(njobs * sizeof *slots);
+
+    strlist_for_each(e, jobs) {
+        pid_t pid;
+
+        if (running == njobs) {
+            failed |= batch_wait(slots);
+            running--;
+        }
+
+        for (slot = slots; slot->pid; slot++)
+            ;
+
+        slot->job = e->str;
+        if (njobs > 1) {
+            slot->errors = tmpfile();
+            if (!slot->errors)
+                nasm_fatal("unable to create a temporary file: %s",
+                           strerror(errno));
+        }
+
+        fflush(NULL);
+        pid = fork();
+        if (pid < 0)
+            nasm_fatal("unable to start a batch job: %s", strerror(errno));
+
+        if (!pid) {
+            if (slot->errors)
+                dup2(fileno(slot->errors), fileno(stderr));
+            exit(job(slot->job));
+        }
+
+        slot->pid = pid;
+        running++;
+    }
+
+    while (running--)
+        failed |= batch_wait(slots);
+
+    nasm_free(slots);
+    return failed;
+}
+
+#else
+
+bool batch_run(const struct strlist *jobs, unsigned int njobs,
+               batch_job_func job)
+{
+    (void)jobs;
+    (void)njobs;
+    (void)job;
+
+    nasm_fatalf(ERR_USAGE, "--batch is not supported on this platform");
+}
+
+#endif
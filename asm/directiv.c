@@ -52,6 +52,7 @@
 #include "listing.h"
 #include "labels.h"
 #include "iflag.h"
+#include "parallel.h"
 
 struct cpunames {
     const char *name;
@@ -271,6 +272,10 @@ bool process_directives(char *directive)
 
     d = parse_directive_line(&directive, &value);
 
+    /* Anything a directive does happens after the deferred output */
+    if (d != D_none)
+        parallel_flush();
+
     switch (d) {
     case D_none:
         return D_none;      /* Not a directive */
@@ -107,7 +107,7 @@ struct warning_stack {
 	struct warning_stack *next;
 	uint8_t state[sizeof warning_state];
 };
-static struct warning_stack *warning_stack, *warning_state_init;
+static per_thread struct warning_stack *warning_stack, *warning_state_init;
 
 /* Push the warning status onto the warning stack */
 void push_warnings(void)
@@ -48,28 +48,98 @@
 #include "floats.h"
 #include "assemble.h"
 
-#define TEMPEXPRS_DELTA 128
-#define TEMPEXPR_DELTA 8
+#define TEMPEXPR_CHUNK 256
+#define EVALPROG_DELTA 32
 
-static scanner scanfunc;        /* Address of scanner routine */
-static void *scpriv;            /* Scanner private pointer */
+/*
+ * An expression is compiled into a postfix program, which is then run
+ * against the current values of the labels it refers to. A program
+ * can be saved with eval_save() and run again on a later pass with
+ * eval_run(), without scanning the source text a second time.
+ *
+ * The operations that push a value come first, then the unary
+ * operators, then the binary ones; emit() relies on this order.
+ */
+enum eval_opcode {
+    EV_CONST,                   /* Push { arg, value } */
+    EV_REG,                     /* Push register arg */
+    EV_SYMBOL,                  /* Push the label whose atom is arg */
+    EV_HERE,                    /* Push $ */
+    EV_BASE,                    /* Push $$ */
+    EV_NEG,                     /* Unary - */
+    EV_NOT,                     /* ~ */
+    EV_LNOT,                    /* ! */
+    EV_IFUNC,                   /* Integer function arg */
+    EV_SEG,                     /* SEG */
+    EV_SCALAR,                  /* ||, ^^, &&, |, ^ or & as arg */
+    EV_COMPARE,                 /* Comparison operator arg */
+    EV_SHIFT,                   /* <<, >> or >>> as arg */
+    EV_ADD,
+    EV_SUB,
+    EV_MUL,
+    EV_DIV,                     /* /, %, // or %% as arg */
+    EV_WRT,
+    EV_COND                     /* ?: */
+};
+
+struct eval_op {
+    int32_t op;                 /* enum eval_opcode */
+    int32_t arg;                /* Type, register, atom, function or token */
+    int64_t value;              /* Value for EV_CONST */
+};
+
+/*
+ * A saved program is this header followed by its operations, so it
+ * can be copied around with memcpy().
+ */
+struct eval_prog {
+    uint32_t nops;
+    uint32_t depth;             /* Stack entries needed to run it */
+};
+
+#define saved_ops(p) ((const struct eval_op *)((p) + 1))
+
+static per_thread scanner scanfunc;        /* Address of scanner routine */
+static per_thread void *scpriv;            /* Scanner private pointer */
 
-static expr **tempexprs = NULL;
-static int ntempexprs;
-static int tempexprs_size = 0;
+static per_thread struct eval_prog prog;   /* The program being compiled */
+static per_thread struct eval_op *prog_ops; /* ... and its operations */
+static per_thread size_t prog_size;        /* Entries in prog_ops */
+static per_thread size_t prog_depth;       /* Stack depth at this point */
 
-static expr *tempexpr;
-static int ntempexpr;
-static int tempexpr_size;
+static per_thread expr **stack;            /* Operand stack for run() */
+static per_thread size_t stack_size;
+static per_thread bool quiet;              /* Fail rather than report */
 
-static struct tokenval *tokval; /* The current token */
-static int tt;                   /* The t_type of tokval */
+/*
+ * Temporary expression vectors are bump-allocated from a chain of
+ * chunks, which is reset at the start of every run; a result is
+ * therefore valid until the next evaluate() or eval_run().
+ */
+struct temp_chunk {
+    struct temp_chunk *prev;
+    expr *e;
+    size_t size;
+};
+
+static per_thread struct temp_chunk *tempchunk;
+static per_thread size_t tempused;          /* Entries used in tempchunk */
 
-static bool critical;
-static int *opflags;
+static per_thread expr *tempexpr;           /* The vector being built */
+static per_thread size_t ntempexpr;
 
-static struct eval_hints *hint;
-static int64_t deadman;
+static per_thread struct tokenval *tokval; /* The current token */
+static per_thread int tt;                   /* The t_type of tokval */
+
+static per_thread bool critical;
+static per_thread int *opflags;
+static per_thread uint64_t symrefs;         /* Symbol, $ and $$ references evaluated */
+static per_thread int64_t exprsyms;         /* ... in the current expression */
+static per_thread const void *exprlabel;    /* The label referenced, if only one */
+static per_thread bool exprlayout;          /* Depends on where labels are */
+
+static per_thread struct eval_hints *hint;
+static per_thread int64_t deadman;
 
 
 /*
@@ -78,9 +148,64 @@ static int64_t deadman;
  */
 void eval_cleanup(void)
 {
-    while (ntempexprs)
-        nasm_free(tempexprs[--ntempexprs]);
-    nasm_free(tempexprs);
+    struct temp_chunk *c;
+
+    while ((c = tempchunk)) {
+        tempchunk = c->prev;
+        nasm_free(c);
+    }
+    tempused = 0;
+
+    nasm_free(prog_ops);
+    prog_ops = NULL;
+    prog.nops = prog_size = 0;
+
+    nasm_free(stack);
+    stack = NULL;
+    stack_size = 0;
+}
+
+/*
+ * Release all temporary vectors, keeping the newest (and largest)
+ * chunk for the next run.
+ */
+static void temp_reset(void)
+{
+    struct temp_chunk *c, *prev;
+
+    if (!tempchunk)
+        return;
+
+    for (c = tempchunk->prev; c; c = prev) {
+        prev = c->prev;
+        nasm_free(c);
+    }
+    tempchunk->prev = NULL;
+    tempused = 0;
+}
+
+/*
+ * Start a new chunk, twice the size of the last one, and move the
+ * vector being built there.
+ */
+static void temp_grow(void)
+{
+    struct temp_chunk *c;
+    size_t size = tempchunk ? tempchunk->size << 1 : TEMPEXPR_CHUNK;
+
+    while (size <= ntempexpr)
+        size <<= 1;
+
+    c = nasm_malloc(sizeof *c + size * sizeof(expr));
+    c->prev = tempchunk;
+    c->e    = (expr *)(c + 1);
+    c->size = size;
+    if (ntempexpr)
+        memcpy(c->e, tempexpr, ntempexpr * sizeof(expr));
+
+    tempchunk = c;
+    tempused  = 0;
+    tempexpr  = c->e;
 }
 
 /*
@@ -88,17 +213,16 @@ void eval_cleanup(void)
  */
 static void begintemp(void)
 {
-    tempexpr = NULL;
-    tempexpr_size = ntempexpr = 0;
+    ntempexpr = 0;
+    if (!tempchunk)
+        temp_grow();
+    tempexpr = tempchunk->e + tempused;
 }
 
 static void addtotemp(int32_t type, int64_t value)
 {
-    while (ntempexpr >= tempexpr_size) {
-        tempexpr_size += TEMPEXPR_DELTA;
-        tempexpr = nasm_realloc(tempexpr,
-                                tempexpr_size * sizeof(*tempexpr));
-    }
+    if (tempused + ntempexpr >= tempchunk->size)
+        temp_grow();
     tempexpr[ntempexpr].type = type;
     tempexpr[ntempexpr++].value = value;
 }
@@ -106,12 +230,27 @@ static void addtotemp(int32_t type, int64_t value)
 static expr *finishtemp(void)
 {
     addtotemp(0L, 0L);          /* terminate */
-    while (ntempexprs >= tempexprs_size) {
-        tempexprs_size += TEMPEXPRS_DELTA;
-        tempexprs = nasm_realloc(tempexprs,
-                                 tempexprs_size * sizeof(*tempexprs));
-    }
-    return tempexprs[ntempexprs++] = tempexpr;
+    tempused += ntempexpr;
+    return tempexpr;
+}
+
+/*
+ * Report a problem found while running a program. Returns false if
+ * the program should give up instead, which is always the case when
+ * running quietly for eval_run().
+ */
+static bool printf_func(2, 3) run_error(errflags severity,
+                                        const char *fmt, ...)
+{
+    va_list ap;
+
+    if (quiet)
+        return false;
+
+    va_start(ap, fmt);
+    nasm_verror(severity, fmt, ap);
+    va_end(ap);
+    return true;
 }
 
 /*
@@ -219,19 +358,19 @@ static expr *segment_part(expr * e)
         return unknown_expr();
 
     if (!is_reloc(e)) {
-        nasm_nonfatal("cannot apply SEG to a non-relocatable value");
+        run_error(ERR_NONFATAL, "cannot apply SEG to a non-relocatable value");
         return NULL;
     }
 
     seg = reloc_seg(e);
     if (seg == NO_SEG) {
-        nasm_nonfatal("cannot apply SEG to a non-relocatable value");
+        run_error(ERR_NONFATAL, "cannot apply SEG to a non-relocatable value");
         return NULL;
     } else if (seg & SEG_ABS) {
         return scalarvect(seg & ~SEG_ABS);
     } else if (seg & 1) {
-        nasm_nonfatal("SEG applied to something which"
-                      " is already a segment base");
+        run_error(ERR_NONFATAL, "SEG applied to something which"
+                  " is already a segment base");
         return NULL;
     } else {
         int32_t base = ofmt->segbase(seg + 1);
@@ -244,10 +383,34 @@ static expr *segment_part(expr * e)
 }
 
 /*
- * Recursive-descent parser. Called with a single boolean operand,
- * which is true if the evaluation is critical (i.e. unresolved
- * symbols are an error condition). Must update the global `tt' to
- * reflect the token after the parsed string. May return NULL.
+ * Add an operation to the program being compiled.
+ */
+static void emit(enum eval_opcode op, int32_t arg, int64_t value)
+{
+    struct eval_op *o;
+
+    if (op <= EV_BASE)
+        prog_depth++;
+    else if (op >= EV_SCALAR)
+        prog_depth -= (op == EV_COND) ? 2 : 1;
+    if (prog_depth > prog.depth)
+        prog.depth = prog_depth;
+
+    if (prog.nops >= prog_size) {
+        prog_size += EVALPROG_DELTA;
+        prog_ops = nasm_realloc(prog_ops, prog_size * sizeof *prog_ops);
+    }
+
+    o = &prog_ops[prog.nops++];
+    o->op    = op;
+    o->arg   = arg;
+    o->value = value;
+}
+
+/*
+ * Recursive-descent parser, which compiles the expression into the
+ * program run by run(). Must update the global `tt' to reflect the
+ * token after the parsed string. Returns false on a syntax error.
  *
  * evaluate() should report its own errors: on return it is assumed
  * that if NULL has been returned, the error has already been
@@ -286,412 +449,194 @@ static int scan(void)
  *       | number
  */
 
-static expr *cexpr(void);
-static expr *rexp0(void), *rexp1(void), *rexp2(void), *rexp3(void);
+static bool cexpr(void);
+static bool rexp0(void), rexp1(void), rexp2(void), rexp3(void);
 
-static expr *expr0(void), *expr1(void), *expr2(void), *expr3(void);
-static expr *expr4(void), *expr5(void), *expr6(void);
+static bool expr0(void), expr1(void), expr2(void), expr3(void);
+static bool expr4(void), expr5(void), expr6(void);
 
 /* This inline is a placeholder for the root of the basic expression */
-static inline expr *bexpr(void)
+static inline bool bexpr(void)
 {
     return cexpr();
 }
 
-static expr *cexpr(void)
+static bool cexpr(void)
 {
-    expr *e, *f, *g;
-
-    e = rexp0();
-    if (!e)
-        return NULL;
+    if (!rexp0())
+        return false;
 
     if (tt == TOKEN_QMARK) {
         scan();
-        f = bexpr();
-        if (!f)
-            return NULL;
+        if (!bexpr())
+            return false;
 
         if (tt != ':') {
             nasm_nonfatal("`?' without matching `:'");
-            return NULL;
+            return false;
         }
 
         scan();
-        g = cexpr();
-        if (!g)
-            return NULL;
+        if (!cexpr())
+            return false;
 
-        if (is_simple(e)) {
-            e = reloc_value(e) ? f : g;
-        } else if (is_just_unknown(e)) {
-            e = unknown_expr();
-        } else {
-            nasm_nonfatal("the left-hand side of `?' must be "
-                          "a scalar value");
-        }
+        emit(EV_COND, 0, 0);
     }
 
-    return e;
+    return true;
 }
 
-static expr *rexp0(void)
+static bool rexp0(void)
 {
-    expr *e, *f;
-
-    e = rexp1();
-    if (!e)
-        return NULL;
+    if (!rexp1())
+        return false;
 
     while (tt == TOKEN_DBL_OR) {
         scan();
-        f = rexp1();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`|' operator may only be applied to"
-                          " scalar values");
-        }
-
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect((int64_t)(reloc_value(e) || reloc_value(f)));
+        if (!rexp1())
+            return false;
+        emit(EV_SCALAR, TOKEN_DBL_OR, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *rexp1(void)
+static bool rexp1(void)
 {
-    expr *e, *f;
-
-    e = rexp2();
-    if (!e)
-        return NULL;
+    if (!rexp2())
+        return false;
 
     while (tt == TOKEN_DBL_XOR) {
         scan();
-        f = rexp2();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`^' operator may only be applied to"
-                          " scalar values");
-        }
-
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect((int64_t)(!reloc_value(e) ^ !reloc_value(f)));
+        if (!rexp2())
+            return false;
+        emit(EV_SCALAR, TOKEN_DBL_XOR, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *rexp2(void)
+static bool rexp2(void)
 {
-    expr *e, *f;
+    if (!rexp3())
+        return false;
 
-    e = rexp3();
-    if (!e)
-        return NULL;
     while (tt == TOKEN_DBL_AND) {
         scan();
-        f = rexp3();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`&' operator may only be applied to"
-                          " scalar values");
-        }
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect((int64_t)(reloc_value(e) && reloc_value(f)));
+        if (!rexp3())
+            return false;
+        emit(EV_SCALAR, TOKEN_DBL_AND, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *rexp3(void)
+static bool rexp3(void)
 {
-    expr *e, *f;
-    int64_t v;
-
-    e = expr0();
-    if (!e)
-        return NULL;
+    if (!expr0())
+        return false;
 
     while (tt == TOKEN_EQ || tt == TOKEN_LT || tt == TOKEN_GT ||
            tt == TOKEN_NE || tt == TOKEN_LE || tt == TOKEN_GE ||
            tt == TOKEN_LEG) {
         int tto = tt;
         scan();
-        f = expr0();
-        if (!f)
-            return NULL;
-
-        e = add_vectors(e, scalar_mult(f, -1L, false));
-
-        switch (tto) {
-        case TOKEN_EQ:
-        case TOKEN_NE:
-            if (is_unknown(e))
-                v = -1;         /* means unknown */
-            else if (!is_really_simple(e) || reloc_value(e) != 0)
-                v = (tto == TOKEN_NE);    /* unequal, so return true if NE */
-            else
-                v = (tto == TOKEN_EQ);    /* equal, so return true if EQ */
-            break;
-        default:
-            if (is_unknown(e))
-                v = -1;         /* means unknown */
-            else if (!is_really_simple(e)) {
-                nasm_nonfatal("`%s': operands differ by a non-scalar",
-                              (tto == TOKEN_LE ? "<=" :
-                               tto == TOKEN_LT ? "<" :
-                               tto == TOKEN_GE ? ">=" :
-                               tto == TOKEN_GT ? ">" :
-                               tto == TOKEN_LEG ? "<=>" :
-                               "<internal error>"));
-                v = 0;          /* must set it to _something_ */
-            } else {
-                int64_t vv = reloc_value(e);
-                if (tto == TOKEN_LEG)
-                    v = (vv < 0) ? -1 : (vv > 0) ? 1 : 0;
-                else if (vv == 0)
-                    v = (tto == TOKEN_LE || tto == TOKEN_GE);
-                else if (vv > 0)
-                    v = (tto == TOKEN_GE || tto == TOKEN_GT);
-                else            /* vv < 0 */
-                    v = (tto == TOKEN_LE || tto == TOKEN_LT);
-            }
-            break;
-        }
-
-        if (v == -1)
-            e = unknown_expr();
-        else
-            e = scalarvect(v);
+        if (!expr0())
+            return false;
+        emit(EV_COMPARE, tto, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr0(void)
+static bool expr0(void)
 {
-    expr *e, *f;
-
-    e = expr1();
-    if (!e)
-        return NULL;
+    if (!expr1())
+        return false;
 
     while (tt == '|') {
         scan();
-        f = expr1();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`|' operator may only be applied to"
-                          " scalar values");
-        }
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect(reloc_value(e) | reloc_value(f));
+        if (!expr1())
+            return false;
+        emit(EV_SCALAR, '|', 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr1(void)
+static bool expr1(void)
 {
-    expr *e, *f;
-
-    e = expr2();
-    if (!e)
-        return NULL;
+    if (!expr2())
+        return false;
 
     while (tt == '^') {
         scan();
-        f = expr2();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`^' operator may only be applied to"
-                          " scalar values");
-        }
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect(reloc_value(e) ^ reloc_value(f));
+        if (!expr2())
+            return false;
+        emit(EV_SCALAR, '^', 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr2(void)
+static bool expr2(void)
 {
-    expr *e, *f;
-
-    e = expr3();
-    if (!e)
-        return NULL;
+    if (!expr3())
+        return false;
 
     while (tt == '&') {
         scan();
-        f = expr3();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("`&' operator may only be applied to"
-                          " scalar values");
-        }
-        if (is_just_unknown(e) || is_just_unknown(f))
-            e = unknown_expr();
-        else
-            e = scalarvect(reloc_value(e) & reloc_value(f));
+        if (!expr3())
+            return false;
+        emit(EV_SCALAR, '&', 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr3(void)
+static bool expr3(void)
 {
-    expr *e, *f;
-
-    e = expr4();
-    if (!e)
-        return NULL;
+    if (!expr4())
+        return false;
 
     while (tt == TOKEN_SHL || tt == TOKEN_SHR || tt == TOKEN_SAR) {
         int tto = tt;
         scan();
-        f = expr4();
-        if (!f)
-            return NULL;
-        if (!(is_simple(e) || is_just_unknown(e)) ||
-            !(is_simple(f) || is_just_unknown(f))) {
-            nasm_nonfatal("shift operator may only be applied to"
-                          " scalar values");
-        } else if (is_just_unknown(e) || is_just_unknown(f)) {
-            e = unknown_expr();
-        } else {
-            switch (tto) {
-            case TOKEN_SHL:
-                e = scalarvect(reloc_value(e) << reloc_value(f));
-                break;
-            case TOKEN_SHR:
-                e = scalarvect(((uint64_t)reloc_value(e)) >>
-                               reloc_value(f));
-                break;
-            case TOKEN_SAR:
-                e = scalarvect(((int64_t)reloc_value(e)) >>
-                               reloc_value(f));
-                break;
-            }
-        }
+        if (!expr4())
+            return false;
+        emit(EV_SHIFT, tto, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr4(void)
+static bool expr4(void)
 {
-    expr *e, *f;
+    if (!expr5())
+        return false;
 
-    e = expr5();
-    if (!e)
-        return NULL;
     while (tt == '+' || tt == '-') {
         int tto = tt;
         scan();
-        f = expr5();
-        if (!f)
-            return NULL;
-        switch (tto) {
-        case '+':
-            e = add_vectors(e, f);
-            break;
-        case '-':
-            e = add_vectors(e, scalar_mult(f, -1L, false));
-            break;
-        }
+        if (!expr5())
+            return false;
+        emit(tto == '+' ? EV_ADD : EV_SUB, 0, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *expr5(void)
+static bool expr5(void)
 {
-    expr *e, *f;
+    if (!expr6())
+        return false;
 
-    e = expr6();
-    if (!e)
-        return NULL;
     while (tt == '*' || tt == '/' || tt == '%' ||
            tt == TOKEN_SDIV || tt == TOKEN_SMOD) {
         int tto = tt;
         scan();
-        f = expr6();
-        if (!f)
-            return NULL;
-        if (tto != '*' && (!(is_simple(e) || is_just_unknown(e)) ||
-                         !(is_simple(f) || is_just_unknown(f)))) {
-            nasm_nonfatal("division operator may only be applied to"
-                          " scalar values");
-            return NULL;
-        }
-        if (tto != '*' && !is_just_unknown(f) && reloc_value(f) == 0) {
-            nasm_nonfatal("division by zero");
-            return NULL;
-        }
-        switch (tto) {
-        case '*':
-            if (is_simple(e))
-                e = scalar_mult(f, reloc_value(e), true);
-            else if (is_simple(f))
-                e = scalar_mult(e, reloc_value(f), true);
-            else if (is_just_unknown(e) && is_just_unknown(f))
-                e = unknown_expr();
-            else {
-                nasm_nonfatal("unable to multiply two "
-                              "non-scalar objects");
-                return NULL;
-            }
-            break;
-        case '/':
-            if (is_just_unknown(e) || is_just_unknown(f))
-                e = unknown_expr();
-            else
-                e = scalarvect(((uint64_t)reloc_value(e)) /
-                               ((uint64_t)reloc_value(f)));
-            break;
-        case '%':
-            if (is_just_unknown(e) || is_just_unknown(f))
-                e = unknown_expr();
-            else
-                e = scalarvect(((uint64_t)reloc_value(e)) %
-                               ((uint64_t)reloc_value(f)));
-            break;
-        case TOKEN_SDIV:
-            if (is_just_unknown(e) || is_just_unknown(f))
-                e = unknown_expr();
-            else
-                e = scalarvect(((int64_t)reloc_value(e)) /
-                               ((int64_t)reloc_value(f)));
-            break;
-        case TOKEN_SMOD:
-            if (is_just_unknown(e) || is_just_unknown(f))
-                e = unknown_expr();
-            else
-                e = scalarvect(((int64_t)reloc_value(e)) %
-                               ((int64_t)reloc_value(f)));
-            break;
-        }
+        if (!expr6())
+            return false;
+        if (tto == '*')
+            emit(EV_MUL, 0, 0);
+        else
+            emit(EV_DIV, tto, 0);
     }
-    return e;
+    return true;
 }
 
-static expr *eval_floatize(enum floatize type)
+static bool eval_floatize(enum floatize type)
 {
     uint8_t result[16], *p;     /* Up to 128 bits */
     int sign = 1;
@@ -705,7 +650,7 @@ static expr *eval_floatize(enum floatize type)
     scan();
     if (tt != '(') {
         nasm_nonfatal("expecting `('");
-        return NULL;
+        return false;
     }
     scan();
     if (tt == '-' || tt == '+') {
@@ -714,14 +659,14 @@ static expr *eval_floatize(enum floatize type)
     }
     if (tt != TOKEN_FLOAT) {
         nasm_nonfatal("expecting floating-point number");
-        return NULL;
+        return false;
     }
     if (!float_const(tokval->t_charptr, sign, result, type))
-        return NULL;
+        return false;
     scan();
     if (tt != ')') {
         nasm_nonfatal("expecting `)'");
-        return NULL;
+        return false;
     }
 
     len = fmt->bytes - fmt->offset;
@@ -734,14 +679,13 @@ static expr *eval_floatize(enum floatize type)
         val = (val << 8) + *p;
     }
 
-    begintemp();
-    addtotemp(EXPR_SIMPLE, val);
+    emit(EV_CONST, EXPR_SIMPLE, val);
 
     scan();
-    return finishtemp();
+    return true;
 }
 
-static expr *eval_strfunc(enum strfunc type, const char *name)
+static bool eval_strfunc(enum strfunc type, const char *name)
 {
     char *string;
     size_t string_len;
@@ -756,13 +700,13 @@ static expr *eval_strfunc(enum strfunc type, const char *name)
     }
     if (tt != TOKEN_STR) {
         nasm_nonfatal("expecting string as argument to %s", name);
-        return NULL;
+        return false;
     }
     string_len = string_transform(tokval->t_charptr, tokval->t_inttwo,
                                   &string, type);
     if (string_len == (size_t)-1) {
         nasm_nonfatal("invalid input string to %s", name);
-        return NULL;
+        return false;
     }
 
     val = readstrnum(string, string_len, &rn_warn);
@@ -770,21 +714,20 @@ static expr *eval_strfunc(enum strfunc type, const char *name)
         scan();
         if (tt != ')') {
             nasm_nonfatal("expecting `)'");
-            return NULL;
+            return false;
         }
     }
 
     if (rn_warn)
         nasm_warn(WARN_OTHER, "character constant too long");
 
-    begintemp();
-    addtotemp(EXPR_SIMPLE, val);
+    emit(EV_CONST, EXPR_SIMPLE, val);
 
     scan();
-    return finishtemp();
+    return true;
 }
 
-static int64_t eval_ifunc(int64_t val, enum ifunc func)
+static bool eval_ifunc(int64_t val, enum ifunc func, int64_t *result)
 {
     uint64_t uval = (uint64_t)val;
     int64_t rv;
@@ -792,9 +735,10 @@ static int64_t eval_ifunc(int64_t val, enum ifunc func)
     switch (func) {
     case IFUNC_ILOG2E:
     case IFUNC_ILOG2W:
-        if (!is_power2(uval))
-            nasm_error((func == IFUNC_ILOG2E) ? ERR_NONFATAL : ERR_WARNING|WARN_OTHER,
-                       "ilog2 argument is not a power of two");
+        if (!is_power2(uval) &&
+            !run_error((func == IFUNC_ILOG2E) ? ERR_NONFATAL : ERR_WARNING|WARN_OTHER,
+                       "ilog2 argument is not a power of two"))
+            return false;
         /* fall through */
     case IFUNC_ILOG2F:
         rv = ilog2_64(uval);
@@ -810,94 +754,59 @@ static int64_t eval_ifunc(int64_t val, enum ifunc func)
         break;
     }
 
-    return rv;
+    *result = rv;
+    return true;
 }
 
-static expr *expr6(void)
+static bool expr6(void)
 {
-    int32_t type;
-    expr *e;
-    int32_t label_seg;
-    int64_t label_ofs;
     int64_t tmpval;
     bool rn_warn;
-    const char *scope;
 
     if (++deadman > nasm_limit[LIMIT_EVAL]) {
         nasm_nonfatal("expression too long");
-        return NULL;
+        return false;
     }
 
     switch (tt) {
     case '-':
         scan();
-        e = expr6();
-        if (!e)
-            return NULL;
-        return scalar_mult(e, -1L, false);
+        if (!expr6())
+            return false;
+        emit(EV_NEG, 0, 0);
+        return true;
 
     case '+':
         scan();
         return expr6();
 
     case '~':
-        scan();
-        e = expr6();
-        if (!e)
-            return NULL;
-        if (is_just_unknown(e))
-            return unknown_expr();
-        else if (!is_simple(e)) {
-            nasm_nonfatal("`~' operator may only be applied to"
-                  " scalar values");
-            return NULL;
-        }
-        return scalarvect(~reloc_value(e));
-
     case '!':
+    {
+        int tto = tt;
         scan();
-        e = expr6();
-        if (!e)
-            return NULL;
-        if (is_just_unknown(e))
-            return unknown_expr();
-        else if (!is_simple(e)) {
-            nasm_nonfatal("`!' operator may only be applied to"
-                  " scalar values");
-            return NULL;
-        }
-        return scalarvect(!reloc_value(e));
+        if (!expr6())
+            return false;
+        emit(tto == '~' ? EV_NOT : EV_LNOT, 0, 0);
+        return true;
+    }
 
     case TOKEN_IFUNC:
     {
         enum ifunc func = tokval->t_integer;
         scan();
-        e = expr6();
-        if (!e)
-            return NULL;
-        if (is_just_unknown(e))
-            return unknown_expr();
-        else if (!is_simple(e)) {
-            nasm_nonfatal("function may only be applied to"
-                  " scalar values");
-            return NULL;
-        }
-        return scalarvect(eval_ifunc(reloc_value(e), func));
+        if (!expr6())
+            return false;
+        emit(EV_IFUNC, func, 0);
+        return true;
     }
 
     case TOKEN_SEG:
         scan();
-        e = expr6();
-        if (!e)
-            return NULL;
-        e = segment_part(e);
-        if (!e)
-            return NULL;
-        if (is_unknown(e) && critical) {
-            nasm_nonfatal("unable to determine segment base");
-            return NULL;
-        }
-        return e;
+        if (!expr6())
+            return false;
+        emit(EV_SEG, 0, 0);
+        return true;
 
     case TOKEN_FLOATIZE:
         return eval_floatize(tokval->t_integer);
@@ -907,15 +816,14 @@ static expr *expr6(void)
 
     case '(':
         scan();
-        e = bexpr();
-        if (!e)
-            return NULL;
+        if (!bexpr())
+            return false;
         if (tt != ')') {
             nasm_nonfatal("expecting `)'");
-            return NULL;
+            return false;
         }
         scan();
-        return e;
+        return true;
 
     case TOKEN_NUM:
     case TOKEN_STR:
@@ -925,143 +833,542 @@ static expr *expr6(void)
     case TOKEN_HERE:
     case TOKEN_BASE:
     case TOKEN_DECORATOR:
-        begintemp();
         switch (tt) {
         case TOKEN_NUM:
-            addtotemp(EXPR_SIMPLE, tokval->t_integer);
+            emit(EV_CONST, EXPR_SIMPLE, tokval->t_integer);
             break;
         case TOKEN_STR:
             tmpval = readstrnum(tokval->t_charptr, tokval->t_inttwo, &rn_warn);
             if (rn_warn)
                 nasm_warn(WARN_OTHER, "character constant too long");
-            addtotemp(EXPR_SIMPLE, tmpval);
+            emit(EV_CONST, EXPR_SIMPLE, tmpval);
             break;
         case TOKEN_REG:
-            addtotemp(tokval->t_integer, 1L);
-            if (hint && hint->type == EAH_NOHINT)
-                hint->base = tokval->t_integer, hint->type = EAH_MAKEBASE;
+            emit(EV_REG, tokval->t_integer, 0);
             break;
         case TOKEN_ID:
         case TOKEN_INSN:
+        {
+            atom_t name = tokval->t_atom;
+
+            if (!name)
+                name = atom_get(tokval->t_charptr);
+            emit(EV_SYMBOL, name, 0);
+            break;
+        }
         case TOKEN_HERE:
+            emit(EV_HERE, 0, 0);
+            break;
         case TOKEN_BASE:
-            /*
-             * If !location.known, this indicates that no
-             * symbol, Here or Base references are valid because we
-             * are in preprocess-only mode.
-             */
-            if (!location.known) {
-                nasm_nonfatal("%s not supported in preprocess-only mode",
-                              (tt == TOKEN_HERE ? "`$'" :
-                               tt == TOKEN_BASE ? "`$$'" :
-                               "symbol references"));
-                addtotemp(EXPR_UNKNOWN, 1L);
-                break;
-            }
-
-            type = EXPR_SIMPLE; /* might get overridden by UNKNOWN */
-            if (tt == TOKEN_BASE) {
-                label_seg = in_absolute ? absolute.segment : location.segment;
-                label_ofs = 0;
-            } else if (tt == TOKEN_HERE) {
-                label_seg = in_absolute ? absolute.segment : location.segment;
-                label_ofs = in_absolute ? absolute.offset : location.offset;
-            } else {
-                enum label_type ltype;
-                ltype = lookup_label(tokval->t_charptr, &label_seg, &label_ofs);
-                if (ltype == LBL_none) {
-                    scope = local_scope(tokval->t_charptr);
-                    if (critical) {
-                        nasm_nonfatal("symbol `%s%s' not defined%s",
-                                      scope,tokval->t_charptr,
-                                      pass_first() ? " before use" : "");
-                        return NULL;
-                    }
-                    if (opflags)
-                        *opflags |= OPFLAG_FORWARD;
-                    type = EXPR_UNKNOWN;
-                    label_seg = NO_SEG;
-                    label_ofs = 1;
-                } else if (is_extern(ltype)) {
-                    if (opflags)
-                        *opflags |= OPFLAG_EXTERN;
-                }
-            }
-            addtotemp(type, label_ofs);
-            if (label_seg != NO_SEG)
-                addtotemp(EXPR_SEGBASE + label_seg, 1L);
+            emit(EV_BASE, 0, 0);
             break;
         case TOKEN_DECORATOR:
-            addtotemp(EXPR_RDSAE, tokval->t_integer);
+            emit(EV_CONST, EXPR_RDSAE, tokval->t_integer);
             break;
         }
         scan();
-        return finishtemp();
+        return true;
 
     default:
         nasm_nonfatal("expression syntax error");
+        return false;
+    }
+}
+
+/*
+ * Push the value of a symbol, $ or $$.
+ */
+static expr *run_symbol(const struct eval_op *o)
+{
+    int32_t type;
+    int32_t label_seg;
+    int64_t label_ofs;
+
+    /*
+     * If !location.known, this indicates that no
+     * symbol, Here or Base references are valid because we
+     * are in preprocess-only mode.
+     */
+    if (!location.known) {
+        if (!run_error(ERR_NONFATAL,
+                       "%s not supported in preprocess-only mode",
+                       (o->op == EV_HERE ? "`$'" :
+                        o->op == EV_BASE ? "`$$'" :
+                        "symbol references")))
+            return NULL;
+        return unknown_expr();
+    }
+
+    symrefs++;
+    exprsyms++;
+    exprlabel = NULL;
+    type = EXPR_SIMPLE;         /* might get overridden by UNKNOWN */
+    if (o->op == EV_BASE) {
+        label_seg = in_absolute ? absolute.segment : location.segment;
+        label_ofs = 0;
+        exprlayout = true;
+    } else if (o->op == EV_HERE) {
+        label_seg = in_absolute ? absolute.segment : location.segment;
+        label_ofs = in_absolute ? absolute.offset : location.offset;
+    } else {
+        enum label_type ltype;
+
+        ltype = lookup_label_atom(o->arg, &label_seg, &label_ofs);
+        if (ltype == LBL_none) {
+            if (critical) {
+                const char *name = atom_str(o->arg);
+
+                run_error(ERR_NONFATAL, "symbol `%s%s' not defined%s",
+                          local_scope(name), name,
+                          pass_first() ? " before use" : "");
+                return NULL;
+            }
+            if (opflags)
+                *opflags |= OPFLAG_FORWARD;
+            exprlayout = true;
+            type = EXPR_UNKNOWN;
+            label_seg = NO_SEG;
+            label_ofs = 1;
+        } else if (is_extern(ltype)) {
+            if (opflags)
+                *opflags |= OPFLAG_EXTERN;
+        } else {
+            exprlabel = lookup_label_ref();
+            exprlayout |= label_ref_layout(exprlabel);
+        }
+    }
+
+    begintemp();
+    addtotemp(type, label_ofs);
+    if (label_seg != NO_SEG)
+        addtotemp(EXPR_SEGBASE + label_seg, 1L);
+    return finishtemp();
+}
+
+/*
+ * Apply a unary operator.
+ */
+static expr *run_unary(const struct eval_op *o, expr *e)
+{
+    int64_t val;
+
+    switch (o->op) {
+    case EV_NEG:
+        return scalar_mult(e, -1L, false);
+
+    case EV_NOT:
+    case EV_LNOT:
+    case EV_IFUNC:
+        if (is_just_unknown(e))
+            return unknown_expr();
+        if (!is_simple(e)) {
+            run_error(ERR_NONFATAL, o->op == EV_IFUNC ?
+                      "function may only be applied to scalar values" :
+                      o->op == EV_NOT ?
+                      "`~' operator may only be applied to scalar values" :
+                      "`!' operator may only be applied to scalar values");
+            return NULL;
+        }
+        if (o->op == EV_NOT)
+            return scalarvect(~reloc_value(e));
+        if (o->op == EV_LNOT)
+            return scalarvect(!reloc_value(e));
+        if (!eval_ifunc(reloc_value(e), o->arg, &val))
+            return NULL;
+        return scalarvect(val);
+
+    case EV_SEG:
+        e = segment_part(e);
+        if (!e)
+            return NULL;
+        if (is_unknown(e) && critical) {
+            run_error(ERR_NONFATAL, "unable to determine segment base");
+            return NULL;
+        }
+        return e;
+
+    default:
+        nasm_panic("invalid unary operation %d", o->op);
         return NULL;
     }
 }
 
-expr *evaluate(scanner sc, void *scprivate, struct tokenval *tv,
-               int *fwref, bool crit, struct eval_hints *hints)
+/*
+ * Apply a binary operator other than WRT.
+ */
+static expr *run_binary(const struct eval_op *o, expr *e, expr *f)
 {
+    const int tto = o->arg;
+    int64_t v;
+
+    switch (o->op) {
+    case EV_SCALAR:
+        if (!(is_simple(e) || is_just_unknown(e)) ||
+            !(is_simple(f) || is_just_unknown(f))) {
+            if (!run_error(ERR_NONFATAL,
+                           "`%c' operator may only be applied to"
+                           " scalar values",
+                           tto == TOKEN_DBL_OR ? '|' :
+                           tto == TOKEN_DBL_XOR ? '^' :
+                           tto == TOKEN_DBL_AND ? '&' : tto))
+                return NULL;
+        }
+        if (is_just_unknown(e) || is_just_unknown(f))
+            return unknown_expr();
+
+        switch (tto) {
+        case TOKEN_DBL_OR:
+            return scalarvect((int64_t)(reloc_value(e) || reloc_value(f)));
+        case TOKEN_DBL_XOR:
+            return scalarvect((int64_t)(!reloc_value(e) ^ !reloc_value(f)));
+        case TOKEN_DBL_AND:
+            return scalarvect((int64_t)(reloc_value(e) && reloc_value(f)));
+        case '|':
+            return scalarvect(reloc_value(e) | reloc_value(f));
+        case '^':
+            return scalarvect(reloc_value(e) ^ reloc_value(f));
+        default:
+            return scalarvect(reloc_value(e) & reloc_value(f));
+        }
+
+    case EV_COMPARE:
+        e = add_vectors(e, scalar_mult(f, -1L, false));
+
+        switch (tto) {
+        case TOKEN_EQ:
+        case TOKEN_NE:
+            if (is_unknown(e))
+                v = -1;         /* means unknown */
+            else if (!is_really_simple(e) || reloc_value(e) != 0)
+                v = (tto == TOKEN_NE);    /* unequal, so return true if NE */
+            else
+                v = (tto == TOKEN_EQ);    /* equal, so return true if EQ */
+            break;
+        default:
+            if (is_unknown(e))
+                v = -1;         /* means unknown */
+            else if (!is_really_simple(e)) {
+                if (!run_error(ERR_NONFATAL,
+                               "`%s': operands differ by a non-scalar",
+                               (tto == TOKEN_LE ? "<=" :
+                                tto == TOKEN_LT ? "<" :
+                                tto == TOKEN_GE ? ">=" :
+                                tto == TOKEN_GT ? ">" :
+                                tto == TOKEN_LEG ? "<=>" :
+                                "<internal error>")))
+                    return NULL;
+                v = 0;          /* must set it to _something_ */
+            } else {
+                int64_t vv = reloc_value(e);
+                if (tto == TOKEN_LEG)
+                    v = (vv < 0) ? -1 : (vv > 0) ? 1 : 0;
+                else if (vv == 0)
+                    v = (tto == TOKEN_LE || tto == TOKEN_GE);
+                else if (vv > 0)
+                    v = (tto == TOKEN_GE || tto == TOKEN_GT);
+                else            /* vv < 0 */
+                    v = (tto == TOKEN_LE || tto == TOKEN_LT);
+            }
+            break;
+        }
+
+        if (v == -1)
+            return unknown_expr();
+        return scalarvect(v);
+
+    case EV_SHIFT:
+        if (!(is_simple(e) || is_just_unknown(e)) ||
+            !(is_simple(f) || is_just_unknown(f))) {
+            if (!run_error(ERR_NONFATAL, "shift operator may only be applied to"
+                           " scalar values"))
+                return NULL;
+            return e;
+        }
+        if (is_just_unknown(e) || is_just_unknown(f))
+            return unknown_expr();
+
+        switch (tto) {
+        case TOKEN_SHL:
+            return scalarvect(reloc_value(e) << reloc_value(f));
+        case TOKEN_SHR:
+            return scalarvect(((uint64_t)reloc_value(e)) >> reloc_value(f));
+        default:
+            return scalarvect(((int64_t)reloc_value(e)) >> reloc_value(f));
+        }
+
+    case EV_ADD:
+        return add_vectors(e, f);
+
+    case EV_SUB:
+        return add_vectors(e, scalar_mult(f, -1L, false));
+
+    case EV_MUL:
+        if (is_simple(e))
+            return scalar_mult(f, reloc_value(e), true);
+        if (is_simple(f))
+            return scalar_mult(e, reloc_value(f), true);
+        if (is_just_unknown(e) && is_just_unknown(f))
+            return unknown_expr();
+        run_error(ERR_NONFATAL, "unable to multiply two non-scalar objects");
+        return NULL;
+
+    case EV_DIV:
+        if (!(is_simple(e) || is_just_unknown(e)) ||
+            !(is_simple(f) || is_just_unknown(f))) {
+            run_error(ERR_NONFATAL, "division operator may only be applied to"
+                      " scalar values");
+            return NULL;
+        }
+        if (!is_just_unknown(f) && reloc_value(f) == 0) {
+            run_error(ERR_NONFATAL, "division by zero");
+            return NULL;
+        }
+        if (is_just_unknown(e) || is_just_unknown(f))
+            return unknown_expr();
+
+        switch (tto) {
+        case '/':
+            return scalarvect(((uint64_t)reloc_value(e)) /
+                              ((uint64_t)reloc_value(f)));
+        case '%':
+            return scalarvect(((uint64_t)reloc_value(e)) %
+                              ((uint64_t)reloc_value(f)));
+        case TOKEN_SDIV:
+            return scalarvect(((int64_t)reloc_value(e)) /
+                              ((int64_t)reloc_value(f)));
+        default:
+            return scalarvect(((int64_t)reloc_value(e)) %
+                              ((int64_t)reloc_value(f)));
+        }
+
+    default:
+        nasm_panic("invalid binary operation %d", o->op);
+        return NULL;
+    }
+}
+
+/*
+ * Apply WRT to an expression, stripping its far-absolute segment part.
+ */
+static expr *run_wrt(expr *e, expr *f)
+{
+    expr *g;
+
+    e = scalar_mult(e, 1L, false);      /* strip far-absolute segment part */
+    if (is_just_unknown(f)) {
+        g = unknown_expr();
+    } else {
+        int64_t value;
+        begintemp();
+        if (!is_reloc(f)) {
+            run_error(ERR_NONFATAL, "invalid right-hand operand to WRT");
+            return NULL;
+        }
+        value = reloc_seg(f);
+        if (value == NO_SEG)
+            value = reloc_value(f) | SEG_ABS;
+        else if (!(value & SEG_ABS) && !(value % 2) && critical) {
+            run_error(ERR_NONFATAL, "invalid right-hand operand to WRT");
+            return NULL;
+        }
+        addtotemp(EXPR_WRT, value);
+        g = finishtemp();
+    }
+    return add_vectors(e, g);
+}
+
+/*
+ * Run a compiled program. Returns NULL if an error occurred, which
+ * has already been reported unless running quietly.
+ */
+static expr *run(const struct eval_prog *p, const struct eval_op *o)
+{
+    const struct eval_op *end = o + p->nops;
+    expr **sp;
     expr *e;
-    expr *f = NULL;
+    bool wrt = false;
 
-    deadman = 0;
+    temp_reset();
+
+    if (p->depth > stack_size) {
+        stack_size = p->depth;
+        stack = nasm_realloc(stack, stack_size * sizeof *stack);
+    }
+
+    sp = stack;
+    for (; o < end; o++) {
+        switch (o->op) {
+        case EV_CONST:
+            begintemp();
+            addtotemp(o->arg, o->value);
+            e = finishtemp();
+            break;
+
+        case EV_REG:
+            begintemp();
+            addtotemp(o->arg, 1L);
+            if (hint && hint->type == EAH_NOHINT)
+                hint->base = o->arg, hint->type = EAH_MAKEBASE;
+            e = finishtemp();
+            break;
+
+        case EV_SYMBOL:
+        case EV_HERE:
+        case EV_BASE:
+            e = run_symbol(o);
+            break;
+
+        case EV_NEG:
+        case EV_NOT:
+        case EV_LNOT:
+        case EV_IFUNC:
+        case EV_SEG:
+            e = run_unary(o, *--sp);
+            break;
+
+        case EV_WRT:
+            sp -= 2;
+            e = run_wrt(sp[0], sp[1]);
+            wrt = true;
+            break;
+
+        case EV_COND:
+            sp -= 3;
+            e = sp[0];
+            if (is_simple(e)) {
+                e = reloc_value(e) ? sp[1] : sp[2];
+            } else if (is_just_unknown(e)) {
+                e = unknown_expr();
+            } else if (!run_error(ERR_NONFATAL,
+                                  "the left-hand side of `?' must be "
+                                  "a scalar value")) {
+                e = NULL;
+            }
+            break;
 
+        default:
+            sp -= 2;
+            e = run_binary(o, sp[0], sp[1]);
+            break;
+        }
+
+        if (!e)
+            return NULL;
+        *sp++ = e;
+    }
+
+    e = stack[0];
+    if (!wrt)
+        e = scalar_mult(e, 1L, false);  /* strip far-absolute segment part */
+    return e;
+}
+
+/*
+ * Number of references to symbols, $ or $$ evaluated so far; an
+ * expression evaluated without changing this does not depend on
+ * where it is or on which pass it is evaluated in.
+ */
+uint64_t eval_symbol_refs(void)
+{
+    return symrefs;
+}
+
+/*
+ * The label the last expression evaluated refers to, if it refers
+ * to exactly one defined label and no other symbols, $ or $$.
+ */
+const void *eval_label_ref(void)
+{
+    return exprsyms == 1 ? exprlabel : NULL;
+}
+
+/*
+ * Does the value of the last expression evaluated depend on where
+ * labels are? A reference to $ alone does not count, as the value
+ * is then the same relative to where it is used.
+ */
+bool eval_layout_ref(void)
+{
+    return exprlayout;
+}
+
+static void eval_begin(int *fwref, bool crit, struct eval_hints *hints)
+{
     hint = hints;
     if (hint)
         hint->type = EAH_NOHINT;
 
+    exprsyms = 0;
+    exprlabel = NULL;
+    exprlayout = false;
+
     critical = crit;
+    opflags = fwref;
+}
+
+expr *evaluate(scanner sc, void *scprivate, struct tokenval *tv,
+               int *fwref, bool crit, struct eval_hints *hints)
+{
+    eval_begin(fwref, crit, hints);
+
+    deadman = 0;
     scanfunc = sc;
     scpriv = scprivate;
     tokval = tv;
-    opflags = fwref;
 
-    while (ntempexprs)          /* initialize temporary storage */
-        nasm_free(tempexprs[--ntempexprs]);
+    prog.nops = prog.depth = prog_depth = 0;
 
     tt = tokval->t_type;
     if (tt == TOKEN_INVALID)
         scan();
 
-    e = bexpr();
-    if (!e)
+    if (!bexpr())
         return NULL;
 
     if (tt == TOKEN_WRT) {
         scan();                 /* eat the WRT */
-        f = expr6();
-        if (!f)
+        if (!expr6())
             return NULL;
+        emit(EV_WRT, 0, 0);
     }
-    e = scalar_mult(e, 1L, false);      /* strip far-absolute segment part */
-    if (f) {
-        expr *g;
-        if (is_just_unknown(f))
-            g = unknown_expr();
-        else {
-            int64_t value;
-            begintemp();
-            if (!is_reloc(f)) {
-                nasm_nonfatal("invalid right-hand operand to WRT");
-                return NULL;
-            }
-            value = reloc_seg(f);
-            if (value == NO_SEG)
-                value = reloc_value(f) | SEG_ABS;
-            else if (!(value & SEG_ABS) && !(value % 2) && critical) {
-                nasm_nonfatal("invalid right-hand operand to WRT");
-                return NULL;
-            }
-            addtotemp(EXPR_WRT, value);
-            g = finishtemp();
-        }
-        e = add_vectors(e, g);
+
+    return run(&prog, prog_ops);
+}
+
+/*
+ * Save the program compiled by the last call to evaluate() into buf,
+ * for eval_run(), unless buf is NULL. Returns its size in bytes; buf
+ * must be aligned for an int64_t.
+ */
+size_t eval_save(struct eval_prog *buf)
+{
+    size_t bytes = prog.nops * sizeof *prog_ops;
+
+    if (buf) {
+        *buf = prog;
+        memcpy(buf + 1, prog_ops, bytes);
     }
+
+    return sizeof prog + bytes;
+}
+
+/*
+ * Run a saved program again, with the current values of the labels
+ * it refers to. This gives the same result as evaluate() on the text
+ * the program was compiled from, except that where evaluate() would
+ * issue a diagnostic, this returns NULL without one; the caller should
+ * then evaluate the text instead.
+ */
+expr *eval_run(const struct eval_prog *p, int *fwref, bool crit,
+               struct eval_hints *hints)
+{
+    expr *e;
+
+    eval_begin(fwref, crit, hints);
+
+    quiet = true;
+    e = run(p, saved_ops(p));
+    quiet = false;
+
     return e;
 }
@@ -45,5 +45,16 @@ expr *evaluate(scanner sc, void *scprivate, struct tokenval *tv,
                int *fwref, bool critical, struct eval_hints *hints);
 
 void eval_cleanup(void);
+uint64_t eval_symbol_refs(void);
+const void *eval_label_ref(void);
+bool eval_layout_ref(void);
+
+/*
+ * Compiled expressions, which can be run again without the source.
+ */
+struct eval_prog;
+size_t eval_save(struct eval_prog *buf);
+expr *eval_run(const struct eval_prog *prog, int *fwref, bool critical,
+               struct eval_hints *hints);
 
 #endif
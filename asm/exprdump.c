@@ -41,7 +41,7 @@
 
 static const char *expr_type(int32_t type)
 {
-    static char seg_str[64];
+    static per_thread char seg_str[64];
 
     switch (type) {
     case 0:
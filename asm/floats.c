@@ -48,8 +48,8 @@
  *  local variables
  * -----------------
  */
-static bool daz = false;        /* denormals as zero */
-static enum float_round rc = FLOAT_RC_NEAR;     /* rounding control */
+static per_thread bool daz = false;        /* denormals as zero */
+static per_thread enum float_round rc = FLOAT_RC_NEAR;     /* rounding control */
 
 /*
  * -----------
@@ -42,7 +42,9 @@
 #include "nasmlib.h"
 #include "error.h"
 #include "hashtbl.h"
+#include "atom.h"
 #include "labels.h"
+#include "parallel.h"
 
 /*
  * A dot-local label is one that begins with exactly one period. Things
@@ -113,6 +115,7 @@ union label {                   /* actual label structures */
         const char *def_file;   /* Where defined */
         int32_t def_line;
         enum label_type type, mangled_type;
+        bool layout;            /* EQU whose value depends on the layout */
     } defn;
     struct {
         int32_t movingon;
@@ -128,13 +131,24 @@ struct permts {                 /* permanent text storage */
 };
 #define PERMTS_HEADER offsetof(struct permts, data)
 
-uint64_t global_offset_changed;		/* counter for global offset changes */
+per_thread uint64_t global_offset_changed;		/* counter for global offset changes */
 
-static struct hash_table ltab;          /* labels hash table */
-static union label *ldata;              /* all label data blocks */
-static union label *lfree;              /* labels free block */
-static struct permts *perm_head;        /* start of perm. text storage */
-static struct permts *perm_tail;        /* end of perm. text storage */
+static per_thread union label **atom_labels;       /* labels by name atom */
+static per_thread atom_t atom_labels_size;
+static per_thread struct hash_table ltab;          /* local labels by scope */
+static per_thread union label *ldata;              /* all label data blocks */
+static per_thread union label *lastref;            /* last label found by lookup */
+static per_thread union label *lfree;              /* labels free block */
+static per_thread struct permts *perm_head;        /* start of perm. text storage */
+static per_thread struct permts *perm_tail;        /* end of perm. text storage */
+
+/* Label values kept by save_labels() */
+static per_thread struct saved_label {
+    union label *lptr;
+    int32_t segment;
+    int64_t offset;
+} *saved_labels;
+static per_thread size_t nsaved_labels, maxsaved_labels;
 
 static void init_block(union label *blk);
 static char *perm_alloc(size_t len);
@@ -142,9 +156,14 @@ static char *perm_copy(const char *string);
 static char *perm_copy3(const char *s1, const char *s2, const char *s3);
 static const char *mangle_label_name(union label *lptr);
 
-static const char *prevlabel;
+static per_thread atom_t prevlabel;
 
-static bool initialized = false;
+/* The key of a local label: the label it follows, and its own name */
+struct local_key {
+    atom_t scope, name;
+};
+
+static per_thread bool initialized = false;
 
 /*
  * Emit a symdef to the output and the debug format backends.
@@ -161,8 +180,10 @@ static void out_symdef(union label *lptr)
         case LBL_GLOBAL:
         case LBL_REQUIRED:
         case LBL_COMMON:
-            if (lptr->defn.special)
+            if (lptr->defn.special) {
+                parallel_flush();
                 ofmt->symdef(lptr->defn.mangled, 0, 0, 3, lptr->defn.special);
+            }
             break;
         default:
             break;
@@ -222,25 +243,45 @@ static void out_symdef(union label *lptr)
  * Internal routine: finds the `union label' corresponding to the
  * given label name. Creates a new one, if it isn't found, and if
  * `create' is true.
+ *
+ * Labels are found by the atom of their full name.  A local label is
+ * first looked up by the label it follows and its own name, so its
+ * full name is only put together the first time it is seen in that
+ * scope.
  */
-static union label *find_label(const char *label, bool create, bool *created)
+static union label *find_label(atom_t label, bool create, bool *created)
 {
-    union label *lptr, **lpp;
-    char *label_str = NULL;
+    union label *lptr;
+    struct local_key key;
     struct hash_insert ip;
+    atom_t name = label;
+    bool local;
+    void **lpp;
+
+    local = islocal(atom_str(label));
+    if (local) {
+        key.scope = prevlabel;
+        key.name = label;
+        lpp = hash_findb(&ltab, &key, sizeof key, &ip);
+        if (lpp) {
+            if (created)
+                *created = false;
+            return *lpp;
+        }
 
-    nasm_assert(label != NULL);
-
-    if (islocal(label))
-        label = label_str = nasm_strcat(prevlabel, label);
+        if (prevlabel != NO_ATOM) {
+            char *str = nasm_strcat(atom_str(prevlabel), atom_str(label));
+            name = atom_get(str);
+            nasm_free(str);
+        }
+    }
 
-    lpp = (union label **) hash_find(&ltab, label, &ip);
-    lptr = lpp ? *lpp : NULL;
+    lptr = name < atom_labels_size ? atom_labels[name] : NULL;
 
     if (lptr || !create) {
         if (created)
             *created = false;
-        return lptr;
+        goto found;
     }
 
     /* Create a new label... */
@@ -257,17 +298,28 @@ static union label *find_label(const char *label, bool create, bool *created)
         *created = true;
 
     nasm_zero(*lfree);
-    lfree->defn.label     = perm_copy(label);
+    lfree->defn.label     = (char *)atom_str(name);
     lfree->defn.subsection = NO_SEG;
-    if (label_str)
-        nasm_free(label_str);
 
-    hash_add(&ip, lfree->defn.label, lfree);
-    return lfree++;
+    if (name >= atom_labels_size) {
+        atom_t old = atom_labels_size;
+
+        atom_labels_size = atom_limit() + (atom_limit() >> 1);
+        atom_labels = nasm_realloc(atom_labels,
+                                   atom_labels_size * sizeof *atom_labels);
+        memset(atom_labels + old, 0,
+               (atom_labels_size - old) * sizeof *atom_labels);
+    }
+    lptr = atom_labels[name] = lfree++;
+
+found:
+    if (lptr && local)
+        hash_add(&ip, memcpy(perm_alloc(sizeof key), &key, sizeof key), lptr);
+    return lptr;
 }
 
-enum label_type lookup_label(const char *label,
-                             int32_t *segment, int64_t *offset)
+enum label_type lookup_label_atom(atom_t label,
+                                  int32_t *segment, int64_t *offset)
 {
     union label *lptr;
 
@@ -281,19 +333,73 @@ enum label_type lookup_label(const char *label,
         lptr->defn.lastref = lpass;
         *segment = lptr->defn.segment;
         *offset = lptr->defn.offset;
+        lastref = lptr;
         return lptr->defn.type;
     }
 
     return LBL_none;
 }
 
+enum label_type lookup_label(const char *label,
+                             int32_t *segment, int64_t *offset)
+{
+    return lookup_label_atom(atom_get(label), segment, offset);
+}
+
+/*
+ * Return a reference to the label found by the last successful
+ * lookup_label(), which stays valid until cleanup_labels().
+ */
+const void *lookup_label_ref(void)
+{
+    return lastref;
+}
+
+/*
+ * Get the current value of a label by reference.
+ */
+bool label_ref_value(const void *ref, int32_t *segment, int64_t *offset)
+{
+    const union label *lptr = ref;
+
+    if (!lptr || !lptr->defn.defined)
+        return false;
+
+    *segment = lptr->defn.segment;
+    *offset  = lptr->defn.offset;
+    return true;
+}
+
+/*
+ * Does the value of a label depend on where other labels are? That
+ * is always the case for a label in a segment, and for an EQU if the
+ * expression it was defined by depends on them.
+ */
+bool label_ref_layout(const void *ref)
+{
+    const union label *lptr = ref;
+
+    return lptr->defn.segment != NO_SEG || lptr->defn.layout;
+}
+
+/*
+ * Tell whether the value of an EQU depends on where other labels are.
+ */
+void set_label_layout(const char *label, bool layout)
+{
+    union label *lptr = find_label(atom_get(label), false, NULL);
+
+    if (lptr)
+        lptr->defn.layout = layout;
+}
+
 static inline bool is_global(enum label_type type)
 {
     return type == LBL_GLOBAL || type == LBL_COMMON;
 }
 
-static const char *mangle_strings[] = {"", "", "", ""};
-static bool mangle_string_set[ARRAY_SIZE(mangle_strings)];
+static per_thread const char *mangle_strings[] = {"", "", "", ""};
+static per_thread bool mangle_string_set[ARRAY_SIZE(mangle_strings)];
 
 /*
  * Set a prefix or suffix
@@ -366,6 +472,7 @@ handle_herelabel(union label *lptr, int32_t *segment, int64_t *offset)
         bool copyoffset = false;
 
         nasm_assert(lptr->defn.mangled);
+        parallel_flush();
         newseg = ofmt->herelabel(lptr->defn.mangled, lptr->defn.type,
                                  oldseg, &lptr->defn.subsection, &copyoffset);
         if (likely(newseg == oldseg))
@@ -431,7 +538,7 @@ static bool declare_label_lptr(union label *lptr,
 
 bool declare_label(const char *label, enum label_type type, const char *special)
 {
-    union label *lptr = find_label(label, true, NULL);
+    union label *lptr = find_label(atom_get(label), true, NULL);
     return declare_label_lptr(lptr, type, special);
 }
 
@@ -443,6 +550,7 @@ void define_label(const char *label, int32_t segment,
                   int64_t offset, bool normal)
 {
     union label *lptr;
+    atom_t name = atom_get(label);
     bool created, changed;
     int64_t size;
     int64_t lpass, lastdef;
@@ -459,7 +567,7 @@ void define_label(const char *label, int32_t segment,
      * or the offset changes. Increment global_offset_changed when that
      * happens, to tell the assembler core to make another pass.
      */
-    lptr = find_label(label, true, &created);
+    lptr = find_label(name, true, &created);
 
     lastdef = lptr->defn.defined;
 
@@ -489,7 +597,7 @@ void define_label(const char *label, int32_t segment,
         lptr->defn.type = LBL_SPECIAL;
 
     if (set_prevlabel(label) && normal)
-        prevlabel = lptr->defn.label;
+        prevlabel = name;
 
     if (lptr->defn.type == LBL_COMMON) {
         size = offset;
@@ -575,6 +683,82 @@ void backend_label(const char *label, int32_t segment, int64_t offset)
     define_label(label, segment, offset, false);
 }
 
+/*
+ * Move the labels defined in the current pass to new offsets, as
+ * computed by the jump relaxation. External, common and special
+ * labels are left alone.
+ */
+void adjust_labels(int64_t (*adjust)(int32_t segment, int64_t offset))
+{
+    union label *lptr = ldata;
+    const int64_t lpass = pass_count() + 1;
+
+    while (lptr) {
+        if (lptr->admin.movingon == END_BLOCK) {
+            lptr = lptr->admin.next;
+            continue;
+        }
+        if (lptr->admin.movingon == END_LIST)
+            break;
+
+        if (lptr->defn.defined == lpass &&
+            (lptr->defn.type == LBL_LOCAL ||
+             lptr->defn.type == LBL_STATIC ||
+             lptr->defn.type == LBL_GLOBAL))
+            lptr->defn.offset = adjust(lptr->defn.segment, lptr->defn.offset);
+
+        lptr++;
+    }
+}
+
+/*
+ * Remember the values of all defined labels, for restore_labels()
+ */
+void save_labels(void)
+{
+    union label *lptr = ldata;
+    struct saved_label *sl;
+
+    nsaved_labels = 0;
+
+    while (lptr) {
+        if (lptr->admin.movingon == END_BLOCK) {
+            lptr = lptr->admin.next;
+            continue;
+        }
+        if (lptr->admin.movingon == END_LIST)
+            break;
+
+        if (lptr->defn.defined) {
+            if (nsaved_labels >= maxsaved_labels) {
+                maxsaved_labels = maxsaved_labels ? maxsaved_labels << 1 : 256;
+                saved_labels = nasm_realloc(saved_labels, maxsaved_labels *
+                                            sizeof *saved_labels);
+            }
+            sl = &saved_labels[nsaved_labels++];
+            sl->lptr    = lptr;
+            sl->segment = lptr->defn.segment;
+            sl->offset  = lptr->defn.offset;
+        }
+
+        lptr++;
+    }
+}
+
+/*
+ * Put the labels back to the values save_labels() remembered. The
+ * labels are left defined in the current pass.
+ */
+void restore_labels(void)
+{
+    const struct saved_label *sl;
+
+    for (sl = saved_labels; sl < saved_labels + nsaved_labels; sl++) {
+        sl->lptr->defn.segment = sl->segment;
+        sl->lptr->defn.offset  = sl->offset;
+    }
+}
+
 int init_labels(void)
 {
     ldata = lfree = nasm_malloc(LBLK_SIZE);
@@ -587,7 +771,7 @@ int init_labels(void)
     perm_head->size = PERMTS_SIZE;
     perm_head->usage = 0;
 
-    prevlabel = "";
+    prevlabel = NO_ATOM;
 
     initialized = true;
 
@@ -599,8 +783,16 @@ void cleanup_labels(void)
     union label *lptr, *lhold;
 
     initialized = false;
+    lastref = NULL;
+
+    nasm_free(saved_labels);
+    saved_labels = NULL;
+    nsaved_labels = maxsaved_labels = 0;
 
     hash_free(&ltab);
+    nasm_free(atom_labels);
+    atom_labels = NULL;
+    atom_labels_size = 0;
 
     lptr = lhold = ldata;
     while (lptr) {
@@ -678,7 +870,7 @@ perm_copy3(const char *s1, const char *s2, const char *s3)
 
 const char *local_scope(const char *label)
 {
-   return islocal(label) ? prevlabel : "";
+   return islocal(label) ? atom_str(prevlabel) : "";
 }
 
 /*
@@ -53,23 +53,23 @@ static const char xdigit[] = "0123456789ABCDEF";
 
 #define HEX(a,b) (*(a)=xdigit[((b)>>4)&15],(a)[1]=xdigit[(b)&15]);
 
-uint64_t list_options, active_list_options;
+per_thread uint64_t list_options, active_list_options;
 
-static char listline[LIST_MAX_LEN];
-static bool listlinep;
+static per_thread char listline[LIST_MAX_LEN];
+static per_thread bool listlinep;
 
-static struct strlist *list_errors;
+static per_thread struct strlist *list_errors;
 
-static char listdata[2 * LIST_INDENT];  /* we need less than that actually */
-static int32_t listoffset;
+static per_thread char listdata[2 * LIST_INDENT];  /* we need less than that actually */
+static per_thread int32_t listoffset;
 
-static int32_t listlineno;
+static per_thread int32_t listlineno;
 
-static int suppress;            /* for INCBIN & TIMES special cases */
+static per_thread int suppress;            /* for INCBIN & TIMES special cases */
 
-static int listlevel, listlevel_e;
+static per_thread int listlevel, listlevel_e;
 
-static FILE *listfp;
+static per_thread FILE *listfp;
 
 static void list_emit(void)
 {
@@ -412,4 +412,4 @@ static const struct lfmt nasm_list = {
     list_set_offset
 };
 
-const struct lfmt *lfmt = &nasm_list;
+per_thread const struct lfmt *lfmt = &nasm_list;
@@ -113,8 +113,8 @@ struct lfmt {
     void (*set_offset)(uint64_t offset);
 };
 
-extern const struct lfmt *lfmt;
-extern bool user_nolist;
+extern per_thread const struct lfmt *lfmt;
+extern per_thread bool user_nolist;
 
 /*
  * list_options are the requested options; active_list_options gets
@@ -123,7 +123,7 @@ extern bool user_nolist;
  * These are simple bitmasks of ASCII-64 mapping directly to option
  * letters.
  */
-extern uint64_t list_options, active_list_options;
+extern per_thread uint64_t list_options, active_list_options;
 
 /*
  * This maps the characters a-z, A-Z and 0-9 onto a 64-bit bitmask.
@@ -37,6 +37,7 @@
 
 #include "compiler.h"
 
+#include <setjmp.h>
 
 #include "nasm.h"
 #include "nasmlib.h"
@@ -52,10 +53,16 @@
 #include "eval.h"
 #include "assemble.h"
 #include "labels.h"
+#include "atom.h"
 #include "outform.h"
 #include "listing.h"
 #include "iflag.h"
 #include "quote.h"
+#include "profile.h"
+#include "batch.h"
+#include "rescache.h"
+#include "parallel.h"
+#include "libnasm.h"
 #include "ver.h"
 
 /*
@@ -70,9 +77,12 @@ struct forwrefinfo {            /* info held on forward refs. */
     int operand;
 };
 
-const char *_progname;
+per_thread const char *_progname;
 
 static void parse_cmdline(int, char **, int);
+static void parse_argv(int, char **, int);
+static int run_job(int, char **);
+static int run_batch(int, char **);
 static void assemble_file(const char *, struct strlist *);
 static bool skip_this_pass(errflags severity);
 static void usage(void);
@@ -86,85 +96,107 @@ struct error_format {
 
 static const struct error_format errfmt_gnu  = { ":", "",  ": "  };
 static const struct error_format errfmt_msvc = { "(", ")", " : " };
-static const struct error_format *errfmt = &errfmt_gnu;
-static struct strlist *warn_list;
-static struct nasm_errhold *errhold_stack;
+static per_thread const struct error_format *errfmt = &errfmt_gnu;
+static per_thread struct strlist *warn_list;
+static per_thread struct nasm_errhold *errhold_stack;
+static per_thread uint64_t diag_count;     /* Diagnostics raised, issued or not */
+static per_thread bool diag_issued;        /* Diagnostics shown to the user */
 
-unsigned int debug_nasm;        /* Debugging messages? */
+per_thread unsigned int debug_nasm;        /* Debugging messages? */
 
-static bool using_debug_info, opt_verbose_info;
-static const char *debug_format;
+static per_thread bool using_debug_info, opt_verbose_info;
+static per_thread const char *debug_format;
 
 #ifndef ABORT_ON_PANIC
 # define ABORT_ON_PANIC 0
 #endif
-static bool abort_on_panic = ABORT_ON_PANIC;
-static bool keep_all;
+static per_thread bool abort_on_panic = ABORT_ON_PANIC;
+static per_thread bool keep_all;
 
-bool tasm_compatible_mode = false;
-enum pass_type _pass_type;
+per_thread bool tasm_compatible_mode = false;
+per_thread enum pass_type _pass_type;
 const char * const _pass_types[] =
 {
     "init", "preproc-only", "first", "optimize", "stabilize", "final"
 };
-int64_t _passn;
-int globalrel = 0;
-int globalbnd = 0;
+per_thread int64_t _passn;
+per_thread int globalrel = 0;
+per_thread int globalbnd = 0;
 
-struct compile_time official_compile_time;
+per_thread struct compile_time official_compile_time;
 
-const char *inname;
-const char *outname;
-static const char *listname;
-static const char *errname;
+per_thread const char *inname;
+per_thread const char *outname;
+static per_thread const char *listname;
+static per_thread const char *errname;
 
-static int64_t globallineno;    /* for forward-reference tracking */
+static per_thread int64_t globallineno;    /* for forward-reference tracking */
 
-const struct ofmt *ofmt = &OF_DEFAULT;
-const struct ofmt_alias *ofmt_alias = NULL;
-const struct dfmt *dfmt;
+static per_thread const char *profile_name; /* NULL for stderr */
+static per_thread bool profile_json;
 
-FILE *error_file;               /* Where to write error messages */
+static per_thread const char *batch_name;  /* Job list for --batch, "-" for stdin */
+static per_thread unsigned int batch_jobs = 1; /* Concurrent batch jobs (-j) */
+static per_thread int batch_argc; /* The real command line, for batch_job() */
+static per_thread char **batch_argv;
 
-FILE *ofile = NULL;
-struct optimization optimizing =
+static per_thread const char *cache_dir;   /* Result cache for --cache */
+static per_thread struct rescache *rescache;
+
+static per_thread unsigned int encode_threads; /* Encoder threads (--threads) */
+
+/* For nasm_assemble_buffer() */
+static per_thread const char *mem_src;    /* Contents of the input file */
+static per_thread size_t mem_srclen;
+static per_thread struct nasm_buffer *mem_obj; /* Output to memory */
+static per_thread jmp_buf *fatal_jmp;     /* Where fatal errors return to */
+
+per_thread const struct ofmt *ofmt = &OF_DEFAULT;
+per_thread const struct ofmt_alias *ofmt_alias = NULL;
+per_thread const struct dfmt *dfmt;
+
+per_thread FILE *error_file;               /* Where to write error messages */
+
+per_thread FILE *ofile = NULL;
+per_thread struct optimization optimizing =
     { MAX_OPTIMIZE, OPTIM_ALL_ENABLED }; /* number of optimization passes to take */
 static int cmd_sb = 16;    /* by default */
 
-iflag_t cpu, cmd_cpu;
+per_thread iflag_t cpu, cmd_cpu;
 
-struct location location;
-bool in_absolute;                 /* Flag we are in ABSOLUTE seg */
-struct location absolute;         /* Segment/offset inside ABSOLUTE */
+per_thread struct location location;
+per_thread bool in_absolute;                 /* Flag we are in ABSOLUTE seg */
+per_thread struct location absolute;         /* Segment/offset inside ABSOLUTE */
 
-static struct RAA *offsets;
+static per_thread struct RAA *offsets;
 
-static struct SAA *forwrefs;    /* keep track of forward references */
-static const struct forwrefinfo *forwref;
+static per_thread struct SAA *forwrefs;    /* keep track of forward references */
+static per_thread const struct forwrefinfo *forwref;
 
-static struct strlist *include_path;
-static enum preproc_opt ppopt;
+static per_thread struct strlist *include_path;
+static per_thread enum preproc_opt ppopt;
 
 #define OP_NORMAL           (1U << 0)
 #define OP_PREPROCESS       (1U << 1)
 #define OP_DEPEND           (1U << 2)
+#define OP_PCH              (1U << 3)
 
-static unsigned int operating_mode;
+static per_thread unsigned int operating_mode;
 
 /* Dependency flags */
-static bool depend_emit_phony = false;
-static bool depend_missing_ok = false;
-static const char *depend_target = NULL;
-static const char *depend_file = NULL;
-struct strlist *depend_list;
+static per_thread bool depend_emit_phony = false;
+static per_thread bool depend_missing_ok = false;
+static per_thread const char *depend_target = NULL;
+static per_thread const char *depend_file = NULL;
+per_thread struct strlist *depend_list;
 
-static bool want_usage;
-static bool terminate_after_phase;
-bool user_nolist = false;
+static per_thread bool want_usage;
+static per_thread bool terminate_after_phase;
+per_thread bool user_nolist = false;
 
 static char *quote_for_pmake(const char *str);
 static char *quote_for_wmake(const char *str);
-static char *(*quote_for_make)(const char *) = quote_for_pmake;
+static per_thread char *(*quote_for_make)(const char *) = quote_for_pmake;
 
 /*
  * Execution limits that can be set via a command-line option or %pragma
@@ -177,7 +209,7 @@ static char *(*quote_for_make)(const char *) = quote_for_pmake;
 */
 #define LIMIT_MAX_VAL	(INT64_MAX >> 1)
 
-int64_t nasm_limit[LIMIT_MAX+1];
+per_thread int64_t nasm_limit[LIMIT_MAX+1];
 
 struct limit_info {
     const char *name;
@@ -193,7 +225,8 @@ static const struct limit_info limit_info[LIMIT_MAX+1] = {
     { "mmacros", "multi-line macros before final return", 100000 },
     { "rep", "%rep count", 1000000 },
     { "eval", "expression evaluation descent", 8192 },
-    { "lines", "total source lines processed", 2000000000 }
+    { "lines", "total source lines processed", 2000000000 },
+    { "include-levels", "levels of nested include files", 1000 }
 };
 
 static void set_default_limits(void)
@@ -485,19 +518,31 @@ static void timestamp(void)
 {
     struct compile_time * const oct = &official_compile_time;
     const struct tm *tp, *best_gm;
+#if defined(HAVE_LOCALTIME_R) || defined(HAVE_GMTIME_R)
+    struct tm tm;
+#endif
 
     time(&oct->t);
 
     best_gm = NULL;
 
+    /* The _r versions don't share a buffer with other threads */
+#ifdef HAVE_LOCALTIME_R
+    tp = localtime_r(&oct->t, &tm);
+#else
     tp = localtime(&oct->t);
+#endif
     if (tp) {
         oct->local = *tp;
         best_gm = &oct->local;
         oct->have_local = true;
     }
 
+#ifdef HAVE_GMTIME_R
+    tp = gmtime_r(&oct->t, &tm);
+#else
     tp = gmtime(&oct->t);
+#endif
     if (tp) {
         oct->gm = *tp;
         best_gm = &oct->gm;
@@ -514,10 +559,12 @@ static void timestamp(void)
     }
 }
 
-int main(int argc, char **argv)
+/*
+ * Run nasm with error_file set up.
+ */
+static int run_nasm(int argc, char **argv)
 {
     /* Do these as early as possible */
-    error_file = stderr;
     _progname = argv[0];
     if (!_progname || !_progname[0])
         _progname = "nasm";
@@ -558,6 +605,88 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (batch_name) {
+        if (fatal_jmp)
+            nasm_fatalf(ERR_USAGE, "--batch cannot be used in a library call");
+        return run_batch(argc, argv);
+    }
+
+    if (encode_threads && fatal_jmp)
+        nasm_fatalf(ERR_USAGE, "--threads cannot be used in a library call");
+
+    return run_job(argc, argv);
+}
+
+int nasm_main(int argc, char **argv)
+{
+    error_file = stderr;
+    return run_nasm(argc, argv);
+}
+
+/*
+ * Read back the contents of a temporary file
+ */
+static void read_tmpfile(FILE *f, struct nasm_buffer *buf)
+{
+    off_t len;
+
+    fflush(f);
+    len = nasm_file_size(f);
+    if (len <= 0)
+        return;
+
+    buf->data = nasm_malloc(len);
+    rewind(f);
+    buf->len = fread(buf->data, 1, len, f);
+}
+
+int nasm_assemble_buffer(int argc, char **argv, const char *src,
+                         size_t srclen, struct nasm_buffer *obj,
+                         struct nasm_buffer *msgs)
+{
+    jmp_buf env;
+    int rv;
+
+    obj->data  = msgs->data = NULL;
+    obj->len   = msgs->len  = 0;
+
+    error_file = tmpfile();
+    if (!error_file)
+        return 1;
+
+    mem_src    = src;
+    mem_srclen = srclen;
+    mem_obj    = obj;
+
+    rv = setjmp(env);
+    if (!rv) {
+        fatal_jmp = &env;
+        rv = run_nasm(argc, argv);
+    }
+    fatal_jmp = NULL;
+
+    if (rv) {
+        nasm_free(obj->data);
+        obj->data = NULL;
+        obj->len  = 0;
+    }
+
+    read_tmpfile(error_file, msgs);
+    fclose(error_file);
+    error_file = NULL;
+
+    return rv;
+}
+
+/*
+ * Assemble one input file once the first pass over the command line
+ * options is done.
+ */
+static int run_job(int argc, char **argv)
+{
+    const char *cache_files[RC_FILES];
+    bool cache_hit = false;
+
     /* At this point we have ofmt and the name of the desired debug format */
     if (!using_debug_info) {
         /* No debug info, redirect to the null backend (empty stubs) */
@@ -580,6 +709,10 @@ int main(int argc, char **argv)
     }
     preproc_init(include_path);
 
+    /* Only whole assemblies are cached */
+    if (cache_dir && (operating_mode & ~OP_DEPEND) == OP_NORMAL && !mem_obj)
+        rescache = rescache_new(cache_dir);
+
     parse_cmdline(argc, argv, 2);
     if (terminate_after_phase) {
         if (want_usage)
@@ -590,6 +723,9 @@ int main(int argc, char **argv)
     /* Save away the default state of warnings */
     init_warnings();
 
+    if (mem_src)
+        nasm_cached_file_preload(inname, mem_src, mem_srclen);
+
     /* Dependency filename if we are also doing other things */
     if (!depend_file && (operating_mode & ~OP_DEPEND)) {
         if (outname)
@@ -603,7 +739,13 @@ int main(int argc, char **argv)
      * is preprocess mode, we're perfectly
      * fine to output into stdout.
      */
-    if (!outname && !(operating_mode & OP_PREPROCESS)) {
+    if (!outname && (operating_mode & OP_PCH)) {
+        outname = filename_set_extension(inname, ".pch");
+        if (!strcmp(outname, inname)) {
+            outname = "nasm.pch";
+            nasm_warn(WARN_OTHER, "default output file same as input, using `%s' for output\n", outname);
+        }
+    } else if (!outname && !(operating_mode & OP_PREPROCESS)) {
         outname = filename_set_extension(inname, ofmt->extension);
         if (!strcmp(outname, inname)) {
             outname = "nasm.out";
@@ -616,7 +758,16 @@ int main(int argc, char **argv)
     if (!depend_target)
         depend_target = quote_for_make(outname);
 
-    if (!(operating_mode & (OP_PREPROCESS|OP_NORMAL))) {
+    if (rescache) {
+        cache_files[RC_OBJ]  = outname;
+        cache_files[RC_DEP]  = (operating_mode & OP_DEPEND) ? depend_file : NULL;
+        cache_files[RC_LIST] = listname;
+        if (profile_enabled)
+            rescache_disable(rescache, "profiling");
+        cache_hit = rescache_fetch(rescache, inname, include_path, cache_files);
+    }
+
+    if (!(operating_mode & (OP_PREPROCESS|OP_NORMAL|OP_PCH))) {
             char *line;
 
             if (depend_missing_ok)
@@ -703,10 +854,35 @@ int main(int argc, char **argv)
             if (ofile && terminate_after_phase && !keep_all)
                 remove(outname);
             ofile = NULL;
+    } else if (operating_mode & OP_PCH) {
+            struct strlist *pch_deps = strlist_alloc(true);
+            char *line;
+
+            location.known = false;
+
+            _pass_type = PASS_PREPROC;
+            pp_reset(inname, PP_PREPROC, pch_deps);
+
+            /* A header may only define macros */
+            while ((line = pp_getline())) {
+                if (line[strspn(line, " \t")])
+                    nasm_nonfatal("precompiled header source generates code or directives");
+                nasm_free(line);
+            }
+
+            if (!terminate_after_phase)
+                pp_write_pch(outname, inname);
+
+            pp_cleanup_pass();
+            reset_warnings();
+            strlist_free(&pch_deps);
     }
 
-    if (operating_mode & OP_NORMAL) {
-        ofile = nasm_open_write(outname, (ofmt->flags & OFMT_TEXT) ? NF_TEXT : NF_BINARY);
+    if ((operating_mode & OP_NORMAL) && !cache_hit) {
+        if (mem_obj)
+            ofile = tmpfile();
+        else
+            ofile = nasm_open_write(outname, (ofmt->flags & OFMT_TEXT) ? NF_TEXT : NF_BINARY);
         if (!ofile)
             nasm_fatal("unable to open output file `%s'", outname);
 
@@ -716,39 +892,107 @@ int main(int argc, char **argv)
         assemble_file(inname, depend_list);
 
         if (!terminate_after_phase) {
+            enum profile_step step;
+
+            profile_restart(PROF_WRITE);
+            step = profile_enter(STEP_WRITE);
             ofmt->cleanup();
             cleanup_labels();
             fflush(ofile);
             if (ferror(ofile))
                 nasm_nonfatal("write error on output file `%s'", outname);
+            profile_leave(step);
         }
 
         if (ofile) {
+            if (mem_obj && !terminate_after_phase)
+                read_tmpfile(ofile, mem_obj);
             fclose(ofile);
-            if (terminate_after_phase && !keep_all)
+            if (terminate_after_phase && !keep_all && !mem_obj)
                 remove(outname);
             ofile = NULL;
         }
+
+        profile_report(profile_name, profile_json);
+        profile_free();
     }
 
     pp_cleanup_session();
 
-    if (depend_list && !terminate_after_phase)
+    if (depend_list && !terminate_after_phase && !cache_hit)
         emit_dependencies(depend_list);
 
+    if (rescache) {
+        if (!cache_hit && !terminate_after_phase && !diag_issued)
+            rescache_store(rescache, cache_files);
+        rescache_free(&rescache);
+    }
+
     if (want_usage)
         usage();
 
     raa_free(offsets);
     saa_free(forwrefs);
     eval_cleanup();
+    replay_cleanup();
     stdscan_cleanup();
+    atom_free_all();
     src_free();
+    nasm_free_file_cache();
     strlist_free(&include_path);
 
     return terminate_after_phase;
 }
 
+/*
+ * Run one line of the --batch job list, in a child process.  The
+ * first pass over the options from the real command line has already
+ * been done; the job line only adds its own options to that pass.
+ * The second pass is over both.
+ */
+static int batch_job(const char *job)
+{
+    char **jargv, **fargv;
+    int jargc, fargc;
+
+    jargv = batch_split(nasm_strdup(job), _progname, &jargc);
+
+    batch_name = NULL;
+    parse_argv(jargc, jargv, 1);
+    if (batch_name)
+        nasm_fatalf(ERR_USAGE, "--batch cannot be used in a batch job");
+    if (terminate_after_phase) {
+        if (want_usage)
+            usage();
+        return 1;
+    }
+
+    fargc = batch_argc + jargc - 1;
+    fargv = nasm_malloc((fargc + 1) * sizeof *fargv);
+    memcpy(fargv, batch_argv, batch_argc * sizeof *fargv);
+    memcpy(fargv + batch_argc, jargv + 1, jargc * sizeof *fargv);
+
+    return run_job(fargc, fargv);
+}
+
+static int run_batch(int argc, char **argv)
+{
+    struct strlist *jobs = batch_read(batch_name);
+    bool failed;
+
+    batch_argc = argc;
+    batch_argv = argv;
+    failed = batch_run(jobs, batch_jobs, batch_job);
+
+    strlist_free(&jobs);
+    raa_free(offsets);
+    saa_free(forwrefs);
+    src_free();
+    strlist_free(&include_path);
+
+    return failed;
+}
+
 /*
  * Get a parameter for a command line option.
  * First arg must be in the form of e.g. -f...
@@ -938,8 +1182,18 @@ enum text_options {
     OPT_LIMIT,
     OPT_KEEP_ALL,
     OPT_NO_LINE,
+    OPT_NO_RELAX,
     OPT_DEBUG,
-    OPT_REPRODUCIBLE
+    OPT_REPRODUCIBLE,
+    OPT_PP_REPLAY,
+    OPT_PROFILE,
+    OPT_PROFILE_FORMAT,
+    OPT_MAKE_PCH,
+    OPT_PCH,
+    OPT_RECHECK_FILES,
+    OPT_BATCH,
+    OPT_CACHE,
+    OPT_THREADS
 };
 enum need_arg {
     ARG_NO,
@@ -970,8 +1224,18 @@ static const struct textargs textopts[] = {
     {"limit-",   OPT_LIMIT,   ARG_YES, 0},
     {"keep-all", OPT_KEEP_ALL, ARG_NO, 0},
     {"no-line",  OPT_NO_LINE, ARG_NO, 0},
+    {"no-relax", OPT_NO_RELAX, ARG_NO, 0},
     {"debug",    OPT_DEBUG, ARG_MAYBE, 0},
     {"reproducible", OPT_REPRODUCIBLE, ARG_NO, 0},
+    {"pp-replay", OPT_PP_REPLAY, ARG_NO, 0},
+    {"profile",  OPT_PROFILE, ARG_MAYBE, 0},
+    {"profile-format", OPT_PROFILE_FORMAT, ARG_YES, 0},
+    {"make-pch", OPT_MAKE_PCH, ARG_NO, 0},
+    {"pch",      OPT_PCH, ARG_YES, 0},
+    {"recheck-files", OPT_RECHECK_FILES, ARG_NO, 0},
+    {"batch",    OPT_BATCH, ARG_YES, 0},
+    {"cache",    OPT_CACHE, ARG_YES, 0},
+    {"threads",  OPT_THREADS, ARG_YES, 0},
     {NULL, OPT_BOGUS, ARG_NO, 0}
 };
 
@@ -982,7 +1246,7 @@ static void show_version(void)
     exit(0);
 }
 
-static bool stopoptions = false;
+static per_thread bool stopoptions = false;
 static bool process_arg(char *p, char *q, int pass)
 {
     char *param;
@@ -991,8 +1255,14 @@ static bool process_arg(char *p, char *q, int pass)
     if (!p || !p[0])
         return false;
 
+    /* Options from anywhere, such as response files, are in the key */
+    if (pass == 2 && rescache) {
+        rescache_arg(rescache, p);
+        rescache_arg(rescache, q ? q : "");
+    }
+
     if (p[0] == '-' && !stopoptions) {
-        if (strchr("oOfpPdDiIlLFXuUZwW", p[1])) {
+        if (strchr("oOfpPdDiIjlLFXuUZwW", p[1])) {
             /* These parameters take values */
             if (!(param = get_param(p, q, &advance)))
                 return advance;
@@ -1065,8 +1335,11 @@ static bool process_arg(char *p, char *q, int pass)
 
         case 'p':       /* pre-include */
         case 'P':
-            if (pass == 2)
+            if (pass == 2) {
                 pp_pre_include(param);
+                if (rescache)
+                    rescache_pre_include(rescache, param);
+            }
             break;
 
         case 'd':       /* pre-define */
@@ -1087,6 +1360,18 @@ static bool process_arg(char *p, char *q, int pass)
                 strlist_add(include_path, param);
             break;
 
+        case 'j':       /* concurrent batch jobs */
+            if (pass == 1) {
+                char *ep;
+                unsigned long n = strtoul(param, &ep, 10);
+
+                if (*ep || !n || n > 1024)
+                    nasm_nonfatalf(ERR_USAGE, "invalid number of jobs `%s'", param);
+                else
+                    batch_jobs = n;
+            }
+            break;
+
         case 'l':       /* listing file */
             if (pass == 2)
                 copy_filename(&listname, param, "listing");
@@ -1308,16 +1593,22 @@ static bool process_arg(char *p, char *q, int pass)
                         set_label_mangle(tx->pvt, param);
                     break;
                 case OPT_INCLUDE:
-                    if (pass == 2)
+                    if (pass == 2) {
                         pp_pre_include(q);
+                        if (rescache)
+                            rescache_pre_include(rescache, q);
+                    }
                     break;
                 case OPT_PRAGMA:
                     if (pass == 2)
                         pp_pre_command("%pragma", param);
                     break;
                 case OPT_BEFORE:
-                    if (pass == 2)
+                    if (pass == 2) {
                         pp_pre_command(NULL, param);
+                        if (rescache)
+                            rescache_pre_text(rescache, param);
+                    }
                     break;
                 case OPT_LIMIT:
                     if (pass == 1)
@@ -1329,12 +1620,64 @@ static bool process_arg(char *p, char *q, int pass)
                 case OPT_NO_LINE:
                     ppopt |= PP_NOLINE;
                     break;
+                case OPT_NO_RELAX:
+                    optimizing.flag |= OPTIM_DISABLE_RELAX;
+                    break;
                 case OPT_DEBUG:
                     debug_nasm = param ? strtoul(param, NULL, 10) : debug_nasm+1;
                     break;
                 case OPT_REPRODUCIBLE:
                     reproducible = true;
                     break;
+                case OPT_PP_REPLAY:
+                    ppopt |= PP_REPLAY;
+                    break;
+                case OPT_PROFILE:
+                    profile_enabled = true;
+                    profile_name = param;
+                    break;
+                case OPT_PROFILE_FORMAT:
+                    if (!nasm_stricmp(param, "text"))
+                        profile_json = false;
+                    else if (!nasm_stricmp(param, "json"))
+                        profile_json = true;
+                    else if (pass == 1)
+                        nasm_nonfatalf(ERR_USAGE,
+                                       "unknown profile format `%s'", param);
+                    break;
+                case OPT_MAKE_PCH:
+                    if (pass == 1)
+                        operating_mode = OP_PCH;
+                    break;
+                case OPT_PCH:
+                    if (pass == 2) {
+                        pp_pre_pch(param);
+                        if (rescache)
+                            rescache_disable(rescache, "uses a precompiled header");
+                    }
+                    break;
+                case OPT_RECHECK_FILES:
+                    nasm_cached_file_recheck(true);
+                    break;
+                case OPT_BATCH:
+                    if (pass == 1)
+                        copy_filename(&batch_name, param, "batch");
+                    break;
+                case OPT_CACHE:
+                    if (pass == 1)
+                        copy_filename(&cache_dir, param, "cache");
+                    break;
+                case OPT_THREADS:
+                    if (pass == 1) {
+                        char *ep;
+                        unsigned long n = strtoul(param, &ep, 10);
+
+                        if (*ep || !n || n > 1024)
+                            nasm_nonfatalf(ERR_USAGE, "invalid number of threads `%s'", param);
+                        else
+                            encode_threads = n;
+                    }
+                    break;
                 case OPT_HELP:
                     help(stdout);
                     exit(0);
@@ -1462,30 +1805,14 @@ static void process_response_file(const char *file, int pass)
     fclose(f);
 }
 
-static void parse_cmdline(int argc, char **argv, int pass)
+/*
+ * Process the options of an argument vector, including response files
+ */
+static void parse_argv(int argc, char **argv, int pass)
 {
     FILE *rfile;
-    char *envreal, *envcopy = NULL, *p;
-
-    /*
-     * Initialize all the warnings to their default state, including
-     * warning index 0 used for "always on".
-     */
-    memcpy(warning_state, warning_default, sizeof warning_state);
+    char *p;
 
-    /*
-     * First, process the NASMENV environment variable.
-     */
-    envreal = getenv("NASMENV");
-    if (envreal) {
-        envcopy = nasm_strdup(envreal);
-        process_args(envcopy, pass);
-        nasm_free(envcopy);
-    }
-
-    /*
-     * Now process the actual command line.
-     */
     while (--argc) {
         bool advance;
         argv++;
@@ -1516,6 +1843,32 @@ static void parse_cmdline(int argc, char **argv, int pass)
             advance = process_arg(argv[0], argc > 1 ? argv[1] : NULL, pass);
         argv += advance, argc -= advance;
     }
+}
+
+static void parse_cmdline(int argc, char **argv, int pass)
+{
+    char *envreal, *envcopy = NULL;
+
+    /*
+     * Initialize all the warnings to their default state, including
+     * warning index 0 used for "always on".
+     */
+    memcpy(warning_state, warning_default, sizeof warning_state);
+
+    /*
+     * First, process the NASMENV environment variable.
+     */
+    envreal = getenv("NASMENV");
+    if (envreal) {
+        envcopy = nasm_strdup(envreal);
+        process_args(envcopy, pass);
+        nasm_free(envcopy);
+    }
+
+    /*
+     * Now process the actual command line.
+     */
+    parse_argv(argc, argv, pass);
 
     /*
      * Look for basic command line typos. This definitely doesn't
@@ -1575,6 +1928,243 @@ static void forward_refs(insn *instruction)
     }
 }
 
+/*
+ * Cache of parsed instructions for the passes before the final one,
+ * indexed by global line number. Only lines whose parse can depend on
+ * the pass through nothing but the values of their TIMES count, data
+ * items and immediate operands are kept, together with the compiled
+ * form of those expressions to run again (see parse_line_record()).
+ * They must also have raised no diagnostics, and have the same text,
+ * BITS and DEFAULT REL setting as when they were cached. Once
+ * INSN_CACHE_MAX bytes are in use, lines not already in the cache are
+ * simply parsed again on every pass.
+ *
+ * Entries are carved out of large chunks; an entry keeps the
+ * instruction only up to its last operand in use, followed by the
+ * replay record, the source line and the label. A dropped entry no
+ * longer counts against INSN_CACHE_MAX, but its space stays in its
+ * chunk until insn_cache_compact() moves the live entries to new
+ * chunks at the start of a pass.
+ */
+#define INSN_CACHE_MAX   ((size_t)128 << 20)
+#define INSN_CACHE_CHUNK ((size_t)1 << 20)
+
+struct insn_cache_entry {
+    const struct replay *replay; /* Expressions to run again, or NULL */
+    const char *text;           /* The source line */
+    size_t len;
+    size_t size;                /* Space taken in its chunk */
+    size_t bytes;               /* Memory held, including the eops */
+    int noprs;                  /* Operands kept */
+    int bits;
+    int rel;
+};
+
+#define ce_insn(ce) ((insn *)((ce) + 1))
+#define ce_insn_size(noprs) \
+    (offsetof(insn, oprs) + (noprs) * sizeof(operand))
+
+struct insn_cache_chunk {
+    struct insn_cache_chunk *prev;
+    size_t used, size;
+};
+
+static per_thread struct insn_cache_entry **insn_cache;
+static per_thread size_t insn_cache_lines;
+static per_thread size_t insn_cache_bytes;   /* Held by live entries */
+static per_thread size_t insn_cache_dead;    /* Chunk space of dropped ones */
+static per_thread struct insn_cache_chunk *insn_cache_chunks;
+
+static void *insn_cache_alloc(size_t bytes)
+{
+    struct insn_cache_chunk *c = insn_cache_chunks;
+    void *p;
+
+    bytes = ALIGN(bytes, 8);
+
+    if (!c || c->size - c->used < bytes) {
+        size_t size = bytes > INSN_CACHE_CHUNK ? bytes : INSN_CACHE_CHUNK;
+
+        c = nasm_malloc(sizeof *c + size);
+        c->prev = insn_cache_chunks;
+        c->used = 0;
+        c->size = size;
+        insn_cache_chunks = c;
+    }
+
+    p = (char *)(c + 1) + c->used;
+    c->used += bytes;
+    return p;
+}
+
+static void insn_cache_drop(size_t lineno)
+{
+    struct insn_cache_entry *ce = insn_cache[lineno];
+
+    insn_cache_bytes -= ce->bytes;
+    insn_cache_dead  += ce->size;
+    cleanup_insn(ce_insn(ce));
+    insn_cache[lineno] = NULL;
+}
+
+static void insn_cache_free_chunks(struct insn_cache_chunk *c)
+{
+    struct insn_cache_chunk *prev;
+
+    for (; c; c = prev) {
+        prev = c->prev;
+        nasm_free(c);
+    }
+}
+
+/*
+ * Move the live entries to new chunks if dropped entries take up a
+ * good part of the old ones.
+ */
+static void insn_cache_compact(void)
+{
+    struct insn_cache_chunk *old = insn_cache_chunks;
+    struct insn_cache_entry *ce, *nce;
+    size_t n;
+
+    if (insn_cache_dead <= INSN_CACHE_CHUNK ||
+        insn_cache_dead <= insn_cache_bytes / 4)
+        return;
+
+    insn_cache_chunks = NULL;
+    insn_cache_dead = 0;
+
+    for (n = 0; n < insn_cache_lines; n++) {
+        if (!(ce = insn_cache[n]))
+            continue;
+
+        nce = insn_cache_alloc(ce->size);
+        memcpy(nce, ce, ce->size);
+        nce->text = (char *)nce + (ce->text - (char *)ce);
+        if (ce->replay) {
+            nce->replay = (const struct replay *)
+                ((char *)nce + ((const char *)ce->replay - (char *)ce));
+        }
+        if (ce_insn(ce)->label) {
+            ce_insn(nce)->label =
+                (char *)nce + (ce_insn(ce)->label - (char *)ce);
+        }
+        insn_cache[n] = nce;
+    }
+
+    insn_cache_free_chunks(old);
+}
+
+static void insn_cache_free(void)
+{
+    size_t n;
+
+    for (n = 0; n < insn_cache_lines; n++) {
+        if (insn_cache[n])
+            insn_cache_drop(n);
+    }
+
+    insn_cache_free_chunks(insn_cache_chunks);
+    insn_cache_chunks = NULL;
+
+    nasm_free(insn_cache);
+    insn_cache = NULL;
+    insn_cache_lines = insn_cache_bytes = insn_cache_dead = 0;
+}
+
+/*
+ * Parse a line, or reuse what an earlier pass parsed for the same
+ * line. Returns true if the instruction belongs to the cache, in
+ * which case it must not be given to cleanup_insn().
+ */
+static bool parse_line_cached(char *line, insn *instruction)
+{
+    const size_t lineno = globallineno;
+    struct insn_cache_entry *ce;
+    size_t len, llen, isize, rsize, size;
+    uint64_t diags;
+    char *text;
+    int n;
+
+    if (pass_final()) {
+        /* Let the code generation pass see all diagnostics */
+        if (insn_cache)
+            insn_cache_free();
+        parse_line(line, instruction);
+        return false;
+    }
+
+    len = strlen(line);
+
+    if (lineno < insn_cache_lines && (ce = insn_cache[lineno])) {
+        if (ce->len == len && ce->bits == globalbits &&
+            ce->rel == globalrel && !memcmp(ce->text, line, len)) {
+            memcpy(instruction, ce_insn(ce), ce_insn_size(ce->noprs));
+            for (n = ce->noprs; n < MAX_OPERANDS; n++)
+                instruction->oprs[n].type = 0;
+            if (replay_line(ce->replay, line, instruction))
+                return true;
+
+            insn_cache_drop(lineno); /* Parsed again to get diagnostics */
+            return false;
+        }
+
+        insn_cache_drop(lineno); /* Not the same line anymore */
+    }
+
+    diags = diag_count;
+
+    if (!parse_line_record(line, instruction) || diag_count != diags ||
+        instruction->opcode == I_INCBIN ||
+        insn_cache_bytes >= INSN_CACHE_MAX)
+        return false;
+
+    if (lineno >= insn_cache_lines) {
+        size_t old = insn_cache_lines;
+
+        insn_cache_lines = lineno < 1024 ? 1024 : lineno << 1;
+        insn_cache = nasm_realloc(insn_cache,
+                                  insn_cache_lines * sizeof *insn_cache);
+        memset(insn_cache + old, 0,
+               (insn_cache_lines - old) * sizeof *insn_cache);
+        insn_cache_bytes += (insn_cache_lines - old) * sizeof *insn_cache;
+    }
+
+    /* Data declarations keep their items in eops, not in oprs */
+    n = opcode_is_db(instruction->opcode) ? 0 : instruction->operands;
+
+    isize = ALIGN(ce_insn_size(n), 8);
+    rsize = replay_save(NULL);
+    llen  = instruction->label ? strlen(instruction->label) + 1 : 0;
+
+    size = ALIGN(sizeof *ce + isize + rsize + len + 1 + llen, 8);
+    ce = insn_cache_alloc(size);
+    ce->replay = NULL;
+    if (rsize) {
+        struct replay *replay = (struct replay *)((char *)(ce + 1) + isize);
+        replay_save(replay);
+        ce->replay = replay;
+    }
+    text = (char *)(ce + 1) + isize + rsize;
+    memcpy(text, line, len + 1);
+    ce->text  = text;
+    ce->len   = len;
+    ce->size  = size;
+    ce->bytes = size + detach_insn(instruction);
+    ce->noprs = n;
+    ce->bits  = globalbits;
+    ce->rel   = globalrel;
+    if (llen) {
+        memcpy(text + len + 1, instruction->label, llen);
+        instruction->label = text + len + 1;
+    }
+    memcpy(ce_insn(ce), instruction, ce_insn_size(n));
+
+    insn_cache_bytes += ce->bytes;
+    insn_cache[lineno] = ce;
+    return true;
+}
+
 static void process_insn(insn *instruction)
 {
     int32_t n;
@@ -1591,6 +2181,8 @@ static void process_insn(insn *instruction)
      */
     if (!pass_final()) {
         int64_t start = location.offset;
+        bool once = instruction->times == 1;
+
         for (n = 1; n <= instruction->times; n++) {
             l = insn_size(location.segment, location.offset,
                           globalbits, instruction);
@@ -1598,6 +2190,9 @@ static void process_insn(insn *instruction)
             if (l != -1)
                 increment_offset(l);
         }
+        if (encode_threads && pass_type() == PASS_STAB)
+            parallel_predict(globallineno,
+                             once ? location.offset - start : -1);
         if (list_option('p')) {
             struct out_data dummy;
             memset(&dummy, 0, sizeof dummy);
@@ -1607,6 +2202,15 @@ static void process_insn(insn *instruction)
             lfmt->output(&dummy);
         }
     } else {
+        if (instruction->opcode != I_none) {
+            /* Encode on the --threads if possible, else after them */
+            if (parallel_defer(instruction, globallineno, globalbits, &l)) {
+                increment_offset(l);
+                return;
+            }
+            parallel_flush();
+        }
+
         l = assemble(location.segment, location.offset,
                      globalbits, instruction);
                 /* We can't get an invalid instruction here */
@@ -1628,8 +2232,11 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
 {
     char *line;
     insn output_ins;
+    bool cached;
     uint64_t prev_offset_changed;
     int64_t stall_count = 0; /* Make sure we make forward progress... */
+    bool relax = true;       /* Jump relaxation has not failed yet */
+    bool relaxed = false;    /* Labels were moved by jump relaxation */
 
     switch (cmd_sb) {
     case 16:
@@ -1703,20 +2310,29 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
         if (!pass_first()) {
             saa_rewind(forwrefs);
             forwref = saa_rstruct(forwrefs);
-            raa_free(offsets);
-            offsets = raa_init();
+            raa_reset(offsets);
         }
         location.segment = NO_SEG;
         location.offset  = 0;
         if (pass_first())
             location.known = true;
+        relax_reset();
+        insn_cache_compact();
         ofmt->reset();
         switch_segment(ofmt->section(NULL, &globalbits));
         pp_reset(fname, PP_NORMAL, pass_final() ? depend_list : NULL);
 
         globallineno = 0;
 
+        if (pass_final() && encode_threads)
+            parallel_begin(encode_threads);
+
+        profile_pass_begin();
         while ((line = pp_getline())) {
+            enum profile_step step;
+
+            profile_phase(PROF_PARSE);
+
             if (++globallineno > nasm_limit[LIMIT_LINES])
                 nasm_fatal("overall line count exceeds the maximum %"PRId64"\n",
                            nasm_limit[LIMIT_LINES]);
@@ -1729,14 +2345,23 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
                 goto end_of_line; /* Just do final cleanup */
 
             /* Not a directive, or even something that starts with [ */
-            parse_line(line, &output_ins);
+            step = profile_enter(STEP_PARSE_LINE);
+            cached = parse_line_cached(line, &output_ins);
             forward_refs(&output_ins);
+            profile_leave(step);
+            profile_phase(pass_final() ? PROF_EMIT : PROF_SIZE);
+            step = profile_enter(STEP_ASSEMBLE);
             process_insn(&output_ins);
-            cleanup_insn(&output_ins);
+            if (!cached)
+                cleanup_insn(&output_ins);
+            profile_leave(step);
 
         end_of_line:
             nasm_free(line);
+            profile_phase(PROF_PREPROCESS);
         }                       /* end while (line = pp_getline... */
+        parallel_end();
+        profile_pass_end();
 
         pp_cleanup_pass();
 
@@ -1757,6 +2382,18 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
                     stall_count++;
                 }
 
+                /*
+                 * Try to predict the final jump sizes; if a prediction
+                 * did not hold, put the labels back where the pass
+                 * before it left them, and go on with plain
+                 * optimization passes from there.
+                 */
+                if (relaxed) {
+                    restore_labels();
+                    relax = false;
+                }
+                relaxed = relax && relax_jumps();
+
                 if (stall_count > nasm_limit[LIMIT_STALLED] ||
                     pass_count() >= nasm_limit[LIMIT_PASSES]) {
                     /* No convergence, almost certainly dead */
@@ -1799,8 +2436,16 @@ static void assemble_file(const char *fname, struct strlist *depend_list)
     if (opt_verbose_info && pass_final()) {
         /*  -On and -Ov switches */
         nasm_info("assembly required 1+%"PRId64"+2 passes\n", pass_count()-3);
+        nasm_info("template matching checked %"PRIu64" of %"PRIu64
+                  " templates\n", match_stats.matches, match_stats.templates);
+        nasm_info("template match cache answered %"PRIu64" of %"PRIu64
+                  " lookups\n", match_stats.hits, match_stats.lookups);
     }
 
+    insn_cache_free();
+    relax_cleanup();
+    match_cache_free();
+    parallel_cleanup();
     lfmt->cleanup();
     strlist_free(&warn_list);
 }
@@ -1871,7 +2516,7 @@ static bool is_suppressed(errflags severity)
     if (!(warning_state[warn_index(severity)] & WARN_ST_ENABLED))
         return true;
 
-    if (!(severity & ERR_PP_LISTMACRO))
+    if (!(severity & ERR_PP_LISTMACRO) && !parallel_replaying())
         return pp_suppress_error(severity);
 
     return false;
@@ -1912,7 +2557,8 @@ static const char * const error_pfx_table[ERR_MASK+1] = {
 static const char no_file_name[] = "nasm"; /* What to print if no file name */
 
 /*
- * For fatal/critical/panic errors, kill this process.
+ * For fatal/critical/panic errors, kill this process, or end the
+ * library call.
  */
 static fatal_func die_hard(errflags true_type, errflags severity)
 {
@@ -1923,7 +2569,7 @@ static fatal_func die_hard(errflags true_type, errflags severity)
 
     if (ofile) {
         fclose(ofile);
-        if (!keep_all)
+        if (!keep_all && !mem_obj)
             remove(outname);
         ofile = NULL;
     }
@@ -1931,6 +2577,10 @@ static fatal_func die_hard(errflags true_type, errflags severity)
     if (severity & ERR_USAGE)
         usage();
 
+    /* Return from nasm_assemble_buffer() */
+    if (fatal_jmp)
+        longjmp(*fatal_jmp, true_type - ERR_FATAL + 1);
+
     /* Terminate immediately */
     exit(true_type - ERR_FATAL + 1);
 }
@@ -1970,7 +2620,7 @@ fatal_func nasm_verror_critical(errflags severity, const char *fmt, va_list args
 {
     struct src_location where;
     errflags true_type = severity & ERR_MASK;
-    static bool been_here = false;
+    static per_thread bool been_here = false;
 
     if (unlikely(been_here))
         abort();                /* Recursive error... just die */
@@ -2077,12 +2727,29 @@ void nasm_verror(errflags severity, const char *fmt, va_list args)
     struct nasm_errtext *et;
     errflags true_type = true_error_type(severity);
 
+    diag_count++;
+
     if (true_type >= ERR_CRITICAL)
         nasm_verror_critical(severity, fmt, args);
 
     if (is_suppressed(severity))
         return;
 
+    /*
+     * Diagnostics come out in order with the output deferred by
+     * --threads: an encoder thread leaves it to the main thread,
+     * which first emits what was deferred before this.
+     */
+    if (parallel_redo())
+        return;
+    if (parallel_pending()) {
+        struct nasm_errhold *eh = errhold_stack;
+
+        errhold_stack = NULL;
+        parallel_flush();
+        errhold_stack = eh;
+    }
+
     nasm_new(et);
     et->severity = severity;
     et->true_type = true_type;
@@ -2146,6 +2813,9 @@ static void nasm_issue_error(struct nasm_errtext *et)
         const char *file = where.filename ? where.filename : no_file_name;
         const char *here = "";
 
+        if (true_type > ERR_DEBUG)
+            diag_issued = true;
+
         if (severity & ERR_HERE) {
             here = where.filename ? " here" : " in an unknown location";
         }
@@ -2228,6 +2898,12 @@ static void help(FILE *out)
         "    -h            show this text and exit (also --help)\n"
         "    -v (or --v)   print the NASM version number and exit\n"
         "    -@ file       response file; one command line option per line\n"
+        "   --batch file   assemble every line of file (- for stdin) as a\n"
+        "                  separate job, with the options given here\n"
+        "    -j n          run up to n batch jobs at the same time [1]\n"
+        "   --cache dir    reuse the results of earlier assemblies with the\n"
+        "                  same inputs, kept in the directory dir\n"
+        "   --threads n    encode the final pass on n threads\n"
         "\n"
         "    -o outfile    write output to outfile\n"
         "    --keep-all    output files will not be removed even if an error happens\n"
@@ -2273,6 +2949,7 @@ static void help(FILE *out)
         "       -O1        minimal optimization\n"
         "       -Ox        multipass optimization (default)\n"
         "       -Ov        display the number of passes executed at the end\n"
+        "   --no-relax     find jump sizes by optimization passes alone\n"
         "    -t            assemble in limited SciTech TASM compatible mode\n"
         "\n"
         "    -E (or -e)    preprocess only (writes output to stdout by default)\n"
@@ -2284,6 +2961,12 @@ static void help(FILE *out)
         "   --pragma str   pre-executes a specific %%pragma\n"
         "   --before str   add line (usually a preprocessor statement) before the input\n"
         "   --no-line      ignore %line directives in input\n"
+        "   --pp-replay    replay the preprocessed first pass on optimization passes\n"
+        "   --make-pch     write the macros defined by the input file to a\n"
+        "                  precompiled header (default name: infile.pch)\n"
+        "   --pch file     use the macros of a precompiled header\n"
+        "   --recheck-files read input files again on every pass if they\n"
+        "                  have changed (size or modification time)\n"
         "\n"
         "   --prefix str   prepend the given string to the names of all extern,\n"
         "                  common and global symbols (also --gprefix)\n"
@@ -2293,6 +2976,9 @@ static void help(FILE *out)
         "   --lpostfix str append the given string to local symbols\n"
         "\n"
         "   --reproducible attempt to produce run-to-run identical output\n"
+        "   --profile[=file] report the time spent in each assembly phase,\n"
+        "                  macro, include file and range of source lines\n"
+        "   --profile-format text|json  format of the --profile report\n"
         "\n"
         "    -w+x          enable warning x (also -Wx)\n"
         "    -w-x          disable warning x (also -Wno-x)\n"
@@ -0,0 +1,649 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * parallel.c - parallel encoding in the final pass, see --threads
+ *
+ * Once the final pass starts, the size of every line is known from
+ * the pass before, so the main thread can go on parsing lines without
+ * encoding them first.  Instructions are collected in batches, which
+ * the encoder threads turn into a log of the output they produce (see
+ * assemble_record()).  The main thread then emits each batch in source
+ * order with assemble_replay(), interleaved with the listing calls
+ * made while the batch was collected, so the output is the same as if
+ * every line had been encoded as soon as it was parsed.
+ *
+ * Anything else which reaches the output, the listing or the
+ * diagnostics first emits what has been deferred so far, by calling
+ * parallel_flush(): directives, label callbacks into the backend,
+ * diagnostics, and the instructions which are not deferred.  An
+ * instruction which issues a diagnostic on an encoder thread is
+ * encoded again on the main thread when its turn comes, so the
+ * message comes out in order and with the right location.  Only lines
+ * outside of macro expansions are deferred, since their location is
+ * then all it takes to put them back in context.
+ */
+
+#include "compiler.h"
+
+#include "nasm.h"
+#include "nasmlib.h"
+#include "error.h"
+#include "assemble.h"
+#include "labels.h"
+#include "listing.h"
+#include "parser.h"
+#include "srcfile.h"
+#include "parallel.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && NASM_THREADS
+# include <pthread.h>
+# define PARALLEL_THREADS 1
+#else
+# define PARALLEL_THREADS 0
+#endif
+
+/*
+ * Sizes of the lines in the pass before the final one, indexed by
+ * global line number; -1 if not known.
+ */
+static per_thread int32_t *line_size;
+static per_thread size_t line_size_lines;
+
+void parallel_predict(int64_t lineno, int64_t size)
+{
+    if ((uint64_t)lineno >= line_size_lines) {
+        size_t old = line_size_lines;
+
+        line_size_lines = lineno < 1024 ? 1024 : lineno << 1;
+        line_size = nasm_realloc(line_size,
+                                 line_size_lines * sizeof *line_size);
+        memset(line_size + old, 0xff,
+               (line_size_lines - old) * sizeof *line_size);
+    }
+
+    line_size[lineno] = (size >= 0 && size <= INT32_MAX) ? size : -1;
+}
+
+void parallel_cleanup(void)
+{
+    nasm_free(line_size);
+    line_size = NULL;
+    line_size_lines = 0;
+}
+
+#if PARALLEL_THREADS
+
+#define PAR_BATCH_LINES 1024    /* Instructions collected in a batch */
+#define PAR_CHUNK_LINES 32      /* Instructions a thread takes at a time */
+
+/* A deferred instruction */
+struct par_line {
+    insn ins;
+    struct src_location where;
+    int32_t segment;
+    int64_t offset;
+    int64_t size;               /* Size in the previous pass */
+    int64_t len;                /* Size as encoded */
+    int bits;
+    bool redo;                  /* Encode again on the main thread */
+    struct out_log log;
+};
+
+/* Something to emit in order: a deferred instruction or a listing call */
+enum par_event_type {
+    PE_INSN,
+    PE_LINE,
+    PE_UPLEVEL,
+    PE_DOWNLEVEL
+};
+struct par_event {
+    enum par_event_type type;
+    int ltype;                  /* Listing call type */
+    int64_t n;                  /* Instruction index, line number or size */
+    char *text;                 /* Listing line */
+};
+
+/* What the encoder threads need of the state of the main thread */
+struct par_state {
+    iflag_t cpu;
+    struct optimization optimizing;
+    const struct ofmt *ofmt;
+    const struct dfmt *dfmt;
+    int globalrel, globalbnd;
+    int64_t passn;
+    FILE *error_file;
+    uint8_t warning_state[sizeof warning_state];
+};
+
+struct par_batch {
+    struct par_line *lines;
+    size_t nlines;
+    struct par_event *events;
+    size_t nevents, maxevents;
+    struct par_state state;
+    size_t next, done;          /* Instructions taken and encoded */
+};
+
+struct parallel {
+    pthread_t *threads;
+    unsigned int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* An instruction to encode, or stop */
+    pthread_cond_t idle;        /* A batch has been encoded */
+    bool stop;
+    struct par_batch batch[2];
+    struct par_batch *open;     /* Being collected */
+    struct par_batch *job;      /* Being encoded, if any */
+    const struct lfmt *lfmt;    /* The listing generator */
+    bool replaying;
+    struct match_stats stats;   /* Of the threads which have finished */
+};
+
+static per_thread struct parallel *par;
+static per_thread struct par_line *encoding; /* On an encoder thread */
+
+static void par_state_save(struct par_state *st)
+{
+    st->cpu        = cpu;
+    st->optimizing = optimizing;
+    st->ofmt       = ofmt;
+    st->dfmt       = dfmt;
+    st->globalrel  = globalrel;
+    st->globalbnd  = globalbnd;
+    st->passn      = _passn;
+    st->error_file = error_file;
+    memcpy(st->warning_state, warning_state, sizeof warning_state);
+}
+
+static void par_state_load(const struct par_state *st)
+{
+    cpu        = st->cpu;
+    optimizing = st->optimizing;
+    ofmt       = st->ofmt;
+    dfmt       = st->dfmt;
+    globalrel  = st->globalrel;
+    globalbnd  = st->globalbnd;
+    _pass_type = PASS_FINAL;
+    _passn     = st->passn;
+    error_file = st->error_file;
+    memcpy(warning_state, st->warning_state, sizeof warning_state);
+}
+
+static void par_encode(struct par_line *l)
+{
+    insn ins = l->ins;          /* assemble() may change it */
+
+    encoding = l;
+    l->redo = false;
+    l->len = assemble_record(&l->log, l->segment, l->offset, l->bits, &ins);
+    encoding = NULL;
+}
+
+static void *par_thread(void *arg)
+{
+    struct parallel *p = arg;
+    struct par_batch *b;
+    size_t first, i, n;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && !(p->job && p->job->next < p->job->nlines))
+            pthread_cond_wait(&p->work, &p->lock);
+        if (p->stop)
+            break;
+
+        b = p->job;
+        first = b->next;
+        n = b->nlines - first;
+        if (n > PAR_CHUNK_LINES)
+            n = PAR_CHUNK_LINES;
+        b->next += n;
+        pthread_mutex_unlock(&p->lock);
+
+        par_state_load(&b->state);
+        for (i = first; i < first + n; i++)
+            par_encode(&b->lines[i]);
+
+        pthread_mutex_lock(&p->lock);
+        b->done += n;
+        if (b->done == b->nlines)
+            pthread_cond_signal(&p->idle);
+    }
+
+    p->stats.templates += match_stats.templates;
+    p->stats.matches   += match_stats.matches;
+    p->stats.lookups   += match_stats.lookups;
+    p->stats.hits      += match_stats.hits;
+    pthread_mutex_unlock(&p->lock);
+
+    match_cache_free();
+    return NULL;
+}
+
+static struct par_event *par_event(enum par_event_type type)
+{
+    struct par_batch *b = par->open;
+    struct par_event *e;
+
+    if (b->nevents >= b->maxevents) {
+        b->maxevents = b->maxevents ? b->maxevents << 1 : 2 * PAR_BATCH_LINES;
+        b->events = nasm_realloc(b->events, b->maxevents * sizeof *b->events);
+    }
+
+    e = &b->events[b->nevents++];
+    e->type = type;
+    e->text = NULL;
+    return e;
+}
+
+/*
+ * While a listing is generated, the listing calls which come with
+ * parsing the lines are deferred along with the instructions;
+ * anything else goes after whatever has been deferred.
+ */
+static void par_list_init(const char *fname)
+{
+    parallel_flush();
+    par->lfmt->init(fname);
+}
+
+static void par_list_cleanup(void)
+{
+    parallel_flush();
+    par->lfmt->cleanup();
+}
+
+static void par_list_output(const struct out_data *data)
+{
+    parallel_flush();
+    par->lfmt->output(data);
+}
+
+static void par_list_line(int type, int32_t lineno, const char *line)
+{
+    struct par_event *e = par_event(PE_LINE);
+
+    e->ltype = type;
+    e->n     = lineno;
+    e->text  = nasm_strdup(line);
+}
+
+static void par_list_uplevel(int type, int64_t size)
+{
+    struct par_event *e = par_event(PE_UPLEVEL);
+
+    e->ltype = type;
+    e->n     = size;
+}
+
+static void par_list_downlevel(int type)
+{
+    struct par_event *e = par_event(PE_DOWNLEVEL);
+
+    e->ltype = type;
+}
+
+static void printf_func(2, 3) par_list_error(errflags severity,
+                                             const char *fmt, ...)
+{
+    va_list ap;
+    char *msg;
+
+    parallel_flush();
+
+    va_start(ap, fmt);
+    msg = nasm_vasprintf(fmt, ap);
+    va_end(ap);
+
+    par->lfmt->error(severity, "%s", msg);
+    nasm_free(msg);
+}
+
+static void par_list_set_offset(uint64_t offset)
+{
+    parallel_flush();
+    par->lfmt->set_offset(offset);
+}
+
+static const struct lfmt par_list = {
+    par_list_init,
+    par_list_cleanup,
+    par_list_output,
+    par_list_line,
+    par_list_uplevel,
+    par_list_downlevel,
+    par_list_error,
+    par_list_set_offset
+};
+
+static void par_emit(struct par_line *l)
+{
+    int64_t len;
+
+    src_update(l->where);
+
+    if (l->redo) {
+        len = assemble(l->segment, l->offset, l->bits, &l->ins);
+    } else {
+        assemble_replay(&l->log);
+        len = l->len;
+    }
+
+    /* The following lines were placed with the size of the last pass */
+    if (len != l->size)
+        global_offset_changed++;
+
+    cleanup_insn(&l->ins);
+}
+
+/*
+ * Emit an encoded batch, outside of any macro expansion and straight
+ * to the listing.
+ */
+static void par_replay(struct par_batch *b)
+{
+    const struct lfmt *list = lfmt;
+    struct src_saved save;
+    struct par_event *e;
+    size_t i;
+
+    par->replaying = true;
+    lfmt = par->lfmt;
+    src_revisit(&save);
+
+    for (i = 0, e = b->events; i < b->nevents; i++, e++) {
+        switch (e->type) {
+        case PE_INSN:
+            par_emit(&b->lines[e->n]);
+            break;
+        case PE_LINE:
+            lfmt->line(e->ltype, e->n, e->text);
+            nasm_free(e->text);
+            break;
+        case PE_UPLEVEL:
+            lfmt->uplevel(e->ltype, e->n);
+            break;
+        case PE_DOWNLEVEL:
+            lfmt->downlevel(e->ltype);
+            break;
+        }
+    }
+    b->nevents = b->nlines = 0;
+
+    src_resume(&save);
+    lfmt = list;
+    par->replaying = false;
+}
+
+static void par_submit(struct par_batch *b)
+{
+    par_state_save(&b->state);
+
+    pthread_mutex_lock(&par->lock);
+    b->next = b->done = 0;
+    par->job = b;
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->lock);
+}
+
+/* Wait for the batch being encoded, and emit it */
+static void par_wait(void)
+{
+    struct par_batch *b = par->job;
+
+    pthread_mutex_lock(&par->lock);
+    while (b->done < b->nlines)
+        pthread_cond_wait(&par->idle, &par->lock);
+    par->job = NULL;
+    pthread_mutex_unlock(&par->lock);
+
+    par_replay(b);
+}
+
+void parallel_begin(unsigned int nthreads)
+{
+    unsigned int i;
+    int err;
+
+    /*
+     * The debug formats which follow the preprocessor want to see
+     * the output at the time each line is preprocessed.
+     */
+    if (dfmt->debug_smacros || dfmt->debug_include || dfmt->debug_mmacros)
+        return;
+
+    nasm_new(par);
+    for (i = 0; i < 2; i++)
+        par->batch[i].lines = nasm_zalloc(PAR_BATCH_LINES *
+                                          sizeof *par->batch[i].lines);
+    par->open = &par->batch[0];
+
+    pthread_mutex_init(&par->lock, NULL);
+    pthread_cond_init(&par->work, NULL);
+    pthread_cond_init(&par->idle, NULL);
+
+    par->threads = nasm_malloc(nthreads * sizeof *par->threads);
+    for (i = 0; i < nthreads; i++) {
+        err = pthread_create(&par->threads[i], NULL, par_thread, par);
+        if (err)
+            nasm_fatal("unable to start encoder threads: %s", strerror(err));
+        par->nthreads++;
+    }
+
+    par->lfmt = lfmt;
+    if (list_active())
+        lfmt = &par_list;
+}
+
+void parallel_end(void)
+{
+    unsigned int i;
+    size_t j;
+
+    if (!par)
+        return;
+
+    parallel_flush();
+    lfmt = par->lfmt;
+
+    pthread_mutex_lock(&par->lock);
+    par->stop = true;
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->lock);
+
+    for (i = 0; i < par->nthreads; i++)
+        pthread_join(par->threads[i], NULL);
+
+    match_stats.templates += par->stats.templates;
+    match_stats.matches   += par->stats.matches;
+    match_stats.lookups   += par->stats.lookups;
+    match_stats.hits      += par->stats.hits;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < PAR_BATCH_LINES; j++)
+            out_log_free(&par->batch[i].lines[j].log);
+        nasm_free(par->batch[i].lines);
+        nasm_free(par->batch[i].events);
+    }
+
+    pthread_cond_destroy(&par->idle);
+    pthread_cond_destroy(&par->work);
+    pthread_mutex_destroy(&par->lock);
+    nasm_free(par->threads);
+    nasm_free(par);
+    par = NULL;
+}
+
+/*
+ * Take an instruction of the final pass to encode on the threads, if
+ * it can be: it must be outside of macro expansions, and its size
+ * must be known from the pass before.  The extended operands then
+ * belong to the deferred copy.
+ */
+bool parallel_defer(insn *instruction, int64_t lineno, int bits,
+                    int64_t *sizep)
+{
+    struct par_batch *b;
+    struct par_line *l;
+    int32_t size;
+
+    if (!par)
+        return false;
+
+    if (instruction->times != 1 || instruction->opcode == I_INCBIN ||
+        instruction->opcode == I_EQU || in_absolute || src_macro_current())
+        return false;
+
+    if ((uint64_t)lineno >= line_size_lines || (size = line_size[lineno]) < 0)
+        return false;
+
+    b = par->open;
+    par_event(PE_INSN)->n = b->nlines;
+    l = &b->lines[b->nlines++];
+
+    l->ins = *instruction;
+    l->ins.label = NULL;
+    detach_insn(&l->ins);
+    instruction->eops = NULL;
+
+    l->where   = src_where();
+    l->segment = location.segment;
+    l->offset  = location.offset;
+    l->bits    = bits;
+    l->size    = *sizep = size;
+
+    if (b->nlines == PAR_BATCH_LINES) {
+        /* Encode this batch while collecting the next one */
+        if (par->job)
+            par_wait();
+        par_submit(b);
+        par->open = &par->batch[b == &par->batch[0]];
+    }
+
+    return true;
+}
+
+bool parallel_pending(void)
+{
+    return par && !par->replaying && (par->job || par->open->nevents);
+}
+
+/*
+ * True while deferred lines are being emitted.  They were read when
+ * the preprocessor was emitting, whatever state it is in by now.
+ */
+bool parallel_replaying(void)
+{
+    return par && par->replaying;
+}
+
+/*
+ * Emit everything deferred so far.
+ */
+void parallel_flush(void)
+{
+    struct par_batch *b;
+
+    if (!parallel_pending())
+        return;
+
+    if (par->job)
+        par_wait();
+
+    b = par->open;
+    if (b->nlines) {
+        par_submit(b);
+        par_wait();
+    } else if (b->nevents) {
+        par_replay(b);
+    }
+}
+
+/*
+ * A diagnostic is about to be issued.  On an encoder thread, the
+ * instruction is instead encoded again on the main thread.
+ */
+bool parallel_redo(void)
+{
+    if (!encoding)
+        return false;
+
+    encoding->redo = true;
+    return true;
+}
+
+#else /* !PARALLEL_THREADS */
+
+void parallel_begin(unsigned int nthreads)
+{
+    (void)nthreads;
+
+    nasm_fatalf(ERR_USAGE, "--threads is not supported on this platform");
+}
+
+void parallel_end(void)
+{
+}
+
+bool parallel_defer(insn *instruction, int64_t lineno, int bits,
+                    int64_t *sizep)
+{
+    (void)instruction;
+    (void)lineno;
+    (void)bits;
+    (void)sizep;
+
+    return false;
+}
+
+bool parallel_pending(void)
+{
+    return false;
+}
+
+bool parallel_replaying(void)
+{
+    return false;
+}
+
+void parallel_flush(void)
+{
+}
+
+bool parallel_redo(void)
+{
+    return false;
+}
+
+#endif /* PARALLEL_THREADS */
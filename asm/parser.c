@@ -53,7 +53,110 @@
 
 static int end_expression_next(void);
 
-static struct tokenval tokval;
+static per_thread struct tokenval tokval;
+
+/*
+ * A line whose parse depends on the pass only through the values of
+ * its TIMES count, data items and immediate operands can be brought
+ * up to date on a later pass by running the programs those
+ * expressions were compiled into, instead of being parsed again.
+ */
+enum replay_kind {
+    REPLAY_TIMES,               /* The TIMES count */
+    REPLAY_OPERAND,             /* An immediate operand */
+    REPLAY_DATA                 /* A data item */
+};
+
+struct replay_item {
+    enum replay_kind kind;
+    int opnum;                  /* Operand number */
+    opflags_t type;             /* Operand type before the value was known */
+    extop *eop;                 /* The data item */
+    size_t prog;                /* Offset of the program */
+};
+
+/* Followed by the items, then the programs they run */
+struct replay {
+    size_t nitems;
+};
+
+#define replay_items(r) ((struct replay_item *)((r) + 1))
+#define replay_prog(r, ri) \
+    ((const struct eval_prog *)((char *)(replay_items(r) + (r)->nitems) + \
+                                (ri)->prog))
+
+static per_thread bool recording;           /* Within parse_line_record() */
+static per_thread bool replayable;          /* ... and nothing stands in the way */
+static per_thread size_t pending;           /* Size of program not yet recorded */
+static per_thread struct replay_item *rec_items;
+static per_thread size_t rec_nitems, rec_size;
+static per_thread char *rec_progs;          /* The programs of rec_items */
+static per_thread size_t rec_plen, rec_psize;
+
+/*
+ * Evaluate an expression in the line being parsed. When recording,
+ * the program of an expression which refers to symbols, $ or $$ is
+ * kept until record() is told where its result went; if that does
+ * not happen before the next expression, the line cannot be replayed.
+ */
+static expr *parse_expr(int *fwref, bool critical, struct eval_hints *hints)
+{
+    uint64_t refs = eval_symbol_refs();
+    expr *e;
+
+    if (pending) {
+        pending = 0;
+        replayable = false;
+    }
+
+    e = evaluate(stdscan, NULL, &tokval, fwref, critical, hints);
+    if (fwref && eval_layout_ref())
+        *fwref |= OPFLAG_LAYOUT;
+
+    if (recording && replayable && eval_symbol_refs() != refs) {
+        if (!e) {
+            replayable = false;
+            return e;
+        }
+
+        pending = eval_save(NULL);
+        if (rec_plen + pending > rec_psize) {
+            rec_psize = (rec_plen + pending) << 1;
+            rec_progs = nasm_realloc(rec_progs, rec_psize);
+        }
+        eval_save((struct eval_prog *)(rec_progs + rec_plen));
+    }
+
+    return e;
+}
+
+static void record(enum replay_kind kind, int opnum, opflags_t type,
+                   extop *eop)
+{
+    struct replay_item *ri;
+
+    if (!pending)
+        return;
+
+    if (rec_nitems >= rec_size) {
+        rec_size = rec_size ? rec_size << 1 : 8;
+        rec_items = nasm_realloc(rec_items, rec_size * sizeof *rec_items);
+    }
+
+    ri = &rec_items[rec_nitems++];
+    ri->kind  = kind;
+    ri->opnum = opnum;
+    ri->type  = type;
+    ri->eop   = eop;
+    ri->prog  = rec_plen;
+    rec_plen += pending;
+    pending = 0;
+}
+
+static void record_discard(void)
+{
+    rec_nitems = rec_plen = pending = 0;
+}
 
 static void process_size_override(insn *result, operand *op)
 {
@@ -395,6 +498,54 @@ static int value_to_extop(expr *vect, extop *eop, int32_t myseg)
     return 0;
 }
 
+/*
+ * Fill in an immediate operand from an expression vector. Returns
+ * false if the value is not an immediate at all.
+ */
+static bool imm_operand(operand *op, const expr *value)
+{
+    if (is_just_unknown(value)) {       /* it's immediate but unknown */
+        op->type      |= IMMEDIATE;
+        op->opflags   |= OPFLAG_UNKNOWN;
+        op->offset    = 0;        /* don't care */
+        op->segment   = NO_SEG;   /* don't care again */
+        op->wrt       = NO_SEG;   /* still don't care */
+
+        if(optimizing.level >= 0 && !(op->type & STRICT)) {
+            /* Be optimistic */
+            op->type |=
+                UNITY | SBYTEWORD | SBYTEDWORD | UDWORD | SDWORD;
+        }
+    } else if (is_reloc(value)) {       /* it's immediate */
+        uint64_t n = reloc_value(value);
+
+        op->type      |= IMMEDIATE;
+        op->offset    = n;
+        op->segment   = reloc_seg(value);
+        op->wrt       = reloc_wrt(value);
+        op->opflags   |= is_self_relative(value) ? OPFLAG_RELATIVE : 0;
+
+        if (is_simple(value)) {
+            if (n == 1)
+                op->type |= UNITY;
+            if (optimizing.level >= 0 && !(op->type & STRICT)) {
+                if ((uint32_t) (n + 128) <= 255)
+                    op->type |= SBYTEDWORD;
+                if ((uint16_t) (n + 128) <= 255)
+                    op->type |= SBYTEWORD;
+                if (n <= UINT64_C(0xFFFFFFFF))
+                    op->type |= UDWORD;
+                if (n + UINT64_C(0x80000000) <= UINT64_C(0xFFFFFFFF))
+                    op->type |= SDWORD;
+            }
+        }
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 /*
  * Parse an extended expression, used by db et al. "elem" is the element
  * size; initially comes from the specific opcode (e.g. db == 1) but
@@ -556,8 +707,7 @@ static int parse_eops(extop **result, bool critical, int elem)
             expr *value;
 
         is_expression:
-            value = evaluate(stdscan, NULL, &tokval, NULL,
-                             critical, NULL);
+            value = parse_expr(NULL, critical, NULL);
             i = tokval.t_type;
             if (!value)                  /* Error in evaluator */
                 goto fail;
@@ -570,6 +720,8 @@ static int parse_eops(extop **result, bool critical, int elem)
                     nasm_nonfatal("negative argument supplied to DUP");
                     goto fail;
                 }
+                if (eval_layout_ref())
+                    relax_unmodelled();
                 eop->dup *= (size_t)value->value;
                 do_subexpr = true;
                 continue;
@@ -580,6 +732,8 @@ static int parse_eops(extop **result, bool critical, int elem)
         }
 
         if (eop->dup == 0 || eop->type == EOT_NOTHING) {
+            if (rec_nitems)
+                replayable = false; /* It may have been recorded */
             nasm_free(eop);
         } else if (eop->type == EOT_DB_RESERVE &&
                    prev && prev->type == EOT_DB_RESERVE &&
@@ -589,6 +743,8 @@ static int parse_eops(extop **result, bool critical, int elem)
             nasm_free(eop);
         } else {
             /* Add this eop to the end of the chain */
+            if (eop->type == EOT_DB_NUMBER)
+                record(REPLAY_DATA, 0, 0, eop);
             prev = eop;
             *tail = eop;
             tail = &eop->next;
@@ -624,7 +780,10 @@ fail:
     return -1;
 }
 
-insn *parse_line(char *buffer, insn *result)
+/*
+ * Parse a line; a label on it is defined only if "define" is set.
+ */
+static insn *parse(char *buffer, insn *result, bool define)
 {
     bool insn_is_label = false;
     struct eval_hints hints;
@@ -640,6 +799,8 @@ restart_parse:
     first               = true;
     result->forw_ref    = false;
 
+    record_discard();
+
     stdscan_reset();
     stdscan_set(buffer);
     i = stdscan(NULL, &tokval);
@@ -682,7 +843,7 @@ restart_parse:
             nasm_warn(WARN_LABEL_ORPHAN ,
                        "label alone on a line without a colon might be in error");
         }
-        if (i != TOKEN_INSN || tokval.t_integer != I_EQU) {
+        if (define && (i != TOKEN_INSN || tokval.t_integer != I_EQU)) {
             /*
              * FIXME: location.segment could be NO_SEG, in which case
              * it is possible we should be passing 'absolute.segment'. Look into this.
@@ -711,11 +872,12 @@ restart_parse:
                 expr *value;
 
                 i = stdscan(NULL, &tokval);
-                value = evaluate(stdscan, NULL, &tokval, NULL,
-                                 pass_stable(), NULL);
+                value = parse_expr(NULL, pass_stable(), NULL);
                 i = tokval.t_type;
                 if (!value)                  /* Error in evaluator */
                     goto fail;
+                if (eval_layout_ref())
+                    relax_unmodelled();
                 if (!is_simple(value)) {
                     nasm_nonfatal("non-constant argument supplied to TIMES");
                     result->times = 1;
@@ -724,6 +886,8 @@ restart_parse:
                     if (value->value < 0) {
                         nasm_nonfatalf(ERR_PASS2, "TIMES value %"PRId64" is negative", value->value);
                         result->times = 0;
+                    } else {
+                        record(REPLAY_TIMES, 0, 0, NULL);
                     }
                 }
                 first = false;
@@ -961,9 +1125,9 @@ restart_parse:
             result->opcode != I_JMP && result->opcode != I_CALL)
             nasm_nonfatal("invalid use of FAR operand specifier");
 
-        value = evaluate(stdscan, NULL, &tokval,
-                         &op->opflags, critical, &hints);
+        value = parse_expr(&op->opflags, critical, &hints);
         i = tokval.t_type;
+        op->label = eval_label_ref();
         if (op->opflags & OPFLAG_FORWARD) {
             result->forw_ref = true;
         }
@@ -990,8 +1154,7 @@ restart_parse:
                 process_size_override(result, op);
                 i = stdscan(NULL, &tokval);
             }
-            value = evaluate(stdscan, NULL, &tokval,
-                             &op->opflags, critical, &hints);
+            value = parse_expr(&op->opflags, critical, &hints);
             i = tokval.t_type;
             if (op->opflags & OPFLAG_FORWARD) {
                 result->forw_ref = true;
@@ -1011,8 +1174,7 @@ restart_parse:
                 goto fail;
 
             i = stdscan(NULL, &tokval); /* Eat comma */
-            value = evaluate(stdscan, NULL, &tokval, &op->opflags,
-                             critical, &hints);
+            value = parse_expr(&op->opflags, critical, &hints);
             i = tokval.t_type;
             if (!value)
                 goto fail;
@@ -1105,41 +1267,10 @@ restart_parse:
             }
             mref_set_optype(op);
         } else {                /* it's not a memory reference */
-            if (is_just_unknown(value)) {       /* it's immediate but unknown */
-                op->type      |= IMMEDIATE;
-                op->opflags   |= OPFLAG_UNKNOWN;
-                op->offset    = 0;        /* don't care */
-                op->segment   = NO_SEG;   /* don't care again */
-                op->wrt       = NO_SEG;   /* still don't care */
-
-                if(optimizing.level >= 0 && !(op->type & STRICT)) {
-                    /* Be optimistic */
-                    op->type |=
-                        UNITY | SBYTEWORD | SBYTEDWORD | UDWORD | SDWORD;
-                }
-            } else if (is_reloc(value)) {       /* it's immediate */
-                uint64_t n = reloc_value(value);
-
-                op->type      |= IMMEDIATE;
-                op->offset    = n;
-                op->segment   = reloc_seg(value);
-                op->wrt       = reloc_wrt(value);
-                op->opflags   |= is_self_relative(value) ? OPFLAG_RELATIVE : 0;
-
-                if (is_simple(value)) {
-                    if (n == 1)
-                        op->type |= UNITY;
-                    if (optimizing.level >= 0 && !(op->type & STRICT)) {
-                        if ((uint32_t) (n + 128) <= 255)
-                            op->type |= SBYTEDWORD;
-                        if ((uint16_t) (n + 128) <= 255)
-                            op->type |= SBYTEWORD;
-                        if (n <= UINT64_C(0xFFFFFFFF))
-                            op->type |= UDWORD;
-                        if (n + UINT64_C(0x80000000) <= UINT64_C(0xFFFFFFFF))
-                            op->type |= SDWORD;
-                    }
-                }
+            opflags_t type = op->type;
+
+            if (imm_operand(op, value)) {
+                record(REPLAY_OPERAND, opnum, type, NULL);
             } else if (value->type == EXPR_RDSAE) {
                 /*
                  * it's not an operand but a rounding or SAE decorator.
@@ -1275,6 +1406,131 @@ fail:
     return result;
 }
 
+insn *parse_line(char *buffer, insn *result)
+{
+    return parse(buffer, result, true);
+}
+
+/*
+ * Parse a line as parse_line() does, and also record what it takes to
+ * bring the result up to date on a later pass; replay_save() keeps
+ * the record. Returns false if the parse depends on the pass in some
+ * way that cannot be replayed.
+ */
+bool parse_line_record(char *buffer, insn *result)
+{
+    recording  = true;
+    replayable = true;
+    parse(buffer, result, true);
+    recording  = false;
+
+    return replayable && !pending;
+}
+
+/*
+ * Save what the last parse_line_record() recorded into buf, for
+ * replay_line(), unless buf is NULL. Returns its size in bytes, or 0
+ * if there is nothing to replay; buf must be aligned for an int64_t.
+ */
+size_t replay_save(struct replay *buf)
+{
+    size_t ibytes = rec_nitems * sizeof *rec_items;
+
+    if (!rec_nitems)
+        return 0;
+
+    if (buf) {
+        buf->nitems = rec_nitems;
+        memcpy(replay_items(buf), rec_items, ibytes);
+        memcpy((char *)replay_items(buf) + ibytes, rec_progs, rec_plen);
+    }
+
+    return sizeof *buf + ibytes + rec_plen;
+}
+
+/*
+ * Run the recorded expressions again. Returns false if one of them
+ * would need a diagnostic.
+ */
+static bool replay_exprs(const struct replay *r, insn *result)
+{
+    const bool critical = pass_final() || (result->opcode == I_INCBIN);
+    const struct replay_item *ri;
+    struct eval_hints hints;
+    expr *value;
+
+    result->forw_ref = false;
+
+    for (ri = replay_items(r); ri < replay_items(r) + r->nitems; ri++) {
+        switch (ri->kind) {
+        case REPLAY_TIMES:
+            value = eval_run(replay_prog(r, ri), NULL, pass_stable(), NULL);
+            if (!value || !is_simple(value) || value->value < 0)
+                return false;
+            if (eval_layout_ref())
+                relax_unmodelled();
+            result->times = value->value;
+            break;
+
+        case REPLAY_OPERAND:
+        {
+            operand *op = &result->oprs[ri->opnum];
+
+            op->type    = ri->type;
+            op->opflags = 0;
+            value = eval_run(replay_prog(r, ri), &op->opflags, critical, &hints);
+            op->label = eval_label_ref();
+            if (eval_layout_ref())
+                op->opflags |= OPFLAG_LAYOUT;
+            if (op->opflags & OPFLAG_FORWARD)
+                result->forw_ref = true;
+            if (!value || !imm_operand(op, value))
+                return false;
+            break;
+        }
+
+        case REPLAY_DATA:
+            value = eval_run(replay_prog(r, ri), NULL, critical, NULL);
+            if (!value || value_to_extop(value, ri->eop, location.segment))
+                return false;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Bring an instruction parsed from this line on an earlier pass up to
+ * date: define its label, as parse_line() would, and run the recorded
+ * expressions again. If one of those would need a diagnostic, the line
+ * is parsed afresh instead and false is returned; the result then no
+ * longer refers to the recorded instruction.
+ */
+bool replay_line(const struct replay *replay, char *buffer, insn *result)
+{
+    if (result->label && result->opcode != I_EQU) {
+        define_label(result->label,
+                     in_absolute ? absolute.segment : location.segment,
+                     location.offset, true);
+    }
+
+    if (!replay || replay_exprs(replay, result))
+        return true;
+
+    parse(buffer, result, false);
+    return false;
+}
+
+void replay_cleanup(void)
+{
+    nasm_free(rec_items);
+    rec_items = NULL;
+    nasm_free(rec_progs);
+    rec_progs = NULL;
+    rec_nitems = rec_size = rec_plen = rec_psize = pending = 0;
+}
+
 static int end_expression_next(void)
 {
     struct tokenval tv;
@@ -1316,3 +1572,47 @@ void cleanup_insn(insn * i)
 {
     free_eops(i->eops);
 }
+
+/*
+ * Make the extended operands of an instruction independent of the
+ * scanner, so the instruction can be kept after the next line has
+ * been parsed. The label, if any, is not copied. Returns the amount
+ * of memory held by the extended operands.
+ */
+static size_t detach_eops(extop *e)
+{
+    size_t bytes = 0;
+
+    for (; e; e = e->next) {
+        bytes += sizeof(extop);
+
+        switch (e->type) {
+        case EOT_EXTOP:
+            bytes += detach_eops(e->val.subexpr);
+            break;
+
+        case EOT_DB_STRING:
+        {
+            char *data = nasm_malloc(e->val.string.len + 1);
+            memcpy(data, e->val.string.data, e->val.string.len);
+            e->val.string.data = data;
+            e->type = EOT_DB_STRING_FREE;
+        }
+            /* fall through */
+        case EOT_DB_STRING_FREE:
+        case EOT_DB_FLOAT:
+            bytes += e->val.string.len;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return bytes;
+}
+
+size_t detach_insn(insn *i)
+{
+    return detach_eops(i->eops);
+}
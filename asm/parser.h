@@ -39,7 +39,14 @@
 #ifndef NASM_PARSER_H
 #define NASM_PARSER_H
 
+struct replay;
+
 insn *parse_line(char *buffer, insn *result);
+bool parse_line_record(char *buffer, insn *result);
+size_t replay_save(struct replay *buf);
+bool replay_line(const struct replay *replay, char *buffer, insn *result);
+void replay_cleanup(void);
 void cleanup_insn(insn *instruction);
+size_t detach_insn(insn *instruction);
 
 #endif
@@ -85,7 +85,7 @@ static enum directive_result limit_pragma(const struct pragma *pragma);
  * Adding default-suppressed warnings would, however, be a good idea
  * at some point.
  */
-static struct pragma_facility global_pragmas[] =
+static per_thread struct pragma_facility global_pragmas[] =
 {
     { "asm",		NULL },
     { "limit",          limit_pragma },
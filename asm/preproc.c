@@ -69,20 +69,23 @@
 #include "error.h"
 #include "preproc.h"
 #include "hashtbl.h"
+#include "saa.h"
 #include "quote.h"
 #include "stdscan.h"
 #include "eval.h"
 #include "tokens.h"
 #include "tables.h"
 #include "listing.h"
+#include "ver.h"
 #include "dbginfo.h"
+#include "profile.h"
 
 /*
  * Preprocessor execution options that can be controlled by %pragma or
  * other directives.  This structure is initialized to zero on each
  * pass; this *must* reflect the default initial state.
  */
-static struct pp_config {
+static per_thread struct pp_config {
     bool noaliases;
     bool sane_empty_expansion;
 } ppconf;
@@ -90,7 +93,7 @@ static struct pp_config {
 /*
  * Preprocessor debug-related flags
  */
-static enum pp_debug_flags {
+static per_thread enum pp_debug_flags {
     PDBG_MMACROS      = 1,      /* Collect mmacro information */
     PDBG_SMACROS      = 2,      /* Collect smacro information */
     PDBG_LIST_SMACROS = 4,      /* Smacros to list file (list option 's') */
@@ -100,7 +103,7 @@ static enum pp_debug_flags {
 /*
  * Preprocessor options configured on the command line
  */
-static enum preproc_opt ppopt;
+static per_thread enum preproc_opt ppopt;
 
 typedef struct SMacro SMacro;
 typedef struct MMacro MMacro;
@@ -115,7 +118,7 @@ typedef struct Cond Cond;
  * if they are at the beginning of a line they are a function if and
  * only if they are followed by a (
  */
-static bool pp_op_may_be_function[PP_count];
+static per_thread bool pp_op_may_be_function[PP_count];
 
 /*
  * This is the internal form which we break input lines up into.
@@ -236,6 +239,8 @@ struct SMacro {
     bool varadic;               /* greedy or supports > nparam arguments */
     bool casesense;
     bool alias;                 /* This is an alias macro */
+    bool constant;              /* Expands to a plain copy of expansion */
+    bool frozen;                /* Shared with the stdmac snapshot */
 };
 
 /*
@@ -287,6 +292,7 @@ struct MMacro {
     bool casesense;
     bool plus;                  /* is the last parameter greedy? */
     bool capture_label;         /* macro definition has %00; capture label */
+    bool frozen;                /* Shared with the stdmac snapshot */
     int32_t in_progress;        /* is this macro currently being expanded? */
     int32_t max_depth;          /* maximum number of recursive expansions allowed */
     Token *dlist;               /* All defaults as one list */
@@ -308,6 +314,38 @@ struct MMacro {
         struct debug_macro_def *def; /* Definition */
         struct debug_macro_inv *inv; /* Current invocation (if any) */
     } dbg;
+    struct mmacro_index *index; /* Overload index, on the head of a list */
+    uint32_t seq;               /* Position in the list, for the index */
+};
+
+/*
+ * Index of the overloads of one multi-line macro name, kept on the
+ * head of the list in the mmacros hash once the list is long enough.
+ * Case-insensitive macros form one group, and case-sensitive ones
+ * one group per spelling; each group is sorted by nparam_min.
+ * Positions in the list are counted from the tail, so the head has
+ * the highest sequence number.
+ */
+#define MMACRO_INDEX_MIN 8
+
+struct mmacro_ref {
+    MMacro *m;
+    int nparam_min;
+    int nparam_max;             /* INT_MAX for a greedy macro */
+    int reach;                  /* Highest nparam_max up to this entry */
+    uint32_t seq;
+};
+
+struct mmacro_group {
+    const char *name;           /* NULL for the case-insensitive group */
+    struct mmacro_ref *refs;
+    size_t nrefs, size;
+};
+
+struct mmacro_index {
+    uint32_t seq;               /* Sequence number of the head */
+    size_t ngroups;
+    struct mmacro_group *groups;
 };
 
 
@@ -464,6 +502,7 @@ struct Line {
     Line *next;
     MMacro *finishes;
     Token *first;
+    const Line *copy;               /* %rep body lines still to copy */
     struct src_location where;      /* Where defined */
 };
 
@@ -477,7 +516,8 @@ struct Line {
  */
 struct Include {
     Include *next;
-    FILE *fp;
+    const struct cached_file *file; /* File contents, NULL for stdmac */
+    const char *rdptr, *rdend;  /* Unread portion of the file contents */
     Cond *conds;
     Line *expansion;
     uint64_t nolist;            /* Listing inhibit counter */
@@ -486,6 +526,7 @@ struct Include {
     struct src_location where;  /* Filename and current line number */
     int32_t lineinc;            /* Increment given by %line */
     int32_t lineskip;           /* Accounting for passed continuation lines */
+    int64_t level;              /* Nesting level of the file */
 };
 
 /*
@@ -493,7 +534,7 @@ struct Include {
  * path for every pass (and potentially more than that if a file
  * is used more than once.)
  */
-struct hash_table FileHash;
+per_thread struct hash_table FileHash;
 
 /*
  * Counters to trap on insane macro recursion or processing.
@@ -505,7 +546,7 @@ struct deadman {
     bool triggered;             /* Already triggered, no need for error msg */
 };
 
-static struct deadman smacro_deadman, mmacro_deadman;
+static per_thread struct deadman smacro_deadman, mmacro_deadman;
 
 /*
  * Conditional assembly: we maintain a separate stack of these for
@@ -585,41 +626,41 @@ static int is_condition(enum preproc_token arg)
     return PP_IS_COND(arg) || (arg == PP_ELSE) || (arg == PP_ENDIF);
 }
 
-static int StackSize = 4;
-static const char *StackPointer = "ebp";
-static int ArgOffset = 8;
-static int LocalOffset = 0;
+static per_thread int StackSize = 4;
+static per_thread const char *StackPointer = "ebp";
+static per_thread int ArgOffset = 8;
+static per_thread int LocalOffset = 0;
 
-static Context *cstk;
-static Include *istk;
-static const struct strlist *ipath_list;
+static per_thread Context *cstk;
+static per_thread Include *istk;
+static per_thread const struct strlist *ipath_list;
 
-static struct strlist *deplist;
+static per_thread struct strlist *deplist;
 
-static uint64_t unique;     /* unique identifier numbers */
+static per_thread uint64_t unique;     /* unique identifier numbers */
 
-static Line *predef = NULL;
-static bool do_predef;
-static enum preproc_mode pp_mode;
+static per_thread Line *predef = NULL;
+static per_thread bool do_predef;
+static per_thread enum preproc_mode pp_mode;
 
 /*
  * The current set of multi-line macros we have defined.
  */
-static struct hash_table mmacros;
+static per_thread struct hash_table mmacros;
 
 /*
  * The current set of single-line macros we have defined.
  */
-static struct hash_table smacros;
+static per_thread struct hash_table smacros;
 
 /*
  * The multi-line macro we are currently defining, or the %rep
  * block we are currently reading, if any.
  */
-static MMacro *defining;
+static per_thread MMacro *defining;
 
-static uint64_t nested_mac_count;
-static uint64_t nested_rep_count;
+static per_thread uint64_t nested_mac_count;
+static per_thread uint64_t nested_rep_count;
 
 /*
  * The number of macro parameters to allocate space for at a time.
@@ -631,21 +672,90 @@ static uint64_t nested_rep_count;
  * This gives our position in any macro set, while we are processing it.
  * The stdmacset is an array of such macro sets.
  */
-static macros_t *stdmacpos;
-static macros_t **stdmacnext;
-static macros_t *stdmacros[8];
-static macros_t *extrastdmac;
+static per_thread macros_t *stdmacpos;
+static per_thread macros_t **stdmacnext;
+static per_thread macros_t *stdmacros[8];
+static per_thread macros_t *extrastdmac;
+
+/*
+ * Snapshot of the macros defined by the standard macro packages.  The
+ * first pass freezes the macro tables as they are after reading the
+ * packages; later passes start out with a copy of the frozen tables
+ * instead of reading the packages again.  The frozen macros are shared
+ * between the snapshot and the live tables, so they must be copied
+ * before they are changed; see unfreeze_smacros() and unfreeze_mmacros().
+ */
+static per_thread struct stdmac_snapshot {
+    bool tried;                 /* Freezing has been attempted */
+    bool valid;                 /* The snapshot is usable */
+    struct hash_table smacros;
+    struct hash_table mmacros;
+    struct pp_config ppconf;
+    uint64_t unique;
+    int StackSize, ArgOffset, LocalOffset;
+    const char *StackPointer;
+    char *keys;                 /* Storage for all the hash keys */
+    size_t keylen;
+} stdmac_snap;
+
+/*
+ * Precompiled macro header given with --pch.  If it is up to date it
+ * is loaded in place of the standard macro packages and predef;
+ * otherwise its source is pre-included like a -P file.
+ */
+static per_thread struct pch_state {
+    const char *name;           /* File name, NULL if none */
+    bool checked;               /* The file has been read and checked */
+    bool valid;                 /* The file is up to date */
+    bool loaded;                /* The file was loaded in this pass */
+    const char *stale;          /* Why the file is out of date */
+    const char *stale_file;     /* The changed file, if that is why */
+    const char *source;         /* Header source file */
+    const char *data;           /* Contents of the file */
+    size_t size;
+    bool mapped;                /* data is mapped rather than allocated */
+    const char *deps;           /* Start of the dependency list */
+    uint32_t ndeps;
+    const char *body;           /* Start of the macro state */
+    size_t bodylen;
+} pch;
 
 /*
  * Map of which %use packages have been loaded
  */
-static bool *use_loaded;
+static per_thread bool *use_loaded;
+
+/*
+ * Line replay cache (PP_REPLAY). The first pass records every line
+ * we emit together with its source location, and the optimization
+ * passes after it play the recording back instead of running the
+ * preprocessor again. Anything which could make the output differ
+ * from one pass to the next invalidates the recording.
+ */
+static per_thread enum pp_replay_state {
+    REPLAY_OFF,                 /* Preprocessing normally */
+    REPLAY_RECORD,              /* Preprocessing and recording the output */
+    REPLAY_PLAY                 /* Playing back the recorded output */
+} replay_state;
+static per_thread struct SAA *replay_lines; /* Recorded lines, NULL if none valid */
+static per_thread const SMacro *pass_smacro; /* The __?PASS?__ macro */
+static per_thread bool in_getline;          /* Inside pp_getline() */
+
+struct replay_line {
+    struct src_location where;
+    size_t len;                 /* Followed by len bytes of text */
+};
 
 /*
  * Forward declarations.
  */
 static void pp_add_stdmac(macros_t *macros);
+static bool stdmac_freeze(void);
+static void define_pass_smacro(enum preproc_mode mode);
+static bool pch_volatile(const Line *l);
+static void pp_replay_invalidate(void);
 static Token *expand_mmac_params(Token * tline);
+static void mmacro_index_add(struct mmacro_index *idx, MMacro *m);
 static Token *expand_smacro(Token * tline);
 static Token *expand_id(Token * tline);
 static Context *get_ctx(const char *name, const char **namep);
@@ -661,6 +771,7 @@ static Token *new_Token_free(Token * next, enum token_type type,
 static Token *dup_Token(Token *next, const Token *src);
 static Token *new_White(Token *next);
 static Token *delete_Token(Token *t);
+static void free_tlist(Token *list);
 static Token *steal_Token(Token *dst, Token *src);
 static const struct use_package *
 get_use_pkg(Token *t, const char *dname, const char **name);
@@ -863,15 +974,6 @@ static const char *pp_getenv(const Token *t, bool warn)
     return v;
 }
 
-/*
- * Free a linked list of tokens.
- */
-static void free_tlist(Token * list)
-{
-    while (list)
-        list = delete_Token(list);
-}
-
 /*
  * Free a linked list of lines.
  */
@@ -980,8 +1082,24 @@ static Token **steal_tlist(Token *tlist, Token **tailp)
 /*
  * Free an MMacro
  */
+static void free_mmacro_index(MMacro *m)
+{
+    struct mmacro_index *idx = m->index;
+    size_t i;
+
+    if (!idx)
+        return;
+
+    for (i = 0; i < idx->ngroups; i++)
+        nasm_free(idx->groups[i].refs);
+    nasm_free(idx->groups);
+    nasm_free(idx);
+    m->index = NULL;
+}
+
 static void free_mmacro(MMacro * m)
 {
+    free_mmacro_index(m);
     nasm_free(m->name);
     free_tlist(m->dlist);
     nasm_free(m->defaults);
@@ -1024,6 +1142,31 @@ static void free_smacro(SMacro *s)
     nasm_free(s);
 }
 
+/*
+ * Is this hash key part of the stdmac snapshot?
+ */
+static inline bool frozen_key(const void *key)
+{
+    const char *k = key;
+    return k >= stdmac_snap.keys && k < stdmac_snap.keys + stdmac_snap.keylen;
+}
+
+/*
+ * Free a macro hash table and its keys, except for keys belonging to
+ * the stdmac snapshot.
+ */
+static void free_macro_table_keys(struct hash_table *ht)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+
+    hash_for_each(ht, it, np) {
+        if (!frozen_key(np->key))
+            nasm_free((void *)np->key);
+    }
+    hash_free(ht);
+}
+
 /*
  * Free all currently defined macros, and free the hash tables if empty
  */
@@ -1053,7 +1196,8 @@ static void clear_smacro_table(struct hash_table *smt, enum clear_what what)
         list_for_each_safe(s, tmp, s) {
             if (what & ((enum clear_what)s->alias + 1)) {
                 *head = s->next;
-                free_smacro(s);
+                if (!s->frozen)
+                    free_smacro(s);
             } else {
                 empty = false;
             }
@@ -1066,7 +1210,7 @@ static void clear_smacro_table(struct hash_table *smt, enum clear_what what)
      * mucks up the hash algorithm.
      */
     if (empty)
-        hash_free_all(smt, true);
+        free_macro_table_keys(smt);
 }
 
 static void free_smacro_table(struct hash_table *smt)
@@ -1082,11 +1226,13 @@ static void free_mmacro_table(struct hash_table *mmt)
     hash_for_each(mmt, it, np) {
         MMacro *tmp;
         MMacro *m = np->data;
-        nasm_free((void *)np->key);
-        list_for_each_safe(m, tmp, m)
+        list_for_each_safe(m, tmp, m) {
+            if (m->frozen)
+                break;          /* The rest of the list is frozen too */
             free_mmacro(m);
+        }
     }
-    hash_free(mmt);
+    free_macro_table_keys(mmt);
 }
 
 static void free_macros(void)
@@ -1095,6 +1241,136 @@ static void free_macros(void)
     free_mmacro_table(&mmacros);
 }
 
+/*
+ * Make a private copy of a frozen SMacro
+ */
+static SMacro *dup_smacro(const SMacro *s)
+{
+    SMacro *n = nasm_malloc(sizeof *n);
+
+    *n = *s;
+    n->frozen    = false;
+    n->name      = nasm_strdup(s->name);
+    n->expansion = dup_tlist(s->expansion, NULL);
+    if (s->params) {
+        int i;
+
+        nasm_newn(n->params, s->nparam);
+        for (i = 0; i < s->nparam; i++) {
+            struct smac_param *p = &n->params[i];
+
+            *p = s->params[i];
+            if (p->name.len > INLINE_TEXT) {
+                p->name.text.p.ptr = nasm_malloc(p->name.len + 1);
+                memcpy(p->name.text.p.ptr, s->params[i].name.text.p.ptr,
+                       p->name.len + 1);
+            }
+            if (p->def)
+                p->def = dup_tlist(p->def, NULL);
+        }
+    }
+    return n;
+}
+
+/*
+ * Make a private copy of a frozen MMacro.  The copy is not being
+ * expanded, whatever the state of the original.
+ */
+static MMacro *dup_mmacro(const MMacro *m)
+{
+    MMacro *n;
+    const Line *l;
+    Line **tail;
+
+    nasm_new(n);
+    n->name          = nasm_strdup(m->name);
+    n->nparam_min    = m->nparam_min;
+    n->nparam_max    = m->nparam_max;
+    n->nolist        = m->nolist;
+    n->casesense     = m->casesense;
+    n->plus          = m->plus;
+    n->capture_label = m->capture_label;
+    n->max_depth     = m->max_depth;
+    n->dlist         = dup_tlist(m->dlist, NULL);
+    n->ndefs         = m->ndefs;
+    n->dstk          = m->dstk;
+    n->where         = m->where;
+    if (m->dstk.mmac == m)
+        n->dstk.mmac = n;
+
+    if (m->defaults) {
+        /* Point the defaults at the same positions in the new dlist */
+        int i;
+
+        nasm_newn(n->defaults, m->ndefs + 2);
+        for (i = 0; i < m->ndefs + 2; i++) {
+            const Token *t;
+            Token *nt;
+
+            if (!m->defaults[i])
+                continue;
+            for (t = m->dlist, nt = n->dlist; t; t = t->next, nt = nt->next) {
+                if (t == m->defaults[i]) {
+                    n->defaults[i] = nt;
+                    break;
+                }
+            }
+        }
+    }
+
+    tail = &n->expansion;
+    list_for_each(l, m->expansion) {
+        Line *nl;
+
+        nasm_new(nl);
+        nl->first = dup_tlist(l->first, NULL);
+        nl->where = l->where;
+        *tail = nl;
+        tail = &nl->next;
+    }
+
+    return n;
+}
+
+/*
+ * Replace the frozen SMacros in a list with private copies, so that
+ * the list can be changed.  Returns the copy of which, if any.
+ */
+static SMacro *unfreeze_smacros(SMacro **sp, const SMacro *which)
+{
+    SMacro *s, *copy = NULL;
+
+    while ((s = *sp)) {
+        if (s->frozen) {
+            *sp = dup_smacro(s);
+            if (s == which)
+                copy = *sp;
+        }
+        sp = &(*sp)->next;
+    }
+    return copy;
+}
+
+/*
+ * Replace the frozen MMacros in a list with private copies.  The
+ * frozen ones are always at the tail of the list.
+ */
+static void unfreeze_mmacros(MMacro **mp)
+{
+    MMacro *m;
+
+    while ((m = *mp) && !m->frozen)
+        mp = &m->next;
+
+    while ((m = *mp)) {
+        MMacro *n = dup_mmacro(m);
+
+        n->next = m->next;
+        *mp = n;
+        mp = &n->next;
+    }
+}
+
 /*
  * Initialize the hash tables
  */
@@ -1150,6 +1426,22 @@ hash_findix(struct hash_table *hash, const char *str)
     return p ? *p : NULL;
 }
 
+/*
+ * Buffer the current source line is assembled in; it is handed out
+ * by read_line() and is only valid until the next call.
+ */
+static per_thread char *srcline;
+static per_thread size_t srcline_size;
+
+static inline char *srcline_room(size_t len)
+{
+    if (unlikely(len > srcline_size)) {
+        srcline_size = (len + 1024) & ~(size_t)511;
+        srcline = nasm_realloc(srcline, srcline_size);
+    }
+    return srcline;
+}
+
 /*
  * read line from standard macros set,
  * if there no more left -- return NULL
@@ -1176,7 +1468,7 @@ static char *line_from_stdmac(void)
             len++;
     }
 
-    line = nasm_malloc(len + 1);
+    line = srcline_room(len + 1);
     q = line;
 
     while ((c = *stdmacpos++) != 127) {
@@ -1195,108 +1487,190 @@ static char *line_from_stdmac(void)
     if (*stdmacpos == 127) {
         /* This was the last of this particular macro set */
         stdmacpos = NULL;
-        if (*stdmacnext) {
+        if (*stdmacnext)
             stdmacpos = *stdmacnext++;
-        } else if (do_predef) {
-            Line *pd, *l;
+    }
 
-            /*
-             * Nasty hack: here we push the contents of
-             * `predef' on to the top-level expansion stack,
-             * since this is the most convenient way to
-             * implement the pre-include and pre-define
-             * features.
-             */
-            list_for_each(pd, predef) {
-                nasm_new(l);
-                l->next     = istk->expansion;
-                l->first    = dup_tlist(pd->first, NULL);
-                l->finishes = NULL;
+    return line;
+}
 
-                istk->expansion = l;
-            }
-            do_predef = false;
+/*
+ * Called when all the standard macro sets have been read.
+ */
+static void pp_stdmac_end(void)
+{
+    Line *pd, *l;
+
+    if (!stdmac_snap.tried && pp_mode == PP_NORMAL && stdmac_freeze())
+        define_pass_smacro(pp_mode);
+
+    if (pch.name && !pch.loaded) {
+        /* Include the source of the precompiled header after predef */
+        Token *inc, *name;
+
+        name = new_Token(NULL, TOKEN_INTERNAL_STR, pch.source, 0);
+        inc  = new_Token(new_White(name), TOKEN_PREPROC_ID, "%include", 0);
+
+        nasm_new(l);
+        l->next     = istk->expansion;
+        l->first    = inc;
+        l->finishes = NULL;
+
+        istk->expansion = l;
+    }
+
+    /*
+     * Nasty hack: here we push the contents of `predef' on to the
+     * top-level expansion stack, since this is the most convenient
+     * way to implement the pre-include and pre-define features.
+     * A precompiled header already contains predef, except for the
+     * definitions which change from one run to the next.
+     */
+    list_for_each(pd, predef) {
+        if (pch.loaded && !pch_volatile(pd))
+            continue;
+
+        nasm_new(l);
+        l->next     = istk->expansion;
+        l->first    = dup_tlist(pd->first, NULL);
+        l->finishes = NULL;
+
+        istk->expansion = l;
+    }
+    do_predef = false;
+}
+
+/*
+ * Set up reading the contents of the file of an include level.  The
+ * contents come from the file cache, and stay there after the file
+ * has been closed.
+ */
+static void src_open(Include *inc, const struct cached_file *file)
+{
+    inc->file  = file;
+    inc->rdptr = file->data;
+    inc->rdend = file->data + file->len;
+}
+
+static void src_close(Include *inc)
+{
+    inc->file  = NULL;
+    inc->rdptr = inc->rdend = NULL;
+}
+
+/*
+ * Find the first character in [p, end) which is of interest when
+ * splitting a file into lines: \0, ^Z, \n, \r or a backslash.
+ * Plain text is skipped a machine word at a time.
+ */
+static const char *src_find_special(const char *p, const char *end)
+{
+#define SRC_BYTES(x) ((uint64_t)(x) * UINT64_C(0x0101010101010101))
+#define SRC_HASZERO(v) \
+    (((v) - SRC_BYTES(0x01)) & ~(v) & SRC_BYTES(0x80))
+
+    while (end - p >= 8) {
+        uint64_t v, hit;
+
+        memcpy(&v, p, 8);
+        hit = SRC_HASZERO(v) |
+            SRC_HASZERO(v ^ SRC_BYTES('\n')) |
+            SRC_HASZERO(v ^ SRC_BYTES('\r')) |
+            SRC_HASZERO(v ^ SRC_BYTES('\\')) |
+            SRC_HASZERO(v ^ SRC_BYTES(032));
+        if (hit)
+            break;
+        p += 8;
+    }
+
+#undef SRC_HASZERO
+#undef SRC_BYTES
+
+    while (p < end) {
+        switch (*p) {
+        case '\0':
+        case 032:
+        case '\n':
+        case '\r':
+        case '\\':
+            return p;
+        default:
+            p++;
+            break;
         }
     }
 
-    return line;
+    return end;
 }
 
 /*
  * Read a line from a file. Return NULL on end of file.
  */
-static char *line_from_file(FILE *f)
+static char *line_from_file(Include *inc)
 {
-    int c;
-    unsigned int size, next;
-    const unsigned int delta = 512;
-    const unsigned int pad = 8;
+    size_t len = 0;
     bool cont = false;
-    char *buffer, *p;
-
-    istk->where.lineno += istk->lineskip + istk->lineinc;
-    src_set_linnum(istk->where.lineno);
-    istk->lineskip = 0;
+    int c, next = EOF;
 
-    size = delta;
-    p = buffer = nasm_malloc(size);
+    inc->where.lineno += inc->lineskip + inc->lineinc;
+    src_set_linnum(inc->where.lineno);
+    inc->lineskip = 0;
 
-    do {
-        c = fgetc(f);
+    for (;;) {
+        const char *p = inc->rdptr;
+        const char *q;
 
-        switch (c) {
-        case EOF:
-            if (p == buffer) {
-                nasm_free(buffer);
+        if (p >= inc->rdend) {
+            if (!len)
                 return NULL;
-            }
-            c = 0;
             break;
+        }
 
-        case '\r':
-            next = fgetc(f);
-            if (next != '\n')
-                ungetc(next, f);
-            if (cont) {
-                cont = false;
-                continue;
-            }
-            c = 0;
-            break;
+        q = src_find_special(p, inc->rdend);
+        if (q > p) {
+            memcpy(srcline_room(len + (q - p) + 1) + len, p, q - p);
+            len += q - p;
+            inc->rdptr = q;
+            continue;
+        }
 
+        c = (unsigned char)*p++;
+        inc->rdptr = p;
+
+        if (c == '\r' || c == '\\')
+            next = p < inc->rdend ? (unsigned char)*p : EOF;
+
+        switch (c) {
+        case '\r':
+            if (next == '\n')
+                inc->rdptr++;
+            /* fall through */
         case '\n':
             if (cont) {
                 cont = false;
                 continue;
             }
-            c = 0;
-            break;
-
-        case 032:               /* ^Z = legacy MS-DOS end of file mark */
-            c = 0;
             break;
 
         case '\\':
-            next = fgetc(f);
-            ungetc(next, f);
             if (next == '\r' || next == '\n') {
                 cont = true;
-                istk->lineskip += istk->lineinc;
-                continue;
+                inc->lineskip += inc->lineinc;
+            } else {
+                srcline_room(len + 2)[len] = '\\';
+                len++;
             }
-            break;
-        }
+            continue;
 
-        if (p >= (buffer + size - pad)) {
-            buffer = nasm_realloc(buffer, size + delta);
-            p = buffer + size - pad;
-            size += delta;
+        default:                /* \0 or ^Z = legacy MS-DOS end of file mark */
+            break;
         }
 
-        *p++ = c;
-    } while (c);
+        break;
+    }
 
-    return buffer;
+    srcline_room(len + 1)[len] = '\0';
+    return srcline;
 }
 
 /*
@@ -1304,14 +1678,16 @@ static char *line_from_file(FILE *f)
  */
 static char *read_line(void)
 {
+    enum profile_step step = profile_enter(STEP_READ_LINE);
     char *line;
-    FILE *f = istk->fp;
 
-    if (f)
-        line = line_from_file(f);
+    if (istk->file)
+        line = line_from_file(istk);
     else
         line = line_from_stdmac();
 
+    profile_leave(step);
+
     if (!line)
         return NULL;
 
@@ -1758,22 +2134,32 @@ static Token *tokenize(const char *line)
  * Tokens are allocated in blocks to improve speed. Set the blocksize
  * to 0 to use regular nasm_malloc(); this is useful for debugging.
  *
+ * New tokens are carved off the newest block, and freed tokens go on
+ * a free list which is used first, so a block is only touched as it
+ * is used.  free_tlist() returns a whole list to the free list at once.
+ *
  * alloc_Token() returns a zero-initialized token structure.
  */
 #define TOKEN_BLOCKSIZE 4096
 
 #if TOKEN_BLOCKSIZE
 
-static Token *freeTokens  = NULL;
-static Token *tokenblocks = NULL;
+static per_thread Token *freeTokens  = NULL;
+static per_thread Token *tokenblocks = NULL;
+static per_thread Token *tokenbump, *tokenbumpend; /* Unused part of newest block */
 
 static Token *alloc_Token(void)
 {
     Token *t = freeTokens;
 
-    if (unlikely(!t)) {
+    if (likely(t)) {
+        freeTokens = t->next;
+        t->next = NULL;
+        return t;
+    }
+
+    if (unlikely(tokenbump == tokenbumpend)) {
         Token *block;
-        size_t i;
 
         nasm_newn(block, TOKEN_BLOCKSIZE);
 
@@ -1785,40 +2171,64 @@ static Token *alloc_Token(void)
 	block[0].type = TOKEN_BLOCK;
         tokenblocks = block;
 
-        /*
-         * Add the rest to the free list
-         */
-        for (i = 2; i < TOKEN_BLOCKSIZE - 1; i++)
-            block[i].next = &block[i+1];
+        tokenbump    = &block[1];
+        tokenbumpend = &block[TOKEN_BLOCKSIZE];
+    }
 
-        freeTokens = &block[2];
+    return tokenbump++;
+}
 
-        /*
-         * Return the topmost usable token
-         */
-        return &block[1];
-    }
+/*
+ * Release the contents of a token, leaving it on no list.
+ */
+static inline void clear_Token(Token *t)
+{
+    nasm_assert(t->type != TOKEN_FREE);
 
-    freeTokens = t->next;
-    t->next = NULL;
-    return t;
+    if (t->len > INLINE_TEXT)
+        nasm_free(t->text.p.ptr);
+
+    nasm_zero(*t);
+    t->type = TOKEN_FREE;
 }
 
 static Token *delete_Token(Token *t)
 {
     Token *next;
 
-    nasm_assert(t && t->type != TOKEN_FREE);
+    nasm_assert(t);
 
     next = t->next;
-    nasm_zero(*t);
-    t->type = TOKEN_FREE;
+    clear_Token(t);
     t->next = freeTokens;
     freeTokens = t;
 
     return next;
 }
 
+/*
+ * Free a linked list of tokens, splicing it onto the free list
+ * as a whole.
+ */
+static void free_tlist(Token *list)
+{
+    Token *t, *next;
+
+    if (!list)
+        return;
+
+    for (t = list; ; t = next) {
+        next = t->next;
+        clear_Token(t);
+        if (!next)
+            break;
+        t->next = next;
+    }
+
+    t->next = freeTokens;
+    freeTokens = list;
+}
+
 static void delete_Blocks(void)
 {
     Token *block, *blocktmp;
@@ -1827,6 +2237,7 @@ static void delete_Blocks(void)
         nasm_free(block);
 
     freeTokens = tokenblocks = NULL;
+    tokenbump = tokenbumpend = NULL;
 }
 
 #else
@@ -1841,10 +2252,19 @@ static inline Token *alloc_Token(void)
 static Token *delete_Token(Token *t)
 {
     Token *next = t->next;
+
+    if (t->len > INLINE_TEXT)
+        nasm_free(t->text.p.ptr);
     nasm_free(t);
     return next;
 }
 
+static void free_tlist(Token *list)
+{
+    while (list)
+        list = delete_Token(list);
+}
+
 static inline void delete_Blocks(void)
 {
     /* Nothing to do */
@@ -2047,45 +2467,189 @@ static char *detoken(Token * tlist, bool expand_locals)
 }
 
 /*
- * A scanner, suitable for use by the expression evaluator, which
- * operates on a line of Tokens. Expects a pointer to a pointer to
- * the first token in the line to be passed in as its private_data
- * field.
- *
- * FIX: This really needs to be unified with stdscan.
+ * Classify the tokens of a line emitted to the assembler the way
+ * stdscan() would, and hand them to the scanner, so the parser does
+ * not need to lex the text produced by detoken() all over again.
+ * Only identifiers, numbers and a few punctuation characters are
+ * classified, and only if their extent in the text cannot depend on
+ * what follows them; stdscan() scans anything else from the text.
  */
-struct ppscan {
-    Token *tptr;
-    int ntokens;
-};
+static per_thread struct stdscan_token *scan_toks;
+static per_thread size_t scan_toks_size;
+static per_thread char *scan_text;
+static per_thread size_t scan_text_size;
 
-static int ppscan(void *private_data, struct tokenval *tokval)
+static void prescan_line(const Token *tlist, const char *line)
 {
-    struct ppscan *pps = private_data;
-    Token *tline;
-    const char *txt;
-
-    do {
-	if (pps->ntokens && (tline = pps->tptr)) {
-	    pps->ntokens--;
-	    pps->tptr = tline->next;
-	} else {
-	    pps->tptr = NULL;
-	    pps->ntokens = 0;
-	    return tokval->t_type = TOKEN_EOS;
-	}
-    } while (tline->type == TOKEN_WHITESPACE);
+    const Token *t;
+    struct stdscan_token *st;
+    size_t ntoks, textlen, pos;
+    char *tp;
+
+    ntoks = textlen = 0;
+    list_for_each(t, tlist) {
+        ntoks++;
+        textlen += t->len + 1;
+    }
+
+    if (ntoks > scan_toks_size) {
+        scan_toks_size = ntoks + (ntoks >> 1);
+        nasm_free(scan_toks);
+        nasm_newn(scan_toks, scan_toks_size);
+    }
+    if (textlen > scan_text_size) {
+        scan_text_size = textlen + (textlen >> 1);
+        nasm_free(scan_text);
+        scan_text = nasm_malloc(scan_text_size);
+    }
+
+    st = scan_toks;
+    tp = scan_text;
+    pos = 0;
+
+    list_for_each(t, tlist) {
+        const char *txt = tok_text(t);
+        size_t len = t->len;
+        size_t start = pos;
+        char next;
+
+        if (t->type == TOKEN_INDIRECT) {
+            pos += len + 3;     /* %[...] */
+            continue;
+        }
+
+        pos += len;
+        next = line[pos];
+
+        switch (t->type) {
+        case TOKEN_ID:
+        {
+            const char *id = txt;
+            bool is_sym = (*id == '$');
+            size_t i, idlen;
+
+            if (is_sym) {
+                id++;
+                len--;
+            }
+            if (!len || !nasm_isidstart(*id) || nasm_isidchar(next))
+                continue;
+            for (i = 1; i < len; i++) {
+                if (!nasm_isidchar(id[i]))
+                    break;
+            }
+            if (i < len)
+                continue;
+
+            nasm_zero(st->tv);
+            idlen = len < IDLEN_MAX ? len : IDLEN_MAX - 1;
+            st->tv.t_charptr = memcpy(tp, id, idlen);
+            tp[idlen] = '\0';
+            tp += idlen + 1;
+
+            if (is_sym || len > MAX_KEYWORD) {
+                st->tv.t_type = TOKEN_ID;
+            } else {
+                nasm_token_hash(st->tv.t_charptr, &st->tv);
+                if (st->tv.t_flag & TFLAG_BRC)
+                    st->tv.t_type = TOKEN_ID;
+            }
+            if (st->tv.t_type == TOKEN_ID) {
+                st->tv.t_atom = atom_intern(id, idlen);
+                st->tv.t_charptr = (char *)atom_str(st->tv.t_atom);
+            }
+            break;
+        }
+
+        case TOKEN_NUM:
+        {
+            size_t i;
+            char last = txt[len-1];
+
+            if (!nasm_isdigit(*txt) || nasm_isidchar(next) || next == '.')
+                continue;
+            if ((next == '+' || next == '-') &&
+                (last == 'e' || last == 'E' || last == 'p' || last == 'P'))
+                continue;
+            for (i = 1; i < len; i++) {
+                if (!nasm_isnumchar(txt[i]))
+                    break;
+            }
+            if (i < len)
+                continue;
+
+            /* Converted by stdscan(), as readnum() may issue warnings */
+            nasm_zero(st->tv);
+            st->tv.t_type = TOKEN_NUM;
+            st->tv.t_charptr = memcpy(tp, txt, len);
+            tp[len] = '\0';
+            tp += len + 1;
+            break;
+        }
+
+        default:
+            if (len != 1 || !strchr(",:[]()+-*~", *txt))
+                continue;
+
+            nasm_zero(st->tv);
+            st->tv.t_type = (unsigned char)*txt;
+            break;
+        }
+
+        st->start = start;
+        st->end   = pos;
+        st++;
+    }
+
+    stdscan_bind(line, scan_toks, st - scan_toks);
+}
+
+/*
+ * A scanner, suitable for use by the expression evaluator, which
+ * operates on a line of Tokens. Expects a pointer to a pointer to
+ * the first token in the line to be passed in as its private_data
+ * field.
+ *
+ * FIX: This really needs to be unified with stdscan.
+ */
+struct ppscan {
+    Token *tptr;
+    int ntokens;
+};
+
+static int ppscan(void *private_data, struct tokenval *tokval)
+{
+    struct ppscan *pps = private_data;
+    Token *tline;
+    const char *txt;
+
+    do {
+	if (pps->ntokens && (tline = pps->tptr)) {
+	    pps->ntokens--;
+	    pps->tptr = tline->next;
+	} else {
+	    pps->tptr = NULL;
+	    pps->ntokens = 0;
+	    return tokval->t_type = TOKEN_EOS;
+	}
+    } while (tline->type == TOKEN_WHITESPACE);
 
     txt = tok_text(tline);
     tokval->t_charptr = (char *)txt; /* Fix this */
+    tokval->t_atom = NO_ATOM;
 
     switch (tline->type) {
     default:
+        if (tline->type == TOKEN_HERE || tline->type == TOKEN_BASE)
+            pp_replay_invalidate();
         return tokval->t_type = tline->type;
 
     case TOKEN_ID:
         /* This could be an assembler keyword */
-	return nasm_token_hash(txt, tokval);
+	nasm_token_hash(txt, tokval);
+        if (tokval->t_type == TOKEN_ID || tokval->t_type == TOKEN_INSN)
+            pp_replay_invalidate(); /* Symbol values can change per pass */
+	return tokval->t_type;
 
     case TOKEN_NUM:
     {
@@ -2250,35 +2814,21 @@ enum incopen_mode {
 };
 
 /* This is conducts a full pathname search */
-static FILE *inc_fopen_search(const char *file, char **slpath,
-                              enum incopen_mode omode, enum file_flags fmode)
+static char *inc_fopen_search(const char *file)
 {
     const struct strlist_entry *ip = strlist_head(ipath_list);
-    FILE *fp;
     const char *prefix = "";
     char *sp;
-    bool found;
 
     while (1) {
         sp = nasm_catfile(prefix, file);
-        if (omode == INC_PROBE) {
-            fp = NULL;
-            found = nasm_file_exists(sp);
-        } else {
-            fp = nasm_open_read(sp, fmode);
-            found = (fp != NULL);
-        }
-        if (found) {
-            *slpath = sp;
-            return fp;
-        }
+        if (nasm_file_exists(sp))
+            return sp;
 
         nasm_free(sp);
 
-        if (!ip) {
-            *slpath = NULL;
+        if (!ip)
             return NULL;
-        }
 
         prefix = ip->str;
         ip = ip->next;
@@ -2287,7 +2837,10 @@ static FILE *inc_fopen_search(const char *file, char **slpath,
 
 /*
  * Open a file, or test for the presence of one (depending on omode),
- * considering the include path.
+ * considering the include path.  The contents are read through the
+ * file cache, under the canonical path of the file, so each file is
+ * read only once however it is named and however many passes there
+ * are.
  */
 struct file_hash_entry {
     const char *path;
@@ -2295,17 +2848,16 @@ struct file_hash_entry {
     int64_t include_pass; /* Pass in which last included (for %require) */
 };
 
-static FILE *inc_fopen(const char *file,
-                       struct strlist *dhead,
-                       const char **found_path,
-                       enum incopen_mode omode,
-                       enum file_flags fmode)
+static const struct cached_file *inc_fopen(const char *file,
+                                           struct strlist *dhead,
+                                           const char **found_path,
+                                           enum incopen_mode omode)
 {
     struct file_hash_entry **fhep;
     struct file_hash_entry *fhe = NULL;
     struct hash_insert hi;
     const char *path = NULL;
-    FILE *fp = NULL;
+    const struct cached_file *cf = NULL;
     const int64_t pass = pass_count();
     bool skip_open = (omode == INC_PROBE);
 
@@ -2319,9 +2871,7 @@ static FILE *inc_fopen(const char *file,
         }
     } else {
         /* Need to do the actual path search */
-        char *pptr;
-        fp = inc_fopen_search(file, &pptr, omode, fmode);
-        path = pptr;
+        path = inc_fopen_search(file);
 
         /* Positive or negative result */
         if (path) {
@@ -2367,10 +2917,10 @@ static FILE *inc_fopen(const char *file,
         strlist_add(dhead, path ? path : file);
     }
 
-    if (path && !fp && omode != INC_PROBE)
-        fp = nasm_open_read(path, fmode);
+    if (path && !skip_open)
+        cf = nasm_cached_file(fhe->full->path);
 
-    if (omode < INC_OPTIONAL && !fp) {
+    if (omode < INC_OPTIONAL && !cf && !skip_open) {
         if (!path)
             errno = ENOENT;
 
@@ -2378,13 +2928,13 @@ static FILE *inc_fopen(const char *file,
                       file, strerror(errno));
     }
 
-    if (fp)
+    if (cf)
         fhe->full->include_pass = pass;
 
     if (found_path)
         *found_path = path;
 
-    return fp;
+    return cf;
 }
 
 /*
@@ -2394,7 +2944,10 @@ static FILE *inc_fopen(const char *file,
  */
 FILE *pp_input_fopen(const char *filename, enum file_flags mode)
 {
-    return inc_fopen(filename, NULL, NULL, INC_OPTIONAL, mode);
+    const char *path;
+
+    inc_fopen(filename, NULL, &path, INC_PROBE);
+    return path ? nasm_open_read(path, mode) : NULL;
 }
 
 /*
@@ -3095,6 +3648,39 @@ finish:
     return nparam;
 }
 
+/*
+ * A parameterless macro using the default expansion routine, whose
+ * expansion contains nothing that could expand or be rewritten, always
+ * expands to a plain copy of its expansion list.
+ */
+static bool smacro_is_constant(const SMacro *s)
+{
+    const Token *t;
+
+    if (s->nparam || s->alias || s->expand != smacro_expand_default)
+        return false;
+
+    list_for_each(t, s->expansion) {
+        switch (t->type) {
+        case TOKEN_ID:
+        case TOKEN_PREPROC_ID:
+        case TOKEN_LOCAL_MACRO:
+        case TOKEN_PREPROC_Q:
+        case TOKEN_PREPROC_SQ:
+        case TOKEN_PREPROC_QQ:
+        case TOKEN_PREPROC_SQQ:
+        case TOKEN_COND_COMMA:
+            return false;
+        default:
+            if (is_smac_param(t->type))
+                return false;
+            break;
+        }
+    }
+
+    return true;
+}
+
 /*
  * Common code for defining an smacro. The tmpl argument, if not NULL,
  * contains any macro parameters that aren't explicit arguments;
@@ -3205,6 +3791,10 @@ static SMacro *define_smacro(const char *mname, bool casesense,
          * existing SMacro structure. This means freeing
          * what was already in it, but not the structure itself.
          */
+        if (smac->frozen) {
+            SMacro **head = (SMacro **)hash_findi(&smacros, mname, NULL);
+            smac = unfreeze_smacros(head, smac);
+        }
         clear_smacro(smac);
     } else {
         /* Create a new macro */
@@ -3245,6 +3835,7 @@ static SMacro *define_smacro(const char *mname, bool casesense,
             smac->nparam_min = nparam_min;
         }
     }
+    smac->constant = smacro_is_constant(smac);
     if (ppdbg & (PDBG_SMACROS|PDBG_LIST_SMACROS)) {
         list_smacro_def((smac->alias ? PP_DEFALIAS : PP_DEFINE)
                         + !casesense, ctx, smac);
@@ -3272,6 +3863,9 @@ static void undef_smacro(const char *mname, bool undefalias)
     smhead = (SMacro **)hash_findi(smtbl, mname, NULL);
 
     if (smhead) {
+        if (!ctx)
+            unfreeze_smacros(smhead, NULL);
+
         /*
          * We now have a macro name... go hunt for it.
          */
@@ -3398,7 +3992,7 @@ static bool parse_mmacro_spec(Token *tline, MMacro *def, const char *directive)
  * Decode a size directive
  */
 static int parse_size(const char *str) {
-    static const char *size_names[] =
+    static per_thread const char *size_names[] =
         { "byte", "dword", "oword", "qword", "tword", "word", "yword" };
     static const int sizes[] =
         { 0, 1, 4, 16, 8, 10, 2, 32 };
@@ -3827,6 +4421,7 @@ static int do_directive(Token *tline, Token **output)
     const char *mname;
     struct ppscan pps;
     Include *inc;
+    const struct cached_file *cf;
     Context *ctx;
     Cond *cond;
     MMacro *mmac, **mmhead;
@@ -4257,17 +4852,27 @@ static int do_directive(Token *tline, Token **output)
                       "trailing garbage after `%s' ignored", dname);
         }
         p = unquote_token_cstr(t);
+        if (istk->level >= nasm_limit[LIMIT_INCLUDE_LEVELS]) {
+            nasm_nonfatal("unable to include file `%s': more than %"PRId64
+                          " levels of nested include files", p,
+                          nasm_limit[LIMIT_INCLUDE_LEVELS]);
+            goto done;
+        }
         nasm_new(inc);
         inc->next = istk;
+        inc->level = istk->level + 1;
         found_path = NULL;
-        inc->fp = inc_fopen(p, deplist, &found_path,
-                            (pp_mode == PP_DEPS) ? INC_OPTIONAL :
-                            (op == PP_REQUIRE) ? INC_REQUIRED :
-                            INC_NEEDED, NF_TEXT);
-        if (!inc->fp) {
+        cf = inc_fopen(p, deplist, &found_path,
+                       (pp_mode == PP_DEPS) ? INC_OPTIONAL :
+                       (op == PP_REQUIRE) ? INC_REQUIRED :
+                       INC_NEEDED);
+        if (!cf) {
             /* -MG given but file not found, or repeated %require */
             nasm_free(inc);
         } else {
+            src_open(inc, cf);
+            if (unlikely(profile_enabled))
+                profile_count(PROF_FILE, found_path ? found_path : p, 0, 0);
             inc->nolist  = istk->nolist;
             inc->noline  = istk->noline;
             inc->where   = istk->where;
@@ -4564,6 +5169,12 @@ issue_error:
         }
         mmhead = (MMacro **) hash_findi_add(&mmacros, defining->name);
         defining->next = *mmhead;
+        if (*mmhead && (*mmhead)->index) {
+            /* The index moves to the new head of the list */
+            defining->index = (*mmhead)->index;
+            (*mmhead)->index = NULL;
+            mmacro_index_add(defining->index, defining);
+        }
         *mmhead = defining;
         defining = NULL;
         break;
@@ -4630,6 +5241,8 @@ issue_error:
             }
         }
 
+        free_mmacro_index(*mmac_p);
+        unfreeze_mmacros(mmac_p);
         while (mmac_p && *mmac_p) {
             mmac = *mmac_p;
             if (mmac->casesense == spec.casesense &&
@@ -4756,6 +5369,21 @@ issue_error:
             goto done;
         }
 
+        /*
+         * The body was collected last line first; put it in order
+         * so the repetitions can copy it line by line.
+         */
+        {
+            Line *body = NULL, *next;
+
+            for (l = defining->expansion; l; l = next) {
+                next = l->next;
+                l->next = body;
+                body = l;
+            }
+            defining->expansion = body;
+        }
+
         /*
          * Now we have a "macro" defined - although it has no name
          * and we won't be entering it in the hash tables - we must
@@ -4942,7 +5570,7 @@ issue_error:
 
 	p = unquote_token_cstr(t);
 
-        inc_fopen(p, NULL, &found_path, INC_PROBE, NF_BINARY);
+        inc_fopen(p, NULL, &found_path, INC_PROBE);
         if (!found_path)
             found_path = p;
 	macro_start = make_tok_qstr(NULL, found_path);
@@ -5650,6 +6278,9 @@ static SMacro *expand_one_smacro(Token ***tpp)
         goto not_a_macro;
     }
 
+    if (unlikely(m == pass_smacro))
+        pp_replay_invalidate();
+
     /* Parse parameters, if applicable */
 
     params = NULL;
@@ -5762,6 +6393,17 @@ static SMacro *expand_one_smacro(Token ***tpp)
     /* Expand the macro */
     m->in_progress++;
 
+    if (m->constant) {
+        /*
+         * Nothing in the expansion can expand further; splice in a
+         * copy of it (the expansion is stored in reverse order.)
+         */
+        tafter = tline->next;
+        tline->next = NULL;
+        tline = dup_tlist_reverse(m->expansion, tafter);
+        goto spliced;
+    }
+
     /* Is it a macro or a preprocessor function? Used for diagnostics. */
     mtype = m->name[0] == '%' ? "function" : "macro";
 
@@ -6052,6 +6694,7 @@ static SMacro *expand_one_smacro(Token ***tpp)
         }
     }
 
+spliced:
     **tpp = tline;
     for (t = tline; t && t != tafter; t = t->next)
         *tpp = &t->next;
@@ -6084,12 +6727,37 @@ done:
  * Tokens from input to output a lot of the time, rather than
  * actually bothering to destroy and replicate.)
  */
+/*
+ * expand_one_smacro() for --profile: count the macro, the tokens it
+ * expanded to and the time it took, including any nested expansion.
+ */
+static SMacro *profile_one_smacro(Token ***tpp)
+{
+    Token **start = *tpp;
+    Token **tail;
+    uint64_t t0 = profile_clock();
+    uint64_t ntok = 0;
+    SMacro *m;
+
+    m = expand_one_smacro(tpp);
+    if (m) {
+        for (tail = start; *tail && tail != *tpp; tail = &(*tail)->next)
+            ntok += !tok_white(*tail);
+        profile_count(PROF_SMACRO, m->name, ntok, profile_clock() - t0);
+    }
+    return m;
+}
+
 static Token *expand_smacro(Token *tline)
 {
+    enum profile_step step = profile_enter(STEP_EXPAND_SMACRO);
+
     smacro_deadman.total  = nasm_limit[LIMIT_MACRO_TOKENS];
     smacro_deadman.levels = nasm_limit[LIMIT_MACRO_LEVELS];
     smacro_deadman.triggered = false;
-    return expand_smacro_noreset(tline);
+    tline = expand_smacro_noreset(tline);
+    profile_leave(step);
+    return tline;
 }
 
 static Token *expand_smacro_noreset(Token *org_tline)
@@ -6136,8 +6804,12 @@ static Token *expand_smacro_noreset(Token *org_tline)
          */
         errhold = nasm_error_hold_push();
 
-        while (*tail)           /* main token loop */
-            expanded |= !!expand_one_smacro(&tail);
+        while (*tail) {         /* main token loop */
+            if (unlikely(profile_enabled))
+                expanded |= !!profile_one_smacro(&tail);
+            else
+                expanded |= !!expand_one_smacro(&tail);
+        }
 
          if (!expanded)
             break;              /* Done! */
@@ -6286,17 +6958,184 @@ static MMacro *use_mmacro(MMacro *m, int *nparamp, Token ***paramsp)
     return m;
 }
 
+static struct mmacro_group *
+mmacro_index_group(struct mmacro_index *idx, const MMacro *m)
+{
+    struct mmacro_group *g;
+    size_t i;
+
+    if (!m->casesense)
+        return &idx->groups[0];
+
+    for (i = 1; i < idx->ngroups; i++) {
+        if (!strcmp(idx->groups[i].name, m->name))
+            return &idx->groups[i];
+    }
+
+    idx->groups = nasm_realloc(idx->groups,
+                               (idx->ngroups + 1) * sizeof *idx->groups);
+    g = &idx->groups[idx->ngroups++];
+    nasm_zero(*g);
+    g->name = m->name;
+    return g;
+}
+
+static struct mmacro_ref *mmacro_group_room(struct mmacro_group *g)
+{
+    if (g->nrefs >= g->size) {
+        g->size = g->size ? g->size << 1 : 8;
+        g->refs = nasm_realloc(g->refs, g->size * sizeof *g->refs);
+    }
+    return &g->refs[g->nrefs];
+}
+
+static void mmacro_ref_init(struct mmacro_ref *r, MMacro *m)
+{
+    r->m          = m;
+    r->nparam_min = m->nparam_min;
+    r->nparam_max = m->plus ? INT_MAX : m->nparam_max;
+    r->seq        = m->seq;
+}
+
+/* Recompute the reach of a group from entry i onward */
+static void mmacro_group_reach(struct mmacro_group *g, size_t i)
+{
+    int reach = i ? g->refs[i-1].reach : INT_MIN;
+
+    for (; i < g->nrefs; i++) {
+        if (g->refs[i].nparam_max > reach)
+            reach = g->refs[i].nparam_max;
+        g->refs[i].reach = reach;
+    }
+}
+
+/* Index of the first entry of a group with nparam_min > nparam */
+static size_t mmacro_group_bound(const struct mmacro_group *g, int nparam)
+{
+    size_t lo = 0, hi = g->nrefs;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) >> 1;
+        if (g->refs[mid].nparam_min <= nparam)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Add a macro which has just become the head of the list */
+static void mmacro_index_add(struct mmacro_index *idx, MMacro *m)
+{
+    struct mmacro_group *g = mmacro_index_group(idx, m);
+    size_t i;
+
+    m->seq = ++idx->seq;
+    mmacro_group_room(g);
+    i = mmacro_group_bound(g, m->nparam_min);
+    memmove(&g->refs[i+1], &g->refs[i], (g->nrefs - i) * sizeof *g->refs);
+    g->nrefs++;
+    mmacro_ref_init(&g->refs[i], m);
+    mmacro_group_reach(g, i);
+}
+
+static int mmacro_ref_cmp(const void *a, const void *b)
+{
+    const struct mmacro_ref *ra = a, *rb = b;
+
+    if (ra->nparam_min != rb->nparam_min)
+        return ra->nparam_min < rb->nparam_min ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : 1;
+}
+
+/*
+ * Build the index of a list if it is long enough to be worth it.
+ */
+static void mmacro_index_build(MMacro *head)
+{
+    struct mmacro_index *idx;
+    MMacro *m;
+    uint32_t n = 0;
+    size_t i;
+
+    list_for_each(m, head)
+        n++;
+    if (n < MMACRO_INDEX_MIN)
+        return;
+
+    nasm_new(idx);
+    idx->seq = n;
+    nasm_new(idx->groups);
+    idx->ngroups = 1;
+
+    list_for_each(m, head) {
+        struct mmacro_group *g = mmacro_index_group(idx, m);
+
+        m->seq = n--;
+        mmacro_ref_init(mmacro_group_room(g), m);
+        g->nrefs++;
+    }
+
+    for (i = 0; i < idx->ngroups; i++) {
+        struct mmacro_group *g = &idx->groups[i];
+
+        if (!g->nrefs)
+            continue;           /* No case-insensitive macros */
+
+        qsort(g->refs, g->nrefs, sizeof *g->refs, mmacro_ref_cmp);
+        mmacro_group_reach(g, 0);
+    }
+
+    head->index = idx;
+}
+
+/*
+ * The same search as the list walk in find_mmacro_in_list(): the
+ * matching macro closest to the head, starting at m.
+ */
+static MMacro *mmacro_index_find(const struct mmacro_index *idx,
+                                 const MMacro *m, const char *finding,
+                                 int nparam)
+{
+    const struct mmacro_ref *best = NULL;
+    size_t i, j;
+
+    for (i = 0; i < idx->ngroups; i++) {
+        const struct mmacro_group *g = &idx->groups[i];
+
+        if (g->name && strcmp(g->name, finding))
+            continue;
+
+        for (j = mmacro_group_bound(g, nparam);
+             j-- > 0 && g->refs[j].reach >= nparam;) {
+            const struct mmacro_ref *r = &g->refs[j];
+
+            if (r->nparam_max >= nparam && r->seq <= m->seq &&
+                (!best || r->seq > best->seq))
+                best = r;
+        }
+    }
+
+    return best ? best->m : NULL;
+}
+
 /*
  * Search a macro list and try to find a match. If matching, call
  * use_mmacro() to set up the macro call. m points to the list of
  * search, which is_mmacro() sets to the first *possible* match.
+ * If the list has an index, it is used instead of walking the list.
  */
 static MMacro *
-find_mmacro_in_list(MMacro *m, const char *finding,
+find_mmacro_in_list(const MMacro *head, MMacro *m, const char *finding,
                     int *nparamp, Token ***paramsp)
 {
     int nparam = *nparamp;
 
+    if (head->index) {
+        m = mmacro_index_find(head->index, m, finding, nparam);
+        return m ? use_mmacro(m, nparamp, paramsp) : NULL;
+    }
+
     while (m) {
         if (m->nparam_min <= nparam
             && (m->plus || nparam <= m->nparam_max)) {
@@ -6357,6 +7196,9 @@ static MMacro *is_mmacro(Token * tline, int *nparamp, Token ***paramsp)
     if (!m)
         return NULL;
 
+    if (!head->index)
+        mmacro_index_build(head);
+
     /*
      * OK, we have a potential macro. Count and demarcate the
      * parameters.
@@ -6372,7 +7214,7 @@ static MMacro *is_mmacro(Token * tline, int *nparamp, Token ***paramsp)
      * encountered an error for which we have already issued a
      * diagnostic, so we should not proceed.
      */
-    found = find_mmacro_in_list(m, finding, nparamp, paramsp);
+    found = find_mmacro_in_list(head, m, finding, nparamp, paramsp);
     if (!*paramsp)
         return NULL;
 
@@ -6436,7 +7278,7 @@ static MMacro *is_mmacro(Token * tline, int *nparamp, Token ***paramsp)
                  */
                 int bogus_nparam = 1;
                 params[2] = NULL;
-                found = find_mmacro_in_list(m, finding, &bogus_nparam, paramsp);
+                found = find_mmacro_in_list(head, m, finding, &bogus_nparam, paramsp);
             } else if (raw_nparam > 1 && comma) {
                 Token *comma_tail = *comma;
 
@@ -6447,7 +7289,7 @@ static MMacro *is_mmacro(Token * tline, int *nparamp, Token ***paramsp)
                  */
                 *comma = NULL;
                 *nparamp = raw_nparam - 1;
-                found = find_mmacro_in_list(m, finding, nparamp, paramsp);
+                found = find_mmacro_in_list(head, m, finding, nparamp, paramsp);
                 if (found)
                     free_tlist(comma_tail);
                 else
@@ -6606,7 +7448,7 @@ static void list_mmacro_call(const MMacro *m)
  * calling the backend reverse it to definition/invocation order just
  * to be nicer. [XXX: not implemented yet]
  */
-struct debug_macro_inv *debug_current_macro;
+per_thread struct debug_macro_inv *debug_current_macro;
 
 /* Get/create a addr structure for a seg:inv combo */
 static struct debug_macro_addr *
@@ -6639,8 +7481,8 @@ struct debug_macro_addr *debug_macro_get_addr(int32_t seg)
     return debug_macro_get_addr_inv(seg, debug_current_macro);
 }
 
-static struct debug_macro_info dmi;
-static struct debug_macro_inv_list *current_inv_list = &dmi.inv;
+static per_thread struct debug_macro_info dmi;
+static per_thread struct debug_macro_inv_list *current_inv_list;
 
 static void debug_macro_start(MMacro *m, struct src_location where)
 {
@@ -6909,6 +7751,9 @@ static int expand_mmacro(Token * tline)
     m->mstk = istk->mstk;
     istk->mstk.mstk = istk->mstk.mmac = m;
 
+    if (unlikely(profile_enabled))
+        profile_count(PROF_MMACRO, m->name, 0, 0);
+
     list_for_each(l, m->expansion) {
         nasm_new(ll);
         ll->next = istk->expansion;
@@ -6987,6 +7832,14 @@ bool pp_suppress_error(errflags severity)
 	 !emitting(istk->conds->state)))
         return true;
 
+    /*
+     * A message issued while preprocessing would be lost if this
+     * pass' output were replayed, unless it is deferred to the
+     * final pass anyway.
+     */
+    if (in_getline && !(severity & ERR_PASS2))
+        pp_replay_invalidate();
+
     return false;
 }
 
@@ -7412,57 +8265,21 @@ static void pp_add_magic_stdmac(void)
     }
 }
 
-static void pp_reset_stdmac(enum preproc_mode mode)
+/*
+ * Define the __?PASS?__ macro.  This is defined here unlike all the
+ * other builtins, because it is special -- it varies between
+ * passes -- but there is really no particular reason to make it
+ * magic.
+ *
+ * 0 = dependencies only
+ * 1 = preparatory passes
+ * 2 = final pass
+ * 3 = preprocess only
+ */
+static void define_pass_smacro(enum preproc_mode mode)
 {
     int apass;
-    struct Include *inc;
-
-    /*
-     * Set up the stdmac packages as a virtual include file,
-     * indicated by a null file pointer.
-     */
-    nasm_new(inc);
-    inc->next = istk;
-    inc->nolist = inc->noline = !list_option('b');
-    inc->where = istk->where;
-    istk = inc;
-    if (!istk->nolist) {
-        lfmt->uplevel(LIST_INCLUDE, 0);
-    }
-    if (!istk->noline) {
-        src_set(0, NULL);
-        istk->where = src_where();
-        if (ppdbg & PDBG_INCLUDE)
-            dfmt->debug_include(true, istk->next->where, istk->where);
-    }
-
-    pp_add_magic_stdmac();
 
-    if (tasm_compatible_mode)
-        pp_add_stdmac(nasm_stdmac_tasm);
-
-    pp_add_stdmac(nasm_stdmac_nasm);
-    pp_add_stdmac(nasm_stdmac_version);
-
-    if (extrastdmac)
-        pp_add_stdmac(extrastdmac);
-
-    stdmacpos  = stdmacros[0];
-    stdmacnext = &stdmacros[1];
-
-    do_predef = true;
-
-    /*
-     * Define the __?PASS?__ macro.  This is defined here unlike all the
-     * other builtins, because it is special -- it varies between
-     * passes -- but there is really no particular reason to make it
-     * magic.
-     *
-     * 0 = dependencies only
-     * 1 = preparatory passes
-     * 2 = final pass
-     * 3 = preprocess only
-     */
     switch (mode) {
     case PP_NORMAL:
         apass = pass_final() ? 2 : 1;
@@ -7477,15 +8294,1038 @@ static void pp_reset_stdmac(enum preproc_mode mode)
         panic();
     }
 
-    define_smacro("__?PASS?__", true, make_tok_num(NULL, apass), NULL);
+    pass_smacro = define_smacro("__?PASS?__", true,
+                                make_tok_num(NULL, apass), NULL);
 }
 
-void pp_reset(const char *file, enum preproc_mode mode,
-              struct strlist *dep_list)
+/*
+ * Can this pass use the stdmac snapshot?  Debug information and some
+ * listing options need to see the standard macros being defined.
+ */
+static bool stdmac_shareable(void)
 {
-    cstk = NULL;
-    defining = NULL;
-    nested_mac_count = 0;
+    return pp_mode == PP_NORMAL &&
+        !(ppdbg & (PDBG_MMACROS|PDBG_SMACROS|PDBG_LIST_SMACROS)) &&
+        !list_option('b') && !list_option('d');
+}
+
+/*
+ * Start the live macro tables out as a copy of the stdmac snapshot
+ */
+static void stdmac_thaw(void)
+{
+    hash_copy(&smacros, &stdmac_snap.smacros);
+    hash_copy(&mmacros, &stdmac_snap.mmacros);
+    unique = stdmac_snap.unique;
+    ppconf = stdmac_snap.ppconf;
+
+    /* A precompiled header may have changed these */
+    if (pch.loaded) {
+        StackSize    = stdmac_snap.StackSize;
+        StackPointer = stdmac_snap.StackPointer;
+        ArgOffset    = stdmac_snap.ArgOffset;
+        LocalOffset  = stdmac_snap.LocalOffset;
+    }
+}
+
+/*
+ * Freeze the macros defined by the standard macro packages, if this
+ * pass has defined them the same way as later passes would.  Returns
+ * true if it did, in which case __?PASS?__ needs to be defined again.
+ */
+static bool stdmac_freeze(void)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    char *p;
+    int i;
+
+    stdmac_snap.tried = true;
+
+    if (!stdmac_shareable() || pass_final() || cstk || defining)
+        return false;
+    for (i = 0; i < use_package_count; i++) {
+        if (use_loaded[i])
+            return false;
+    }
+
+    /* __?PASS?__ differs between passes, so keep it out */
+    undef_smacro("__?PASS?__", false);
+
+    stdmac_snap.smacros = smacros;
+    stdmac_snap.mmacros = mmacros;
+    stdmac_snap.unique  = unique;
+    stdmac_snap.ppconf  = ppconf;
+    stdmac_snap.StackSize    = StackSize;
+    stdmac_snap.StackPointer = StackPointer;
+    stdmac_snap.ArgOffset    = ArgOffset;
+    stdmac_snap.LocalOffset  = LocalOffset;
+
+    /*
+     * Move all the keys into a single block, so a key can be told to
+     * belong to the snapshot by its address.
+     */
+    stdmac_snap.keylen = 0;
+    hash_for_each(&stdmac_snap.smacros, it, np)
+        stdmac_snap.keylen += strlen(np->key) + 1;
+    hash_for_each(&stdmac_snap.mmacros, it, np)
+        stdmac_snap.keylen += strlen(np->key) + 1;
+    p = stdmac_snap.keys = nasm_malloc(stdmac_snap.keylen);
+
+    hash_for_each(&stdmac_snap.smacros, it, np) {
+        struct hash_node *n = (struct hash_node *)np;
+        size_t len = strlen(n->key) + 1;
+        SMacro *s;
+
+        memcpy(p, n->key, len);
+        nasm_free((void *)n->key);
+        n->key = p;
+        p += len;
+        list_for_each(s, n->data)
+            s->frozen = true;
+    }
+    hash_for_each(&stdmac_snap.mmacros, it, np) {
+        struct hash_node *n = (struct hash_node *)np;
+        size_t len = strlen(n->key) + 1;
+        MMacro *m;
+
+        memcpy(p, n->key, len);
+        nasm_free((void *)n->key);
+        n->key = p;
+        p += len;
+        list_for_each(m, n->data)
+            m->frozen = true;
+    }
+
+    stdmac_snap.valid = true;
+    stdmac_thaw();
+    return true;
+}
+
+/*
+ * Free the stdmac snapshot and the frozen macros
+ */
+static void stdmac_free(void)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+
+    hash_for_each(&stdmac_snap.smacros, it, np) {
+        SMacro *s, *tmp;
+        list_for_each_safe(s, tmp, np->data)
+            free_smacro(s);
+    }
+    hash_for_each(&stdmac_snap.mmacros, it, np) {
+        MMacro *m, *tmp;
+        list_for_each_safe(m, tmp, np->data)
+            free_mmacro(m);
+    }
+    hash_free(&stdmac_snap.smacros);
+    hash_free(&stdmac_snap.mmacros);
+    nasm_free(stdmac_snap.keys);
+    nasm_zero(stdmac_snap);
+}
+
+/*
+ * Precompiled macro headers.  The file holds the macros defined after
+ * preprocessing a header, the options it was preprocessed under and
+ * the files it was read from:
+ *
+ *     magic, format version
+ *     header source file, NASM version, options
+ *     dependencies: file name, size and modification time of each
+ *     length and CRC of the body
+ *     body: the preprocessor state, see pch_put_state()
+ *
+ * Numbers are in host byte order; strings are a 32-bit length followed
+ * by the bytes and a null terminator.
+ */
+#define PCH_MAGIC   "NASMPCH\032"
+#define PCH_VERSION 1
+
+/* Buffer a precompiled header is assembled in */
+struct pch_buf {
+    char *data;
+    size_t len, size;
+};
+
+/* Position in the precompiled header being read */
+struct pch_reader {
+    const char *p, *end;
+    bool err;                   /* Read past the end, or malformed */
+};
+
+/* Functions which can appear as SMacro expand methods */
+static const ExpandSMacro pch_expanders[] = {
+    smacro_expand_default,
+    stdmac_file, stdmac_line, stdmac_bits, stdmac_ptr, stdmac_is,
+    stdmac_join, stdmac_strcat, stdmac_substr, stdmac_strlen,
+    stdmac_tok, stdmac_cond_sel, stdmac_count, stdmac_num, stdmac_abs
+};
+
+static void pch_put(struct pch_buf *b, const void *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        b->size = (b->len + len) * 2;
+        b->data = nasm_realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void pch_put_u32(struct pch_buf *b, uint32_t v)
+{
+    pch_put(b, &v, sizeof v);
+}
+
+static void pch_put_u64(struct pch_buf *b, uint64_t v)
+{
+    pch_put(b, &v, sizeof v);
+}
+
+static void pch_put_str(struct pch_buf *b, const char *str, size_t len)
+{
+    pch_put_u32(b, len);
+    pch_put(b, str, len);
+    pch_put(b, "", 1);
+}
+
+static void pch_put_cstr(struct pch_buf *b, const char *str)
+{
+    pch_put_str(b, str, strlen(str));
+}
+
+static void pch_get(struct pch_reader *r, void *data, size_t len)
+{
+    if ((size_t)(r->end - r->p) < len) {
+        memset(data, 0, len);
+        r->p = r->end;
+        r->err = true;
+        return;
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+}
+
+static uint32_t pch_get_u32(struct pch_reader *r)
+{
+    uint32_t v;
+    pch_get(r, &v, sizeof v);
+    return v;
+}
+
+static uint64_t pch_get_u64(struct pch_reader *r)
+{
+    uint64_t v;
+    pch_get(r, &v, sizeof v);
+    return v;
+}
+
+static const char *pch_get_str(struct pch_reader *r, size_t *lenp)
+{
+    size_t len = pch_get_u32(r);
+    const char *str = r->p;
+
+    if ((size_t)(r->end - r->p) <= len || str[len]) {
+        r->p = r->end;
+        r->err = true;
+        str = "";
+        len = 0;
+    } else {
+        r->p += len + 1;
+    }
+
+    if (lenp)
+        *lenp = len;
+    return str;
+}
+
+static void pch_put_tlist(struct pch_buf *b, const Token *list)
+{
+    const Token *t;
+    uint32_t n = 0;
+
+    list_for_each(t, list)
+        n++;
+    pch_put_u32(b, n);
+    list_for_each(t, list) {
+        pch_put_u32(b, t->type);
+        pch_put_str(b, tok_text(t), t->len);
+    }
+}
+
+static Token *pch_get_tlist(struct pch_reader *r)
+{
+    Token *list = NULL;
+    Token **tail = &list;
+    uint32_t n = pch_get_u32(r);
+
+    while (n-- && !r->err) {
+        enum token_type type = pch_get_u32(r);
+        size_t len;
+        const char *text = pch_get_str(r, &len);
+
+        *tail = new_Token(NULL, type, text, len);
+        tail = &(*tail)->next;
+    }
+    return list;
+}
+
+static void pch_put_where(struct pch_buf *b, struct src_location where)
+{
+    pch_put_u32(b, !!where.filename);
+    pch_put_cstr(b, where.filename ? where.filename : "");
+    pch_put_u32(b, where.lineno);
+}
+
+static struct src_location pch_get_where(struct pch_reader *r)
+{
+    struct src_location where;
+    bool named = pch_get_u32(r);
+    const char *filename = pch_get_str(r, NULL);
+
+    /* Get the shared copy of the file name */
+    where.filename = named ? src_set_fname(src_set_fname(filename)) : NULL;
+    where.lineno = pch_get_u32(r);
+    return where;
+}
+
+static void pch_put_smacro(struct pch_buf *b, const SMacro *s)
+{
+    size_t fn;
+    int i;
+
+    for (fn = 0; pch_expanders[fn] != s->expand; fn++) {
+        if (fn >= ARRAY_SIZE(pch_expanders) - 1)
+            panic();
+    }
+
+    pch_put_cstr(b, s->name);
+    pch_put_u32(b, fn);
+    pch_put_u64(b, s->expandpvt.u);
+    pch_put_u32(b, s->nparam);
+    pch_put_u32(b, s->nparam_min);
+    pch_put_u32(b, s->recursive | (s->varadic << 1) | (s->casesense << 2) |
+                (s->alias << 3) | (s->constant << 4) | (!!s->params << 5));
+    if (s->params) {
+        for (i = 0; i < s->nparam; i++) {
+            const struct smac_param *p = &s->params[i];
+
+            pch_put_u32(b, p->name.type);
+            pch_put_str(b, tok_text(&p->name), p->name.len);
+            pch_put_u32(b, p->flags);
+            pch_put_tlist(b, p->def);
+        }
+    }
+    pch_put_tlist(b, s->expansion);
+}
+
+static SMacro *pch_get_smacro(struct pch_reader *r)
+{
+    SMacro *s;
+    uint32_t fn, flags;
+
+    nasm_new(s);
+    s->name = nasm_strdup(pch_get_str(r, NULL));
+    fn = pch_get_u32(r);
+    s->expand = pch_expanders[fn < ARRAY_SIZE(pch_expanders) ? fn : 0];
+    s->expandpvt.u = pch_get_u64(r);
+    s->nparam      = pch_get_u32(r);
+    s->nparam_min  = pch_get_u32(r);
+    flags = pch_get_u32(r);
+    s->recursive = !!(flags & 1);
+    s->varadic   = !!(flags & 2);
+    s->casesense = !!(flags & 4);
+    s->alias     = !!(flags & 8);
+    s->constant  = !!(flags & 16);
+    if ((flags & 32) && s->nparam > 0 && !r->err) {
+        int i;
+
+        nasm_newn(s->params, s->nparam);
+        for (i = 0; i < s->nparam; i++) {
+            struct smac_param *p = &s->params[i];
+            enum token_type type = pch_get_u32(r);
+            size_t len;
+            const char *text = pch_get_str(r, &len);
+            Token *name = new_Token(NULL, type, text, len);
+
+            steal_Token(&p->name, name);
+            delete_Token(name);
+            p->flags = pch_get_u32(r);
+            p->def = pch_get_tlist(r);
+        }
+    }
+    s->expansion = pch_get_tlist(r);
+
+    /* The magic macros mark preprocessor functions when defined */
+    if (s->expand != smacro_expand_default && s->name[0] == '%') {
+        enum preproc_token op = pp_token_hash(s->name);
+        if (op != PP_invalid)
+            pp_op_may_be_function[op] = true;
+    }
+
+    return s;
+}
+
+static void pch_put_mmacro(struct pch_buf *b, const MMacro *m)
+{
+    const Line *l;
+    const Token *t;
+    uint32_t n;
+    int i;
+
+    pch_put_cstr(b, m->name);
+    pch_put_u32(b, m->nparam_min);
+    pch_put_u32(b, m->nparam_max);
+    pch_put_u32(b, m->nolist);
+    pch_put_u32(b, m->casesense | (m->plus << 1) | (m->capture_label << 2));
+    pch_put_u32(b, m->max_depth);
+    pch_put_tlist(b, m->dlist);
+    pch_put_u32(b, m->ndefs);
+
+    /* Defaults are stored as positions in dlist */
+    n = m->defaults ? m->ndefs + 2 : 0;
+    pch_put_u32(b, n);
+    for (i = 0; i < (int)n; i++) {
+        int32_t pos = -1, j = 0;
+
+        list_for_each(t, m->dlist) {
+            if (t == m->defaults[i]) {
+                pos = j;
+                break;
+            }
+            j++;
+        }
+        pch_put_u32(b, pos);
+    }
+
+    n = 0;
+    list_for_each(l, m->expansion)
+        n++;
+    pch_put_u32(b, n);
+    list_for_each(l, m->expansion) {
+        pch_put_tlist(b, l->first);
+        pch_put_where(b, l->where);
+    }
+    pch_put_where(b, m->where);
+}
+
+static MMacro *pch_get_mmacro(struct pch_reader *r)
+{
+    MMacro *m;
+    Line **tail;
+    uint32_t flags, n, i;
+
+    nasm_new(m);
+    m->name        = nasm_strdup(pch_get_str(r, NULL));
+    m->nparam_min  = pch_get_u32(r);
+    m->nparam_max  = pch_get_u32(r);
+    m->nolist      = pch_get_u32(r);
+    flags = pch_get_u32(r);
+    m->casesense     = !!(flags & 1);
+    m->plus          = !!(flags & 2);
+    m->capture_label = !!(flags & 4);
+    m->max_depth   = pch_get_u32(r);
+    m->dlist       = pch_get_tlist(r);
+    m->ndefs       = pch_get_u32(r);
+
+    n = pch_get_u32(r);
+    if (n && !r->err) {
+        nasm_newn(m->defaults, n);
+        for (i = 0; i < n; i++) {
+            int32_t pos = pch_get_u32(r);
+            Token *t = m->dlist;
+
+            while (pos-- > 0 && t)
+                t = t->next;
+            if (pos == -1)
+                m->defaults[i] = t;
+        }
+    }
+
+    n = pch_get_u32(r);
+    tail = &m->expansion;
+    while (n-- && !r->err) {
+        Line *l;
+
+        nasm_new(l);
+        l->first = pch_get_tlist(r);
+        l->where = pch_get_where(r);
+        *tail = l;
+        tail = &l->next;
+    }
+    m->where = pch_get_where(r);
+    m->dstk.mmac = m;
+
+    return m;
+}
+
+static void pch_put_smacros(struct pch_buf *b, const struct hash_table *ht)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    const SMacro *s;
+    uint32_t n = 0;
+
+    hash_for_each(ht, it, np) {
+        list_for_each(s, np->data) {
+            if (s != pass_smacro) {
+                n++;
+                break;
+            }
+        }
+    }
+    pch_put_u32(b, n);
+
+    hash_for_each(ht, it, np) {
+        n = 0;
+        list_for_each(s, np->data)
+            n += s != pass_smacro;
+        if (!n)
+            continue;
+
+        pch_put_cstr(b, np->key);
+        pch_put_u32(b, n);
+        list_for_each(s, np->data) {
+            if (s != pass_smacro)
+                pch_put_smacro(b, s);
+        }
+    }
+}
+
+static void pch_get_smacros(struct pch_reader *r, struct hash_table *ht)
+{
+    uint32_t n = pch_get_u32(r);
+
+    while (n-- && !r->err) {
+        SMacro **tail = (SMacro **)hash_findi_add(ht, pch_get_str(r, NULL));
+        uint32_t count = pch_get_u32(r);
+
+        while (*tail)
+            tail = &(*tail)->next;
+        while (count-- && !r->err) {
+            *tail = pch_get_smacro(r);
+            tail = &(*tail)->next;
+        }
+    }
+}
+
+static void pch_put_mmacros(struct pch_buf *b, const struct hash_table *ht)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    const MMacro *m;
+    uint32_t n = 0;
+
+    hash_for_each(ht, it, np)
+        n += !!np->data;
+    pch_put_u32(b, n);
+
+    hash_for_each(ht, it, np) {
+        if (!np->data)
+            continue;
+
+        n = 0;
+        list_for_each(m, np->data)
+            n++;
+        pch_put_cstr(b, np->key);
+        pch_put_u32(b, n);
+        list_for_each(m, np->data)
+            pch_put_mmacro(b, m);
+    }
+}
+
+static void pch_get_mmacros(struct pch_reader *r, struct hash_table *ht)
+{
+    uint32_t n = pch_get_u32(r);
+
+    while (n-- && !r->err) {
+        MMacro **tail = (MMacro **)hash_findi_add(ht, pch_get_str(r, NULL));
+        uint32_t count = pch_get_u32(r);
+
+        if (*tail)
+            free_mmacro_index(*tail);
+        while (*tail)
+            tail = &(*tail)->next;
+        while (count-- && !r->err) {
+            *tail = pch_get_mmacro(r);
+            tail = &(*tail)->next;
+        }
+    }
+}
+
+/*
+ * The preprocessor state at the end of a header
+ */
+static void pch_put_state(struct pch_buf *b)
+{
+    const Context *ctx;
+    uint32_t n;
+    int i;
+
+    pch_put_u64(b, unique);
+    pch_put_u32(b, ppconf.noaliases);
+    pch_put_u32(b, ppconf.sane_empty_expansion);
+    pch_put_u32(b, StackSize);
+    pch_put_cstr(b, StackPointer);
+    pch_put_u32(b, ArgOffset);
+    pch_put_u32(b, LocalOffset);
+
+    pch_put_u32(b, use_package_count);
+    for (i = 0; i < use_package_count; i++)
+        pch_put_u32(b, use_loaded[i]);
+
+    pch_put_smacros(b, &smacros);
+    pch_put_mmacros(b, &mmacros);
+
+    n = 0;
+    list_for_each(ctx, cstk)
+        n++;
+    pch_put_u32(b, n);
+    list_for_each(ctx, cstk) {
+        pch_put_u32(b, !!ctx->name);
+        pch_put_cstr(b, ctx->name ? ctx->name : "");
+        pch_put_u64(b, ctx->number);
+        pch_put_u32(b, ctx->depth);
+        pch_put_smacros(b, &ctx->localmac);
+    }
+}
+
+static void pch_get_state(struct pch_reader *r)
+{
+    static const char * const stack_pointers[] = { "ebp", "rbp", "bp" };
+    Context **tail = &cstk;
+    const char *sp;
+    uint32_t n;
+    size_t i;
+
+    unique                    = pch_get_u64(r);
+    ppconf.noaliases          = pch_get_u32(r);
+    ppconf.sane_empty_expansion = pch_get_u32(r);
+    StackSize                 = pch_get_u32(r);
+    sp = pch_get_str(r, NULL);
+    for (i = 0; i < ARRAY_SIZE(stack_pointers); i++) {
+        if (!strcmp(sp, stack_pointers[i]))
+            StackPointer = stack_pointers[i];
+    }
+    ArgOffset                 = pch_get_u32(r);
+    LocalOffset               = pch_get_u32(r);
+
+    n = pch_get_u32(r);
+    if (n != (uint32_t)use_package_count)
+        r->err = true;
+    for (i = 0; i < n && !r->err; i++)
+        use_loaded[i] = pch_get_u32(r);
+
+    pch_get_smacros(r, &smacros);
+    pch_get_mmacros(r, &mmacros);
+
+    n = pch_get_u32(r);
+    while (n-- && !r->err) {
+        Context *ctx;
+        bool named;
+        const char *name;
+
+        nasm_new(ctx);
+        named = pch_get_u32(r);
+        name = pch_get_str(r, NULL);
+        ctx->name   = named ? nasm_strdup(name) : NULL;
+        ctx->number = pch_get_u64(r);
+        ctx->depth  = pch_get_u32(r);
+        pch_get_smacros(r, &ctx->localmac);
+        *tail = ctx;
+        tail = &ctx->next;
+    }
+}
+
+/*
+ * Predefinitions which differ from one run to the next: these are not
+ * part of the options a header was built under, and are processed
+ * again after loading it.
+ */
+static bool pch_volatile(const Line *l)
+{
+    static const char * const volatile_macros[] = {
+        "__?DATE?__", "__?DATE_NUM?__", "__?TIME?__", "__?TIME_NUM?__",
+        "__?UTC_DATE?__", "__?UTC_DATE_NUM?__", "__?UTC_TIME?__",
+        "__?UTC_TIME_NUM?__", "__?POSIX_TIME?__"
+    };
+    const Token *t = l->first;
+    size_t i;
+
+    if (!tok_is(t, TOKEN_PREPROC_ID) || strcmp(tok_text(t), "%define"))
+        return false;
+
+    t = t->next;
+    while (tok_white(t))
+        t = t->next;
+    if (!tok_is(t, TOKEN_ID))
+        return false;
+
+    for (i = 0; i < ARRAY_SIZE(volatile_macros); i++) {
+        if (!strcmp(tok_text(t), volatile_macros[i]))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Everything other than the input files which determines the macros a
+ * header defines
+ */
+static void pch_put_options(struct pch_buf *b)
+{
+    const struct strlist_entry *e;
+    const Line *l;
+
+    pch_put_cstr(b, ofmt->shortname);
+    pch_put_u32(b, ppopt & (PP_TRIVIAL|PP_NOLINE|PP_TASM));
+    pch_put_u32(b, list_option('f'));
+
+    strlist_for_each(e, ipath_list)
+        pch_put_cstr(b, e->str);
+
+    list_for_each(l, predef) {
+        if (!pch_volatile(l)) {
+            char *line = detoken(l->first, false);
+            pch_put_cstr(b, line);
+            nasm_free(line);
+        }
+    }
+}
+
+/*
+ * Read a precompiled header and check that it is up to date.  If it
+ * cannot be used, its source is included instead.
+ */
+static void pch_open(void)
+{
+    struct pch_reader r;
+    struct pch_buf opts;
+    const char *reason = NULL;
+    const char *what = NULL;
+    const char *str;
+    size_t len;
+    char magic[8];
+    FILE *fp;
+    uint64_t crc;
+    uint32_t i;
+
+    pch.checked = true;
+
+    fp = nasm_open_read(pch.name, NF_BINARY|NF_FORMAP);
+    if (!fp)
+        nasm_fatalf(ERR_NOFILE, "unable to open precompiled header `%s'",
+                    pch.name);
+
+    pch.size = nasm_file_size(fp);
+    pch.data = nasm_map_file(fp, 0, pch.size);
+    pch.mapped = !!pch.data;
+    if (!pch.mapped) {
+        char *buf;
+
+        if (pch.size == (size_t)-1)
+            nasm_fatalf(ERR_NOFILE, "error reading precompiled header `%s'",
+                        pch.name);
+        buf = nasm_malloc(pch.size + 1);
+        if (fread(buf, 1, pch.size, fp) != pch.size)
+            nasm_fatalf(ERR_NOFILE, "error reading precompiled header `%s'",
+                        pch.name);
+        pch.data = buf;
+    }
+    fclose(fp);
+
+    r.p   = pch.data;
+    r.end = pch.data + pch.size;
+    r.err = false;
+
+    pch_get(&r, magic, sizeof magic);
+    if (memcmp(magic, PCH_MAGIC, sizeof magic) ||
+        pch_get_u32(&r) != PCH_VERSION)
+        nasm_fatalf(ERR_NOFILE, "`%s' is not a precompiled header", pch.name);
+
+    pch.source = pch_get_str(&r, NULL);
+
+    str = pch_get_str(&r, NULL);
+    if (strcmp(str, nasm_version))
+        reason = "was built by a different version of NASM";
+
+    nasm_zero(opts);
+    pch_put_options(&opts);
+    str = pch_get_str(&r, &len);
+    if (!reason && (len != opts.len || memcmp(str, opts.data, len)))
+        reason = "was built with different options";
+    nasm_free(opts.data);
+
+    pch.ndeps = pch_get_u32(&r);
+    pch.deps = r.p;
+    for (i = 0; i < pch.ndeps && !r.err; i++) {
+        const char *dep = pch_get_str(&r, NULL);
+        uint64_t size  = pch_get_u64(&r);
+        uint64_t mtime = pch_get_u64(&r);
+        time_t t;
+
+        if (!reason && !r.err &&
+            ((uint64_t)nasm_file_size_by_path(dep) != size ||
+             !nasm_file_time(&t, dep) || (uint64_t)t != mtime)) {
+            reason = "is older than";
+            what = dep;
+        }
+    }
+
+    pch.bodylen = pch_get_u64(&r);
+    crc = pch_get_u64(&r);
+    pch.body = r.p;
+    if (r.err || pch.bodylen != (size_t)(r.end - r.p) ||
+        crc64b(CRC64_INIT, pch.body, pch.bodylen) != crc) {
+        if (r.err)
+            nasm_fatalf(ERR_NOFILE, "precompiled header `%s' is corrupt",
+                        pch.name);
+        reason = "is corrupt";
+        what = NULL;
+    }
+
+    pch.stale = reason;
+    pch.stale_file = what;
+    pch.valid = !reason;
+}
+
+/*
+ * Warn that the precompiled header is not used.  Warnings are only
+ * shown in the final pass, so this is repeated in every pass.
+ */
+static void pch_warn_stale(void)
+{
+    const char *what = pch.stale_file;
+
+    /*!
+     *!pch-stale [on] precompiled header is out of date
+     *!  warns that a precompiled macro header given with \c{--pch}
+     *!  cannot be used, because its source, the files it includes,
+     *!  the options or the version of NASM have changed since it
+     *!  was built.  The source of the header is included instead.
+     */
+    nasm_warn(WARN_PCH_STALE|ERR_NOFILE,
+              "precompiled header `%s' %s%s%s%s, including `%s' instead",
+              pch.name, pch.stale, what ? " `" : "", what ? what : "",
+              what ? "'" : "", pch.source);
+}
+
+/*
+ * Load the macros of the precompiled header into the empty tables
+ */
+static void pch_load(void)
+{
+    struct pch_reader r;
+
+    r.p   = pch.body;
+    r.end = pch.body + pch.bodylen;
+    r.err = false;
+    pch_get_state(&r);
+    if (r.err)
+        nasm_fatalf(ERR_NOFILE, "precompiled header `%s' is corrupt",
+                    pch.name);
+}
+
+/*
+ * The files this pass depends on through the precompiled header; if
+ * it was not loaded, its source was included the usual way.
+ */
+static void pch_add_deps(void)
+{
+    struct pch_reader r;
+    uint32_t i;
+
+    if (!deplist)
+        return;
+
+    strlist_add(deplist, pch.name);
+    if (!pch.loaded)
+        return;
+
+    r.p   = pch.deps;
+    r.end = pch.body;
+    r.err = false;
+    for (i = 0; i < pch.ndeps; i++) {
+        strlist_add(deplist, pch_get_str(&r, NULL));
+        pch_get_u64(&r);
+        pch_get_u64(&r);
+    }
+}
+
+void pp_pre_pch(const char *file)
+{
+    pch.name = file;
+}
+
+void pp_write_pch(const char *file, const char *source)
+{
+    struct pch_buf b, body, opts;
+    const struct strlist_entry *e;
+    char *path;
+    FILE *fp;
+
+    if (defining)
+        return;                 /* pp_cleanup_pass() reports this */
+
+    nasm_zero(body);
+    pch_put_state(&body);
+
+    nasm_zero(b);
+    pch_put(&b, PCH_MAGIC, 8);
+    pch_put_u32(&b, PCH_VERSION);
+    path = nasm_realpath(source);
+    pch_put_cstr(&b, path);
+    nasm_free(path);
+    pch_put_cstr(&b, nasm_version);
+
+    nasm_zero(opts);
+    pch_put_options(&opts);
+    pch_put_str(&b, opts.data ? opts.data : "", opts.len);
+    nasm_free(opts.data);
+
+    pch_put_u32(&b, deplist ? deplist->nstr : 0);
+    strlist_for_each(e, deplist) {
+        time_t t = 0;
+
+        path = nasm_realpath(e->str);
+        pch_put_cstr(&b, path);
+        nasm_free(path);
+        pch_put_u64(&b, nasm_file_size_by_path(e->str));
+        nasm_file_time(&t, e->str);
+        pch_put_u64(&b, t);
+    }
+
+    pch_put_u64(&b, body.len);
+    pch_put_u64(&b, crc64b(CRC64_INIT, body.data, body.len));
+    pch_put(&b, body.data, body.len);
+    nasm_free(body.data);
+
+    fp = nasm_open_write(file, NF_BINARY);
+    if (!fp)
+        nasm_fatal("unable to open output file `%s'", file);
+    fwrite(b.data, 1, b.len, fp);
+    if (ferror(fp))
+        nasm_nonfatal("write error on output file `%s'", file);
+    fclose(fp);
+    nasm_free(b.data);
+}
+
+static void pp_reset_stdmac(enum preproc_mode mode)
+{
+    struct Include *inc;
+    bool thaw = stdmac_snap.valid && stdmac_shareable();
+
+    /*
+     * Set up the stdmac packages as a virtual include file,
+     * indicated by a null file pointer.
+     */
+    nasm_new(inc);
+    inc->next = istk;
+    inc->nolist = inc->noline = !list_option('b');
+    inc->where = istk->where;
+    istk = inc;
+    if (!istk->nolist) {
+        lfmt->uplevel(LIST_INCLUDE, 0);
+    }
+    if (!istk->noline) {
+        src_set(0, NULL);
+        istk->where = src_where();
+        if (ppdbg & PDBG_INCLUDE)
+            dfmt->debug_include(true, istk->next->where, istk->where);
+    }
+
+    if (pch.name && !pch.checked)
+        pch_open();
+    if (pch.stale)
+        pch_warn_stale();
+    pch.loaded = pch.valid && stdmac_shareable();
+
+    if (thaw) {
+        /* The packages have been read already; only predef is left */
+        stdmac_thaw();
+        stdmacpos  = NULL;
+        stdmacnext = &stdmacros[ARRAY_SIZE(stdmacros)-1];
+    } else if (pch.loaded) {
+        /* So have the packages, predef and header in the pch */
+        pch_load();
+        stdmacpos  = NULL;
+        stdmacnext = &stdmacros[ARRAY_SIZE(stdmacros)-1];
+    } else {
+        pp_add_magic_stdmac();
+
+        if (tasm_compatible_mode)
+            pp_add_stdmac(nasm_stdmac_tasm);
+
+        pp_add_stdmac(nasm_stdmac_nasm);
+        pp_add_stdmac(nasm_stdmac_version);
+
+        if (extrastdmac)
+            pp_add_stdmac(extrastdmac);
+
+        stdmacpos  = stdmacros[0];
+        stdmacnext = &stdmacros[1];
+    }
+
+    if (pch.name)
+        pch_add_deps();
+
+    do_predef = true;
+
+    define_pass_smacro(mode);
+}
+
+/*
+ * Drop the recording being made in this pass, if any; the output
+ * of this pass depends on something which may differ in the next.
+ */
+static void pp_replay_invalidate(void)
+{
+    if (replay_state != REPLAY_RECORD)
+        return;
+
+    saa_free(replay_lines);
+    replay_lines = NULL;
+    replay_state = REPLAY_OFF;
+}
+
+static void pp_replay_record(const char *line)
+{
+    struct replay_line rl;
+
+    rl.where = src_where_top();
+    rl.len = strlen(line);
+    saa_wbytes(replay_lines, &rl, sizeof rl);
+    saa_wbytes(replay_lines, line, rl.len);
+}
+
+static char *pp_replay_getline(void)
+{
+    struct replay_line rl;
+    char *line;
+
+    if (replay_lines->rptr >= replay_lines->datalen)
+        return NULL;
+
+    saa_rnbytes(replay_lines, &rl, sizeof rl);
+    line = nasm_malloc(rl.len + 1);
+    saa_rnbytes(replay_lines, line, rl.len);
+    line[rl.len] = '\0';
+    src_update(rl.where);
+    if (unlikely(profile_enabled))
+        profile_line(rl.where, NULL, 0);
+
+    return line;
+}
+
+void pp_reset(const char *file, enum preproc_mode mode,
+              struct strlist *dep_list)
+{
+    const struct cached_file *cf;
+
+    cstk = NULL;
+    defining = NULL;
+    nested_mac_count = 0;
     nested_rep_count = 0;
     init_macros();
     unique = 0;
@@ -7513,14 +9353,33 @@ void pp_reset(const char *file, enum preproc_mode mode,
 
     memset(use_loaded, 0, use_package_count * sizeof(bool));
 
+    replay_state = REPLAY_OFF;
+    if ((ppopt & PP_REPLAY) && mode == PP_NORMAL) {
+        if (pass_first()) {
+            if (replay_lines)
+                saa_free(replay_lines);
+            replay_lines = saa_init(1);
+            replay_state = REPLAY_RECORD;
+        } else if (replay_lines && !pass_final() && !list_on_every_pass()) {
+            /* Nothing read on this pass can differ from the recording */
+            saa_rewind(replay_lines);
+            replay_state = REPLAY_PLAY;
+            src_set(0, file);
+            return;
+        }
+    }
+
     /* First set up the top level input file */
     nasm_new(istk);
-    istk->fp = nasm_open_read(file, NF_TEXT);
-    if (!istk->fp) {
+    cf = nasm_cached_file(file);
+    if (!cf) {
 	nasm_fatalf(ERR_NOFILE, "unable to open input file `%s'%s%s",
                     file, errno ? " " : "", errno ? strerror(errno) : "");
     }
+    src_open(istk, cf);
     src_set(0, file);
+    if (unlikely(profile_enabled))
+        profile_count(PROF_FILE, file, 0, 0);
     istk->where = src_where();
     istk->lineinc = 1;
 
@@ -7541,6 +9400,7 @@ void pp_init(enum preproc_opt opt)
 {
     ppopt = opt;
     nasm_newn(use_loaded, use_package_count);
+    current_inv_list = &dmi.inv;
 }
 
 /*
@@ -7548,7 +9408,25 @@ void pp_init(enum preproc_opt opt)
  * we return a pointer to the dummy token tok_pop; at that point if
  * istk is NULL then we have reached end of input;
  */
-static Token tok_pop;           /* Dummy token placeholder */
+static per_thread Token tok_pop;           /* Dummy token placeholder */
+
+/*
+ * Tell --profile that a new line has been fetched, from the current
+ * file or the expansion of the innermost macro. The standard macro
+ * package is not counted as a file.
+ */
+static void pp_profile_line(const Token *tline)
+{
+    const MMacro *m = istk->mstk.mmac;
+    uint64_t ntok = 0;
+    const Token *t;
+
+    list_for_each(t, tline)
+        ntok += !tok_white(t);
+
+    profile_line((istk->file || m) ? istk->where : src_nowhere(),
+                 m ? m->name : NULL, ntok);
+}
 
 static Token *pp_tokline(void)
 {
@@ -7582,13 +9460,16 @@ static Token *pp_tokline(void)
                  * if we did.
                  */
                 fm->in_progress--;
-                list_for_each(l, fm->expansion) {
+                if (fm->expansion) {
                     Line *ll;
 
+                    /*
+                     * The body is shared between the repetitions;
+                     * each line is copied when it is fetched.
+                     */
                     nasm_new(ll);
-                    ll->next  = istk->expansion;
-                    ll->first = dup_tlist(l->first, NULL);
-                    ll->where = l->where;
+                    ll->next = istk->expansion;
+                    ll->copy = fm->expansion;
                     istk->expansion = ll;
                 }
                 break;
@@ -7690,10 +9571,23 @@ static Token *pp_tokline(void)
             if (istk->expansion) {      /* from a macro expansion */
                 Line *l = istk->expansion;
 
-                istk->expansion = l->next;
-                istk->where = l->where;
-                tline = l->first;
-                nasm_free(l);
+                if (l->copy) {
+                    /* A shared %rep body: copy its next line */
+                    const Line *body = l->copy;
+
+                    l->copy = body->next;
+                    if (!l->copy) {
+                        istk->expansion = l->next;
+                        nasm_free(l);
+                    }
+                    istk->where = body->where;
+                    tline = dup_tlist(body->first, NULL);
+                } else {
+                    istk->expansion = l->next;
+                    istk->where = l->where;
+                    tline = l->first;
+                    nasm_free(l);
+                }
 
                 if (!istk->noline)
                     src_update(istk->where);
@@ -7704,16 +9598,19 @@ static Token *pp_tokline(void)
                     nasm_free(line);
                 }
             } else if ((line = read_line())) {
+                enum profile_step step = profile_enter(STEP_TOKENIZE);
                 tline = tokenize(line);
-                nasm_free(line);
+                profile_leave(step);
+            } else if (do_predef) {
+                pp_stdmac_end();
+                return &tok_pop;
             } else {
                 /*
                  * The current file has ended; work down the istk
                  */
                 Include *i = istk;
 
-                if (i->fp)
-                    fclose(i->fp);
+                src_close(i);
                 if (i->conds) {
                     /* nasm_fatal can't be conditionally suppressed */
                     nasm_fatal("expected `%%endif' before end of file");
@@ -7737,6 +9634,9 @@ static Token *pp_tokline(void)
             }
         } while (0);
 
+        if (unlikely(profile_enabled))
+            pp_profile_line(tline);
+
         /*
          * We must expand MMacro parameters and MMacro-local labels
          * _before_ we plunge into directive processing, to cope
@@ -7807,8 +9707,14 @@ static Token *pp_tokline(void)
              */
             free_tlist(tline);
         } else {
+            enum profile_step step;
+            int expanded;
+
             tline = expand_smacro(tline);
-            if (!expand_mmacro(tline))
+            step = profile_enter(STEP_EXPAND_MMACRO);
+            expanded = expand_mmacro(tline);
+            profile_leave(step);
+            if (!expanded)
                 return tline;
         }
     }
@@ -7819,6 +9725,13 @@ char *pp_getline(void)
     char *line = NULL;
     Token *tline;
 
+    stdscan_bind(NULL, NULL, 0);
+
+    if (replay_state == REPLAY_PLAY)
+        return pp_replay_getline();
+
+    in_getline = true;
+
     while (true) {
         tline = pp_tokline();
         if (tline == &tok_pop) {
@@ -7833,6 +9746,8 @@ char *pp_getline(void)
              * De-tokenize the line and emit it.
              */
             line = detoken(tline, true);
+            if (pp_mode == PP_NORMAL)
+                prescan_line(tline, line);
             free_tlist(tline);
             break;
         }
@@ -7844,11 +9759,25 @@ char *pp_getline(void)
         nasm_free(buf);
     }
 
+    in_getline = false;
+
+    if (replay_state == REPLAY_RECORD && line)
+        pp_replay_record(line);
+
     return line;
 }
 
 void pp_cleanup_pass(void)
 {
+    if (replay_state == REPLAY_PLAY) {
+        replay_state = REPLAY_OFF;
+        src_set_fname(NULL);
+        return;
+    }
+
+    /* A recording which survived the whole pass is valid */
+    replay_state = REPLAY_OFF;
+
     if (defining) {
         if (defining->name) {
             nasm_nonfatal("end of file while still defining macro `%s'",
@@ -7867,7 +9796,7 @@ void pp_cleanup_pass(void)
     while (istk) {
         Include *i = istk;
         istk = istk->next;
-        fclose(i->fp);
+        src_close(i);
         if (!istk && (ppdbg & PDBG_INCLUDE)) {
             /* Signal closing the top-level input file */
             dfmt->debug_include(false, src_nowhere(), i->where);
@@ -7884,9 +9813,29 @@ void pp_cleanup_pass(void)
 
 void pp_cleanup_session(void)
 {
+    nasm_free(srcline);
+    srcline = NULL;
+    srcline_size = 0;
+    stdscan_bind(NULL, NULL, 0);
+    nasm_free(scan_toks);
+    nasm_free(scan_text);
+    scan_toks = NULL;
+    scan_text = NULL;
+    scan_toks_size = scan_text_size = 0;
+
+    if (replay_lines) {
+        saa_free(replay_lines);
+        replay_lines = NULL;
+    }
     nasm_free(use_loaded);
     free_llist(predef);
     predef = NULL;
+    stdmac_free();
+    if (pch.mapped)
+        nasm_unmap_file(pch.data, pch.size);
+    else
+        nasm_free((void *)pch.data);
+    nasm_zero(pch);
     delete_Blocks();
     ipath_list = NULL;
 }
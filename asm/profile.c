@@ -0,0 +1,437 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * profile.c - timing and statistics for --profile
+ *
+ * Time is measured as the difference between successive calls to
+ * profile_tick(), and charged to the current pass, phase and step.
+ * Source lines are timed from the point where the preprocessor
+ * fetches one to the point where it fetches the next, so the time
+ * includes assembling the line.
+ */
+
+#include "compiler.h"
+
+#include "nasm.h"
+#include "nasmlib.h"
+#include "error.h"
+#include "hashtbl.h"
+#include "profile.h"
+
+/* Lines per line range */
+#define PROFILE_RANGE_LINES     100
+
+/* Number of objects of each kind in the text report */
+#define PROFILE_TEXT_TOP        20
+
+per_thread bool profile_enabled;
+per_thread enum profile_phase profile_cur_phase;
+per_thread enum profile_step profile_cur_step;
+
+static const char * const profile_phase_names[PROF_PHASES] = {
+    "preprocess", "parse", "size", "emit", "write"
+};
+static const char * const profile_step_names[PROF_STEPS] = {
+    "other", "read_line", "tokenize", "expand_smacro", "expand_mmacro",
+    "parse_line", "find_match", "assemble", "output", "write"
+};
+
+static per_thread uint64_t profile_last;
+static per_thread uint64_t phase_ns[PROF_PHASES];
+static per_thread uint64_t step_ns[PROF_STEPS];
+
+struct profile_pass {
+    const char *type;
+    uint64_t ns;
+};
+static per_thread struct profile_pass *passes;
+static per_thread size_t npasses;
+static per_thread int64_t cur_pass = -1;
+
+struct profile_entry {
+    struct profile_key {
+        const char *name;       /* Macro or file name */
+        int32_t range;          /* Line range number, for line ranges */
+    } key;
+    uint64_t calls, lines, tokens, ns;
+};
+
+/* Line ranges are kept in one more table, keyed by struct profile_key */
+#define PROF_RANGE PROF_KINDS
+static per_thread struct hash_table profile_tables[PROF_KINDS+1];
+
+static const char * const profile_kind_names[PROF_KINDS+1] = {
+    "mmacro", "smacro", "file", "lines"
+};
+static const char * const profile_json_names[PROF_KINDS+1] = {
+    "mmacros", "smacros", "files", "lines"
+};
+
+/* The line which is being timed */
+static per_thread struct {
+    struct profile_entry *file, *range, *macro;
+    uint64_t start;
+} pending;
+
+uint64_t profile_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (UINT64_C(1000000000) / CLOCKS_PER_SEC);
+#endif
+}
+
+void profile_tick(void)
+{
+    uint64_t now = profile_clock();
+    uint64_t ns = now - profile_last;
+
+    profile_last = now;
+    phase_ns[profile_cur_phase] += ns;
+    step_ns[profile_cur_step] += ns;
+    if (cur_pass >= 0)
+        passes[cur_pass].ns += ns;
+}
+
+static void profile_line_end(uint64_t now)
+{
+    uint64_t ns = now - pending.start;
+
+    if (pending.file)
+        pending.file->ns += ns;
+    if (pending.range)
+        pending.range->ns += ns;
+    if (pending.macro)
+        pending.macro->ns += ns;
+
+    nasm_zero(pending);
+    pending.start = now;
+}
+
+void profile_restart(enum profile_phase phase)
+{
+    if (!profile_enabled)
+        return;
+
+    profile_last = pending.start = profile_clock();
+    profile_cur_phase = phase;
+    profile_cur_step = STEP_OTHER;
+}
+
+void profile_pass_begin(void)
+{
+    if (!profile_enabled)
+        return;
+
+    passes = nasm_realloc(passes, (npasses + 1) * sizeof *passes);
+    passes[npasses].type = pass_type_name();
+    passes[npasses].ns = 0;
+    cur_pass = npasses++;
+
+    profile_restart(PROF_PREPROCESS);
+}
+
+void profile_pass_end(void)
+{
+    if (!profile_enabled)
+        return;
+
+    profile_tick();
+    profile_line_end(profile_last);
+    cur_pass = -1;
+}
+
+static struct profile_entry *
+profile_entry(enum profile_kind kind, const char *name)
+{
+    struct hash_insert hi;
+    struct profile_entry *e;
+    void **dp;
+
+    dp = hash_find(&profile_tables[kind], name, &hi);
+    if (dp)
+        return *dp;
+
+    nasm_new(e);
+    e->key.name = nasm_strdup(name);
+    hash_add(&hi, e->key.name, e);
+    return e;
+}
+
+/*
+ * The filename is one returned by the srcfile subsystem, so the
+ * pointer value identifies it.
+ */
+static struct profile_entry *
+profile_range(const char *filename, int32_t lineno)
+{
+    struct profile_key key;
+    struct hash_insert hi;
+    struct profile_entry *e;
+    void **dp;
+
+    nasm_zero(key);
+    key.name  = filename;
+    key.range = lineno > 0 ? (lineno - 1) / PROFILE_RANGE_LINES : 0;
+
+    dp = hash_findb(&profile_tables[PROF_RANGE], &key, sizeof key, &hi);
+    if (dp)
+        return *dp;
+
+    nasm_new(e);
+    e->key = key;
+    hash_add(&hi, &e->key, e);
+    return e;
+}
+
+void profile_count(enum profile_kind kind, const char *name,
+                   uint64_t tokens, uint64_t ns)
+{
+    struct profile_entry *e = profile_entry(kind, name);
+
+    e->calls++;
+    e->tokens += tokens;
+    e->ns += ns;
+}
+
+void profile_line(struct src_location where, const char *macro,
+                  uint64_t tokens)
+{
+    profile_line_end(profile_clock());
+
+    if (where.filename) {
+        pending.file = profile_entry(PROF_FILE, where.filename);
+        pending.file->lines++;
+        pending.file->tokens += tokens;
+        pending.range = profile_range(where.filename, where.lineno);
+        pending.range->lines++;
+        pending.range->tokens += tokens;
+    }
+    if (macro) {
+        pending.macro = profile_entry(PROF_MMACRO, macro);
+        pending.macro->lines++;
+        pending.macro->tokens += tokens;
+    }
+}
+
+/* Most expensive first */
+static int profile_cmp(const void *a, const void *b)
+{
+    const struct profile_entry *ea = *(const struct profile_entry * const *)a;
+    const struct profile_entry *eb = *(const struct profile_entry * const *)b;
+    int cmp;
+
+    if (ea->ns != eb->ns)
+        return ea->ns < eb->ns ? 1 : -1;
+    cmp = strcmp(ea->key.name, eb->key.name);
+    if (cmp)
+        return cmp;
+    return ea->key.range - eb->key.range;
+}
+
+static struct profile_entry **profile_sorted(int kind, size_t *np)
+{
+    struct profile_entry **list;
+    struct hash_iterator it;
+    const struct hash_node *node;
+    size_t n = 0;
+
+    nasm_newn(list, profile_tables[kind].load + 1);
+    hash_for_each(&profile_tables[kind], it, node)
+        list[n++] = node->data;
+
+    qsort(list, n, sizeof *list, profile_cmp);
+    *np = n;
+    return list;
+}
+
+static void profile_json_string(FILE *f, const char *str)
+{
+    unsigned char c;
+
+    fputc('"', f);
+    while ((c = *str++)) {
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < ' ')
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void profile_report_text(FILE *f, uint64_t total)
+{
+    size_t i, n;
+    int kind;
+
+    fprintf(f, "passes %"PRIu64"\n", (uint64_t)npasses);
+    for (i = 0; i < npasses; i++)
+        fprintf(f, "pass %"PRIu64" %s %.6f\n", (uint64_t)i + 1,
+                passes[i].type, passes[i].ns / 1e9);
+    for (i = 0; i < PROF_PHASES; i++)
+        fprintf(f, "phase %s %.6f\n", profile_phase_names[i],
+                phase_ns[i] / 1e9);
+    fprintf(f, "total %.6f\n", total / 1e9);
+    for (i = 0; i < PROF_STEPS; i++)
+        fprintf(f, "step %s %.6f\n", profile_step_names[i],
+                step_ns[i] / 1e9);
+
+    for (kind = 0; kind <= PROF_RANGE; kind++) {
+        struct profile_entry **list = profile_sorted(kind, &n);
+
+        if (n) {
+            fprintf(f, "\n# %-8s %10s %10s %10s %10s  name\n",
+                    profile_kind_names[kind],
+                    "calls", "lines", "tokens", "seconds");
+        }
+        for (i = 0; i < n && i < PROFILE_TEXT_TOP; i++) {
+            const struct profile_entry *e = list[i];
+
+            fprintf(f, "%-10s %10"PRIu64" %10"PRIu64" %10"PRIu64" %10.6f  %s",
+                    profile_kind_names[kind],
+                    e->calls, e->lines, e->tokens, e->ns / 1e9, e->key.name);
+            if (kind == PROF_RANGE)
+                fprintf(f, ":%"PRId32"-%"PRId32,
+                        e->key.range * PROFILE_RANGE_LINES + 1,
+                        (e->key.range + 1) * PROFILE_RANGE_LINES);
+            fputc('\n', f);
+        }
+        if (n > PROFILE_TEXT_TOP)
+            fprintf(f, "# ... and %"PRIu64" more\n",
+                    (uint64_t)(n - PROFILE_TEXT_TOP));
+        nasm_free(list);
+    }
+}
+
+static void profile_report_json(FILE *f, uint64_t total)
+{
+    size_t i, n;
+    int kind;
+
+    fprintf(f, "{\n  \"passes\": [");
+    for (i = 0; i < npasses; i++)
+        fprintf(f, "%s\n    { \"pass\": %"PRIu64", \"type\": \"%s\", "
+                "\"seconds\": %.6f }", i ? "," : "",
+                (uint64_t)i + 1, passes[i].type, passes[i].ns / 1e9);
+    fprintf(f, "\n  ],\n  \"phases\": {");
+    for (i = 0; i < PROF_PHASES; i++)
+        fprintf(f, "%s\n    \"%s\": %.6f", i ? "," : "",
+                profile_phase_names[i], phase_ns[i] / 1e9);
+    fprintf(f, "\n  },\n  \"total\": %.6f,\n  \"steps\": {", total / 1e9);
+    for (i = 0; i < PROF_STEPS; i++)
+        fprintf(f, "%s\n    \"%s\": %.6f", i ? "," : "",
+                profile_step_names[i], step_ns[i] / 1e9);
+    fprintf(f, "\n  }");
+
+    for (kind = 0; kind <= PROF_RANGE; kind++) {
+        struct profile_entry **list = profile_sorted(kind, &n);
+
+        fprintf(f, ",\n  \"%s\": [", profile_json_names[kind]);
+        for (i = 0; i < n; i++) {
+            const struct profile_entry *e = list[i];
+
+            fprintf(f, "%s\n    { \"%s\": ", i ? "," : "",
+                    kind == PROF_RANGE ? "file" : "name");
+            profile_json_string(f, e->key.name);
+            if (kind == PROF_RANGE)
+                fprintf(f, ", \"first\": %"PRId32", \"last\": %"PRId32,
+                        e->key.range * PROFILE_RANGE_LINES + 1,
+                        (e->key.range + 1) * PROFILE_RANGE_LINES);
+            fprintf(f, ", \"calls\": %"PRIu64", \"lines\": %"PRIu64
+                    ", \"tokens\": %"PRIu64", \"seconds\": %.6f }",
+                    e->calls, e->lines, e->tokens, e->ns / 1e9);
+        }
+        fprintf(f, "%s]", n ? "\n  " : "");
+        nasm_free(list);
+    }
+    fprintf(f, "\n}\n");
+}
+
+void profile_report(const char *filename, bool json)
+{
+    FILE *f = error_file;
+    uint64_t total = 0;
+    int i;
+
+    if (!profile_enabled)
+        return;
+
+    if (filename) {
+        f = nasm_open_write(filename, NF_TEXT);
+        if (!f) {
+            nasm_nonfatalf(ERR_USAGE, "unable to open profile file `%s'",
+                           filename);
+            return;
+        }
+    }
+
+    for (i = 0; i < PROF_PHASES; i++)
+        total += phase_ns[i];
+
+    if (json)
+        profile_report_json(f, total);
+    else
+        profile_report_text(f, total);
+
+    if (filename)
+        fclose(f);
+}
+
+void profile_free(void)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+    int kind;
+
+    for (kind = 0; kind <= PROF_RANGE; kind++) {
+        hash_for_each(&profile_tables[kind], it, np) {
+            struct profile_entry *e = np->data;
+            if (kind != PROF_RANGE)
+                nasm_free((char *)e->key.name);
+            nasm_free(e);
+        }
+        hash_free(&profile_tables[kind]);
+    }
+
+    nasm_free(passes);
+    passes = NULL;
+    npasses = 0;
+    cur_pass = -1;
+}
@@ -0,0 +1,143 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * profile.h - timing and statistics for --profile
+ *
+ * All the hooks reduce to a test of profile_enabled when profiling
+ * is off.
+ */
+#ifndef ASM_PROFILE_H
+#define ASM_PROFILE_H
+
+#include "compiler.h"
+#include "srcfile.h"
+
+/*
+ * Top-level phases. Time is charged to the current phase until
+ * profile_phase() selects another one.
+ */
+enum profile_phase {
+    PROF_PREPROCESS,            /* pp_getline() */
+    PROF_PARSE,                 /* Directives and parse_line() */
+    PROF_SIZE,                  /* Matching and sizing, before the final pass */
+    PROF_EMIT,                  /* Code generation in the final pass */
+    PROF_WRITE,                 /* Output format cleanup; writes the file */
+    PROF_PHASES
+};
+
+/*
+ * Finer steps, nested within the phases. Steps nest within each
+ * other as well; the time is charged to the innermost one only.
+ */
+enum profile_step {
+    STEP_OTHER,                 /* Not in any of the below */
+    STEP_READ_LINE,             /* read_line() */
+    STEP_TOKENIZE,              /* tokenize() of source lines */
+    STEP_EXPAND_SMACRO,         /* expand_smacro() */
+    STEP_EXPAND_MMACRO,         /* expand_mmacro() */
+    STEP_PARSE_LINE,            /* parse_line() */
+    STEP_FIND_MATCH,            /* find_match() */
+    STEP_ASSEMBLE,              /* The rest of assemble() and insn_size() */
+    STEP_OUTPUT,                /* ofmt->output() */
+    STEP_WRITE,                 /* ofmt->cleanup() */
+    PROF_STEPS
+};
+
+/* Objects which are counted by name */
+enum profile_kind {
+    PROF_MMACRO,                /* Multi-line macros */
+    PROF_SMACRO,                /* Single-line macros */
+    PROF_FILE,                  /* Input and include files */
+    PROF_KINDS
+};
+
+extern per_thread bool profile_enabled;
+extern per_thread enum profile_phase profile_cur_phase;
+extern per_thread enum profile_step profile_cur_step;
+
+uint64_t profile_clock(void);
+void profile_tick(void);
+
+static inline void profile_phase(enum profile_phase phase)
+{
+    if (unlikely(profile_enabled)) {
+        profile_tick();
+        profile_cur_phase = phase;
+    }
+}
+
+/* Enter a step; returns the step to pass to profile_leave() */
+static inline enum profile_step profile_enter(enum profile_step step)
+{
+    enum profile_step prev = profile_cur_step;
+
+    if (unlikely(profile_enabled)) {
+        profile_tick();
+        profile_cur_step = step;
+    }
+    return prev;
+}
+
+static inline void profile_leave(enum profile_step prev)
+{
+    if (unlikely(profile_enabled)) {
+        profile_tick();
+        profile_cur_step = prev;
+    }
+}
+
+/* Start timing a pass, or some work outside of the passes */
+void profile_pass_begin(void);
+void profile_pass_end(void);
+void profile_restart(enum profile_phase phase);
+
+/*
+ * Count one invocation of a named object, the tokens it generated
+ * and the time it took, if known.
+ */
+void profile_count(enum profile_kind kind, const char *name,
+                   uint64_t tokens, uint64_t ns);
+
+/*
+ * A new source line has been fetched. The time since the previous
+ * line was fetched is charged to that line's file, line range and
+ * innermost macro, if any.
+ */
+void profile_line(struct src_location where, const char *macro,
+                  uint64_t tokens);
+
+void profile_report(const char *filename, bool json);
+void profile_free(void);
+
+#endif /* ASM_PROFILE_H */
@@ -0,0 +1,597 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * rescache.c - cache of the results of whole assemblies (--cache)
+ *
+ * A result is stored in a single file in the cache directory, named
+ * by the hex digits of its key:
+ *
+ *   "NASMRC01", then for each of RC_FILES:
+ *   64-bit little-endian length (RC_ABSENT if not produced), contents
+ *
+ * It is written to a temporary file and renamed, so concurrent runs
+ * never see half a result.
+ */
+
+#include "compiler.h"
+
+#include "nasm.h"
+#include "nasmlib.h"
+#include "nctype.h"
+#include "error.h"
+#include "quote.h"
+#include "md5.h"
+#include "ver.h"
+#include "rescache.h"
+
+#define RC_MAGIC        "NASMRC01"
+#define RC_MAGIC_LEN    8
+#define RC_ABSENT       UINT64_MAX
+
+struct rescache {
+    char *dir;                  /* The cache directory */
+    char *entry;                /* File of the result, once the key is known */
+    const char *why;            /* Why the result can't be cached */
+    const struct strlist *ipath; /* Include path */
+    struct strlist *pre_include; /* -P files */
+    struct strlist *pre_text;   /* --before lines */
+    struct strlist *seen;       /* Files already in the key */
+    MD5_CTX md5;                /* The key so far */
+};
+
+/*
+ * Add a tagged, counted item to the key, so different sequences of
+ * items can never hash the same bytes.
+ */
+static void key_add(struct rescache *rc, char tag, const void *data,
+                    size_t len)
+{
+    const unsigned char *p = data;
+    unsigned char hdr[9];
+    int i;
+
+    hdr[0] = tag;
+    for (i = 0; i < 8; i++)
+        hdr[i+1] = (unsigned char)((uint64_t)len >> (i << 3));
+    MD5Update(&rc->md5, hdr, sizeof hdr);
+
+    /* MD5Update() takes an unsigned length */
+    while (len) {
+        unsigned int n = len > (1U << 30) ? (1U << 30) : (unsigned int)len;
+        MD5Update(&rc->md5, p, n);
+        p   += n;
+        len -= n;
+    }
+}
+
+static void key_str(struct rescache *rc, char tag, const char *str)
+{
+    key_add(rc, tag, str, strlen(str));
+}
+
+struct rescache *rescache_new(const char *dir)
+{
+    struct rescache *rc;
+    char *cwd;
+
+    nasm_new(rc);
+    rc->dir         = nasm_strdup(dir);
+    rc->pre_include = strlist_alloc(false);
+    rc->pre_text    = strlist_alloc(false);
+    rc->seen        = strlist_alloc(true);
+
+    MD5Init(&rc->md5);
+    key_str(rc, 'V', nasm_version);
+    key_str(rc, 'V', nasm_compile_options);
+
+    /* Paths in the output, e.g. in debug information, depend on it */
+    cwd = nasm_realpath(".");
+    key_str(rc, 'C', cwd);
+    nasm_free(cwd);
+
+    return rc;
+}
+
+void rescache_free(struct rescache **rcp)
+{
+    struct rescache *rc = *rcp;
+
+    if (!rc)
+        return;
+
+    nasm_free(rc->dir);
+    nasm_free(rc->entry);
+    strlist_free(&rc->pre_include);
+    strlist_free(&rc->pre_text);
+    strlist_free(&rc->seen);
+    nasm_free(rc);
+    *rcp = NULL;
+}
+
+void rescache_arg(struct rescache *rc, const char *arg)
+{
+    key_str(rc, 'A', arg);
+}
+
+void rescache_pre_include(struct rescache *rc, const char *file)
+{
+    strlist_add(rc->pre_include, file);
+}
+
+void rescache_pre_text(struct rescache *rc, const char *text)
+{
+    strlist_add(rc->pre_text, text);
+}
+
+void rescache_disable(struct rescache *rc, const char *why)
+{
+    if (!rc->why)
+        rc->why = why;
+}
+
+/* The same search as the preprocessor does for %include */
+static char *search_path(const struct rescache *rc, const char *file)
+{
+    const struct strlist_entry *ip = strlist_head(rc->ipath);
+    const char *prefix = "";
+    char *sp;
+
+    while (1) {
+        sp = nasm_catfile(prefix, file);
+        if (nasm_file_exists(sp))
+            return sp;
+
+        nasm_free(sp);
+
+        if (!ip)
+            return NULL;
+
+        prefix = ip->str;
+        ip = ip->next;
+    }
+}
+
+static void scan_text(struct rescache *rc, const char *data, size_t len);
+
+/*
+ * Add a file to the key, and scan it for more if it is source.
+ * A missing file is part of the key too.
+ */
+static void scan_file(struct rescache *rc, const char *name, bool search,
+                      bool source)
+{
+    const struct cached_file *cf;
+    char *path, *seen;
+    bool done;
+
+    key_str(rc, 'F', name);
+
+    path = search ? search_path(rc, name) : nasm_strdup(name);
+    if (!path) {
+        key_str(rc, 'M', "");
+        return;
+    }
+    key_str(rc, 'P', path);
+
+    /* Each file is hashed and scanned only once */
+    seen = nasm_strcat(source ? "s:" : "b:", path);
+    done = !!strlist_find(rc->seen, seen);
+    if (!done)
+        strlist_add(rc->seen, seen);
+    nasm_free(seen);
+    if (done) {
+        nasm_free(path);
+        return;
+    }
+
+    /* Read through the file cache, which the assembly then reuses */
+    cf = nasm_cached_file(path);
+    nasm_free(path);
+    if (!cf) {
+        key_str(rc, 'M', "");
+        return;
+    }
+
+    key_add(rc, 'D', cf->data, cf->len);
+    if (source)
+        scan_text(rc, cf->data, cf->len);
+}
+
+/*
+ * A file name, which must be a literal string for the input set to be
+ * known.  Returns the position after it.
+ */
+static char *scan_filename(struct rescache *rc, char *p, bool search,
+                           bool source)
+{
+    char *ep;
+
+    p = nasm_skip_spaces(p);
+    if (!nasm_isquote(*p)) {
+        rescache_disable(rc, "file name is not a literal string");
+        return p;
+    }
+
+    nasm_unquote(p, &ep);
+    scan_file(rc, p, search, source);
+    return *ep ? ep + 1 : ep;
+}
+
+static bool word_is(const char *word, size_t len, const char *what)
+{
+    return len == strlen(what) && !nasm_strnicmp(word, what, len);
+}
+
+/* The standard macros which expand to the date or time */
+static bool is_time_macro(const char *word, size_t len)
+{
+    static const char * const time_macros[] = {
+        "DATE", "TIME", "DATE_NUM", "TIME_NUM",
+        "UTC_DATE", "UTC_TIME", "UTC_DATE_NUM", "UTC_TIME_NUM",
+        "POSIX_TIME"
+    };
+    size_t i;
+
+    if (len < 5 || memcmp(word, "__", 2) || memcmp(word + len - 2, "__", 2))
+        return false;
+
+    word += 2;
+    len  -= 4;
+    if (len >= 2 && word[0] == '?' && word[len-1] == '?') {
+        word++;
+        len -= 2;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(time_macros); i++) {
+        if (len == strlen(time_macros[i]) &&
+            !memcmp(word, time_macros[i], len))
+            return true;
+    }
+    return false;
+}
+
+static char *scan_directive(struct rescache *rc, const char *word,
+                            size_t len, char *p)
+{
+    if (word_is(word, len, "include") || word_is(word, len, "require"))
+        return scan_filename(rc, p, true, true);
+
+    if (word_is(word, len, "depend"))
+        return scan_filename(rc, p, false, false);
+
+    if (word_is(word, len, "pathsearch")) {
+        /* Skip the macro name */
+        p = nasm_skip_spaces(p);
+        while (*p && !nasm_isspace(*p) && !nasm_isquote(*p))
+            p++;
+        return scan_filename(rc, p, true, false);
+    }
+
+    if (word_is(word, len, "ifenv") || word_is(word, len, "ifnenv") ||
+        word_is(word, len, "elifenv") || word_is(word, len, "elifnenv"))
+        rescache_disable(rc, "uses the environment");
+
+    return p;
+}
+
+/*
+ * Scan one line for what makes the assembly read other files, or
+ * depend on something else than its inputs.  This sees every line,
+ * whether it is assembled or skipped, so the input set found may be
+ * larger than the real one, but never smaller.
+ */
+static void scan_line(struct rescache *rc, char *p)
+{
+    bool first = true;
+    const char *word;
+    size_t len;
+
+    while (*p && !rc->why) {
+        if (nasm_isspace(*p)) {
+            p++;
+            continue;
+        }
+
+        if (*p == ';') {
+            break;
+        } else if (nasm_isquote(*p)) {
+            p = nasm_skip_string(p);
+            if (*p)
+                p++;
+        } else if (*p == '%' && p[1] == '!') {
+            rescache_disable(rc, "uses the environment");
+        } else if (*p == '%' && nasm_isidstart(p[1])) {
+            word = ++p;
+            while (nasm_isidchar(*p))
+                p++;
+            if (first)
+                p = scan_directive(rc, word, p - word, p);
+        } else if (nasm_isidstart(*p)) {
+            word = p;
+            while (nasm_isidchar(*p))
+                p++;
+            len = p - word;
+            if (word_is(word, len, "incbin"))
+                p = scan_filename(rc, p, true, false);
+            else if (is_time_macro(word, len))
+                rescache_disable(rc, "uses the date or time");
+        } else if (*p == '[' && first) {
+            /* [MAP] writes a file of its own */
+            p = nasm_skip_spaces(p + 1);
+            word = p;
+            while (nasm_isidchar(*p))
+                p++;
+            if (word_is(word, p - word, "map"))
+                rescache_disable(rc, "writes a map file");
+        } else {
+            p++;
+        }
+        first = false;
+    }
+}
+
+static void scan_text(struct rescache *rc, const char *data, size_t len)
+{
+    const char *end = data + len;
+    char *buf = NULL;
+    size_t bufsize = 0;
+
+    while (data < end && !rc->why) {
+        size_t n = 0;
+
+        /* One line, with its continuation lines */
+        while (1) {
+            const char *eol = memchr(data, '\n', end - data);
+            size_t ll = (eol ? eol : end) - data;
+
+            if (n + ll + 1 > bufsize) {
+                bufsize = (n + ll + 1) << 1;
+                buf = nasm_realloc(buf, bufsize);
+            }
+            memcpy(buf + n, data, ll);
+            n += ll;
+            data = eol ? eol + 1 : end;
+
+            if (n && buf[n-1] == '\r')
+                n--;
+            if (!n || buf[n-1] != '\\' || data >= end)
+                break;
+            n--;
+        }
+        buf[n] = '\0';
+        scan_line(rc, buf);
+    }
+
+    nasm_free(buf);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_u64(FILE *f, uint64_t v)
+{
+    unsigned char buf[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(v >> (i << 3));
+    fwrite(buf, 1, 8, f);
+}
+
+/* Read a whole file into memory */
+static char *read_file(const char *name, size_t *lenp)
+{
+    FILE *f;
+    off_t size;
+    char *buf;
+    size_t len;
+
+    f = nasm_open_read(name, NF_BINARY);
+    if (!f)
+        return NULL;
+
+    size = nasm_file_size(f);
+    if (size < 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    buf = nasm_malloc(size + 1);
+    len = fread(buf, 1, size, f);
+    if (ferror(f) || len != (size_t)size) {
+        nasm_free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+
+    *lenp = len;
+    return buf;
+}
+
+static bool write_file(const char *name, const char *data, size_t len)
+{
+    FILE *f;
+    bool ok;
+
+    f = nasm_open_write(name, NF_BINARY);
+    if (!f)
+        return false;
+
+    fwrite(data, 1, len, f);
+    ok = !ferror(f);
+    ok &= !fclose(f);
+    return ok;
+}
+
+/* Restore the files of the result, if the cache has it */
+static bool restore(struct rescache *rc, const char * const files[RC_FILES])
+{
+    const unsigned char *p, *end;
+    const unsigned char *data[RC_FILES];
+    uint64_t len[RC_FILES];
+    char *buf;
+    size_t buflen;
+    bool ok = false;
+    int i;
+
+    buf = read_file(rc->entry, &buflen);
+    if (!buf)
+        return false;
+
+    p   = (const unsigned char *)buf;
+    end = p + buflen;
+    if (buflen < RC_MAGIC_LEN || memcmp(p, RC_MAGIC, RC_MAGIC_LEN))
+        goto done;
+    p += RC_MAGIC_LEN;
+
+    /* Check the whole entry before writing anything */
+    for (i = 0; i < RC_FILES; i++) {
+        if (end - p < 8)
+            goto done;
+        len[i] = get_u64(p);
+        p += 8;
+        data[i] = p;
+
+        if (len[i] == RC_ABSENT) {
+            if (files[i])
+                goto done;
+        } else {
+            if (!files[i] || len[i] > (uint64_t)(end - p))
+                goto done;
+            p += len[i];
+        }
+    }
+
+    ok = true;
+    for (i = 0; i < RC_FILES; i++) {
+        if (files[i])
+            ok &= write_file(files[i], (const char *)data[i], len[i]);
+    }
+
+done:
+    nasm_free(buf);
+    return ok;
+}
+
+bool rescache_fetch(struct rescache *rc, const char *inname,
+                    const struct strlist *ipath,
+                    const char * const files[RC_FILES])
+{
+    const struct strlist_entry *e;
+    unsigned char digest[MD5_HASHBYTES];
+    char key[MD5_HASHBYTES*2 + 1];
+    bool hit;
+    int i;
+
+    rc->ipath = ipath;
+    strlist_for_each(e, rc->pre_text)
+        scan_text(rc, e->str, e->size - 1);
+    strlist_for_each(e, rc->pre_include)
+        scan_file(rc, e->str, true, true);
+    scan_file(rc, inname, false, true);
+
+    if (rc->why) {
+        if (debug_level(1))
+            nasm_debug("result cache: `%s' not cached: %s",
+                       inname, rc->why);
+        return false;
+    }
+
+    MD5Final(digest, &rc->md5);
+    for (i = 0; i < MD5_HASHBYTES; i++)
+        sprintf(key + (i << 1), "%02x", digest[i]);
+    rc->entry = nasm_catfile(rc->dir, key);
+
+    hit = restore(rc, files);
+    if (debug_level(1))
+        nasm_debug("result cache: %s for `%s' (%s)",
+                   hit ? "hit" : "miss", inname, key);
+    return hit;
+}
+
+void rescache_store(struct rescache *rc, const char * const files[RC_FILES])
+{
+    char *tmpname;
+    FILE *f;
+    bool ok;
+    int i;
+
+    if (rc->why || !rc->entry)
+        return;
+
+    /*
+     * Fails if another run is storing the same result right now, or
+     * if there is no cache directory.
+     */
+    tmpname = nasm_strcat(rc->entry, ".tmp");
+    f = fopen(tmpname, "wbx");
+    if (!f) {
+        nasm_free(tmpname);
+        return;
+    }
+
+    fwrite(RC_MAGIC, 1, RC_MAGIC_LEN, f);
+    ok = true;
+    for (i = 0; i < RC_FILES && ok; i++) {
+        char *data;
+        size_t len;
+
+        if (!files[i]) {
+            put_u64(f, RC_ABSENT);
+            continue;
+        }
+
+        data = read_file(files[i], &len);
+        if (!data) {
+            ok = false;
+            break;
+        }
+        put_u64(f, len);
+        fwrite(data, 1, len, f);
+        nasm_free(data);
+    }
+
+    ok &= !ferror(f);
+    ok &= !fclose(f);
+    if (!ok || rename(tmpname, rc->entry))
+        remove(tmpname);
+    nasm_free(tmpname);
+}
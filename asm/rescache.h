@@ -0,0 +1,82 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * rescache.h - cache of the results of whole assemblies (--cache)
+ *
+ * The key of a result is a hash of everything the assembly depends
+ * on: the version of NASM, the working directory, the command line
+ * and the contents of every file it reads.  The input files are
+ * found by a quick scan of the source for %include, incbin and the
+ * like, without preprocessing it.  If the scan can't tell which files
+ * are read, or if the output depends on anything else, such as the
+ * time, the assembly is not cached.
+ */
+#ifndef ASM_RESCACHE_H
+#define ASM_RESCACHE_H
+
+#include "compiler.h"
+#include "strlist.h"
+
+/* The files a cached result consists of */
+enum rescache_file {
+    RC_OBJ,                     /* Output file */
+    RC_DEP,                     /* Dependencies (-MD) */
+    RC_LIST,                    /* Listing */
+    RC_FILES
+};
+
+struct rescache;
+
+struct rescache *rescache_new(const char *dir);
+void rescache_free(struct rescache **rcp);
+
+/* Things that are part of the key, in addition to the input files */
+void rescache_arg(struct rescache *rc, const char *arg);
+void rescache_pre_include(struct rescache *rc, const char *file);
+void rescache_pre_text(struct rescache *rc, const char *text);
+void rescache_disable(struct rescache *rc, const char *why);
+
+/*
+ * Compute the key, and restore the files from the cache if there is a
+ * result for it.  files[] are the names of the files, or NULL for those
+ * not produced.  Returns true if the files were restored.
+ */
+bool rescache_fetch(struct rescache *rc, const char *inname,
+                    const struct strlist *ipath,
+                    const char * const files[RC_FILES]);
+
+/* Store the files produced by a successful assembly */
+void rescache_store(struct rescache *rc, const char * const files[RC_FILES]);
+
+#endif /* ASM_RESCACHE_H */
@@ -49,14 +49,16 @@
 #include "hashtbl.h"
 #include "srcfile.h"
 
-struct src_location_stack _src_top;
-struct src_location_stack *_src_bottom = &_src_top;
-struct src_location_stack *_src_error = &_src_top;
+per_thread struct src_location_stack _src_top;
+per_thread struct src_location_stack *_src_bottom;
+per_thread struct src_location_stack *_src_error;
 
-static struct hash_table filename_hash;
+static per_thread struct hash_table filename_hash;
 
 void src_init(void)
 {
+    /* The address of a thread-local variable is not a constant */
+    _src_bottom = _src_error = &_src_top;
 }
 
 void src_free(void)
@@ -66,9 +66,9 @@ struct src_location_stack {
     struct src_location_stack *up, *down;
     const void *macro;
 };
-extern struct src_location_stack _src_top;
-extern struct src_location_stack *_src_bottom;
-extern struct src_location_stack *_src_error;
+extern per_thread struct src_location_stack _src_top;
+extern per_thread struct src_location_stack *_src_bottom;
+extern per_thread struct src_location_stack *_src_error;
 
 void src_init(void);
 void src_free(void);
@@ -169,6 +169,28 @@ static inline struct src_location src_update(struct src_location whence)
     return old;
 }
 
+/*
+ * Go back to a location outside of any macro expansion for a while,
+ * to emit something deferred from an earlier line; src_resume()
+ * returns to where we were.
+ */
+struct src_saved {
+    struct src_location_stack top;
+    struct src_location_stack *bottom;
+};
+static inline void src_revisit(struct src_saved *save)
+{
+    save->top    = _src_top;
+    save->bottom = _src_bottom;
+    _src_top.down = NULL;
+    _src_bottom   = &_src_top;
+}
+static inline void src_resume(const struct src_saved *save)
+{
+    _src_top    = save->top;
+    _src_bottom = save->bottom;
+}
+
 /*
  * Push/pop macro expansion level. "macroname" must remain constant at
  * least until the same macro expansion level is popped.
@@ -41,20 +41,54 @@
 #include "quote.h"
 #include "stdscan.h"
 #include "insns.h"
+#include "atom.h"
 
 /*
  * Standard scanner routine used by parser.c and some output
  * formats. It keeps a succession of temporary-storage strings in
  * stdscan_tempstorage, which can be cleared using stdscan_reset.
+ * Identifiers are interned as atoms instead, which are kept for the
+ * whole assembly.
  */
-static char *stdscan_bufptr = NULL;
-static char **stdscan_tempstorage = NULL;
-static int stdscan_tempsize = 0, stdscan_templen = 0;
+static per_thread char *stdscan_bufptr = NULL;
+static per_thread char **stdscan_tempstorage = NULL;
+static per_thread int stdscan_tempsize = 0, stdscan_templen = 0;
 #define STDSCAN_TEMP_DELTA 256
 
+/*
+ * Tokens of the current source line, as already classified by the
+ * preprocessor. They are used while the scanner has been set to the
+ * start of that line and not reset since, i.e. by the parser; any
+ * other user of the scanner, or any part of the line which was not
+ * classified in advance, is scanned from the text as usual.
+ */
+static per_thread const char *bound_line;
+static per_thread const struct stdscan_token *bound_toks;
+static per_thread size_t bound_ntoks, bound_next;
+static per_thread bool bound_active;
+
+void stdscan_bind(const char *line, const struct stdscan_token *toks,
+                  size_t ntoks)
+{
+    bound_line   = ntoks ? line : NULL;
+    bound_toks   = toks;
+    bound_ntoks  = ntoks;
+    bound_next   = 0;
+    bound_active = false;
+}
+
 void stdscan_set(char *str)
 {
         stdscan_bufptr = str;
+        if (!bound_line) {
+            return;
+        } else if (str == bound_line) {
+            bound_active = true;
+            bound_next = 0;
+        } else if (str < bound_line ||
+                   str > bound_line + bound_toks[bound_ntoks-1].end) {
+            bound_active = false;
+        }
 }
 
 char *stdscan_get(void)
@@ -69,6 +103,7 @@ static void stdscan_pop(void)
 
 void stdscan_reset(void)
 {
+    bound_active = false;
     while (stdscan_templen > 0)
         stdscan_pop();
 }
@@ -102,6 +137,37 @@ static char *stdscan_copy(const char *p, int len)
     return text;
 }
 
+/*
+ * Find the classified token, if any, starting at the current
+ * position in the bound line.
+ */
+static const struct stdscan_token *stdscan_bound_token(void)
+{
+    size_t pos = stdscan_bufptr - bound_line;
+    size_t lo, hi;
+
+    if (likely(bound_next < bound_ntoks &&
+               bound_toks[bound_next].start == pos))
+        return &bound_toks[bound_next++];
+
+    /* We have been moved around; find the first token at or after pos */
+    lo = 0;
+    hi = bound_ntoks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) >> 1;
+        if (bound_toks[mid].start < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    bound_next = lo;
+    if (lo < bound_ntoks && bound_toks[lo].start == pos)
+        return &bound_toks[bound_next++];
+
+    return NULL;
+}
+
 /*
  * a token is enclosed with braces. proper token type will be assigned
  * accordingly with the token flag.
@@ -134,6 +200,29 @@ int stdscan(void *private_data, struct tokenval *tv)
     if (!*stdscan_bufptr)
         return tv->t_type = TOKEN_EOS;
 
+    if (bound_active) {
+        const struct stdscan_token *st = stdscan_bound_token();
+
+        if (st) {
+            *tv = st->tv;
+            stdscan_bufptr = (char *)bound_line + st->end;
+
+            if (tv->t_type == TOKEN_NUM && tv->t_charptr) {
+                bool rn_error;
+
+                tv->t_integer = readnum(tv->t_charptr, &rn_error);
+                tv->t_charptr = NULL;
+                if (rn_error)
+                    return tv->t_type = TOKEN_ERRNUM;
+            } else if (unlikely(tv->t_flag & TFLAG_WARN)) {
+                nasm_warn(WARN_PTR, "`%s' is not a NASM keyword",
+                          tv->t_charptr);
+            }
+
+            return tv->t_type;
+        }
+    }
+
     /* we have a token; either an id, a number or a char */
     if (nasm_isidstart(*stdscan_bufptr) ||
         (*stdscan_bufptr == '$' && nasm_isidstart(stdscan_bufptr[1]))) {
@@ -151,9 +240,10 @@ int stdscan(void *private_data, struct tokenval *tv)
         while (nasm_isidchar(*stdscan_bufptr))
             stdscan_bufptr++;
 
-        /* ... copy only up to IDLEN_MAX-1 characters */
-        tv->t_charptr = stdscan_copy(r, stdscan_bufptr - r < IDLEN_MAX ?
-                                     stdscan_bufptr - r : IDLEN_MAX - 1);
+        /* ... keep only up to IDLEN_MAX-1 characters */
+        tv->t_atom = atom_intern(r, stdscan_bufptr - r < IDLEN_MAX ?
+                                 stdscan_bufptr - r : IDLEN_MAX - 1);
+        tv->t_charptr = (char *)atom_str(tv->t_atom);
 
         if (is_sym || stdscan_bufptr - r > MAX_KEYWORD)
             return tv->t_type = TOKEN_ID;       /* bypass all other checks */
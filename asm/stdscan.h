@@ -38,7 +38,20 @@
 #ifndef NASM_STDSCAN_H
 #define NASM_STDSCAN_H
 
+/*
+ * A token of a source line which has already been classified the
+ * way stdscan() would classify it; start and end are offsets of the
+ * token text in the line. A TOKEN_NUM with a non-NULL t_charptr has
+ * not been converted yet; stdscan() does that when it is consumed.
+ */
+struct stdscan_token {
+    struct tokenval tv;
+    size_t start, end;
+};
+
 /* Standard scanner */
+void stdscan_bind(const char *line, const struct stdscan_token *toks,
+                  size_t ntoks);
 void stdscan_set(char *str);
 char *stdscan_get(void);
 void stdscan_reset(void);
@@ -173,7 +173,7 @@ if ($what eq 'c') {
 	print $out ",\n\tWARN_INIT_", uc($warn->{def});
     }
     print $out "\n};\n\n";
-    printf $out "uint8_t warning_state[%d];\t/* Current state */\n",
+    printf $out "per_thread uint8_t warning_state[%d];\t/* Current state */\n",
 	$#warn_noall + 2;
 } elsif ($what eq 'h') {
     my $filename = basename($outfile);
@@ -220,7 +220,7 @@ if ($what eq 'c') {
     print $out "extern const struct warning_alias warning_alias[NUM_WARNING_ALIAS];\n";
     printf $out "extern const uint8_t warning_default[%d];\n",
 	$#warn_noall + 2;
-    printf $out "extern uint8_t warning_state[%d];\n",
+    printf $out "extern per_thread uint8_t warning_state[%d];\n",
 	$#warn_noall + 2;
     print $out "\n#endif /* $guard */\n";
 } elsif ($what eq 'doc') {
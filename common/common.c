@@ -43,7 +43,7 @@
 /*
  * The current bit size of the CPU
  */
-int globalbits = 0;
+per_thread int globalbits = 0;
 /*
  * Common list of prefix names; ideally should be auto-generated
  * from tokens.dat. This MUST match the enum in include/nasm.h.
@@ -330,6 +330,25 @@ static inline void *mempset(void *dst, int c, size_t n)
 #define fatal_func     no_return unlikely_func
 #define fatal_func_ptr no_return unlikely_func_ptr
 
+/*
+ * Storage class of the state of an assembly.  Every thread has a
+ * copy of its own, so several threads can each run an assembly at
+ * the same time.  NASM_THREADS is 0 if the compiler can't do that.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+# define per_thread _Thread_local
+# define NASM_THREADS 1
+#elif defined(__GNUC__)
+# define per_thread __thread
+# define NASM_THREADS 1
+#elif defined(_MSC_VER)
+# define per_thread __declspec(thread)
+# define NASM_THREADS 1
+#else
+# define per_thread
+# define NASM_THREADS 0
+#endif
+
 /*
  * How to tell the compiler that a function takes a printf-like string
  */
@@ -110,6 +110,6 @@ static inline int32_t debug_macro_seg(const struct debug_macro_addr *dma)
 struct debug_macro_addr *debug_macro_get_addr(int32_t seg);
 
 /* The macro we are currently emitting for, if any */
-extern struct debug_macro_inv *debug_current_macro;
+extern per_thread struct debug_macro_inv *debug_current_macro;
 
 #endif /* NASM_DBGINFO_H */
@@ -43,7 +43,7 @@
 /*
  * File pointer for error messages
  */
-extern FILE *error_file;        /* Error file descriptor */
+extern per_thread FILE *error_file;        /* Error file descriptor */
 
 /*
  * Typedef for the severity field
@@ -153,7 +153,7 @@ void nasm_error_hold_pop(errhold hold, bool issue);
 /* Debug level checks */
 static inline bool debug_level(unsigned int level)
 {
-    extern unsigned int debug_nasm;
+    extern per_thread unsigned int debug_nasm;
     if (is_constant(level) && level > MAX_DEBUG)
         return false;
     return unlikely(level <= debug_nasm);
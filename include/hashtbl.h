@@ -51,6 +51,7 @@ struct hash_node {
 
 struct hash_table {
     struct hash_node *table;
+    uint8_t *ctrl;              /* Per-slot tag byte; follows table */
     size_t load;
     size_t size;
     size_t max_load;
@@ -102,6 +103,7 @@ const struct hash_node *hash_iterate(struct hash_iterator *iterator);
     for (hash_iterator_init((_head), &(_it)), (_np) = hash_iterate(&(_it)) ; \
          (_np) ; (_np) = hash_iterate(&(_it)))
 
+void hash_copy(struct hash_table *dst, const struct hash_table *src);
 void hash_free(struct hash_table *head);
 void hash_free_all(struct hash_table *head, bool free_keys);
 
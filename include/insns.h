@@ -41,8 +41,27 @@ struct disasm_index {
     int n;
 };
 
+/*
+ * Compact prefilter index for the assembler, generated parallel to
+ * nasm_instructions[].  Each entry holds the operand count, the modes
+ * the template is valid in and the class bits of each operand type
+ * (everything below the size field).  If the filter rejects an
+ * instruction, the template can never match it.
+ */
+struct itemplate_filter {
+    uint8_t         operands;           /* number of operands */
+    uint8_t         modes;              /* ITF_MODE_* */
+    uint32_t        opd[MAX_OPERANDS];  /* operand class bits */
+};
+
+#define ITF_MODE_1632   1
+#define ITF_MODE_64     2
+#define ITF_MODE_ALL    (ITF_MODE_1632|ITF_MODE_64)
+#define ITF_OPD(x)      ((uint32_t)((x) & UINT32_MAX))
+
 /* Tables for the assembler and disassembler, respectively */
 extern const struct itemplate * const nasm_instructions[];
+extern const struct itemplate_filter * const nasm_instruction_filters[];
 extern const struct disasm_index itable[256];
 extern const struct disasm_index * const itable_vex[NASM_VEX_CLASSES][32][4];
 
@@ -39,6 +39,7 @@
 #define LABELS_H
 
 #include "compiler.h"
+#include "atom.h"
 
 enum mangle_index {
     LM_LPREFIX,                 /* Local variable prefix */
@@ -60,6 +61,15 @@ enum label_type {
 };
 
 enum label_type lookup_label(const char *label, int32_t *segment, int64_t *offset);
+enum label_type lookup_label_atom(atom_t label, int32_t *segment,
+                                  int64_t *offset);
+const void *lookup_label_ref(void);
+bool label_ref_value(const void *ref, int32_t *segment, int64_t *offset);
+bool label_ref_layout(const void *ref);
+void set_label_layout(const char *label, bool layout);
+void adjust_labels(int64_t (*adjust)(int32_t segment, int64_t offset));
+void save_labels(void);
+void restore_labels(void);
 static inline bool is_extern(enum label_type type)
 {
     return type == LBL_EXTERN || type == LBL_REQUIRED;
@@ -74,6 +84,6 @@ int init_labels(void);
 void cleanup_labels(void);
 const char *local_scope(const char *label);
 
-extern uint64_t global_offset_changed;
+extern per_thread uint64_t global_offset_changed;
 
 #endif /* LABELS_H */
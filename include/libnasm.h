@@ -0,0 +1,71 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * libnasm.h - running the assembler from within another program
+ *
+ * All the state of an assembly is thread-local (see per_thread in
+ * compiler.h), so several threads can each run an assembly at the
+ * same time.  That state is not reset afterwards: each of these
+ * calls must be the only one on its thread.
+ */
+#ifndef NASM_LIBNASM_H
+#define NASM_LIBNASM_H
+
+#include "compiler.h"
+
+/* A block of memory allocated by the assembler; release with free() */
+struct nasm_buffer {
+    char *data;
+    size_t len;
+};
+
+/* The nasm program, given its command line */
+int nasm_main(int argc, char **argv);
+
+/*
+ * Assemble from memory to memory.  The command line names the input
+ * file as usual, but its contents are src instead of those of the
+ * file, and the object is returned in *obj instead of being written
+ * to the output file.  The diagnostics are returned in *msgs.  Other
+ * outputs, such as a listing or dependencies, are still written to
+ * files.  Fatal errors return rather than terminate the process.
+ *
+ * Returns the exit status nasm would have.  *obj is empty unless it
+ * is zero.
+ */
+int nasm_assemble_buffer(int argc, char **argv, const char *src,
+                         size_t srclen, struct nasm_buffer *obj,
+                         struct nasm_buffer *msgs);
+
+#endif /* NASM_LIBNASM_H */
@@ -55,7 +55,7 @@
 #include "error.h"
 
 /* Program name for error messages etc. */
-extern const char *_progname;
+extern per_thread const char *_progname;
 
 /* Time stamp for the official start of compilation */
 struct compile_time {
@@ -65,10 +65,10 @@ struct compile_time {
     struct tm local;
     struct tm gm;
 };
-extern struct compile_time official_compile_time;
+extern per_thread struct compile_time official_compile_time;
 
 /* POSIX timestamp if and only if we are not a reproducible build */
-extern bool reproducible;
+extern per_thread bool reproducible;
 static inline int64_t posix_timestamp(void)
 {
     return reproducible ? 0 : official_compile_time.posix;
@@ -312,6 +312,7 @@ size_t string_transform(char *, size_t, char **, enum strfunc);
  */
 struct tokenval {
     char                *t_charptr;
+    atom_t              t_atom;         /* For TOKEN_ID, if known */
     int64_t             t_integer;
     int64_t             t_inttwo;
     enum token_type     t_type;
@@ -324,7 +325,7 @@ struct location {
     int32_t segment;
     int     known;
 };
-extern struct location location;
+extern per_thread struct location location;
 
 /*
  * Expression-evaluator datatype. Expressions, within the
@@ -421,7 +422,8 @@ enum preproc_mode {
 enum preproc_opt {
     PP_TRIVIAL  = 1,            /* Only %line or # directives */
     PP_NOLINE   = 2,            /* Ignore %line and # directives */
-    PP_TASM     = 4             /* TASM compatibility hacks */
+    PP_TASM     = 4,            /* TASM compatibility hacks */
+    PP_REPLAY   = 8             /* Replay the first pass on later passes */
 };
 
 /*
@@ -464,6 +466,10 @@ void pp_pre_undefine(char *definition);
 /* Include file from command line */
 void pp_pre_include(char *fname);
 
+/* Precompiled macro header to use, and to write (--pch, --make-pch) */
+void pp_pre_pch(const char *file);
+void pp_write_pch(const char *file, const char *source);
+
 /* Add a command from the command line */
 void pp_pre_command(const char *what, char *str);
 
@@ -477,10 +483,10 @@ void pp_error_list_macros(errflags severity);
 bool pp_suppress_error(errflags severity);
 
 /* List of dependency files */
-extern struct strlist *depend_list;
+extern per_thread struct strlist *depend_list;
 
 /* TASM mode changes some properties */
-extern bool tasm_compatible_mode;
+extern per_thread bool tasm_compatible_mode;
 
 /*
  * inline function to skip past an identifier; returns the first character past
@@ -641,6 +647,7 @@ typedef struct operand { /* operand to an instruction */
     int             eaflags;    /* special EA flags */
     int             opflags;    /* see OPFLAG_* defines below */
     decoflags_t     decoflags;  /* decorator flags such as {...} */
+    const void      *label;     /* the only label the value refers to */
 } operand;
 
 #define OPFLAG_FORWARD      1   /* operand is a forward reference */
@@ -649,6 +656,8 @@ typedef struct operand { /* operand to an instruction */
                                    (always a forward reference also) */
 #define OPFLAG_RELATIVE     8   /* operand is self-relative, e.g. [foo - $]
                                    where foo is not in the current segment */
+#define OPFLAG_LAYOUT      16   /* operand depends on where labels are,
+                                   e.g. foo - bar; $ alone does not count */
 
 enum extop_type { /* extended operand types */
     EOT_NOTHING = 0,
@@ -750,7 +759,6 @@ typedef struct insn { /* an instruction itself */
     enum opcode     opcode;                 /* the opcode - not just the string */
     int             operands;               /* how many operands? 0-3 (more if db et al) */
     int             addr_size;              /* address size */
-    operand         oprs[MAX_OPERANDS];     /* the operands, defined as above */
     extop           *eops;                  /* extended operands */
     int             eops_float;             /* true if DD and floating */
     int32_t         times;                  /* repeat count (TIMES prefix) */
@@ -765,6 +773,9 @@ typedef struct insn { /* an instruction itself */
     enum ttypes     evex_tuple;             /* Tuple type for compressed Disp8*N */
     int             evex_rm;                /* static rounding mode for AVX512 (EVEX) */
     int8_t          evex_brerop;            /* BR/ER/SAE operand position */
+    operand         oprs[MAX_OPERANDS];     /* the operands, defined as above;
+                                               last, so that a copy can stop
+                                               after the ones in use */
 } insn;
 
 /* Instruction flags type: IF_* flags are defined in insns.h */
@@ -835,10 +846,11 @@ enum nasm_limit {
     LIMIT_MMACROS,
     LIMIT_REP,
     LIMIT_EVAL,
-    LIMIT_LINES
+    LIMIT_LINES,
+    LIMIT_INCLUDE_LEVELS
 };
-#define LIMIT_MAX LIMIT_LINES
-extern int64_t nasm_limit[LIMIT_MAX+1];
+#define LIMIT_MAX LIMIT_INCLUDE_LEVELS
+extern per_thread int64_t nasm_limit[LIMIT_MAX+1];
 extern enum directive_result  nasm_set_limit(const char *, const char *);
 
 /*
@@ -1057,8 +1069,8 @@ struct ofmt_alias {
     const struct ofmt *ofmt;
 };
 
-extern const struct ofmt *ofmt;
-extern FILE *ofile;
+extern per_thread const struct ofmt *ofmt;
+extern per_thread FILE *ofile;
 
 /*
  * ------------------------------------------------------------
@@ -1163,7 +1175,7 @@ struct dfmt {
     const struct pragma_facility *pragmas;
 };
 
-extern const struct dfmt *dfmt;
+extern per_thread const struct dfmt *dfmt;
 
 /*
  * The type definition macros
@@ -1377,7 +1389,8 @@ static inline opflags_t brsize_to_size(opflags_t brbits)
  */
 enum optimization_disable_flag {
     OPTIM_ALL_ENABLED       = 0,
-    OPTIM_DISABLE_JMP_MATCH = 1
+    OPTIM_DISABLE_JMP_MATCH = 1,
+    OPTIM_DISABLE_RELAX     = 2
 };
 
 struct optimization {
@@ -1399,7 +1412,7 @@ enum pass_type {
     PASS_FINAL            /* Code generation pass (original pass 2) */
 };
 extern const char * const _pass_types[];
-extern enum pass_type _pass_type;
+extern per_thread enum pass_type _pass_type;
 static inline enum pass_type pass_type(void)
 {
     return _pass_type;
@@ -1439,19 +1452,19 @@ static inline bool pass_final_or_preproc(void)
  * first pass is 1, and then it is simply increasing numbers until we are
  * done.
  */
-extern int64_t _passn;           /* Actual pass number */
+extern per_thread int64_t _passn;           /* Actual pass number */
 static inline int64_t pass_count(void)
 {
     return _passn;
 }
 
-extern struct optimization optimizing;
-extern int globalbits;          /* 16, 32 or 64-bit mode */
-extern int globalrel;           /* default to relative addressing? */
-extern int globalbnd;           /* default to using bnd prefix? */
+extern per_thread struct optimization optimizing;
+extern per_thread int globalbits;          /* 16, 32 or 64-bit mode */
+extern per_thread int globalrel;           /* default to relative addressing? */
+extern per_thread int globalbnd;           /* default to using bnd prefix? */
 
-extern const char *inname;	/* primary input filename */
-extern const char *outname;     /* output filename */
+extern per_thread const char *inname;	/* primary input filename */
+extern per_thread const char *outname;     /* output filename */
 
 /*
  * Switch to a different segment and return the current offset
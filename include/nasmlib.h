@@ -96,12 +96,12 @@ void * safe_alloc vprintf_func(2) nasm_vaxprintf(size_t extra, const char *fmt,
  */
 static inline size_t nasm_last_string_len(void)
 {
-    extern size_t _nasm_last_string_size;
+    extern per_thread size_t _nasm_last_string_size;
     return _nasm_last_string_size - 1;
 }
 static inline size_t nasm_last_string_size(void)
 {
-    extern size_t _nasm_last_string_size;
+    extern per_thread size_t _nasm_last_string_size;
     return _nasm_last_string_size;
 }
 
@@ -401,6 +401,19 @@ void nasm_unmap_file(const void *p, size_t len);
 off_t nasm_file_size(FILE *f);
 off_t nasm_file_size_by_path(const char *pathname);
 bool nasm_file_time(time_t *t, const char *pathname);
+
+/*
+ * Contents of an input file, read once and kept for the whole run
+ */
+struct cached_file {
+    const char *data;
+    size_t len;
+};
+const struct cached_file *nasm_cached_file(const char *filename);
+void nasm_cached_file_recheck(bool recheck);
+void nasm_cached_file_preload(const char *filename, const void *data,
+                              size_t len);
+void nasm_free_file_cache(void);
 void fwritezero(off_t bytes, FILE *fp);
 
 static inline bool const_func overflow_general(int64_t value, int bytes)
@@ -41,7 +41,7 @@
 
 void nasm_ctype_init(void);
 
-extern unsigned char nasm_tolower_tab[256];
+extern per_thread unsigned char nasm_tolower_tab[256];
 static inline char nasm_tolower(char x)
 {
     return nasm_tolower_tab[(unsigned char)x];
@@ -66,7 +66,7 @@ enum nasm_ctype {
     NCT_QUOTE      = 0x1000     /* " ' ` */
 };
 
-extern uint16_t nasm_ctype_tab[256];
+extern per_thread uint16_t nasm_ctype_tab[256];
 static inline bool nasm_ctype(unsigned char x, enum nasm_ctype mask)
 {
     return (nasm_ctype_tab[x] & mask) != 0;
@@ -0,0 +1,91 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * outvec.h - gather the contents of an output file in memory
+ *
+ * An outvec collects the pieces of an output file as a list of
+ * memory ranges, and writes them all with as few system calls as
+ * possible when it is flushed.  Small items (headers, integers) are
+ * copied into the outvec; large ones, such as the blocks of an SAA,
+ * are only referenced, and must not change or be freed until the
+ * outvec has been flushed.
+ */
+
+#ifndef NASM_OUTVEC_H
+#define NASM_OUTVEC_H
+
+#include "compiler.h"
+#include "bytesex.h"
+#include "saa.h"
+
+struct outvec;
+
+struct outvec * never_null outvec_init(FILE *fp);
+void outvec_write(struct outvec *ov, const void *data, size_t len);
+void outvec_ref(struct outvec *ov, const void *data, size_t len);
+void outvec_saa(struct outvec *ov, struct SAA *s);
+void outvec_zero(struct outvec *ov, size_t len);
+void outvec_flush(struct outvec *ov);
+void outvec_free(struct outvec *ov);
+
+static inline void outvec_write8(struct outvec *ov, uint8_t v)
+{
+    outvec_write(ov, &v, 1);
+}
+
+static inline void outvec_write16(struct outvec *ov, uint16_t v)
+{
+    v = cpu_to_le16(v);
+    outvec_write(ov, &v, 2);
+}
+
+static inline void outvec_write32(struct outvec *ov, uint32_t v)
+{
+    v = cpu_to_le32(v);
+    outvec_write(ov, &v, 4);
+}
+
+static inline void outvec_write64(struct outvec *ov, uint64_t v)
+{
+    v = cpu_to_le64(v);
+    outvec_write(ov, &v, 8);
+}
+
+static inline void outvec_writeaddr(struct outvec *ov, uint64_t v, int size)
+{
+    v = cpu_to_le64(v);
+    outvec_write(ov, &v, size);
+}
+
+#endif /* NASM_OUTVEC_H */
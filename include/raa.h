@@ -41,6 +41,7 @@ typedef uint64_t raaindex;
 
 #define raa_init() NULL
 void raa_free(struct RAA *);
+void raa_reset(struct RAA *);
 int64_t raa_read(struct RAA *, raaindex);
 void *raa_read_ptr(struct RAA *, raaindex);
 struct RAA * never_null raa_write(struct RAA *r, raaindex posn, int64_t value);
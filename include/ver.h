@@ -43,7 +43,7 @@
 extern const char nasm_version[];
 extern const char nasm_compile_options[];
 
-extern bool reproducible;
+extern per_thread bool reproducible;
 
 extern const char *nasm_comment(void);
 extern size_t nasm_comment_len(void);
@@ -40,7 +40,7 @@
 #include "error.h"
 #include "alloc.h"
 
-size_t _nasm_last_string_size;
+per_thread size_t _nasm_last_string_size;
 
 fatal_func nasm_alloc_failed(void)
 {
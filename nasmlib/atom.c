@@ -0,0 +1,155 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * atom.c - interned identifiers
+ */
+
+#include "compiler.h"
+
+#include "nasmlib.h"
+#include "hashtbl.h"
+#include "atom.h"
+
+#define ATOM_BLOCK_SIZE 16384   /* Size of a block of atom text */
+
+struct atom {
+    const char *str;
+    size_t len;
+};
+
+struct atom_block {
+    struct atom_block *next;
+    size_t size, usage;
+    char data[1];
+};
+
+static per_thread struct hash_table atom_tab;   /* Atom numbers by text */
+static per_thread struct atom *atoms;           /* Atoms by number */
+static per_thread atom_t natoms, maxatoms;
+static per_thread struct atom_block *atom_blocks;
+
+static char *atom_alloc(size_t len)
+{
+    struct atom_block *b = atom_blocks;
+    char *p;
+
+    if (!b || b->size - b->usage < len) {
+        size_t size = len > ATOM_BLOCK_SIZE ? len : ATOM_BLOCK_SIZE;
+
+        b = nasm_malloc(offsetof(struct atom_block, data) + size);
+        b->next = atom_blocks;
+        b->size = size;
+        b->usage = 0;
+        atom_blocks = b;
+    }
+
+    p = b->data + b->usage;
+    b->usage += len;
+    return p;
+}
+
+/*
+ * Return the atom for the len characters at str, which need not be
+ * null-terminated.  An atom is created the first time a string is seen.
+ */
+atom_t atom_intern(const char *str, size_t len)
+{
+    struct hash_insert hi;
+    void **dp;
+    struct atom *a;
+    char *text;
+
+    if (!len)
+        return NO_ATOM;
+
+    dp = hash_findb(&atom_tab, str, len, &hi);
+    if (dp)
+        return (atom_t)(uintptr_t)*dp;
+
+    if (!natoms)
+        natoms = 1;             /* NO_ATOM */
+    if (natoms >= maxatoms) {
+        maxatoms = maxatoms ? maxatoms << 1 : 1024;
+        atoms = nasm_realloc(atoms, maxatoms * sizeof *atoms);
+        atoms[NO_ATOM].str = "";
+        atoms[NO_ATOM].len = 0;
+    }
+
+    text = atom_alloc(len + 1);
+    memcpy(text, str, len);
+    text[len] = '\0';
+
+    a = &atoms[natoms];
+    a->str = text;
+    a->len = len;
+    hash_add(&hi, text, (void *)(uintptr_t)natoms);
+
+    return natoms++;
+}
+
+/*
+ * The text of an atom, null-terminated.
+ */
+const char *atom_str(atom_t atom)
+{
+    return atom ? atoms[atom].str : "";
+}
+
+size_t atom_len(atom_t atom)
+{
+    return atom ? atoms[atom].len : 0;
+}
+
+/*
+ * One more than the highest atom number handed out so far.
+ */
+atom_t atom_limit(void)
+{
+    return natoms ? natoms : 1;
+}
+
+void atom_free_all(void)
+{
+    struct atom_block *b;
+
+    hash_free(&atom_tab);
+    nasm_free(atoms);
+    atoms = NULL;
+    natoms = maxatoms = 0;
+
+    while ((b = atom_blocks)) {
+        atom_blocks = b->next;
+        nasm_free(b);
+    }
+}
@@ -36,7 +36,7 @@
 /* Used to avoid returning NULL to a debug printing function */
 const char *invalid_enum_str(int x)
 {
-    static char buf[64];
+    static per_thread char buf[64];
 
     snprintf(buf, sizeof buf, "<invalid %d>", x);
     return buf;
@@ -1,4 +1,4 @@
 #include "compiler.h"
 
-FILE *error_file;
+per_thread FILE *error_file;
 
@@ -0,0 +1,236 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * Cache of the contents of input files.  Include files and incbin
+ * files are used again on every pass; with the cache, each of them
+ * is opened and read (or mapped) only once per run.
+ */
+
+#include "file.h"
+#include "hashtbl.h"
+
+struct file_cache_entry {
+    struct cached_file file;    /* MUST BE FIRST */
+    bool mapped;                /* file.data is mapped */
+    bool preloaded;             /* From nasm_cached_file_preload() */
+    off_t size;                 /* Size and time when it was read */
+    time_t mtime;
+    struct file_cache_entry *old; /* Replaced contents, maybe in use */
+};
+
+static per_thread struct hash_table file_cache;
+static per_thread bool file_recheck;
+
+/*
+ * Check files for changes on every use, and read them again if they
+ * have changed.
+ */
+void nasm_cached_file_recheck(bool recheck)
+{
+    file_recheck = recheck;
+}
+
+static bool file_stat(const char *filename, off_t *size, time_t *mtime)
+{
+    os_filename osfname;
+    os_struct_stat st;
+    bool rv;
+
+    osfname = os_mangle_filename(filename);
+    if (!osfname)
+        return false;
+
+    rv = !os_stat(osfname, &st);
+    if (rv) {
+        *size  = st.st_size;
+        *mtime = st.st_mtime;
+    }
+    os_free_filename(osfname);
+    return rv;
+}
+
+/*
+ * Read the contents of a file, mapping it if possible
+ */
+static bool file_load(struct file_cache_entry *fc, const char *filename)
+{
+    FILE *fp;
+    off_t size;
+    char *buf;
+    size_t len, bufsize;
+    int err;
+
+    fp = nasm_open_read(filename, NF_BINARY|NF_FORMAP);
+    if (!fp)
+        return false;
+
+    if (!file_stat(filename, &fc->size, &fc->mtime)) {
+        fc->size  = -1;
+        fc->mtime = 0;
+    }
+
+    size = nasm_file_size(fp);
+    if (size > 0) {
+        fc->file.data = nasm_map_file(fp, 0, size);
+        if (fc->file.data) {
+            fc->file.len = size;
+            fc->mapped = true;
+            fclose(fp);
+            return true;
+        }
+    }
+
+    /* Read it, which also works if the size is not known */
+    bufsize = size > 0 ? (size_t)size + 1 : BUFSIZ;
+    buf = nasm_malloc(bufsize);
+    len = 0;
+    for (;;) {
+        size_t n = fread(buf + len, 1, bufsize - len, fp);
+        len += n;
+        if (len < bufsize)
+            break;
+        bufsize <<= 1;
+        buf = nasm_realloc(buf, bufsize);
+    }
+
+    if (ferror(fp)) {
+        err = errno;
+        nasm_free(buf);
+        fclose(fp);
+        errno = err ? err : EIO;
+        return false;
+    }
+    fclose(fp);
+
+    fc->file.data = buf;
+    fc->file.len  = len;
+    fc->mapped    = false;
+    return true;
+}
+
+static void file_unload(struct file_cache_entry *fc)
+{
+    if (!fc->file.data)
+        return;
+    if (fc->mapped)
+        nasm_unmap_file(fc->file.data, fc->file.len);
+    else
+        nasm_free((char *)fc->file.data);
+}
+
+/*
+ * Return the contents of a file, reading it if this is the first use.
+ * The contents stay valid until nasm_free_file_cache().  Returns NULL
+ * and sets errno if the file cannot be read.
+ */
+const struct cached_file *nasm_cached_file(const char *filename)
+{
+    struct file_cache_entry **fcp, *fc;
+    struct hash_insert hi;
+    off_t size;
+    time_t mtime;
+
+    fcp = (struct file_cache_entry **)hash_find(&file_cache, filename, &hi);
+    if (fcp) {
+        fc = *fcp;
+        if (fc->file.data) {
+            if (!file_recheck || fc->preloaded)
+                return &fc->file;
+
+            if (file_stat(filename, &size, &mtime) &&
+                size == fc->size && mtime == fc->mtime)
+                return &fc->file;
+
+            /* Changed; the old contents may still be in use */
+            nasm_new(*fcp);
+            (*fcp)->old = fc;
+            fc = *fcp;
+        }
+    } else {
+        nasm_new(fc);
+        hash_add(&hi, nasm_strdup(filename), fc);
+    }
+
+    if (!file_load(fc, filename))
+        return NULL;            /* Try again next time */
+
+    return &fc->file;
+}
+
+/*
+ * Use a copy of data as the contents of a file, which need not exist.
+ */
+void nasm_cached_file_preload(const char *filename, const void *data,
+                              size_t len)
+{
+    struct file_cache_entry **fcp, *fc;
+    struct hash_insert hi;
+    char *buf;
+
+    fcp = (struct file_cache_entry **)hash_find(&file_cache, filename, &hi);
+    if (fcp) {
+        /* The old contents may still be in use */
+        nasm_new(fc);
+        fc->old = *fcp;
+        *fcp = fc;
+    } else {
+        nasm_new(fc);
+        hash_add(&hi, nasm_strdup(filename), fc);
+    }
+
+    buf = nasm_malloc(len + 1);
+    memcpy(buf, data, len);
+    fc->file.data = buf;
+    fc->file.len  = len;
+    fc->size      = len;
+    fc->preloaded = true;
+}
+
+void nasm_free_file_cache(void)
+{
+    struct hash_iterator it;
+    const struct hash_node *np;
+
+    hash_for_each(&file_cache, it, np) {
+        struct file_cache_entry *fc, *old;
+
+        for (fc = np->data; fc; fc = old) {
+            old = fc->old;
+            file_unload(fc);
+            nasm_free(fc);
+        }
+        nasm_free((void *)np->key);
+    }
+    hash_free(&file_cache);
+}
@@ -41,54 +41,241 @@
 
 #include "nasm.h"
 #include "hashtbl.h"
+#include "bytesex.h"
+#include "ilog2.h"
 
-#define HASH_MAX_LOAD   2	/* Higher = more memory-efficient, slower */
-#define HASH_INIT_SIZE  16      /* Initial size (power of 2, min 4) */
+/*
+ * The table is an array of hash_node entries plus a parallel array of
+ * control bytes, one per slot.  A control byte is HASH_EMPTY for an
+ * unused slot, otherwise the top 7 bits of the hash of the key in that
+ * slot.  Lookups compare a whole group of control bytes against the
+ * tag at once and only touch the hash_node entries which match, so a
+ * miss rarely looks at the nodes at all.
+ *
+ * The groups are probed in triangular order, which visits every group
+ * exactly once for a power-of-2 number of groups.  Entries are never
+ * deleted, so the first empty slot ends the search and is where the
+ * key would be inserted.
+ */
+#define HASH_MAX_LOAD(size)     ((size) - ((size) >> 2)) /* 75% */
+#define HASH_INIT_SIZE  16      /* Initial size (power of 2, >= HASH_GROUP) */
+#define HASH_EMPTY      0x80
 
-#define hash_calc(key,keylen)   crc64b(CRC64_INIT, (key), (keylen))
-#define hash_calci(key,keylen)  crc64ib(CRC64_INIT, (key), (keylen))
-#define hash_max_load(size)     ((size) * (HASH_MAX_LOAD - 1) / HASH_MAX_LOAD)
 #define hash_expand(size)       ((size) << 1)
 #define hash_mask(size)         ((size) - 1)
-#define hash_pos(hash, mask)    ((hash) & (mask))
-#define hash_inc(hash, mask)    ((((hash) >> 32) & (mask)) | 1) /* always odd */
-#define hash_pos_next(pos, inc, mask) (((pos) + (inc)) & (mask))
+#define hash_tag(hash)          ((uint8_t)((hash) >> 57))
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define HASH_GROUP 16
+typedef unsigned int hash_match_t; /* One bit per slot */
+
+static inline hash_match_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+}
+
+static inline hash_match_t group_empty(const uint8_t *ctrl)
+{
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+
+#define group_first(m) ilog2_32((m) & -(m))
+
+#else /* Portable version: 8 slots per 64-bit word */
+
+#define HASH_GROUP 8
+typedef uint64_t hash_match_t;  /* High bit of each byte */
+
+#define GROUP_LO UINT64_C(0x0101010101010101)
+#define GROUP_HI UINT64_C(0x8080808080808080)
 
-static void hash_init(struct hash_table *head)
+static inline uint64_t group_load(const uint8_t *ctrl)
 {
-    head->size     = HASH_INIT_SIZE;
-    head->load     = 0;
-    head->max_load = hash_max_load(head->size);
-    nasm_newn(head->table, head->size);
+    uint64_t g;
+    memcpy(&g, ctrl, sizeof g);
+    return cpu_to_le64(g);
 }
 
+/* May report false matches above a true one; the caller verifies them */
+static inline hash_match_t group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    uint64_t x = group_load(ctrl) ^ (GROUP_LO * tag);
+    return (x - GROUP_LO) & ~x & GROUP_HI;
+}
+
+static inline hash_match_t group_empty(const uint8_t *ctrl)
+{
+    return group_load(ctrl) & GROUP_HI;
+}
+
+#define group_first(m) (ilog2_64((m) & -(m)) >> 3)
+
+#endif
+
 /*
- * Find an entry in a hash table.  The key can be any binary object.
- *
- * On failure, if "insert" is non-NULL, store data in that structure
- * which can be used to insert that node using hash_add().
- * See hash_add() for constraints on the uses of the insert object.
- *
- * On success, return a pointer to the "data" element of the hash
- * structure.
+ * Hash function: consume the key a 64-bit little-endian word at a
+ * time, then finalize with the MurmurHash3 mixer.  The result does
+ * not depend on the host, so iteration order stays reproducible.
+ * The case-insensitive version folds ASCII A-Z to lower case within
+ * each word, matching nasm_memicmp(): nasm never leaves the C
+ * locale, so nasm_tolower() folds nothing else.
  */
-void **hash_findb(struct hash_table *head, const void *key,
-                  size_t keylen, struct hash_insert *insert)
+#define HASH_MUL UINT64_C(0x9e3779b97f4a7c15)
+
+static inline uint64_t hash_word(const uint8_t *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof w);
+    return cpu_to_le64(w);
+}
+
+static inline uint32_t hash_half(const uint8_t *p)
+{
+    uint32_t w;
+    memcpy(&w, p, sizeof w);
+    return cpu_to_le32(w);
+}
+
+static inline uint64_t hash_fold(uint64_t w)
+{
+    const uint64_t ones = UINT64_C(0x0101010101010101);
+    uint64_t hept = w & (ones * 0x7f);
+    uint64_t ge_a = hept + ones * (0x80 - 'A');
+    uint64_t gt_z = hept + ones * (0x80 - 'Z' - 1);
+    uint64_t upper = (ge_a ^ gt_z) & ~w & (ones * 0x80);
+
+    return w | (upper >> 2);
+}
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t w)
+{
+    return (((h << 5) | (h >> 59)) ^ w) * HASH_MUL;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * The last 1-7 bytes are read as two overlapping 32-bit loads, or as
+ * three single bytes, without mixing bytes of the key into the same
+ * byte lane.  Each half is folded separately for the same reason.
+ */
+static inline uint64_t hash_tail(const uint8_t *p, size_t n, bool fold)
+{
+    uint64_t lo, hi;
+
+    if (n >= 4) {
+        lo = hash_half(p);
+        hi = hash_half(p + n - 4);
+    } else {
+        lo = p[0] | ((uint32_t)p[n >> 1] << 8) | ((uint32_t)p[n - 1] << 16);
+        hi = 0;
+    }
+    if (fold) {
+        lo = hash_fold(lo);
+        hi = hash_fold(hi);
+    }
+    return lo | (hi << 32);
+}
+
+static inline uint64_t hash_bytes(const void *key, size_t keylen, bool fold)
+{
+    const uint8_t *p = key;
+    uint64_t h = keylen;
+    uint64_t w;
+
+    while (keylen >= 8) {
+        w = hash_word(p);
+        h = hash_mix(h, fold ? hash_fold(w) : w);
+        p += 8;
+        keylen -= 8;
+    }
+    if (keylen)
+        h = hash_mix(h, hash_tail(p, keylen, fold));
+    return hash_final(h);
+}
+
+#define hash_calc(key,keylen)   hash_bytes((key), (keylen), false)
+#define hash_calci(key,keylen)  hash_bytes((key), (keylen), true)
+
+static void hash_alloc(struct hash_table *head, size_t size)
+{
+    head->size     = size;
+    head->max_load = HASH_MAX_LOAD(size);
+    head->table    = nasm_malloc(size * (sizeof(struct hash_node) + 1));
+    head->ctrl     = (uint8_t *)(head->table + size);
+    memset(head->ctrl, HASH_EMPTY, size);
+}
+
+/*
+ * Return the first empty slot on the probe sequence for hash.
+ */
+static size_t hash_slot(const struct hash_table *head, uint64_t hash)
+{
+    size_t mask = hash_mask(head->size);
+    size_t pos  = hash & mask & ~(size_t)(HASH_GROUP - 1);
+    size_t step = 0;
+    hash_match_t m;
+
+    while (!(m = group_empty(head->ctrl + pos))) {
+        step += HASH_GROUP;
+        pos = (pos + step) & mask;
+    }
+    return pos + group_first(m);
+}
+
+/*
+ * Common lookup for both case-sensitive and case-insensitive keys;
+ * fold is a constant at each call site, so this is specialized.
+ */
+static inline void **
+hash_lookup(struct hash_table *head, const void *key, size_t keylen,
+            struct hash_insert *insert, bool fold)
 {
     struct hash_node *np = NULL;
     struct hash_node *tbl = head->table;
-    uint64_t hash = hash_calc(key, keylen);
-    size_t mask = hash_mask(head->size);
-    size_t pos = hash_pos(hash, mask);
-    size_t inc = hash_inc(hash, mask);
+    uint64_t hash = fold ? hash_calci(key, keylen) : hash_calc(key, keylen);
 
     if (likely(tbl)) {
-        while ((np = &tbl[pos])->key) {
-            if (hash == np->hash &&
-                keylen == np->keylen &&
-                !memcmp(key, np->key, keylen))
-                return &np->data;
-            pos = hash_pos_next(pos, inc, mask);
+        const uint8_t *ctrl = head->ctrl;
+        uint8_t tag = hash_tag(hash);
+        size_t mask = hash_mask(head->size);
+        size_t pos  = hash & mask & ~(size_t)(HASH_GROUP - 1);
+        size_t step = 0;
+        hash_match_t m;
+
+        for (;;) {
+            m = group_match(ctrl + pos, tag);
+            while (m) {
+                np = &tbl[pos + group_first(m)];
+                if (hash == np->hash &&
+                    keylen == np->keylen &&
+                    !(fold ? nasm_memicmp(key, np->key, keylen)
+                      : memcmp(key, np->key, keylen)))
+                    return &np->data;
+                m &= m - 1;
+            }
+
+            m = group_empty(ctrl + pos);
+            if (m) {
+                np = &tbl[pos + group_first(m)];
+                break;
+            }
+
+            step += HASH_GROUP;
+            pos = (pos + step) & mask;
         }
     }
 
@@ -104,6 +291,22 @@ void **hash_findb(struct hash_table *head, const void *key,
     return NULL;
 }
 
+/*
+ * Find an entry in a hash table.  The key can be any binary object.
+ *
+ * On failure, if "insert" is non-NULL, store data in that structure
+ * which can be used to insert that node using hash_add().
+ * See hash_add() for constraints on the uses of the insert object.
+ *
+ * On success, return a pointer to the "data" element of the hash
+ * structure.
+ */
+void **hash_findb(struct hash_table *head, const void *key,
+                  size_t keylen, struct hash_insert *insert)
+{
+    return hash_lookup(head, key, keylen, insert, false);
+}
+
 /*
  * Same as hash_findb(), but for a C string.
  */
@@ -119,33 +322,7 @@ void **hash_find(struct hash_table *head, const char *key,
 void **hash_findib(struct hash_table *head, const void *key, size_t keylen,
                    struct hash_insert *insert)
 {
-    struct hash_node *np = NULL;
-    struct hash_node *tbl = head->table;
-    uint64_t hash = hash_calci(key, keylen);
-    size_t mask = hash_mask(head->size);
-    size_t pos = hash_pos(hash, mask);
-    size_t inc = hash_inc(hash, mask);
-
-    if (likely(tbl)) {
-        while ((np = &tbl[pos])->key) {
-            if (hash == np->hash &&
-                keylen == np->keylen &&
-                !nasm_memicmp(key, np->key, keylen))
-                return &np->data;
-            pos = hash_pos_next(pos, inc, mask);
-        }
-    }
-
-    /* Not found.  Store info for insert if requested. */
-    if (insert) {
-        insert->node.hash = hash;
-        insert->node.key = key;
-        insert->node.keylen = keylen;
-        insert->node.data = NULL;
-        insert->head  = head;
-        insert->where = np;
-    }
-    return NULL;
+    return hash_lookup(head, key, keylen, insert, true);
 }
 
 /*
@@ -176,9 +353,9 @@ void **hash_add(struct hash_insert *insert, const void *key, void *data)
     struct hash_node *np = insert->where;
 
     if (unlikely(!np)) {
-        hash_init(head);
-        /* The hash table is empty, so we don't need to iterate here */
-        np = &head->table[hash_pos(insert->node.hash, hash_mask(head->size))];
+        hash_alloc(head, HASH_INIT_SIZE);
+        head->load = 0;
+        np = &head->table[hash_slot(head, insert->node.hash)];
     }
 
     /*
@@ -189,36 +366,29 @@ void **hash_add(struct hash_insert *insert, const void *key, void *data)
     np->data = data;
     if (key)
         np->key = key;
+    head->ctrl[np - head->table] = hash_tag(np->hash);
 
     if (unlikely(++head->load > head->max_load)) {
         /* Need to expand the table */
-        size_t newsize           = hash_expand(head->size);
-        struct hash_node *newtbl;
-        size_t mask              = hash_mask(newsize);
+        struct hash_table old = *head;
         struct hash_node *op, *xp;
         size_t i;
 
-        nasm_newn(newtbl, newsize);
+        hash_alloc(head, hash_expand(old.size));
 
         /* Rebalance all the entries */
-        for (i = 0, op = head->table; i < head->size; i++, op++) {
-            if (op->key) {
-                size_t pos = hash_pos(op->hash, mask);
-                size_t inc = hash_inc(op->hash, mask);
-
-                while ((xp = &newtbl[pos])->key)
-                    pos = hash_pos_next(pos, inc, mask);
+        for (i = 0, op = old.table; i < old.size; i++, op++) {
+            if (old.ctrl[i] != HASH_EMPTY) {
+                size_t pos = hash_slot(head, op->hash);
 
+                xp = &head->table[pos];
                 *xp = *op;
+                head->ctrl[pos] = old.ctrl[i];
                 if (op == np)
                     np = xp;
             }
         }
-        nasm_free(head->table);
-
-        head->table    = newtbl;
-        head->size     = newsize;
-        head->max_load = hash_max_load(newsize);
+        nasm_free(old.table);
     }
 
     return &np->data;
@@ -240,7 +410,7 @@ const struct hash_node *hash_iterate(struct hash_iterator *iter)
 
     /* For an empty table, cp == ep == NULL */
     while (cp < ep) {
-        if (cp->key) {
+        if (head->ctrl[cp - head->table] != HASH_EMPTY) {
             iter->next = cp+1;
             return cp;
         }
@@ -251,6 +421,23 @@ const struct hash_node *hash_iterate(struct hash_iterator *iter)
     return NULL;
 }
 
+/*
+ * Make dst an independent copy of the hash table src.  The keys and
+ * data pointers are shared with src, not copied; entries later added
+ * to or changed in either table do not affect the other.
+ */
+void hash_copy(struct hash_table *dst, const struct hash_table *src)
+{
+    *dst = *src;
+    if (src->table) {
+        size_t bytes = src->size * (sizeof *src->table + 1);
+
+        dst->table = nasm_malloc(bytes);
+        memcpy(dst->table, src->table, bytes);
+        dst->ctrl = (uint8_t *)(dst->table + src->size);
+    }
+}
+
 /*
  * Free the hash itself.  Doesn't free the data elements; use
  * hash_iterate() to do that first, if needed.  This function is normally
@@ -43,7 +43,7 @@
  */
 
 /* File scope since not all compilers like static data in inline functions */
-static size_t nasm_pagemask;
+static per_thread size_t nasm_pagemask;
 
 static size_t get_pagemask(void)
 {
@@ -38,7 +38,7 @@
  * Table of tolower() results.  This avoids function calls
  * on some platforms.
  */
-unsigned char nasm_tolower_tab[256];
+per_thread unsigned char nasm_tolower_tab[256];
 
 static void tolower_tab_init(void)
 {
@@ -53,7 +53,7 @@ static void tolower_tab_init(void)
  * some are NASM-specific.
  */
 
-uint16_t nasm_ctype_tab[256];
+per_thread uint16_t nasm_ctype_tab[256];
 
 #if !defined(HAVE_ISCNTRL) && !defined(iscntrl)
 # define iscntrl(x) ((x) < 32)
@@ -0,0 +1,263 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * outvec.c - gather the contents of an output file in memory
+ */
+
+#include "compiler.h"
+#include "nasmlib.h"
+#include "error.h"
+#include "outvec.h"
+#include "file.h"
+
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H) && defined(fileno)
+# define USE_WRITEV 1
+#endif
+
+#define OUTVEC_BUFLEN	65536   /* Block size for copied data */
+#define OUTVEC_IOVMAX	256     /* Ranges per writev() call */
+
+struct outvec_range {
+    const void *data;
+    size_t len;
+};
+
+/* A block of copied data; the data itself follows the header */
+struct outvec_buf {
+    struct outvec_buf *next;
+    size_t size;
+    size_t used;
+};
+
+struct outvec {
+    FILE *fp;
+    struct outvec_range *ranges;
+    size_t nranges;
+    size_t maxranges;
+    struct outvec_buf *bufs;    /* Current block first */
+};
+
+struct outvec *outvec_init(FILE *fp)
+{
+    struct outvec *ov;
+
+    nasm_new(ov);
+    ov->fp = fp;
+    return ov;
+}
+
+static void outvec_add(struct outvec *ov, const void *data, size_t len)
+{
+    struct outvec_range *r;
+
+    if (!len)
+        return;
+
+    if (ov->nranges) {
+        /* Extend the last range if this follows on from it */
+        r = &ov->ranges[ov->nranges - 1];
+        if ((const char *)r->data + r->len == (const char *)data) {
+            r->len += len;
+            return;
+        }
+    }
+
+    if (ov->nranges >= ov->maxranges) {
+        ov->maxranges = ov->maxranges ? ov->maxranges << 1 : 64;
+        ov->ranges = nasm_realloc(ov->ranges,
+                                  ov->maxranges * sizeof *ov->ranges);
+    }
+
+    r = &ov->ranges[ov->nranges++];
+    r->data = data;
+    r->len  = len;
+}
+
+/*
+ * Copy data into the outvec.
+ */
+void outvec_write(struct outvec *ov, const void *data, size_t len)
+{
+    struct outvec_buf *b = ov->bufs;
+    char *p;
+
+    if (!b || b->size - b->used < len) {
+        size_t size = len > OUTVEC_BUFLEN ? len : OUTVEC_BUFLEN;
+
+        b = nasm_malloc(sizeof *b + size);
+        b->size = size;
+        b->used = 0;
+        b->next = ov->bufs;
+        ov->bufs = b;
+    }
+
+    p = (char *)(b + 1) + b->used;
+    memcpy(p, data, len);
+    b->used += len;
+    outvec_add(ov, p, len);
+}
+
+/*
+ * Add data without copying it.
+ */
+void outvec_ref(struct outvec *ov, const void *data, size_t len)
+{
+    outvec_add(ov, data, len);
+}
+
+/*
+ * Add the whole contents of an SAA, block by block, without copying.
+ */
+void outvec_saa(struct outvec *ov, struct SAA *s)
+{
+    const void *data;
+    size_t len;
+
+    saa_rewind(s);
+    while (len = s->datalen, (data = saa_rbytes(s, &len)) != NULL)
+        outvec_add(ov, data, len);
+}
+
+void outvec_zero(struct outvec *ov, size_t len)
+{
+    while (len) {
+        size_t n = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+
+        outvec_add(ov, zero_buffer, n);
+        len -= n;
+    }
+}
+
+#ifdef USE_WRITEV
+/*
+ * Write the ranges straight to the file descriptor, bypassing the
+ * stdio buffer.  Returns false if this isn't possible, in which case
+ * nothing has been written.
+ */
+static bool outvec_writev(struct outvec *ov)
+{
+    const struct outvec_range *r   = ov->ranges;
+    const struct outvec_range *end = r + ov->nranges;
+    struct iovec iov[OUTVEC_IOVMAX];
+    size_t skip = 0;            /* Bytes of *r already written */
+    off_t pos;
+    int fd;
+
+    if (fflush(ov->fp) || (fd = fileno(ov->fp)) < 0)
+        return false;
+
+    while (r < end) {
+        const struct outvec_range *q = r;
+        size_t off = skip;
+        ssize_t done;
+        int n = 0;
+
+        while (q < end && n < OUTVEC_IOVMAX) {
+            iov[n].iov_base = (char *)q->data + off;
+            iov[n].iov_len  = q->len - off;
+            off = 0;
+            n++;
+            q++;
+        }
+
+        done = writev(fd, iov, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            nasm_fatal("unable to write output: %s", strerror(errno));
+
+        while (done) {
+            size_t left = r->len - skip;
+            if ((size_t)done < left) {
+                skip += done;
+                break;
+            }
+            done -= left;
+            skip = 0;
+            r++;
+        }
+    }
+
+    /* Let stdio know where the file position is now */
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos != (off_t)-1)
+        fseeko(ov->fp, pos, SEEK_SET);
+
+    return true;
+}
+#endif
+
+static void outvec_free_bufs(struct outvec *ov)
+{
+    struct outvec_buf *b, *next;
+
+    for (b = ov->bufs; b; b = next) {
+        next = b->next;
+        nasm_free(b);
+    }
+    ov->bufs = NULL;
+}
+
+/*
+ * Write out everything collected so far, and empty the outvec.
+ */
+void outvec_flush(struct outvec *ov)
+{
+    size_t i;
+
+#ifdef USE_WRITEV
+    if (!outvec_writev(ov))
+#endif
+    {
+        for (i = 0; i < ov->nranges; i++)
+            nasm_write(ov->ranges[i].data, ov->ranges[i].len, ov->fp);
+    }
+
+    ov->nranges = 0;
+    outvec_free_bufs(ov);
+}
+
+/*
+ * Free the outvec.  Anything not yet flushed is discarded.
+ */
+void outvec_free(struct outvec *ov)
+{
+    outvec_free_bufs(ov);
+    nasm_free(ov->ranges);
+    nasm_free(ov);
+}
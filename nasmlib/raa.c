@@ -44,6 +44,7 @@
 #define RAA_LAYERSHIFT	11      /* 2^this many items per layer */
 #define RAA_LAYERSIZE	((size_t)1 << RAA_LAYERSHIFT)
 #define RAA_LAYERMASK	(RAA_LAYERSIZE-1)
+#define RAA_DENSEMIN	32      /* Smallest dense top-level leaf */
 
 typedef struct RAA RAA;
 typedef union RAA_UNION RAA_UNION;
@@ -51,7 +52,11 @@ typedef struct RAA_LEAF RAA_LEAF;
 typedef struct RAA_BRANCH RAA_BRANCH;
 
 struct RAA {
-    /* Last position in this RAA */
+    /*
+     * Last position in this RAA.  A leaf at the top level may hold
+     * fewer than RAA_LAYERSIZE items, in which case this is the last
+     * one it has room for; it is grown as needed until it is full.
+     */
     raaindex endposn;
 
     /*
@@ -71,6 +76,14 @@ struct RAA {
      */
     unsigned int shift;
 
+    /*
+     * Top-level branch only: the leaf most recently used, and the
+     * position of its first item.  Most accesses are sequential or
+     * close together, so this usually saves walking the tree.
+     */
+    struct RAA *lastleaf;
+    raaindex lastbase;
+
     /*
      * The actual data
      */
@@ -86,6 +99,9 @@ struct RAA {
 
 #define LEAFSIZ (sizeof(RAA)-sizeof(RAA_UNION)+sizeof(RAA_LEAF))
 #define BRANCHSIZ (sizeof(RAA)-sizeof(RAA_UNION)+sizeof(RAA_BRANCH))
+#define DENSESIZ(n) (sizeof(RAA)-sizeof(RAA_UNION)+(n)*sizeof(union intorptr))
+
+#define raa_leafbase(posn) ((posn) & ~(raaindex)RAA_LAYERMASK)
 
 static struct RAA *raa_init_layer(raaindex posn, unsigned int layers)
 {
@@ -100,6 +116,31 @@ static struct RAA *raa_init_layer(raaindex posn, unsigned int layers)
     return r;
 }
 
+/*
+ * Number of items in a dense top-level leaf big enough for posn.
+ */
+static size_t raa_dense_size(raaindex posn)
+{
+    if (posn < RAA_DENSEMIN)
+        return RAA_DENSEMIN;
+    if (posn >= RAA_LAYERSIZE / 2)
+        return RAA_LAYERSIZE;
+    return (size_t)2 << ilog2_64(posn);
+}
+
+static struct RAA *raa_grow_dense(struct RAA *r, raaindex posn)
+{
+    size_t oldn = r ? r->endposn + 1 : 0;
+    size_t n = raa_dense_size(posn);
+
+    r = nasm_realloc(r, DENSESIZ(n));
+    if (!oldn)
+        memset(r, 0, DENSESIZ(0));
+    memset(&r->u.l.data[oldn], 0, (n - oldn) * sizeof(union intorptr));
+    r->endposn = n - 1;
+    return r;
+}
+
 void raa_free(struct RAA *r)
 {
     if (!r)
@@ -114,19 +155,51 @@ void raa_free(struct RAA *r)
     nasm_free(r);
 }
 
+/*
+ * Set every item to zero, but keep the memory already allocated, so
+ * an RAA which is filled in the same way again (e.g. on every pass)
+ * does not have to be rebuilt.
+ */
+void raa_reset(struct RAA *r)
+{
+    if (!r)
+        return;
+
+    if (r->layers) {
+        struct RAA **p = r->u.b.data;
+        size_t i;
+        for (i = 0; i < RAA_LAYERSIZE; i++)
+            raa_reset(*p++);
+    } else {
+        memset(r->u.l.data, 0,
+               ((r->endposn & RAA_LAYERMASK) + 1) * sizeof(union intorptr));
+    }
+}
+
 static const union intorptr *real_raa_read(struct RAA *r, raaindex posn)
 {
+    struct RAA *top = r;
+
     nasm_assert(posn <= (~(raaindex)0 >> 1));
 
     if (unlikely(!r || posn > r->endposn))
         return NULL;            /* Beyond the end */
 
+    if (likely(!r->layers))
+        return &r->u.l.data[posn];
+
+    if (top->lastleaf && top->lastbase == raa_leafbase(posn))
+        return &top->lastleaf->u.l.data[posn & RAA_LAYERMASK];
+
     while (r->layers) {
         size_t l = (posn >> r->shift) & RAA_LAYERMASK;
         r = r->u.b.data[l];
         if (!r)
             return NULL;        /* Not present */
     }
+
+    top->lastleaf = r;
+    top->lastbase = raa_leafbase(posn);
     return &r->u.l.data[posn & RAA_LAYERMASK];
 }
 
@@ -156,9 +229,16 @@ real_raa_write(struct RAA *r, raaindex posn, union intorptr value)
 
     if (unlikely(!r)) {
         /* Create a new top-level RAA */
-        r = raa_init_layer(posn, ilog2_64(posn)/RAA_LAYERSHIFT);
-    } else {
-        while (unlikely(r->endposn < posn)) {
+        if (posn < RAA_LAYERSIZE)
+            r = raa_grow_dense(NULL, posn);
+        else
+            r = raa_init_layer(posn, ilog2_64(posn)/RAA_LAYERSHIFT);
+    } else if (unlikely(r->endposn < posn)) {
+        /* A dense leaf is filled up before it gets a parent */
+        if (!r->layers && r->endposn < RAA_LAYERMASK)
+            r = raa_grow_dense(r, posn);
+
+        while (r->endposn < posn) {
             /* We need to add layers to an existing RAA */
             struct RAA *s = raa_init_layer(r->endposn, r->layers + 1);
             s->u.b.data[0] = r;
@@ -168,6 +248,16 @@ real_raa_write(struct RAA *r, raaindex posn, union intorptr value)
 
     result = r;
 
+    if (likely(!r->layers)) {
+        r->u.l.data[posn] = value;
+        return result;
+    }
+
+    if (result->lastleaf && result->lastbase == raa_leafbase(posn)) {
+        result->lastleaf->u.l.data[posn & RAA_LAYERMASK] = value;
+        return result;
+    }
+
     while (r->layers) {
         struct RAA **s;
         size_t l = (posn >> r->shift) & RAA_LAYERMASK;
@@ -178,6 +268,8 @@ real_raa_write(struct RAA *r, raaindex posn, union intorptr value)
     }
     r->u.l.data[posn & RAA_LAYERMASK] = value;
 
+    result->lastleaf = r;
+    result->lastbase = raa_leafbase(posn);
     return result;
 }
 
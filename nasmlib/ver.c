@@ -42,7 +42,7 @@ const char nasm_compile_options[] = ""
 #endif
     ;
 
-bool reproducible;              /* Reproducible output */
+per_thread bool reproducible;              /* Reproducible output */
 
 /* These are used by some backends. For a reproducible build,
  * these cannot contain version numbers.
@@ -161,7 +161,7 @@ struct cv8_state {
         size_t namebytes;
     } outfile;
 };
-struct cv8_state cv8_state;
+per_thread struct cv8_state cv8_state;
 
 static void cv8_init(void)
 {
@@ -115,20 +115,20 @@ struct Section {
     struct Symbol *gsyms, *asym;
 };
 
-static struct Section stext, sdata, sbss;
+static per_thread struct Section stext, sdata, sbss;
 
-static struct SAA *syms;
-static uint32_t nsyms;
+static per_thread struct SAA *syms;
+static per_thread uint32_t nsyms;
 
-static struct RAA *bsym;
+static per_thread struct RAA *bsym;
 
-static struct SAA *strs;
-static uint32_t strslen;
+static per_thread struct SAA *strs;
+static per_thread uint32_t strslen;
 
-static struct Symbol *fwds;
+static per_thread struct Symbol *fwds;
 
-static int bsd;
-static int is_pic;
+static per_thread int bsd;
+static per_thread int is_pic;
 
 static void aout_write(void);
 static void aout_write_relocs(struct Reloc *);
@@ -143,9 +143,9 @@ static void aout_fixup_relocs(struct Section *);
  * symbols, which can be used with WRT to provide PIC relocation
  * types.
  */
-static int32_t aout_gotpc_sect, aout_gotoff_sect;
-static int32_t aout_got_sect, aout_plt_sect;
-static int32_t aout_sym_sect;
+static per_thread int32_t aout_gotpc_sect, aout_gotoff_sect;
+static per_thread int32_t aout_got_sect, aout_plt_sect;
+static per_thread int32_t aout_sym_sect;
 
 static void aoutg_init(void)
 {
@@ -717,7 +717,7 @@ static void aout_out(int32_t segto, const void *data,
 
 static void aout_pad_sections(void)
 {
-    static uint8_t pad[] = { 0x90, 0x90, 0x90, 0x90 };
+    static per_thread uint8_t pad[] = { 0x90, 0x90, 0x90, 0x90 };
     /*
      * Pad each of the text and data sections with NOPs until their
      * length is a multiple of four. (NOP == 0x90.) Also increase
@@ -88,19 +88,19 @@ struct Section {
     struct Piece *head, *last, **tail;
 };
 
-static struct Section stext, sdata;
-static uint32_t bsslen;
-static int32_t bssindex;
+static per_thread struct Section stext, sdata;
+static per_thread uint32_t bsslen;
+static per_thread int32_t bssindex;
 
-static struct SAA *syms;
-static uint32_t nsyms;
+static per_thread struct SAA *syms;
+static per_thread uint32_t nsyms;
 
-static struct RAA *bsym;
+static per_thread struct RAA *bsym;
 
-static struct SAA *strs;
-static size_t strslen;
+static per_thread struct SAA *strs;
+static per_thread size_t strslen;
 
-static int as86_reloc_size;
+static per_thread int as86_reloc_size;
 
 static void as86_write(void);
 static void as86_write_section(struct Section *, int);
@@ -89,8 +89,8 @@
 
 #ifdef OF_BIN
 
-static FILE *rf = NULL;
-static void (*do_output)(void);
+static per_thread FILE *rf = NULL;
+static per_thread void (*do_output)(void);
 
 /* Section flags keep track of which attributes the user has defined. */
 #define START_DEFINED       0x001
@@ -104,12 +104,12 @@ static void (*do_output)(void);
 #define TYPE_NOBITS         0x100
 
 /* This struct is used to keep track of symbols for map-file generation. */
-static struct bin_label {
+static per_thread struct bin_label {
     char *name;
     struct bin_label *next;
 } *no_seg_labels, **nsl_tail;
 
-static struct Section {
+static per_thread struct Section {
     char *name;
     struct SAA *contents;
     int64_t length;                /* section length in bytes */
@@ -140,7 +140,7 @@ static struct Section {
 
 } *sections, *last_section;
 
-static struct Reloc {
+static per_thread struct Reloc {
     struct Reloc *next;
     int32_t posn;
     int32_t bytes;
@@ -149,15 +149,15 @@ static struct Reloc {
     struct Section *target;
 } *relocs, **reloctail;
 
-static uint64_t origin;
-static int origin_defined;
+static per_thread uint64_t origin;
+static per_thread int origin_defined;
 
 /* Stuff we need for map-file generation. */
 #define MAP_ORIGIN       1
 #define MAP_SUMMARY      2
 #define MAP_SECTIONS     4
 #define MAP_SYMBOLS      8
-static int map_control = 0;
+static per_thread int map_control = 0;
 
 extern macros_t bin_stdmac[];
 
@@ -1176,7 +1176,7 @@ static void bin_assign_attributes(struct Section *sec, char *astring)
 
 static void bin_define_section_labels(void)
 {
-    static int labels_defined = 0;
+    static per_thread int labels_defined = 0;
     struct Section *sec;
     char *label_name;
     size_t base_len;
@@ -48,6 +48,7 @@
 #include "error.h"
 #include "saa.h"
 #include "raa.h"
+#include "outvec.h"
 #include "eval.h"
 #include "outform.h"
 #include "outlib.h"
@@ -99,9 +100,9 @@
  */
 
 /* Flag which version of COFF we are currently outputting. */
-bool win32, win64;
+per_thread bool win32, win64;
 
-static int32_t imagebase_sect;
+static per_thread int32_t imagebase_sect;
 #define WRT_IMAGEBASE "..imagebase"
 
 /*
@@ -162,21 +163,23 @@ static int32_t imagebase_sect;
 #define COFF_MAX_ALIGNMENT 8192
 
 #define SECT_DELTA 32
-struct coff_Section **coff_sects;
-static int sectlen;
-int coff_nsects;
+per_thread struct coff_Section **coff_sects;
+static per_thread int sectlen;
+per_thread int coff_nsects;
 
-struct SAA *coff_syms;
-uint32_t coff_nsyms;
+per_thread struct SAA *coff_syms;
+per_thread uint32_t coff_nsyms;
 
-static int32_t def_seg;
+static per_thread int32_t def_seg;
 
-static int initsym;
+static per_thread int initsym;
 
-static struct RAA *bsym, *symval;
+static per_thread struct outvec *coff_ov; /* Output file while writing */
 
-struct SAA *coff_strs;
-static uint32_t strslen;
+static per_thread struct RAA *bsym, *symval;
+
+per_thread struct SAA *coff_strs;
+static per_thread uint32_t strslen;
 
 static void coff_gen_init(void);
 static void coff_sect_write(struct coff_Section *, const uint8_t *, uint32_t);
@@ -833,8 +836,8 @@ typedef struct tagString {
  * #define EXPORT_SECTION_FLAGS TEXT_FLAGS
  */
 
-static STRING *Exports = NULL;
-static struct coff_Section *directive_sec;
+static per_thread STRING *Exports = NULL;
+static per_thread struct coff_Section *directive_sec;
 static void AddExport(char *name)
 {
     STRING *rvp = Exports, *newS;
@@ -929,7 +932,7 @@ coff_directives(enum directive directive, char *value)
     }
     case D_SAFESEH:
     {
-        static int sxseg=-1;
+        static per_thread int sxseg=-1;
         int i;
 
         if (!win32) /* Only applicable for -f win32 */
@@ -1105,14 +1108,15 @@ static void coff_write(void)
         i = IMAGE_FILE_MACHINE_AMD64;
     else
         i = IMAGE_FILE_MACHINE_I386;
-    fwriteint16_t(i,                    ofile); /* machine type */
-    fwriteint16_t(coff_nsects,               ofile); /* number of sections */
-    fwriteint32_t(posix_timestamp(), ofile); /* timestamp */
-    fwriteint32_t(sympos,               ofile);
-    fwriteint32_t(coff_nsyms + initsym,      ofile);
-    fwriteint16_t(0,                    ofile); /* no optional header */
+    coff_ov = outvec_init(ofile);
+    outvec_write16(coff_ov, i);                    /* machine type */
+    outvec_write16(coff_ov, coff_nsects);          /* number of sections */
+    outvec_write32(coff_ov, posix_timestamp());    /* timestamp */
+    outvec_write32(coff_ov, sympos);
+    outvec_write32(coff_ov, coff_nsyms + initsym);
+    outvec_write16(coff_ov, 0);                    /* no optional header */
     /* Flags: 32-bit, no line numbers. Win32 doesn't even bother with them. */
-    fwriteint16_t((win32 | win64) ? 0 : 0x104, ofile);
+    outvec_write16(coff_ov, (win32 | win64) ? 0 : 0x104);
 
     /*
      * Output the section headers.
@@ -1130,7 +1134,7 @@ static void coff_write(void)
      */
     for (i = 0; i < coff_nsects; i++)
         if (coff_sects[i]->data) {
-            saa_fpwrite(coff_sects[i]->data, ofile);
+            outvec_saa(coff_ov, coff_sects[i]->data);
             coff_write_relocs(coff_sects[i]);
 
             if (coff_sects[i]->flags & IMAGE_SCN_LNK_COMDAT) {
@@ -1154,8 +1158,12 @@ static void coff_write(void)
      * Output the symbol and string tables.
      */
     coff_write_symbols();
-    fwriteint32_t(strslen + 4, ofile);     /* length includes length count */
-    saa_fpwrite(coff_strs, ofile);
+    outvec_write32(coff_ov, strslen + 4); /* length includes length count */
+    outvec_saa(coff_ov, coff_strs);
+
+    outvec_flush(coff_ov);
+    outvec_free(coff_ov);
+    coff_ov = NULL;
 }
 
 static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
@@ -1168,7 +1176,7 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
 
     if (namepos == -1) {
         strncpy(padname, name, 8);
-        nasm_write(padname, 8, ofile);
+        outvec_write(coff_ov, padname, 8);
     } else {
         /*
          * If name is longer than 8 bytes, write '/' followed
@@ -1190,15 +1198,15 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
         padname[6] = '0' + (namepos / 10);
         namepos = namepos % 10;
         padname[7] = '0' + (namepos);
-        nasm_write(padname, 8, ofile);
+        outvec_write(coff_ov, padname, 8);
     }
 
-    fwriteint32_t(0,            ofile); /* Virtual size field - set to 0 or vsize */
-    fwriteint32_t(0L,           ofile); /* RVA/offset - we ignore */
-    fwriteint32_t(datalen,      ofile);
-    fwriteint32_t(datapos,      ofile);
-    fwriteint32_t(relpos,       ofile);
-    fwriteint32_t(0L,           ofile); /* no line numbers - we don't do 'em */
+    outvec_write32(coff_ov, 0);       /* Virtual size field - set to 0 or vsize */
+    outvec_write32(coff_ov, 0L);      /* RVA/offset - we ignore */
+    outvec_write32(coff_ov, datalen);
+    outvec_write32(coff_ov, datapos);
+    outvec_write32(coff_ov, relpos);
+    outvec_write32(coff_ov, 0L);      /* no line numbers - we don't do 'em */
 
     /*
      * a special case -- if there are too many relocs
@@ -1207,12 +1215,12 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
      * relocation
      */
     if (flags & IMAGE_SCN_LNK_NRELOC_OVFL)
-        fwriteint16_t(IMAGE_SCN_MAX_RELOC, ofile);
+        outvec_write16(coff_ov, IMAGE_SCN_MAX_RELOC);
     else
-        fwriteint16_t(nrelocs,  ofile);
+        outvec_write16(coff_ov, nrelocs);
 
-    fwriteint16_t(0,            ofile); /* again, no line numbers */
-    fwriteint32_t(flags,        ofile);
+    outvec_write16(coff_ov, 0);       /* again, no line numbers */
+    outvec_write32(coff_ov, flags);
 }
 
 static void coff_write_relocs(struct coff_Section *s)
@@ -1221,18 +1229,18 @@ static void coff_write_relocs(struct coff_Section *s)
 
     /* a real number of relocations if needed */
     if (s->flags & IMAGE_SCN_LNK_NRELOC_OVFL) {
-        fwriteint32_t(s->nrelocs, ofile);
-        fwriteint32_t(0, ofile);
-        fwriteint16_t(0, ofile);
+        outvec_write32(coff_ov, s->nrelocs);
+        outvec_write32(coff_ov, 0);
+        outvec_write16(coff_ov, 0);
     }
 
     for (r = s->head; r; r = r->next) {
-        fwriteint32_t(r->address, ofile);
-        fwriteint32_t(r->symbol + (r->symbase == REAL_SYMBOLS ? initsym :
-                                   r->symbase == ABS_SYMBOL   ? initsym - 1 :
-                                   r->symbase == SECT_SYMBOLS ? 2 : 0),
-                      ofile);
-        fwriteint16_t(r->type, ofile);
+        outvec_write32(coff_ov, r->address);
+        outvec_write32(coff_ov,
+                       r->symbol + (r->symbase == REAL_SYMBOLS ? initsym :
+                                    r->symbase == ABS_SYMBOL   ? initsym - 1 :
+                                    r->symbase == SECT_SYMBOLS ? 2 : 0));
+        outvec_write16(coff_ov, r->type);
     }
 }
 
@@ -1243,18 +1251,18 @@ static void coff_symbol(char *name, int32_t strpos, int32_t value,
 
     if (name) {
         strncpy(padname, name, 8);
-        nasm_write(padname, 8, ofile);
+        outvec_write(coff_ov, padname, 8);
     } else {
-        fwriteint32_t(0, ofile);
-        fwriteint32_t(strpos, ofile);
+        outvec_write32(coff_ov, 0);
+        outvec_write32(coff_ov, strpos);
     }
 
-    fwriteint32_t(value,        ofile);
-    fwriteint16_t(section,      ofile);
-    fwriteint16_t(type,         ofile);
+    outvec_write32(coff_ov, value);
+    outvec_write16(coff_ov, section);
+    outvec_write16(coff_ov, type);
 
-    fputc(storageclass, ofile);
-    fputc(aux, ofile);
+    outvec_write8(coff_ov, storageclass);
+    outvec_write8(coff_ov, aux);
 }
 
 static void coff_write_symbols(void)
@@ -1270,7 +1278,7 @@ static void coff_write_symbols(void)
         memset(filename, 0, 18);
     else
         strncpy(filename, inname, 18);
-    nasm_write(filename, 18, ofile);
+    outvec_write(coff_ov, filename, 18);
 
     /*
      * The section records, with their auxiliaries.
@@ -1279,17 +1287,17 @@ static void coff_write_symbols(void)
 
     for (i = 0; i < (uint32_t) coff_nsects; i++) {
         coff_symbol(coff_sects[i]->name, 0L, 0L, i + 1, 0, 3, 1);
-        fwriteint32_t(coff_sects[i]->len,    ofile);
-        fwriteint16_t(coff_sects[i]->nrelocs,ofile);
+        outvec_write32(coff_ov, coff_sects[i]->len);
+        outvec_write16(coff_ov, coff_sects[i]->nrelocs);
         if (coff_sects[i]->flags & IMAGE_SCN_LNK_COMDAT) {
-            fwriteint16_t(0, ofile);
-            fwriteint32_t(coff_sects[i]->checksum, ofile);
-            fwriteint16_t(coff_sects[i]->comdat_associated, ofile);
-            fputc(coff_sects[i]->comdat_selection, ofile);
-            nasm_write(filename, 3, ofile);
+            outvec_write16(coff_ov, 0);
+            outvec_write32(coff_ov, coff_sects[i]->checksum);
+            outvec_write16(coff_ov, coff_sects[i]->comdat_associated);
+            outvec_write8(coff_ov, coff_sects[i]->comdat_selection);
+            outvec_write(coff_ov, filename, 3);
         }
         else
-            nasm_write(filename, 12, ofile);
+            outvec_write(coff_ov, filename, 12);
     }
 
     /*
@@ -50,16 +50,16 @@
 
 #ifdef OF_DBG
 
-struct Section {
+per_thread struct Section {
     struct Section *next;
     int32_t number;
     char *name;
 } *dbgsect;
 
-static unsigned long dbg_max_data_dump = 128;
-static bool section_labels = true;
-static bool subsections_via_symbols = false;
-static int32_t init_seg;
+static per_thread unsigned long dbg_max_data_dump = 128;
+static per_thread bool section_labels = true;
+static per_thread bool subsections_via_symbols = false;
+static per_thread int32_t init_seg;
 
 const struct ofmt of_dbg;
 static void dbg_init(void)
@@ -171,7 +171,7 @@ static const char *out_type(enum out_type type)
         "reladdr",
         "segment"
     };
-    static char invalid_buf[64];
+    static per_thread char invalid_buf[64];
 
     if (type >= sizeof(out_types)/sizeof(out_types[0])) {
         sprintf(invalid_buf, "[invalid type %d]", type);
@@ -187,7 +187,7 @@ static const char *out_flags(enum out_flags flags)
         "signed",
         "unsigned"
     };
-    static char flags_buf[1024];
+    static per_thread char flags_buf[1024];
     unsigned long flv = flags;
     size_t n;
     size_t left = sizeof flags_buf - 1;
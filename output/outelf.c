@@ -49,6 +49,7 @@
 #include "outlib.h"
 #include "rbtree.h"
 #include "hashtbl.h"
+#include "outvec.h"
 #include "ver.h"
 
 #include "dwarf.h"
@@ -59,51 +60,52 @@
 #if defined(OF_ELF32) || defined(OF_ELF64) || defined(OF_ELFX32)
 
 #define SECT_DELTA 32
-static struct elf_section **sects;
-static int nsects, sectlen;
+static per_thread struct elf_section **sects;
+static per_thread int nsects, sectlen;
 
 #define SHSTR_DELTA 256
-static char *shstrtab;
-static int shstrtablen, shstrtabsize;
+static per_thread char *shstrtab;
+static per_thread int shstrtablen, shstrtabsize;
 
-static struct SAA *syms;
-static uint32_t nlocals, nglobs, ndebugs; /* Symbol counts */
+static per_thread struct SAA *syms;
+static per_thread uint32_t nlocals, nglobs, ndebugs; /* Symbol counts */
 
-static int32_t def_seg;
+static per_thread int32_t def_seg;
 
-static struct RAA *bsym;
+static per_thread struct RAA *bsym;
 
-static struct SAA *symtab, *symtab_shndx;
+static per_thread struct SAA *symtab, *symtab_shndx;
 
-static struct SAA *strs;
-static uint32_t strslen;
+static per_thread struct SAA *strs;
+static per_thread uint32_t strslen;
 
 struct glob_sym {
     struct rbtree rb;
     char *name;
 };
-static struct rbtree *globs_rbt;
+static per_thread struct rbtree *globs_rbt;
 
-static struct RAA *section_by_index;
-static struct hash_table section_by_name;
+static per_thread struct RAA *section_by_index;
+static per_thread struct hash_table section_by_name;
 
-static struct elf_symbol *fwds;
+static per_thread struct elf_symbol *fwds;
 
-static char elf_module[FILENAME_MAX];
-static char elf_dir[FILENAME_MAX];
+static per_thread char elf_module[FILENAME_MAX];
+static per_thread char elf_dir[FILENAME_MAX];
 
 extern const struct ofmt of_elf32;
 extern const struct ofmt of_elf64;
 extern const struct ofmt of_elfx32;
 
-static struct ELF_SECTDATA {
+static per_thread struct ELF_SECTDATA {
     void                *data;
     int64_t             len;
     bool                is_saa;
 } *elf_sects;
 
-static int elf_nsect, nsections;
-static int64_t elf_foffs;
+static per_thread int elf_nsect, nsections;
+static per_thread int64_t elf_foffs;
+static per_thread struct outvec *elf_ov; /* Output file while writing */
 
 static void elf_write(void);
 static void elf_sect_write(struct elf_section *, const void *, size_t);
@@ -117,7 +119,7 @@ static size_t elf_build_symtab(void);
 static int add_sectname(const char *, const char *);
 
 /* First debugging section index */
-static int sec_debug;
+static per_thread int sec_debug;
 
 struct symlininfo {
     int                 offset;
@@ -145,28 +147,28 @@ struct sectlist {
 };
 
 /* common debug variables */
-static int currentline = 1;
-static int debug_immcall = 0;
+static per_thread int currentline = 1;
+static per_thread int debug_immcall = 0;
 
 /* stabs debug variables */
-static struct linelist *stabslines = 0;
-static int numlinestabs = 0;
-static char *stabs_filename = 0;
-static uint8_t *stabbuf = 0, *stabstrbuf = 0, *stabrelbuf = 0;
-static int stablen, stabstrlen, stabrellen;
+static per_thread struct linelist *stabslines = 0;
+static per_thread int numlinestabs = 0;
+static per_thread char *stabs_filename = 0;
+static per_thread uint8_t *stabbuf = 0, *stabstrbuf = 0, *stabrelbuf = 0;
+static per_thread int stablen, stabstrlen, stabrellen;
 
 /* dwarf debug variables */
-static struct linelist *dwarf_flist = 0, *dwarf_clist = 0, *dwarf_elist = 0;
-static struct sectlist *dwarf_fsect = 0, *dwarf_csect = 0, *dwarf_esect = 0;
-static int dwarf_numfiles = 0, dwarf_nsections;
-static uint8_t *arangesbuf = 0, *arangesrelbuf = 0, *pubnamesbuf = 0, *infobuf = 0,  *inforelbuf = 0,
+static per_thread struct linelist *dwarf_flist = 0, *dwarf_clist = 0, *dwarf_elist = 0;
+static per_thread struct sectlist *dwarf_fsect = 0, *dwarf_csect = 0, *dwarf_esect = 0;
+static per_thread int dwarf_numfiles = 0, dwarf_nsections;
+static per_thread uint8_t *arangesbuf = 0, *arangesrelbuf = 0, *pubnamesbuf = 0, *infobuf = 0,  *inforelbuf = 0,
                *abbrevbuf = 0, *linebuf = 0, *linerelbuf = 0, *framebuf = 0, *locbuf = 0;
 static int8_t line_base = -5, line_range = 14, opcode_base = 13;
-static int arangeslen, arangesrellen, pubnameslen, infolen, inforellen,
+static per_thread int arangeslen, arangesrellen, pubnameslen, infolen, inforellen,
            abbrevlen, linelen, linerellen, framelen, loclen;
-static int64_t dwarf_infosym, dwarf_abbrevsym, dwarf_linesym;
+static per_thread int64_t dwarf_infosym, dwarf_abbrevsym, dwarf_linesym;
 
-static struct elf_symbol *lastsym;
+static per_thread struct elf_symbol *lastsym;
 
 /* common debugging routines */
 static void debug_typevalue(int32_t);
@@ -199,7 +201,7 @@ struct dwarf_format {
     uint16_t sect_version[DWARF_NSECT];
     /* ... add more here to generalize further */
 };
-const struct dwarf_format *dwfmt;
+per_thread const struct dwarf_format *dwfmt;
 
 static void dwarf32_init(void);
 static void dwarfx32_init(void);
@@ -229,7 +231,7 @@ struct elf_format_info {
     /* Build a relocation table */
     struct SAA *(*elf_build_reltab)(const struct elf_reloc *);
 };
-static const struct elf_format_info *efmt;
+static per_thread const struct elf_format_info *efmt;
 
 static void elf32_sym(const struct elf_symbol *sym);
 static void elf64_sym(const struct elf_symbol *sym);
@@ -245,12 +247,12 @@ static bool dfmt_is_dwarf(void);
  * Special NASM section numbers which are used to define ELF special
  * symbols.
  */
-static int32_t elf_gotpc_sect, elf_gotoff_sect;
-static int32_t elf_got_sect, elf_plt_sect;
-static int32_t elf_sym_sect, elf_gottpoff_sect, elf_tlsie_sect;
+static per_thread int32_t elf_gotpc_sect, elf_gotoff_sect;
+static per_thread int32_t elf_got_sect, elf_plt_sect;
+static per_thread int32_t elf_sym_sect, elf_gottpoff_sect, elf_tlsie_sect;
 
-uint8_t elf_osabi = 0;      /* Default OSABI = 0 (System V or Linux) */
-uint8_t elf_abiver = 0;     /* Current ABI version */
+per_thread uint8_t elf_osabi = 0;      /* Default OSABI = 0 (System V or Linux) */
+per_thread uint8_t elf_abiver = 0;     /* Current ABI version */
 
 /* Known sections with nonstandard defaults. -n means n*pointer size. */
 struct elf_known_section {
@@ -1169,7 +1171,7 @@ static void elf32_out(int32_t segto, const void *data,
     struct elf_section *s;
     int64_t addr;
     int reltype, bytes;
-    static struct symlininfo sinfo;
+    static per_thread struct symlininfo sinfo;
     const char *gnu16 = NULL;
     int badsize = 0;
 
@@ -1403,7 +1405,7 @@ static void elf64_out(int32_t segto, const void *data,
     struct elf_section *s;
     int64_t addr;
     int reltype, bytes;
-    static struct symlininfo sinfo;
+    static per_thread struct symlininfo sinfo;
 
     /*
      * handle absolute-assembly (structure definitions)
@@ -1684,7 +1686,7 @@ static void elfx32_out(int32_t segto, const void *data,
     struct elf_section *s;
     int64_t addr;
     int reltype, bytes;
-    static struct symlininfo sinfo;
+    static per_thread struct symlininfo sinfo;
 
     /*
      * handle absolute-assembly (structure definitions)
@@ -2028,7 +2030,8 @@ static void elf_write(void)
         ehdr.ehdr64.e_shstrndx      = elf_shndx(sec_shstrtab, SHN_XINDEX);
     }
 
-    nasm_write(&ehdr, sizeof(ehdr), ofile);
+    elf_ov = outvec_init(ofile);
+    outvec_write(elf_ov, &ehdr, sizeof(ehdr));
     elf_foffs = sizeof ehdr + efmt->shdr_size * nsections;
 
     /*
@@ -2167,12 +2170,15 @@ static void elf_write(void)
             p += strlen(p) + 1;
         }
     }
-    fwritezero(align, ofile);
+    outvec_zero(elf_ov, align);
 
     /*
      * Now output the sections.
      */
     elf_write_sections();
+    outvec_flush(elf_ov);
+    outvec_free(elf_ov);
+    elf_ov = NULL;
 
     nasm_free(elf_sects);
     saa_free(symtab);
@@ -2180,7 +2186,7 @@ static void elf_write(void)
         saa_free(symtab_shndx);
 }
 
-static size_t nsyms;
+static per_thread size_t nsyms;
 
 static void elf_sym(const struct elf_symbol *sym)
 {
@@ -2445,7 +2451,7 @@ static void elf_section_header(int name, int type, uint64_t flags,
         shdr.sh_addralign    = cpu_to_le32(align);
         shdr.sh_entsize      = cpu_to_le32(entsize);
 
-        nasm_write(&shdr, sizeof shdr, ofile);
+        outvec_write(elf_ov, &shdr, sizeof shdr);
     } else {
         Elf64_Shdr  shdr;
 
@@ -2462,7 +2468,7 @@ static void elf_section_header(int name, int type, uint64_t flags,
         shdr.sh_addralign   = cpu_to_le64(align);
         shdr.sh_entsize     = cpu_to_le64(entsize);
 
-        nasm_write(&shdr, sizeof shdr, ofile);
+        outvec_write(elf_ov, &shdr, sizeof shdr);
     }
 }
 
@@ -2475,10 +2481,10 @@ static void elf_write_sections(void)
             int32_t reallen = ALIGN(len, SEC_FILEALIGN);
             int32_t align = reallen - len;
             if (elf_sects[i].is_saa)
-                saa_fpwrite(elf_sects[i].data, ofile);
+                outvec_saa(elf_ov, elf_sects[i].data);
             else
-                nasm_write(elf_sects[i].data, len, ofile);
-            fwritezero(align, ofile);
+                outvec_ref(elf_ov, elf_sects[i].data, len);
+            outvec_zero(elf_ov, align);
         }
 }
 
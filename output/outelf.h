@@ -79,8 +79,8 @@ struct stabentry {
 #define sec_debug_frame         (sec_debug + 8)
 #define sec_debug_loc           (sec_debug + 9)
 
-extern uint8_t elf_osabi;
-extern uint8_t elf_abiver;
+extern per_thread uint8_t elf_osabi;
+extern per_thread uint8_t elf_abiver;
 
 #define WRITE_STAB(p,n_strx,n_type,n_other,n_desc,n_value)  \
     do {                                                    \
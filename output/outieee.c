@@ -83,11 +83,11 @@
 
 #define ARRAY_BOT 0x1
 
-static char ieee_infile[FILENAME_MAX];
-static int ieee_uppercase;
+static per_thread char ieee_infile[FILENAME_MAX];
+static per_thread int ieee_uppercase;
 
-static bool any_segs;
-static int arrindex;
+static per_thread bool any_segs;
+static per_thread int arrindex;
 
 #define HUNKSIZE 1024           /* Size of the data hunk */
 #define EXT_BLKSIZ 512
@@ -102,19 +102,19 @@ struct LineNumber {
     int32_t lineno;
 };
 
-static struct FileName {
+static per_thread struct FileName {
     struct FileName *next;
     char *name;
     int32_t index;
 } *fnhead, **fntail;
 
-static struct Array {
+static per_thread struct Array {
     struct Array *next;
     unsigned size;
     int basetype;
 } *arrhead, **arrtail;
 
-static struct ieeePublic {
+static per_thread struct ieeePublic {
     struct ieeePublic *next;
     char *name;
     int32_t offset;
@@ -123,21 +123,21 @@ static struct ieeePublic {
     int type;                   /* for debug purposes */
 } *fpubhead, **fpubtail, *last_defined;
 
-static struct ieeeExternal {
+static per_thread struct ieeeExternal {
     struct ieeeExternal *next;
     char *name;
     int32_t commonsize;
 } *exthead, **exttail;
 
-static int externals;
+static per_thread int externals;
 
-static struct ExtBack {
+static per_thread struct ExtBack {
     struct ExtBack *next;
     int index[EXT_BLKSIZ];
 } *ebhead, **ebtail;
 
 /* NOTE: the first segment MUST be the lineno segment */
-static struct ieeeSection {
+static per_thread struct ieeeSection {
     struct ieeeSection *next;
     char *name;
     struct ieeeObjData *data, *datacurr;
@@ -181,8 +181,8 @@ struct ieeeFixupp {
     int32_t addend;
 };
 
-static int32_t ieee_entry_seg, ieee_entry_ofs;
-static int checksum;
+static per_thread int32_t ieee_entry_seg, ieee_entry_ofs;
+static per_thread int checksum;
 
 extern const struct ofmt of_ieee;
 static const struct dfmt ladsoft_debug_form;
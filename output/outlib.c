@@ -58,19 +58,21 @@ uint64_t realsize(enum out_type type, uint64_t size)
 
 /* Common section/symbol handling */
 
-struct ol_sect *_ol_sect_list;
-uint64_t _ol_nsects;             /* True sections, not external symbols */
-static struct ol_sect **ol_sect_tail = &_ol_sect_list;
-static struct hash_table ol_secthash;
-static struct RAA *ol_sect_index_tbl;
+per_thread struct ol_sect *_ol_sect_list;
+per_thread uint64_t _ol_nsects;             /* True sections, not external symbols */
+static per_thread struct ol_sect **ol_sect_tail;
+static per_thread struct hash_table ol_secthash;
+static per_thread struct RAA *ol_sect_index_tbl;
 
-struct ol_sym *_ol_sym_list;
-uint64_t _ol_nsyms;
-static struct ol_sym **ol_sym_tail = &_ol_sym_list;
-static struct hash_table ol_symhash;
+per_thread struct ol_sym *_ol_sym_list;
+per_thread uint64_t _ol_nsyms;
+static per_thread struct ol_sym **ol_sym_tail;
+static per_thread struct hash_table ol_symhash;
 
 void ol_init(void)
 {
+    ol_sect_tail = &_ol_sect_list;
+    ol_sym_tail = &_ol_sym_list;
 }
 
 static void ol_free_symbols(void)
@@ -231,14 +231,14 @@ static inline O_Section *ol_sect_by_index(int32_t index)
 }
 
 /* Global list of sections (not including external symbols) */
-extern struct ol_sect *_ol_sect_list;
+extern per_thread struct ol_sect *_ol_sect_list;
 static inline O_Section *ol_sect_list(void)
 {
     return (O_Section *)_ol_sect_list;
 }
 
 /* Count of sections (not including external symbols) */
-extern uint64_t _ol_nsects;
+extern per_thread uint64_t _ol_nsects;
 static inline uint64_t ol_nsects(void)
 {
     return _ol_nsects;
@@ -297,14 +297,14 @@ static inline O_Symbol *ol_sym_by_address(O_Section *sect, int64_t addr,
 }
 
 /* Global list of symbols */
-extern struct ol_sym *_ol_sym_list;
+extern per_thread struct ol_sym *_ol_sym_list;
 static inline O_Symbol *ol_sym_list(void)
 {
     return (O_Symbol *)_ol_sym_list;
 }
 
 /* Global count of symbols */
-extern uint64_t _ol_nsyms;
+extern per_thread uint64_t _ol_nsyms;
 static inline uint64_t ol_nsyms(void)
 {
     return _ol_nsyms;
@@ -47,6 +47,7 @@
 #include "error.h"
 #include "saa.h"
 #include "raa.h"
+#include "outvec.h"
 #include "rbtree.h"
 #include "hashtbl.h"
 #include "outform.h"
@@ -104,11 +105,13 @@ struct macho_fmt {
     bool forcesym;		/* Always use "external" (symbol-relative) relocations */
 };
 
-static struct macho_fmt fmt;
+static per_thread struct macho_fmt fmt;
 
-static void fwriteptr(uint64_t data, FILE * fp)
+static per_thread struct outvec *macho_ov; /* Output file while writing */
+
+static void macho_writeptr(uint64_t data)
 {
-    fwriteaddr(data, fmt.ptrsize, fp);
+    outvec_writeaddr(macho_ov, data, fmt.ptrsize);
 }
 
 struct section {
@@ -139,7 +142,7 @@ struct section {
 #define S_NASM_TYPE_MASK	 0x800004ff	/* we consider these bits "section type" */
 
 /* fake section for absolute symbols, *not* part of the section linked list */
-static struct section absolute_sect;
+static per_thread struct section absolute_sect;
 
 struct reloc {
     /* nasm internal data */
@@ -174,9 +177,9 @@ struct symbol {
 
 #define DEFAULT_SECTION_ALIGNMENT 0 /* byte (i.e. no) alignment */
 
-static struct section *sects, **sectstail, **sectstab;
-static struct symbol *syms, **symstail;
-static uint32_t nsyms;
+static per_thread struct section *sects, **sectstail, **sectstab;
+static per_thread struct symbol *syms, **symstail;
+static per_thread uint32_t nsyms;
 
 /* These variables are set by macho_layout_symbols() to organize
    the symbol table and string table in order the dynamic linker
@@ -195,25 +198,25 @@ static uint32_t nsyms;
 static uint32_t ilocalsym = 0;
 static uint32_t iextdefsym = 0;
 static uint32_t iundefsym = 0;
-static uint32_t nlocalsym;
-static uint32_t nextdefsym;
-static uint32_t nundefsym;
-static struct symbol **extdefsyms = NULL;
-static struct symbol **undefsyms = NULL;
+static per_thread uint32_t nlocalsym;
+static per_thread uint32_t nextdefsym;
+static per_thread uint32_t nundefsym;
+static per_thread struct symbol **extdefsyms = NULL;
+static per_thread struct symbol **undefsyms = NULL;
 
-static struct RAA *extsyms;
-static struct SAA *strs;
-static uint32_t strslen;
+static per_thread struct RAA *extsyms;
+static per_thread struct SAA *strs;
+static per_thread uint32_t strslen;
 
 /* Global file information. This should be cleaned up into either
    a structure or as function arguments.  */
-static uint32_t head_ncmds = 0;
-static uint32_t head_sizeofcmds = 0;
-static uint32_t head_flags = 0;
-static uint64_t seg_filesize = 0;
-static uint64_t seg_vmsize = 0;
-static uint32_t seg_nsects = 0;
-static uint64_t rel_padcnt = 0;
+static per_thread uint32_t head_ncmds = 0;
+static per_thread uint32_t head_sizeofcmds = 0;
+static per_thread uint32_t head_flags = 0;
+static per_thread uint64_t seg_filesize = 0;
+static per_thread uint64_t seg_vmsize = 0;
+static per_thread uint32_t seg_nsects = 0;
+static per_thread uint64_t rel_padcnt = 0;
 
 /*
  * Functions for handling fixed-length zero-padded string
@@ -235,8 +238,8 @@ static uint64_t rel_padcnt = 0;
 #define alignptr(x) \
     ALIGN(x, fmt.ptrsize)	/* align x to output format width */
 
-static struct hash_table section_by_name;
-static struct RAA *section_by_index;
+static per_thread struct hash_table section_by_name;
+static per_thread struct RAA *section_by_index;
 
 static struct section * never_null
 find_or_add_section(const char *segname, const char *sectname)
@@ -325,20 +328,20 @@ struct section_info {
 #define DW_MAX_LN (DW_LN_BASE + DW_LN_RANGE)
 #define DW_MAX_SP_OPCODE 256
 
-static struct file_list *dw_head_file = 0, *dw_cur_file = 0, **dw_last_file_next = NULL;
-static struct dir_list *dw_head_dir = 0, **dw_last_dir_next = NULL;
-static struct dw_sect_list  *dw_head_sect = 0, *dw_cur_sect = 0, *dw_last_sect = 0;
-static uint32_t  cur_line = 0, dw_num_files = 0, dw_num_dirs = 0, dw_num_sects = 0;
-static bool  dbg_immcall = false;
-static const char *module_name = NULL;
+static per_thread struct file_list *dw_head_file = 0, *dw_cur_file = 0, **dw_last_file_next = NULL;
+static per_thread struct dir_list *dw_head_dir = 0, **dw_last_dir_next = NULL;
+static per_thread struct dw_sect_list  *dw_head_sect = 0, *dw_cur_sect = 0, *dw_last_sect = 0;
+static per_thread uint32_t  cur_line = 0, dw_num_files = 0, dw_num_dirs = 0, dw_num_sects = 0;
+static per_thread bool  dbg_immcall = false;
+static per_thread const char *module_name = NULL;
 
 /*
  * Special section numbers which are used to define Mach-O special
  * symbols, which can be used with WRT to provide PIC relocation
  * types.
  */
-static int32_t macho_tlvp_sect;
-static int32_t macho_gotpcrel_sect;
+static per_thread int32_t macho_tlvp_sect;
+static per_thread int32_t macho_gotpcrel_sect;
 
 static void macho_init(void)
 {
@@ -1291,14 +1294,14 @@ static void macho_calculate_sizes (void)
 
 static void macho_write_header (void)
 {
-    fwriteint32_t(fmt.mh_magic, ofile);	/* magic */
-    fwriteint32_t(fmt.cpu_type, ofile);	/* CPU type */
-    fwriteint32_t(CPU_SUBTYPE_I386_ALL, ofile);	/* CPU subtype */
-    fwriteint32_t(MH_OBJECT, ofile);	/* Mach-O file type */
-    fwriteint32_t(head_ncmds, ofile);	/* number of load commands */
-    fwriteint32_t(head_sizeofcmds, ofile);	/* size of load commands */
-    fwriteint32_t(head_flags, ofile);		/* flags, if any */
-    fwritezero(fmt.header_size - 7*4, ofile);	/* reserved fields */
+    outvec_write32(macho_ov, fmt.mh_magic);	/* magic */
+    outvec_write32(macho_ov, fmt.cpu_type);	/* CPU type */
+    outvec_write32(macho_ov, CPU_SUBTYPE_I386_ALL);	/* CPU subtype */
+    outvec_write32(macho_ov, MH_OBJECT);	/* Mach-O file type */
+    outvec_write32(macho_ov, head_ncmds);	/* number of load commands */
+    outvec_write32(macho_ov, head_sizeofcmds);	/* size of load commands */
+    outvec_write32(macho_ov, head_flags);		/* flags, if any */
+    outvec_zero(macho_ov, fmt.header_size - 7*4);	/* reserved fields */
 }
 
 /* Write out the segment load command at offset.  */
@@ -1309,23 +1312,22 @@ static uint32_t macho_write_segment (uint64_t offset)
     uint32_t s_reloff = 0;
     struct section *s;
 
-    fwriteint32_t(fmt.lc_segment, ofile);        /* cmd == LC_SEGMENT_64 */
+    outvec_write32(macho_ov, fmt.lc_segment);        /* cmd == LC_SEGMENT_64 */
 
     /* size of load command including section load commands */
-    fwriteint32_t(fmt.segcmd_size + seg_nsects * fmt.sectcmd_size,
-		  ofile);
+    outvec_write32(macho_ov, fmt.segcmd_size + seg_nsects * fmt.sectcmd_size);
 
     /* in an MH_OBJECT file all sections are in one unnamed (name
     ** all zeros) segment */
-    fwritezero(16, ofile);
-    fwriteptr(0, ofile);		     /* in-memory offset */
-    fwriteptr(seg_vmsize, ofile);	     /* in-memory size */
-    fwriteptr(offset, ofile);	             /* in-file offset to data */
-    fwriteptr(seg_filesize, ofile);	     /* in-file size */
-    fwriteint32_t(VM_PROT_DEFAULT, ofile);   /* maximum vm protection */
-    fwriteint32_t(VM_PROT_DEFAULT, ofile);   /* initial vm protection */
-    fwriteint32_t(seg_nsects, ofile);        /* number of sections */
-    fwriteint32_t(0, ofile);		     /* no flags */
+    outvec_zero(macho_ov, 16);
+    macho_writeptr(0);		     /* in-memory offset */
+    macho_writeptr(seg_vmsize);	     /* in-memory size */
+    macho_writeptr(offset);	             /* in-file offset to data */
+    macho_writeptr(seg_filesize);	     /* in-file size */
+    outvec_write32(macho_ov, VM_PROT_DEFAULT);   /* maximum vm protection */
+    outvec_write32(macho_ov, VM_PROT_DEFAULT);   /* initial vm protection */
+    outvec_write32(macho_ov, seg_nsects);        /* number of sections */
+    outvec_write32(macho_ov, 0);		     /* no flags */
 
     /* emit section headers */
     for (s = sects; s != NULL; s = s->next) {
@@ -1347,36 +1349,36 @@ static uint32_t macho_write_segment (uint64_t offset)
 	    xstrncpy(s->segname, "__TEXT");
 	}
 
-        nasm_write(s->sectname, sizeof(s->sectname), ofile);
-        nasm_write(s->segname, sizeof(s->segname), ofile);
-        fwriteptr(s->addr, ofile);
-        fwriteptr(s->size, ofile);
+        outvec_write(macho_ov, s->sectname, sizeof(s->sectname));
+        outvec_write(macho_ov, s->segname, sizeof(s->segname));
+        macho_writeptr(s->addr);
+        macho_writeptr(s->size);
 
         /* dummy data for zerofill sections or proper values */
         if ((s->flags & SECTION_TYPE) != S_ZEROFILL) {
 	    nasm_assert(s->pad != (uint32_t)-1);
 	    offset += s->pad;
-            fwriteint32_t(offset, ofile);
+            outvec_write32(macho_ov, offset);
 	    offset += s->size;
             /* Write out section alignment, as a power of two.
             e.g. 32-bit word alignment would be 2 (2^2 = 4).  */
-            fwriteint32_t(s->align, ofile);
+            outvec_write32(macho_ov, s->align);
             /* To be compatible with cctools as we emit
             a zero reloff if we have no relocations.  */
-            fwriteint32_t(s->nreloc ? rel_base + s_reloff : 0, ofile);
-            fwriteint32_t(s->nreloc, ofile);
+            outvec_write32(macho_ov, s->nreloc ? rel_base + s_reloff : 0);
+            outvec_write32(macho_ov, s->nreloc);
 
             s_reloff += s->nreloc * MACHO_RELINFO_SIZE;
         } else {
-            fwriteint32_t(0, ofile);
-            fwriteint32_t(s->align, ofile);
-            fwriteint32_t(0, ofile);
-            fwriteint32_t(0, ofile);
+            outvec_write32(macho_ov, 0);
+            outvec_write32(macho_ov, s->align);
+            outvec_write32(macho_ov, 0);
+            outvec_write32(macho_ov, 0);
         }
 
-        fwriteint32_t(s->flags, ofile);      /* flags */
-        fwriteint32_t(0, ofile);	     /* reserved */
-        fwriteptr(0, ofile);		     /* reserved */
+        outvec_write32(macho_ov, s->flags);      /* flags */
+        outvec_write32(macho_ov, 0);	     /* reserved */
+        macho_writeptr(0);		     /* reserved */
     }
 
     rel_padcnt = rel_base - offset;
@@ -1393,14 +1395,14 @@ static void macho_write_relocs (struct reloc *r)
     while (r) {
 	uint32_t word2;
 
-	fwriteint32_t(r->addr, ofile); /* reloc offset */
+	outvec_write32(macho_ov, r->addr); /* reloc offset */
 
 	word2 = r->snum;
 	word2 |= r->pcrel << 24;
 	word2 |= r->length << 25;
 	word2 |= r->ext << 27;
 	word2 |= r->type << 28;
-	fwriteint32_t(word2, ofile); /* reloc data */
+	outvec_write32(macho_ov, word2); /* reloc data */
 	r = r->next;
     }
 }
@@ -1469,12 +1471,12 @@ static void macho_write_section (void)
 	}
 
 	/* dump the section data to file */
-	fwritezero(s->pad, ofile);
-	saa_fpwrite(s->data, ofile);
+	outvec_zero(macho_ov, s->pad);
+	outvec_saa(macho_ov, s->data);
     }
 
     /* pad last section up to reloc entries on pointer boundary */
-    fwritezero(rel_padcnt, ofile);
+    outvec_zero(macho_ov, rel_padcnt);
 
     /* emit relocation entries */
     for (s = sects; s != NULL; s = s->next)
@@ -1492,10 +1494,10 @@ static void macho_write_symtab (void)
 
     for (sym = syms; sym != NULL; sym = sym->next) {
 	if ((sym->type & N_EXT) == 0) {
-	    fwriteint32_t(sym->strx, ofile);		/* string table entry number */
-	    nasm_write(&sym->type, 1, ofile);		/* symbol type */
-	    nasm_write(&sym->sect, 1, ofile);		/* section */
-	    fwriteint16_t(sym->desc, ofile);		/* description */
+	    outvec_write32(macho_ov, sym->strx);		/* string table entry number */
+	    outvec_write(macho_ov, &sym->type, 1);		/* symbol type */
+	    outvec_write(macho_ov, &sym->sect, 1);		/* section */
+	    outvec_write16(macho_ov, sym->desc);		/* description */
 
 	    /* Fix up the symbol value now that we know the final section
 	       sizes.  */
@@ -1504,16 +1506,16 @@ static void macho_write_symtab (void)
 		sym->symv[0].key += sectstab[sym->sect]->addr;
 	    }
 
-	    fwriteptr(sym->symv[0].key, ofile);	/* value (i.e. offset) */
+	    macho_writeptr(sym->symv[0].key);	/* value (i.e. offset) */
 	}
     }
 
     for (i = 0; i < nextdefsym; i++) {
 	sym = extdefsyms[i];
-	fwriteint32_t(sym->strx, ofile);
-	nasm_write(&sym->type, 1, ofile);	/* symbol type */
-	nasm_write(&sym->sect, 1, ofile);	/* section */
-	fwriteint16_t(sym->desc, ofile);	/* description */
+	outvec_write32(macho_ov, sym->strx);
+	outvec_write(macho_ov, &sym->type, 1);	/* symbol type */
+	outvec_write(macho_ov, &sym->sect, 1);	/* section */
+	outvec_write16(macho_ov, sym->desc);	/* description */
 
 	/* Fix up the symbol value now that we know the final section
 	   sizes.  */
@@ -1522,15 +1524,15 @@ static void macho_write_symtab (void)
 	    sym->symv[0].key += sectstab[sym->sect]->addr;
 	}
 
-	fwriteptr(sym->symv[0].key, ofile); /* value (i.e. offset) */
+	macho_writeptr(sym->symv[0].key); /* value (i.e. offset) */
     }
 
      for (i = 0; i < nundefsym; i++) {
 	 sym = undefsyms[i];
-	 fwriteint32_t(sym->strx, ofile);
-	 nasm_write(&sym->type, 1, ofile);	/* symbol type */
-	 nasm_write(&sym->sect, 1, ofile);	/* section */
-	 fwriteint16_t(sym->desc, ofile);	/* description */
+	 outvec_write32(macho_ov, sym->strx);
+	 outvec_write(macho_ov, &sym->type, 1);	/* symbol type */
+	 outvec_write(macho_ov, &sym->sect, 1);	/* section */
+	 outvec_write16(macho_ov, sym->desc);	/* description */
 
 	/* Fix up the symbol value now that we know the final section
 	   sizes.  */
@@ -1539,7 +1541,7 @@ static void macho_write_symtab (void)
 	    sym->symv[0].key += sectstab[sym->sect]->addr;
 	 }
 
-	 fwriteptr(sym->symv[0].key, ofile); /* value (i.e. offset) */
+	 macho_writeptr(sym->symv[0].key); /* value (i.e. offset) */
      }
 
 }
@@ -1642,6 +1644,8 @@ static void macho_write (void)
     **  list of null-terminated strings
     */
 
+    macho_ov = outvec_init(ofile);
+
     /* Emit the Mach-O header.  */
     macho_write_header();
 
@@ -1655,14 +1659,14 @@ static void macho_write (void)
 
     if (nsyms > 0) {
         /* write out symbol command */
-        fwriteint32_t(LC_SYMTAB, ofile); /* cmd == LC_SYMTAB */
-        fwriteint32_t(MACHO_SYMCMD_SIZE, ofile); /* size of load command */
-        fwriteint32_t(offset, ofile);    /* symbol table offset */
-        fwriteint32_t(nsyms, ofile);     /* number of symbol
+        outvec_write32(macho_ov, LC_SYMTAB); /* cmd == LC_SYMTAB */
+        outvec_write32(macho_ov, MACHO_SYMCMD_SIZE); /* size of load command */
+        outvec_write32(macho_ov, offset);    /* symbol table offset */
+        outvec_write32(macho_ov, nsyms);     /* number of symbol
                                          ** table entries */
         offset += nsyms * fmt.nlist_size;
-        fwriteint32_t(offset, ofile);    /* string table offset */
-        fwriteint32_t(strslen, ofile);   /* string table size */
+        outvec_write32(macho_ov, offset);    /* string table offset */
+        outvec_write32(macho_ov, strslen);   /* string table size */
     }
 
     /* emit section data */
@@ -1676,7 +1680,11 @@ static void macho_write (void)
     /* we don't need to pad here, we are already aligned */
 
     /* emit string table */
-    saa_fpwrite(strs, ofile);
+    outvec_saa(macho_ov, strs);
+
+    outvec_flush(macho_ov);
+    outvec_free(macho_ov);
+    macho_ov = NULL;
 }
 /* We do quite a bit here, starting with finalizing all of the data
    for the object file, writing, and then freeing all of the data from
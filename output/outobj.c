@@ -47,6 +47,7 @@
 #include "stdscan.h"
 #include "eval.h"
 #include "ver.h"
+#include "outvec.h"
 
 #include "outform.h"
 #include "outlib.h"
@@ -178,9 +179,9 @@ static void ori_pubdef(ObjRecord * orp);
 static void ori_null(ObjRecord * orp);
 static ObjRecord *obj_commit(ObjRecord * orp);
 
-static bool obj_uppercase;       /* Flag: all names in uppercase */
-static bool obj_use32;           /* Flag: at least one segment is 32-bit */
-static bool obj_nodepend;        /* Flag: don't emit file dependencies */
+static per_thread bool obj_uppercase;       /* Flag: all names in uppercase */
+static per_thread bool obj_use32;           /* Flag: at least one segment is 32-bit */
+static per_thread bool obj_nodepend;        /* Flag: don't emit file dependencies */
 
 /*
  * Clear an ObjRecord structure.  (Never reallocates).
@@ -504,12 +505,13 @@ static void ori_null(ObjRecord * orp)
  * This concludes the low level section of outobj.c
  */
 
-static char obj_infile[FILENAME_MAX];
+static per_thread char obj_infile[FILENAME_MAX];
+static per_thread struct outvec *obj_ov; /* Output file while writing */
 
-static int32_t first_seg;
-static bool any_segs;
+static per_thread int32_t first_seg;
+static per_thread bool any_segs;
 static int passtwo;
-static int arrindex;
+static per_thread int arrindex;
 
 #define GROUP_MAX 256           /* we won't _realistically_ have more
                                  * than this many segs in a group */
@@ -525,14 +527,14 @@ struct LineNumber {
     int32_t lineno;
 };
 
-static struct FileName {
+static per_thread struct FileName {
     struct FileName *next;
     char *name;
     struct LineNumber *lnhead, **lntail;
     int index;
 } *fnhead, **fntail;
 
-static struct Array {
+static per_thread struct Array {
     struct Array *next;
     unsigned size;
     int basetype;
@@ -540,7 +542,7 @@ static struct Array {
 
 #define ARRAYBOT 31             /* magic number  for first array index */
 
-static struct Public {
+static per_thread struct Public {
     struct Public *next;
     char *name;
     int32_t offset;
@@ -548,7 +550,7 @@ static struct Public {
     int type;                   /* only for local debug syms */
 } *fpubhead, **fpubtail, *last_defined;
 
-static struct External {
+static per_thread struct External {
     struct External *next;
     char *name;
     int32_t commonsize;
@@ -568,14 +570,14 @@ static struct External {
     struct External *next_dws;  /* next with DEFWRT_STRING */
 } *exthead, **exttail, *dws;
 
-static int externals;
+static per_thread int externals;
 
-static struct ExtBack {
+static per_thread struct ExtBack {
     struct ExtBack *next;
     struct External *exts[EXT_BLKSIZ];
 } *ebhead, **ebtail;
 
-static struct Segment {
+static per_thread struct Segment {
     struct Segment *next;
     char *name;
     int32_t index;                 /* the NASM segment id */
@@ -596,7 +598,7 @@ static struct Segment {
     bool use32;                 /* is this segment 32-bit? */
 } *seghead, **segtail, *obj_seg_needs_update;
 
-static struct Group {
+static per_thread struct Group {
     struct Group *next;
     char *name;
     int32_t index;                 /* NASM segment id */
@@ -609,7 +611,7 @@ static struct Group {
     } segs[GROUP_MAX];          /* ...in this */
 } *grphead, **grptail, *obj_grp_needs_update;
 
-static struct ImpDef {
+static per_thread struct ImpDef {
     struct ImpDef *next;
     char *extname;
     char *libname;
@@ -617,7 +619,7 @@ static struct ImpDef {
     char *impname;
 } *imphead, **imptail;
 
-static struct ExpDef {
+static per_thread struct ExpDef {
     struct ExpDef *next;
     char *intname;
     char *extname;
@@ -630,13 +632,13 @@ static struct ExpDef {
 #define EXPDEF_FLAG_NODATA   0x20
 #define EXPDEF_MASK_PARMCNT  0x1F
 
-static int32_t obj_entry_seg, obj_entry_ofs;
+static per_thread int32_t obj_entry_seg, obj_entry_ofs;
 
 const struct ofmt of_obj;
 static const struct dfmt borland_debug_form;
 
 /* The current segment */
-static struct Segment *current_seg;
+static per_thread struct Segment *current_seg;
 
 static int32_t obj_segment(char *, int *);
 static void obj_write_file(void);
@@ -1957,6 +1959,8 @@ static void obj_write_file(void)
     const struct strlist_entry *depfile;
     const bool debuginfo = (dfmt == &borland_debug_form);
 
+    obj_ov = outvec_init(ofile);
+
     /*
      * Write the THEADR module header.
      */
@@ -2416,6 +2420,10 @@ static void obj_write_file(void)
         obj_byte(orp, 0);
     obj_emit2(orp);
     nasm_free(orp);
+
+    outvec_flush(obj_ov);
+    outvec_free(obj_ov);
+    obj_ov = NULL;
 }
 
 static void obj_fwrite(ObjRecord * orp)
@@ -2423,17 +2431,19 @@ static void obj_fwrite(ObjRecord * orp)
     unsigned int cksum, len;
     uint8_t *ptr;
 
+    nasm_assert(obj_ov);
+
     cksum = orp->type;
     if (orp->x_size == 32)
         cksum |= 1;
-    fputc(cksum, ofile);
+    outvec_write8(obj_ov, cksum);
     len = orp->committed + 1;
     cksum += (len & 0xFF) + ((len >> 8) & 0xFF);
-    fwriteint16_t(len, ofile);
-    nasm_write(orp->buf, len-1, ofile);
+    outvec_write16(obj_ov, len);
+    outvec_write(obj_ov, orp->buf, len-1);
     for (ptr = orp->buf; --len; ptr++)
         cksum += *ptr;
-    fputc((-cksum) & 0xFF, ofile);
+    outvec_write8(obj_ov, (-cksum) & 0xFF);
 }
 
 static enum directive_result
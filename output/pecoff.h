@@ -526,12 +526,12 @@ struct coff_DebugInfo {
     struct coff_Section *section;
 };
 
-extern struct coff_Section **coff_sects;
-extern int coff_nsects;
-extern struct SAA *coff_syms;
-extern uint32_t coff_nsyms;
-extern struct SAA *coff_strs;
-extern bool win32, win64;
+extern per_thread struct coff_Section **coff_sects;
+extern per_thread int coff_nsects;
+extern per_thread struct SAA *coff_syms;
+extern per_thread uint32_t coff_nsyms;
+extern per_thread struct SAA *coff_strs;
+extern per_thread bool win32, win64;
 
 extern char coff_infile[FILENAME_MAX];
 extern char coff_outfile[FILENAME_MAX];
@@ -0,0 +1,268 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * hashbench.c - compare the hash table against the old implementation
+ *
+ * The old table (crc64 over the key, double hashing over an array of
+ * hash_node entries at most half full) is reproduced here as a
+ * reference.  Both are filled with the same identifier-shaped keys
+ * and then looked up with hits and misses, case-sensitively and
+ * case-insensitively.  The number of hits found must agree.
+ *
+ * Usage: hashbench [keys [rounds]]
+ */
+
+#include "compiler.h"
+
+#include <time.h>
+
+#include "nasmlib.h"
+#include "nctype.h"
+#include "hashtbl.h"
+
+/* ---- Reference: the previous implementation ---- */
+
+struct old_table {
+    struct hash_node *table;
+    size_t load, size, max_load;
+};
+
+#define old_pos(hash, mask)     ((hash) & (mask))
+#define old_inc(hash, mask)     ((((hash) >> 32) & (mask)) | 1)
+
+static void **old_find(struct old_table *head, const void *key,
+                       size_t keylen, bool fold, struct hash_node **where,
+                       uint64_t *hashp)
+{
+    struct hash_node *np = NULL;
+    uint64_t hash = fold ? crc64ib(CRC64_INIT, key, keylen)
+        : crc64b(CRC64_INIT, key, keylen);
+    size_t mask = head->size - 1;
+    size_t pos = old_pos(hash, mask);
+    size_t inc = old_inc(hash, mask);
+
+    if (head->table) {
+        while ((np = &head->table[pos])->key) {
+            if (hash == np->hash && keylen == np->keylen &&
+                !(fold ? nasm_memicmp(key, np->key, keylen)
+                  : memcmp(key, np->key, keylen)))
+                return &np->data;
+            pos = (pos + inc) & mask;
+        }
+    }
+    *where = np;
+    *hashp = hash;
+    return NULL;
+}
+
+static void old_add(struct old_table *head, const void *key, size_t keylen,
+                    bool fold, void *data)
+{
+    struct hash_node *np;
+    uint64_t hash;
+
+    if (old_find(head, key, keylen, fold, &np, &hash))
+        return;
+
+    if (!np) {
+        head->size = 16;
+        head->max_load = head->size / 2;
+        nasm_newn(head->table, head->size);
+        np = &head->table[old_pos(hash, head->size - 1)];
+    }
+    np->hash = hash;
+    np->key = key;
+    np->keylen = keylen;
+    np->data = data;
+
+    if (++head->load > head->max_load) {
+        size_t newsize = head->size << 1;
+        size_t mask = newsize - 1;
+        struct hash_node *newtbl, *op, *xp;
+        size_t i;
+
+        nasm_newn(newtbl, newsize);
+        for (i = 0, op = head->table; i < head->size; i++, op++) {
+            if (op->key) {
+                size_t pos = old_pos(op->hash, mask);
+                size_t inc = old_inc(op->hash, mask);
+
+                while ((xp = &newtbl[pos])->key)
+                    pos = (pos + inc) & mask;
+                *xp = *op;
+            }
+        }
+        nasm_free(head->table);
+        head->table = newtbl;
+        head->size = newsize;
+        head->max_load = newsize / 2;
+    }
+}
+
+/* ---- Benchmark ---- */
+
+static const char * const stems[] = {
+    "loop", "done", "next", "skip", "buf", "len", "ptr", "count",
+    "table", "entry", "handler", "init", "exit", "fail", "retry",
+    "VPADDD", "mov", "Section", "__?NASM_VERSION?__", "offset"
+};
+
+/* Identifiers like "count17", ".loop_3", "handler_table_250" */
+static char **make_keys(size_t n, unsigned int seed)
+{
+    char **keys = nasm_malloc(n * sizeof *keys);
+    char buf[64];
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const char *a, *b;
+
+        seed = seed * 1103515245 + 12345;
+        a = stems[(seed >> 16) % ARRAY_SIZE(stems)];
+        seed = seed * 1103515245 + 12345;
+        b = stems[(seed >> 16) % ARRAY_SIZE(stems)];
+        switch (i % 4) {
+        case 0:
+            snprintf(buf, sizeof buf, "%s%zu", a, i);
+            break;
+        case 1:
+            snprintf(buf, sizeof buf, ".%s_%zu", a, i);
+            break;
+        case 2:
+            snprintf(buf, sizeof buf, "%s_%s_%zu", a, b, i);
+            break;
+        default:
+            snprintf(buf, sizeof buf, "%s.%s%zu", a, b, i);
+            break;
+        }
+        keys[i] = nasm_strdup(buf);
+    }
+    return keys;
+}
+
+static double now(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void run(const char *what, bool fold, char **keys, char **miss,
+                size_t n, unsigned int rounds)
+{
+    struct hash_table nt;
+    struct old_table ot;
+    struct hash_insert hi;
+    struct hash_node *where;
+    uint64_t hash;
+    size_t i, nhits, ohits;
+    unsigned int r;
+    double t0, tnew, told;
+    void **(*find)(struct hash_table *, const char *, struct hash_insert *) =
+        fold ? hash_findi : hash_find;
+
+    memset(&nt, 0, sizeof nt);
+    memset(&ot, 0, sizeof ot);
+
+    t0 = now();
+    for (i = 0; i < n; i++)
+        if (!find(&nt, keys[i], &hi))
+            hash_add(&hi, keys[i], keys[i]);
+    nhits = 0;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            nhits += !!find(&nt, keys[i], NULL);
+            nhits += !!find(&nt, miss[i], NULL);
+        }
+    }
+    tnew = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++)
+        old_add(&ot, keys[i], strlen(keys[i]) + 1, fold, keys[i]);
+    ohits = 0;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            ohits += !!old_find(&ot, keys[i], strlen(keys[i]) + 1, fold,
+                                &where, &hash);
+            ohits += !!old_find(&ot, miss[i], strlen(miss[i]) + 1, fold,
+                                &where, &hash);
+        }
+    }
+    told = now() - t0;
+
+    printf("%-18s old %8.3fs  new %8.3fs  speedup %5.2fx\n",
+           what, told, tnew, tnew > 0.0 ? told / tnew : 0.0);
+
+    if (nhits != ohits) {
+        fprintf(stderr, "hashbench: %s: %zu hits, reference %zu\n",
+                what, nhits, ohits);
+        exit(1);
+    }
+
+    hash_free(&nt);
+    nasm_free(ot.table);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+    unsigned int rounds = argc > 2 ? strtoul(argv[2], NULL, 0) : 50;
+    char **keys, **miss;
+    size_t i;
+
+    if (!n || !rounds) {
+        fprintf(stderr, "Usage: %s [keys [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    nasm_ctype_init();
+
+    keys = make_keys(n, 1);
+    miss = make_keys(n, 2);
+    /* Same shapes, but never present in the table */
+    for (i = 0; i < n; i++)
+        miss[i][0] ^= 0x40;
+
+    printf("%zu keys, %u rounds of lookups (half hits, half misses)\n",
+           n, rounds);
+    run("case-sensitive", false, keys, miss, n, rounds);
+    run("case-insensitive", true, keys, miss, n, rounds);
+
+    for (i = 0; i < n; i++) {
+        nasm_free(keys[i]);
+        nasm_free(miss[i]);
+    }
+    nasm_free(keys);
+    nasm_free(miss);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#!/usr/bin/perl
+#Run the NASM performance suite
+
+use strict;
+use warnings;
+
+use Getopt::Long qw(GetOptions);
+use Pod::Usage qw(pod2usage);
+
+use Cwd qw(getcwd);
+use FindBin qw($Bin);
+use File::Path qw(mkpath);
+use File::Spec::Functions qw(rel2abs);
+
+#
+# Workloads: name, generator, base size, extra generator arguments,
+# output formats to assemble with.  Sizes are multiplied by --scale.
+#
+my @workloads = (
+    [ 'label',   'label.pl',  20000, [], ['bin'] ],
+    [ 'smacro',  'macro.pl',  20000, [], ['bin'] ],
+    [ 'mmacro',  'mmacro.pl', 50000, [], ['bin'] ],
+    [ 'rep',     'rep.pl',   100000, [], ['bin'] ],
+    [ 'token',   'token.pl', 100000, [], ['bin'] ],
+    [ 'match',   'match.pl',  50000, [], ['bin'] ],
+    [ 'jump',    'jump.pl',   50000, [], ['bin'] ],
+    [ 'table',   'table.pl',  20000, [], ['bin'] ],
+    [ 'incbin',  'incbin.pl', 20000, ['incbin.dat'], ['bin'] ],
+    [ 'reloc',   'reloc.pl',  50000, [],
+      ['elf32', 'obj', 'bin', 'macho32', 'coff', 'win32'] ],
+    [ 'segreloc', 'reloc.pl', 50000, ['seg'], ['elf32', 'obj'] ],
+);
+
+my @phases = qw(preprocess parse size emit write total);
+
+my $nasm;
+my $scale = 1;
+my $runs = 3;
+my $workdir = 'bench';
+my $output;
+my $compare;
+my $threshold = 10;
+my $mintime = 0.05;
+my @only = ();
+my $help = 0;
+
+GetOptions('nasm=s' => \$nasm,
+           'scale=f' => \$scale,
+           'runs=i' => \$runs,
+           'workdir=s' => \$workdir,
+           'output=s' => \$output,
+           'compare=s' => \$compare,
+           'threshold=f' => \$threshold,
+           'min-time=f' => \$mintime,
+           'only=s' => \@only,
+           'help' => \$help
+          ) or pod2usage();
+
+pod2usage() if $help;
+die "Please specify --nasm. Use --help for help.\n" unless $nasm;
+die "$nasm is not executable\n" unless -x $nasm;
+$runs = 1 if ($runs < 1);
+
+my %only = map { $_ => 1 } map { split /,/ } @only;
+
+$nasm = rel2abs($nasm) if ($nasm =~ m:/:);
+
+my $top = getcwd();
+mkpath($workdir);
+chdir($workdir) or die "$0: cannot enter $workdir: $!\n";
+
+#Generate one input file with a fixed random seed
+sub generate {
+    my ($name, $gen, $size, $args) = @_;
+    my $asm = "$name.asm";
+
+    open(my $save, '>&', \*STDOUT) or die;
+    open(STDOUT, '>', $asm) or die "$0: cannot create $asm: $!\n";
+    my $err = system($^X, '-e', 'srand(0); $f = shift; do $f; die $@ if $@',
+                     "$Bin/$gen", int($size * $scale), @$args);
+    open(STDOUT, '>&', $save) or die;
+    die "$0: $gen failed\n" if ($err);
+    return $asm;
+}
+
+#Assemble one file and return the phase timings of the fastest run
+sub measure {
+    my ($asm, $fmt) = @_;
+    my %best;
+
+    for (my $i = 0; $i < $runs; $i++) {
+        my $err = system($nasm, '--profile=profile.txt', '-f', $fmt,
+                         '-o', 'bench.out', $asm);
+        die "$0: $nasm failed on $asm ($fmt)\n" if ($err);
+
+        open(my $prof, '<', 'profile.txt')
+            or die "$0: no profile from $nasm\n";
+        while (<$prof>) {
+            my ($phase, $time);
+            if (/^phase\s+(\S+)\s+([0-9.]+)/) {
+                ($phase, $time) = ($1, $2);
+            } elsif (/^(total)\s+([0-9.]+)/) {
+                ($phase, $time) = ($1, $2);
+            } else {
+                next;
+            }
+            $best{$phase} = $time
+                if (!defined($best{$phase}) || $time < $best{$phase});
+        }
+        close($prof);
+    }
+    unlink('profile.txt', 'bench.out');
+    return \%best;
+}
+
+my %results;
+my @rows;
+
+foreach my $w (@workloads) {
+    my ($name, $gen, $size, $args, $formats) = @$w;
+    next if (%only && !$only{$name});
+
+    my $asm = generate($name, $gen, $size, $args);
+    foreach my $fmt (@$formats) {
+        my $best = measure($asm, $fmt);
+        foreach my $phase (@phases) {
+            next unless defined($best->{$phase});
+            $results{"$name\t$fmt\t$phase"} = $best->{$phase};
+            push(@rows, "$name\t$fmt\t$phase");
+        }
+        printf STDERR "%-10s %-8s %8.3f s\n", $name, $fmt, $best->{total};
+    }
+    unlink($asm);
+}
+unlink('incbin.dat');
+chdir($top);
+rmdir($workdir);
+
+my $out;
+if ($output) {
+    open($out, '>', $output) or die "$0: cannot create $output: $!\n";
+} else {
+    $out = \*STDOUT;
+}
+print $out "# workload\tformat\tphase\tseconds\n";
+printf $out "%s\t%.6f\n", $_, $results{$_} foreach @rows;
+close($out) if ($output);
+
+exit 0 unless ($compare);
+
+#Compare against a baseline produced by an earlier --output
+my %base;
+open(my $bf, '<', $compare) or die "$0: cannot open $compare: $!\n";
+while (<$bf>) {
+    next if /^#/;
+    chomp;
+    my @f = split(/\t/);
+    next unless (@f == 4);
+    $base{join("\t", @f[0..2])} = $f[3];
+}
+close($bf);
+
+my $regressions = 0;
+foreach my $row (@rows) {
+    my $old = $base{$row};
+    next unless (defined($old) && $old >= $mintime);
+    my $new = $results{$row};
+    my $pct = ($new - $old) * 100 / $old;
+    my $flag = '';
+    if ($pct > $threshold) {
+        $flag = '  REGRESSION';
+        $regressions++;
+    }
+    my ($name, $fmt, $phase) = split(/\t/, $row);
+    printf "%-10s %-8s %-10s %8.3f -> %8.3f  %+6.1f%%%s\n",
+        $name, $fmt, $phase, $old, $new, $pct, $flag;
+}
+print "$regressions regression(s) above $threshold%\n";
+exit($regressions ? 1 : 0);
+
+__END__
+
+=head1 NAME
+
+bench.pl - NASM performance suite
+
+=head1 SYNOPSIS
+
+bench.pl --nasm=file [options]
+
+Generates scaled inputs with the scripts in test/perf, assembles
+each with --profile and reports the fastest time of each phase.
+
+ Options:
+     --nasm=file       NASM executable to benchmark
+     --scale=n         Multiply the size of every input by n (default 1)
+     --runs=n          Run each case n times and keep the fastest (default 3)
+     --only=list       Only run the named workloads (comma separated)
+     --output=file     Write the results to file instead of stdout
+     --compare=file    Compare against the results of an earlier --output
+     --threshold=pct   Slowdown counted as a regression (default 10)
+     --min-time=sec    Ignore baseline timings below sec (default 0.05)
+     --workdir=dir     Directory for the generated inputs (default bench)
+     --help            Get this help
+
+The results are tab separated lines of workload, output format,
+phase and seconds.  The phases are those reported by --profile:
+preprocess, parse, size (matching and sizing before the final pass),
+emit (code generation in the final pass), write (the output format
+backend), and total.
+
+With --compare, every phase slower than the baseline by more than
+the threshold is reported as a regression, and the exit status is
+nonzero if there were any.
+
+=cut
@@ -0,0 +1,23 @@
+#!/usr/bin/perl
+#
+# Generate a test case for incbin performance; writes the binary
+# file to be included alongside the source
+#
+
+($len, $file) = @ARGV;
+$len = 100000 unless ($len);
+$file = 'incbin.dat' unless ($file);
+
+open(my $dat, '>', $file) or die "$0: cannot create $file: $!\n";
+binmode $dat;
+print $dat pack('C*', map { $_ & 255 } 0..65535);
+close($dat);
+
+print "\tbits 32\n";
+print "\tsection .data\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    $off = int(rand(65536));
+    print "\tincbin \"$file\", $off, ", int(rand(65536 - $off)) & 255, "\n";
+}
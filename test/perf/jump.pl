@@ -0,0 +1,21 @@
+#!/usr/bin/perl
+#
+# Generate a test case for jump relaxation performance: many
+# interdependent jumps whose sizes are only known after several passes
+#
+
+($len) = @ARGV;
+$len = 100000 unless ($len);
+
+print "\tbits 32\n";
+print "\tsection .text\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    print "j$i:\n";
+    $t = $i + int(rand(64)) - 16;
+    $t = 0 if ($t < 0);
+    $t = $len - 1 if ($t >= $len);
+    print "\tjnz j$t\n";
+    print "\ttimes ", int(rand(8)), " nop\n";
+}
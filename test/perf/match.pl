@@ -0,0 +1,33 @@
+#!/usr/bin/perl
+#
+# Generate a test case for instruction template matching performance;
+# assemble with -Ov to see how many templates were checked
+#
+
+@forms = ('mov %r, %r', 'mov %r, [%r+8]', 'mov [%r], %r',
+	  'mov dword [%r], 1234', 'mov %r, 0x12345678',
+	  'add %r, %r', 'add %r, 4', 'and %r, [%r]', 'cmp %r, 100000',
+	  'push %r', 'pop %r', 'lea %r, [%r+%r*4]', 'inc %r',
+	  'shl %r, 3', 'test %r, %r', 'imul %r, %r, 7',
+	  'movdqa xmm%x, xmm%x', 'paddd xmm%x, [%r]', 'movd xmm%x, %r',
+	  'vaddps ymm%x, ymm%x, ymm%x', 'vmovdqu ymm%x, [%r]',
+	  'vpaddd zmm%x, zmm%x, zmm%x', 'vmovups zmm%x{k1}, [%r]');
+@regs  = qw(eax ebx ecx edx esi edi ebp);
+
+srand(0);
+sub pickone(@) {
+    return $_[int(rand(scalar @_))];
+}
+
+($len) = @ARGV;
+$len = 1000000 unless ($len);
+
+print "\tbits 32\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    $insn = pickone(@forms);
+    $insn =~ s/%r/pickone(@regs)/ge;
+    $insn =~ s/%x/int(rand(8))/ge;
+    print "\t", $insn, "\n";
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/perl
+#
+# Generate a test case for multi-line macro expansion performance
+#
+
+($len) = @ARGV;
+$len = 100000 unless ($len);
+
+print "\tbits 32\n";
+print "\tsection .text\n";
+print "\n";
+print "%macro load 2-3 0\n";
+print "\tmov %1, [%2+%3]\n";
+print "\tadd %1, %3\n";
+print "%endmacro\n";
+print "%macro swap 2\n";
+print "\tpush %1\n";
+print "\tmov %1, %2\n";
+print "\tpop %2\n";
+print "%endmacro\n";
+print "\n";
+
+@regs = qw(eax ebx ecx edx esi edi);
+
+for ($i = 0; $i < $len; $i++) {
+    $a = $regs[int(rand(@regs))];
+    $b = $regs[int(rand(@regs))];
+    if ($i & 1) {
+	print "\tload $a, $b, ", int(rand(256)), "\n";
+    } else {
+	print "\tswap $a, $b\n";
+    }
+}
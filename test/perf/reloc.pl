@@ -0,0 +1,29 @@
+#!/usr/bin/perl
+#
+# Generate a test case for relocation and symbol table performance
+# in the output formats.  With "seg", also emit segment base
+# relocations (16-bit code; elf32 and obj only).
+#
+
+($len, $seg) = @ARGV;
+$len = 100000 unless ($len);
+
+print $seg ? "\tbits 16\n" : "\tbits 32\n";
+print "\tsection .data\n";
+print "\n";
+
+for ($i = 0; $i < $len; $i++) {
+    print "\tglobal d$i\n" unless ($i & 7);
+    print "d$i:\tdd d", int(rand($i+1)), "\n";
+}
+
+print "\n";
+print "\tsection .text\n";
+for ($i = 0; $i < $len; $i++) {
+    if ($seg) {
+	print "\tmov ax, seg d", int(rand($len)) & ~7, "\n";
+	print "\tmov bx, d", int(rand($len)), "\n";
+    } else {
+	print "\tmov eax, [d", int(rand($len)), "]\n";
+    }
+}
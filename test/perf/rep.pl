@@ -0,0 +1,17 @@
+#!/usr/bin/perl
+#
+# Generate a test case for %rep and %assign performance
+#
+
+($len) = @ARGV;
+$len = 100000 unless ($len);
+
+print "\tbits 32\n";
+print "\tsection .data\n";
+print "\n";
+print "%assign n 0\n";
+print "%rep $len\n";
+print "\tdd n, n*3+1\n";
+print "\tdb 'repeated string body', 0\n";
+print "%assign n n+1\n";
+print "%endrep\n";
@@ -0,0 +1,29 @@
+#!/usr/bin/perl
+#
+# Generate a test case for evaluating data tables on every pass: jumps
+# whose sizes take several passes to settle, followed by a table of
+# their offsets
+#
+
+($len) = @ARGV;
+$len = 100000 unless ($len);
+
+print "\tbits 32\n";
+print "\tsection .text\n";
+print "\n";
+print "base:\n";
+
+for ($i = 0; $i < $len; $i++) {
+    $t = $i + int(rand(64)) - 16;
+    $t = 0 if ($t < 0);
+    $t = $len - 1 if ($t >= $len);
+    print "l$i:\tjmp l$t\n";
+}
+
+print "\ttimes 16-(\$-\$\$) % 16 db 0x90\n";
+print "size equ \$ - base\n";
+print "\n";
+
+for ($i = 0; $i < $len * 4; $i++) {
+    print "\tdd l", int(rand($len)), " - base\n";
+}
@@ -0,0 +1,197 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2024 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * threadtest.c - run assemblies on several threads at the same time
+ *
+ * Every thread assembles the same source with nasm_assemble_buffer();
+ * the objects and the diagnostics must all be identical to those of
+ * an assembly run on its own.  One more thread runs into a fatal
+ * error, which must end its own assembly only.
+ *
+ * Usage: threadtest [threads [rounds]]
+ */
+
+#include "compiler.h"
+
+#include <pthread.h>
+
+#include "libnasm.h"
+
+static const char source[] =
+    "%macro  pushall 1-*\n"
+    "  %rep %0\n"
+    "    push %1\n"
+    "    %rotate 1\n"
+    "  %endrep\n"
+    "%endmacro\n"
+    "\n"
+    "        bits 64\n"
+    "        default rel\n"
+    "        section .text\n"
+    "        global func\n"
+    "func:   pushall rbx, rbp, r12, r13\n"
+    "%assign i 0\n"
+    "%rep 500\n"
+    "        mov eax, [table + i*4]\n"
+    "        cmp eax, i\n"
+    "        jne near .fail\n"
+    "        vpaddd ymm1, ymm2, [rsi + rcx*8 + i]\n"
+    "  %assign i i+1\n"
+    "%endrep\n"
+    "        jmp .done\n"
+    ".fail:  xor eax, eax\n"
+    ".done:  ret\n"
+    "\n"
+    "        section .data\n"
+    "table:\n"
+    "%assign i 0\n"
+    "%rep 500\n"
+    "        dd i\n"
+    "  %assign i i+1\n"
+    "%endrep\n"
+    "        dq func, table, later\n"
+    "        db __?FILE?__, 0\n"
+    "        section .bss\n"
+    "later:  resb 64\n"
+    "%warning assembled\n";
+
+static const char bad_source[] =
+    "        mov eax, 1\n"
+    "%fatal stopped here\n";
+
+static char *argv_good[] = {
+    "nasm", "-f", "elf64", "-g", "-o", "thread.o", "thread.asm", NULL
+};
+static char *argv_bad[] = {
+    "nasm", "-f", "elf64", "-o", "bad.o", "bad.asm", NULL
+};
+
+struct job {
+    pthread_t thread;
+    bool bad;
+    int status;
+    struct nasm_buffer obj, msgs;
+};
+
+static void *run(void *arg)
+{
+    struct job *job = arg;
+
+    if (job->bad)
+        job->status = nasm_assemble_buffer(6, argv_bad, bad_source,
+                                           sizeof bad_source - 1,
+                                           &job->obj, &job->msgs);
+    else
+        job->status = nasm_assemble_buffer(7, argv_good, source,
+                                           sizeof source - 1,
+                                           &job->obj, &job->msgs);
+    return NULL;
+}
+
+static bool same(const struct nasm_buffer *a, const struct nasm_buffer *b)
+{
+    return a->len == b->len && (!a->len || !memcmp(a->data, b->data, a->len));
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds  = argc > 2 ? atoi(argv[2]) : 4;
+    struct job ref, *jobs;
+    int round, i, errors = 0;
+
+    if (threads < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [threads [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    /* The reference, on a thread of its own like all the others */
+    memset(&ref, 0, sizeof ref);
+    if (pthread_create(&ref.thread, NULL, run, &ref) ||
+        pthread_join(ref.thread, NULL)) {
+        fprintf(stderr, "%s: cannot run a thread\n", argv[0]);
+        return 1;
+    }
+    if (ref.status || !ref.obj.len) {
+        fprintf(stderr, "%s: reference assembly failed:\n%.*s", argv[0],
+                (int)ref.msgs.len, ref.msgs.data);
+        return 1;
+    }
+
+    jobs = calloc(threads + 1, sizeof *jobs);
+    if (!jobs)
+        return 1;
+
+    for (round = 0; round < rounds; round++) {
+        memset(jobs, 0, (threads + 1) * sizeof *jobs);
+        jobs[threads].bad = true;
+
+        for (i = 0; i <= threads; i++) {
+            if (pthread_create(&jobs[i].thread, NULL, run, &jobs[i])) {
+                fprintf(stderr, "%s: cannot run a thread\n", argv[0]);
+                return 1;
+            }
+        }
+
+        for (i = 0; i <= threads; i++) {
+            struct job *job = &jobs[i];
+
+            pthread_join(job->thread, NULL);
+
+            if (job->bad) {
+                if (!job->status || job->obj.len || !job->msgs.len) {
+                    fprintf(stderr, "round %d: fatal error not reported\n",
+                            round);
+                    errors++;
+                }
+            } else if (job->status != ref.status ||
+                       !same(&job->obj, &ref.obj) ||
+                       !same(&job->msgs, &ref.msgs)) {
+                fprintf(stderr, "round %d, thread %d: output differs\n",
+                        round, i);
+                errors++;
+            }
+
+            free(job->obj.data);
+            free(job->msgs.data);
+        }
+    }
+
+    printf("%d rounds of %d threads: %d errors\n", rounds, threads, errors);
+
+    free(ref.obj.data);
+    free(ref.msgs.data);
+    free(jobs);
+    return errors != 0;
+}
@@ -0,0 +1,16 @@
+;
+; Assembled with --cache by cache.json. The result depends on
+; cachegen.mac, which the tests write, on the cacheinc.mac found
+; through -I, and on -D.
+;
+%include "cachegen.mac"
+%include "cacheinc.mac"
+
+	bits 32
+
+	mov eax, CACHE_GEN
+	mov ebx, CACHE_INC
+%ifdef CACHE_EXTRA
+	mov ecx, CACHE_EXTRA
+%endif
+	ret
@@ -0,0 +1,2 @@
+./travis/test/cache.bin : ./travis/test/cache.asm
+
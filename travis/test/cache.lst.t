@@ -0,0 +1,21 @@
+     1                                  ;
+     2                                  ; Assembled with --cache by cache.json. The result depends on
+     3                                  ; cachegen.mac, which the tests write, on the cacheinc.mac found
+     4                                  ; through -I, and on -D.
+     5                                  ;
+     6                                  %include "cachegen.mac"
+     1                              <1> %define CACHE_GEN 1
+     7                                  %include "cacheinc.mac"
+     1                              <1> ;
+     2                              <1> ; cacheinc.mac found through -I./travis/test/cachei1/
+     3                              <1> ;
+     4                              <1> %define CACHE_INC 0x11
+     8                                  
+     9                                  	bits 32
+    10                                  
+    11 00000000 B801000000              	mov eax, CACHE_GEN
+    12 00000005 BB11000000              	mov ebx, CACHE_INC
+    13                                  %ifdef CACHE_EXTRA
+    14                                  	mov ecx, CACHE_EXTRA
+    15                                  %endif
+    16 0000000A C3                      	ret
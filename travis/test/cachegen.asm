@@ -0,0 +1,6 @@
+;
+; Writes cachegen.mac for the --cache tests in cache.json, so that a
+; file cache.asm includes changes between the tests. -DGEN= gives the
+; value it defines.
+;
+	db '%define CACHE_GEN ', '0' + GEN, 10
@@ -0,0 +1,18 @@
+;
+; Jumps whose sizes depend on each other, so that finding their
+; sizes one optimization pass at a time takes many passes.
+;
+	bits 32
+
+%assign i 0
+%rep 200
+L %+ i:
+	jz L %+ %eval(i + 4)
+	times 29 nop
+	jmp L %+ %eval(i - 3 * (i > 2))
+%assign i i + 1
+%endrep
+%rep 4
+L %+ i:
+%assign i i + 1
+%endrep
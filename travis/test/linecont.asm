@@ -0,0 +1,10 @@
+; Line continuations and line endings
+	dw __LINE__
+	db 1, \
+	   2, \
+	   3
+	dw __LINE__
+%define FOUR \	4	db FOUR
+	dw __LINE__
+	db "\\"
+	dw __LINE__
\ No newline at end of file
@@ -0,0 +1,95 @@
+;
+; Enough overloads of one multi-line macro name for the preprocessor
+; to index them. Each overload emits its own tag byte, so the output
+; shows which one every call picked.
+;
+	bits 32
+
+[warning -pp-macro-redef-multi]
+
+%macro op 0
+	db 0x00
+%endmacro
+%macro op 1
+	db 0x01, %1
+%endmacro
+%macro op 2
+	db 0x02, %1, %2
+%endmacro
+%macro op 3-5
+	db 0x03, %0
+%endmacro
+%macro op 4+
+	db 0x04, %0
+%endmacro
+%imacro op 6
+	db 0x06
+%endmacro
+%imacro OP 7-*
+	db 0x07, %0
+%endmacro
+%macro Op 1
+	db 0x11, %1
+%endmacro
+%macro Op 2-3
+	db 0x12, %0
+%endmacro
+%macro OP 8
+	db 0x18
+%endmacro
+
+	op
+	op 1
+	op 1, 2
+	op 1, 2, 3
+	op 1, 2, 3, 4
+	op 1, 2, 3, 4, 5, 6
+	op 1, 2, 3, 4, 5, 6, 7
+	Op 1
+	Op 1, 2
+	Op 1, 2, 3, 4, 5, 6
+	oP 1, 2, 3, 4, 5, 6
+	OP 1, 2, 3, 4, 5, 6, 7, 8
+	OP 1, 2, 3, 4, 5, 6, 7, 8, 9
+
+; Redefined once the index is built
+%imacro Op 0-*
+	db 0x20, %0
+%endmacro
+%macro op 1
+	db 0x21, %1
+%endmacro
+
+	op 1
+	op 1, 2
+	Op 1
+	Op 1, 2
+	oP
+	op 1, 2, 3, 4, 5, 6, 7, 8
+
+; Removed again
+%unimacro op 0-*
+%unmacro op 1
+%unimacro op 6
+%unmacro op 4+
+
+	Op 1
+	op 1, 2
+	op 1, 2, 3, 4
+	op 1, 2, 3, 4, 5
+	OP 1, 2, 3, 4, 5, 6, 7, 8
+
+; Only case-sensitive overloads
+%assign n 0
+%rep 9
+%macro cs %[n]
+	db 0x30 + %0
+%endmacro
+%assign n n+1
+%endrep
+
+	cs
+	cs 1, 2, 3
+	cs 1, 2, 3, 4, 5, 6, 7, 8
+%unmacro cs 4
+	cs 1, 2, 3, 4, 5
@@ -0,0 +1,15 @@
+;
+; Uses the macros of pchdefs.mac, either from the precompiled header
+; given with --pch or, with -DPCH_INCLUDE, by including it.
+;
+%ifdef PCH_INCLUDE
+ %include "pchdefs.mac"
+%endif
+
+	bits 32
+
+	pchdata PCH_COUNT
+	pchdata PCH_SUM(1, 2), PCH_INNER
+	pchfill 2
+	db PCH_NAME, %$pchval, PCH_TWICE(PCH_BYTE)
+%pop pchctx
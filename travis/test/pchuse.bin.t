@@ -0,0 +1 @@
+ZZpch	
\ No newline at end of file
@@ -0,0 +1,69 @@
+;
+; Jumps to a label plus an offset, some with jumps which grow between
+; the label and the target. The output must be the same as without
+; the relaxation (--no-relax).
+;
+	bits 32
+L0:
+	jz L5 + 4
+	times 6 nop
+L1:
+	jmp L0 + 1
+L2:
+	jz L0
+	jmp L0
+	jmp L1 + 2
+	times 4 nop
+	jz L3
+	times 19 nop
+	jmp L2
+	times 17 nop
+	jz L1
+L3:
+	jmp L0
+	jmp L0
+L4:
+	jmp L0
+	times 15 nop
+	jmp L7 + 2
+	times 27 nop
+	jmp L10
+	times 6 nop
+L5:
+	jmp L9 + 1
+L6:
+	times 18 nop
+	jmp L11
+L7:
+	times 18 nop
+	jz L10
+	jmp L10 + 3
+	times 23 nop
+	jmp L10
+L8:
+	times 10 nop
+	jmp L13
+	times 7 nop
+	jmp L13
+	jz L4
+	jmp L10 + 1
+	jmp L12
+	times 3 nop
+	jmp L8
+	times 13 nop
+	jmp L6
+L9:
+	times 35 nop
+L10:
+	times 40 nop
+L11:
+	jmp L10
+L12:
+	times 6 nop
+	jmp L13
+	times 2 nop
+	jmp L9
+	jmp L10
+	times 5 nop
+	jz L13
+L13:
@@ -0,0 +1,51 @@
+;
+; Jump sizes which depend on ALIGN padding, TIMES counts and label
+; differences, which the jump relaxation does not model. The output
+; must be the same as without the relaxation (--no-relax).
+;
+	bits 32
+
+; A short jump across an ALIGN
+a0:
+	jmp a9
+a2:
+	jmp a8
+	times 99 nop
+	align 32
+	jmp a12
+a7:
+	jmp a10
+a8:
+	jmp a12
+a9:
+	times 120 nop
+a10:
+	jz a2
+a12:
+
+; Label differences as immediates
+	align 32
+b0:
+	jz b15
+b2:
+	align 16
+	jz b16
+	jmp b15
+b5:
+	times 108 nop
+b6:
+	add esp, b7 - b2
+b7:
+	jmp b15
+b8:
+	align 16
+b9:
+	times 103 nop
+	align 16
+	jz b6
+	jmp b16
+	add esp, b16 - b8
+	jmp b9
+b15:
+	jmp b5
+b16:
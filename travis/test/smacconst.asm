@@ -0,0 +1,33 @@
+;
+; Constant single-line macros are spliced in directly; make sure that
+; redefinition and removal are still honored.
+;
+%define K 1 + 2
+	db K, K * 2
+%define K 3
+	db K
+%define L 5
+%define K L
+	db K
+%define L 6
+	db K
+%xdefine K L
+%define L 7
+	db K
+%undef K
+%define K 9
+	db K
+%define E
+	db 8 E, E 9
+%assign A 10
+	db A
+%assign A A+1
+	db A
+%push ctx
+%define %$C 12
+	db %$C
+%define %$C 13
+	db %$C
+%pop
+%define S "a", "b"
+	db S, S
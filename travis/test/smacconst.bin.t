@@ -0,0 +1,2 @@
+		
+abab
\ No newline at end of file
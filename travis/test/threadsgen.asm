@@ -0,0 +1,37 @@
+;
+; Writes threads.asm for the --threads tests in threads.json: a few
+; thousand instructions outside of any macro, as only those are
+; encoded on the encoder threads, enough to fill several batches.
+;
+	db 9, 'bits 64', 10
+
+%assign i 0
+%rep 4000
+ %defstr n i
+ %assign f i + 5
+ %defstr fwd f
+ %assign b i - 3
+ %defstr back b
+	db 'L', n, ':', 10
+ %if i % 7 == 0
+	db 9, 'jmp L', fwd, 10
+ %elif i % 7 == 1 && i > 3
+	db 9, 'jnz L', back, 10
+ %elif i % 7 == 2
+	db 9, 'mov eax, [rel L', fwd, ']', 10
+ %elif i % 7 == 3
+	db 9, 'lea rsi, [rbx + rcx*4 + ', n, ']', 10
+ %elif i % 7 == 4
+	db 9, 'vpaddd ymm1, ymm2, [rdi + ', n, ' * 32]', 10
+ %elif i % 7 == 5
+	db 9, 'dd L', back, ' - $', 10
+ %else
+	db 9, 'mov rax, ', n, ' * 0x10001', 10
+ %endif
+ %assign i i + 1
+%endrep
+%rep 5
+ %defstr n i
+	db 'L', n, ':', 10
+ %assign i i + 1
+%endrep
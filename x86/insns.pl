@@ -195,6 +195,7 @@ open(F, '<', $fname) || die "unable to open $fname";
 %dinstables = ();
 @bytecode_list = ();
 %aname = ();
+%afilter = ();
 
 $line = 0;
 $insns = 0;
@@ -215,10 +216,11 @@ while (<F>) {
     @field_list = conditional_forms(@field_list);
 
     foreach my $fields (@field_list) {
-        ($formatted, $nd) = format_insn(@$fields);
+        ($formatted, $nd, $filter) = format_insn(@$fields);
         if ($formatted) {
             $insns++;
 	    xpush(\$aname{$fields->[0]}, $formatted);
+	    xpush(\$afilter{$fields->[0]}, $filter);
         }
 	if (!defined($k_opcodes{$fields->[0]})) {
 	    $k_opcodes{$fields->[0]} = $n_opcodes++;
@@ -323,6 +325,21 @@ if ( $output eq 'a' ) {
     foreach $i (@opcodes) {
         print A "    instrux_${i},\n";
     }
+    print A "};\n\n";
+
+    # The prefilter index runs parallel to the template lists above
+    foreach $i (@opcodes) {
+        next unless (defined($afilter{$i}));
+        print A "static const struct itemplate_filter instruf_${i}[] = {\n";
+        foreach $j (@{$afilter{$i}}) {
+            print A "    $j\n";
+        }
+        print A "};\n\n";
+    }
+    print A "const struct itemplate_filter * const nasm_instruction_filters[] = {\n";
+    foreach $i (@opcodes) {
+        print A "    ", (defined($afilter{$i}) ? "instruf_${i}" : "NULL"), ",\n";
+    }
     print A "};\n";
 
     close A;
@@ -506,7 +523,7 @@ sub format_insn($$$$$) {
     my @bytecode;
     my ($op, @ops, @opsize, $opp, @opx, @oppx, @decos, @opevex);
 
-    return (undef, undef) if $operands eq "ignore";
+    return (undef, undef, undef) if $operands eq "ignore";
 
     # format the operands
     $operands =~ s/\*//g;
@@ -635,7 +652,14 @@ sub format_insn($$$$$) {
     $codes = hexstr(@bytecode);
     count_bytecodes(@bytecode);
 
-    ("{I_$opcode, $num, {$operands}, $decorators, \@\@CODES-$codes\@\@, $flagsindex},", $nd);
+    # Prefilter entry: operand count, valid modes and operand classes
+    my $modes = $flags{'LONG'} ? 'ITF_MODE_64' :
+	$flags{'NOLONG'} ? 'ITF_MODE_1632' : 'ITF_MODE_ALL';
+    my $filter = "{$num, $modes, {" .
+	join(',', map { $_ eq '0' ? '0' : "ITF_OPD($_)" } @ops) . "}},";
+    $filter =~ tr/a-z/A-Z/;
+
+    ("{I_$opcode, $num, {$operands}, $decorators, \@\@CODES-$codes\@\@, $flagsindex},", $nd, $filter);
 }
 
 #